@@ -24,19 +24,63 @@
 #include <stdlib.h>
 #include <string.h>
 #include "arcp.h"
+#if defined(_MSC_VER)
+  #include <intrin.h>
+#endif
+#if !defined(ARCP_NUTOS)
+  #include <stdio.h>
+  #include <time.h>
+#endif
 
-/* ======================================================================== */
+/* Vector byte-swap kernels for the stream array functions are used when the
+ * compiler targets a suitable x86 instruction set.  Other targets use the
+ * portable scalar code.
+ */
+#if defined(__AVX2__)
+  #include <immintrin.h>
+  #define ARCP_SIMD_AVX2
+  #define ARCP_SIMD_SSE2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+  #include <emmintrin.h>
+  #define ARCP_SIMD_SSE2
+#endif
 
-/* The next exchange ID to use */
-static unsigned short int exchange_id = 0;
+/* ======================================================================== */
 
 /* Flags used internally by arcp_socket_process() */
 #define MSG_ARCP             0x0001
 #define MSG_ASCII            0x0002
 #define MSG_ALL              (MSG_ARCP | MSG_ASCII)
 
+/* Values of arcp_handle_t.rx_nonblock: read only what is available, or
+ * don't read from the socket at all.
+ */
+#define RX_NONBLOCK          1
+#define RX_BUFFERED          2
+
+/* Scatter/gather sends with sendmsg() are available on POSIX systems.  The
+ * in-place payload of a message needs at most one piece beyond its header,
+ * so SEND_IOV_MAX pieces carry at least SEND_IOV_MAX/2 messages.
+ */
+#if !defined(ARCP_NUTOS) && !defined(ARCP_WIN32)
+#define VECTORED_SEND
+#define SEND_IOV_MAX         16
+#endif
+
+/* Alignment of allocations carved from a status decode arena */
+#define ARENA_ALIGN          8
+#define ARENA_ROUND(_n)      (((_n)+ARENA_ALIGN-1) & ~(ARENA_ALIGN-1))
+#define ARENA_MIN(_a,_b)     ((_a)<(_b)?(_a):(_b))
+
 /* ======================================================================== */
 
+/* Word used for bulk pulse code operations, and the number of words in the
+ * longest code.
+ */
+typedef unsigned long long pc_word_t;
+#define PC_WORD_BITS         64
+#define PC_WORDS             ((ARCP_MAX_PULSECODE_SIZE+PC_WORD_BITS-1)/PC_WORD_BITS)
+
 /* Used in arcp_pulsecode_new() */
 signed int arcp_pulsecode_setsize(arcp_pulsecode_t *code, uint16 newsize);
 
@@ -236,10 +280,17 @@ signed int arcp_pulsecode_setbit(arcp_pulsecode_t *code, uint16 bitnum,
  * some odd reason.
  */
 
-  /* Extend storage space for the pulse code if necessary */
-  if (bitnum >= code->size)
-    if (arcp_pulsecode_setsize(code, (uint16)(bitnum+1)) < 0)
+  /* Extend storage space for the pulse code if necessary.  The storage is
+   * at least doubled each time so that building a code bit by bit doesn't
+   * reallocate for every byte.
+   */
+  if (bitnum >= code->size) {
+    uint16 newsize = (uint16)(bitnum+1);
+    if (newsize<2*code->size && 2*code->size<=ARCP_MAX_PULSECODE_SIZE)
+      newsize = (uint16)(2*code->size);
+    if (arcp_pulsecode_setsize(code, newsize) < 0)
       return -1;
+  }
 
   if (value)
     code->data[bitnum/8] |= (uint8)(1<<(bitnum%8));
@@ -251,6 +302,226 @@ signed int arcp_pulsecode_setbit(arcp_pulsecode_t *code, uint16 bitnum,
 }
 /* ======================================================================== */
 
+static void pulsecode_trim(arcp_pulsecode_t *code) {
+/*
+ * Internal function: clears the bits of the last byte of the given pulse
+ * code which lie beyond its length.
+ */
+  if (code->code_length%8 != 0)
+    code->data[code->code_length/8] &= (uint8)((1<<(code->code_length%8))-1);
+}
+/* ======================================================================== */
+
+static signed int pulsecode_prepare(arcp_pulsecode_t *code, uint16 length) {
+/*
+ * Internal function: makes room for a code of the given length in one step
+ * and sets the code's length.  Returns 0 on success or -1 on error.
+ */
+  if (code == NULL)
+    return -1;
+  if (code->size < length)
+    if (arcp_pulsecode_setsize(code, length) < 0)
+      return -1;
+  code->code_length = length;
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_pulsecode_set_bytes(arcp_pulsecode_t *code, const uint8 *bytes,
+  uint16 length) {
+/*
+ * Sets the given pulse code to the first length bits of bytes[], which are
+ * in the same order as the code's own storage: bit n of the code is bit
+ * (n%8) of bytes[n/8].  Returns 0 on success or -1 if the code can't be
+ * extended to the requested length.
+ */
+  if ((bytes==NULL && length!=0) || pulsecode_prepare(code, length)<0)
+    return -1;
+  if (length != 0) {
+    memcpy(code->data, bytes, 1+(length-1)/8);
+    pulsecode_trim(code);
+  }
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_pulsecode_set_words(arcp_pulsecode_t *code, const uint32 *words,
+  uint16 length) {
+/*
+ * As for arcp_pulsecode_set_bytes() but taking the bits from 32 bit words:
+ * bit n of the code is bit (n%32) of words[n/32].
+ */
+uint16 i;
+
+  if ((words==NULL && length!=0) || pulsecode_prepare(code, length)<0)
+    return -1;
+  for (i=0; i<(length+7)/8; i++)
+    code->data[i] = (uint8)(words[i/4] >> (8*(i%4)));
+  if (length != 0)
+    pulsecode_trim(code);
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_pulsecode_set_chips(arcp_pulsecode_t *code, const char *chips) {
+/*
+ * Sets the given pulse code from a string of chips, one character per bit
+ * starting with bit 0: '+' sets the bit and '-' clears it.  Returns 0 on
+ * success or -1 if the string contains any other character or is too
+ * long.
+ */
+size_t n;
+uint16 i;
+uint8 byte = 0;
+
+  if (chips == NULL)
+    return -1;
+  n = strspn(chips, "+-");
+  if (chips[n]!='\0' || n>ARCP_MAX_PULSECODE_SIZE ||
+      pulsecode_prepare(code, (uint16)n)<0)
+    return -1;
+  for (i=0; i<n; i++) {
+    if (chips[i] == '+')
+      byte |= (uint8)(1<<(i%8));
+    if (i%8==7 || i==n-1) {
+      code->data[i/8] = byte;
+      byte = 0;
+    }
+  }
+  return 0;
+}
+/* ======================================================================== */
+
+void arcp_pulsecode_complement(arcp_pulsecode_t *code) {
+/*
+ * Flips every bit of the given pulse code (multiplying each chip by -1).
+ */
+uint16 i;
+
+  if (code==NULL || code->code_length==0)
+    return;
+  for (i=0; i<=(code->code_length-1)/8; i++)
+    code->data[i] = (uint8)~code->data[i];
+  pulsecode_trim(code);
+}
+/* ======================================================================== */
+
+void arcp_pulsecode_invert(arcp_pulsecode_t *code) {
+/*
+ * Reverses the given pulse code in time, so that the last bit becomes bit
+ * 0.
+ */
+uint8 rev[ARCP_MAX_PULSECODE_SIZE/8+1], b;
+uint16 i, n_bytes, shift;
+
+  if (code==NULL || code->code_length<2)
+    return;
+  n_bytes = (uint16)(1+(code->code_length-1)/8);
+
+  /* Reverse the order of the bytes and of the bits within each byte, then
+   * shift the result down over the padding which ends up at the bottom.
+   */
+  for (i=0; i<n_bytes; i++) {
+    b = code->data[n_bytes-1-i];
+    b = (uint8)(((b&0xf0)>>4) | ((b&0x0f)<<4));
+    b = (uint8)(((b&0xcc)>>2) | ((b&0x33)<<2));
+    b = (uint8)(((b&0xaa)>>1) | ((b&0x55)<<1));
+    rev[i] = b;
+  }
+  rev[n_bytes] = 0;
+  shift = (uint16)(8*n_bytes-code->code_length);
+  for (i=0; i<n_bytes; i++)
+    code->data[i] = (uint8)((rev[i]>>shift) | (rev[i+1]<<(8-shift)));
+  pulsecode_trim(code);
+}
+/* ======================================================================== */
+
+static unsigned int pc_popcount(pc_word_t w) {
+/*
+ * Internal function: returns the number of set bits in w.
+ */
+#ifdef __GNUC__
+  return (unsigned int)__builtin_popcountll(w);
+#else
+  w = w - ((w>>1) & 0x5555555555555555ULL);
+  w = (w & 0x3333333333333333ULL) + ((w>>2) & 0x3333333333333333ULL);
+  w = (w + (w>>4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (unsigned int)((w*0x0101010101010101ULL) >> 56);
+#endif
+}
+/* ======================================================================== */
+
+signed int arcp_pulsecode_sidelobes(arcp_pulsecode_t *code, int16 *acf) {
+/*
+ * Computes the aperiodic autocorrelation of the given pulse code, taking
+ * set bits as +1 chips and clear bits as -1.  If acf is not NULL, acf[k]
+ * receives the autocorrelation at lag k for k = 0 to length-1 (acf[0] is
+ * the length itself).  Each lag is evaluated a word at a time: the number
+ * of chips which disagree is the population count of the code XORed with
+ * itself shifted by the lag.
+ *
+ * Returns the peak sidelobe level - the largest magnitude at any non-zero
+ * lag - or -1 if code is NULL or empty.
+ */
+pc_word_t w[PC_WORDS+1], x, mask;
+uint16 n, k, m, q, r, j;
+unsigned int diff;
+signed int c, peak = 0;
+
+  if (code==NULL || code->code_length==0)
+    return -1;
+  n = code->code_length;
+
+  memset(w, 0, sizeof(w));
+  for (j=0; j<=(n-1)/8; j++)
+    w[j/(PC_WORD_BITS/8)] |= (pc_word_t)code->data[j] << (8*(j%(PC_WORD_BITS/8)));
+
+  if (acf != NULL)
+    acf[0] = (int16)n;
+  for (k=1; k<n; k++) {
+    /* Compare bits i and i+k for i in [0, m) */
+    m = (uint16)(n-k);
+    q = (uint16)(k/PC_WORD_BITS);
+    r = (uint16)(k%PC_WORD_BITS);
+    diff = 0;
+    for (j=0; j*PC_WORD_BITS<m; j++) {
+      x = w[j+q] >> r;
+      if (r!=0 && j+q+1<=PC_WORDS)
+        x |= w[j+q+1] << (PC_WORD_BITS-r);
+      mask = (j+1)*PC_WORD_BITS<=m ? ~(pc_word_t)0 :
+        ((pc_word_t)1 << (m%PC_WORD_BITS))-1;
+      diff += pc_popcount((w[j]^x) & mask);
+    }
+    c = (signed int)m - 2*(signed int)diff;
+    if (acf != NULL)
+      acf[k] = (int16)c;
+    if (c < 0)
+      c = -c;
+    if (c > peak)
+      peak = c;
+  }
+  return peak;
+}
+/* ======================================================================== */
+
+arcp_pulsecode_t *arcp_pulsecode_fixed_init(arcp_pulsecode_fixed_t *fixed) {
+/*
+ * Initialises the given fixed pulse code, which has inline storage for the
+ * longest code, and returns a pointer to its arcp_pulsecode_t.  This may
+ * be used anywhere a pulse code is expected and never allocates memory. 
+ * It must not be passed to arcp_pulsecode_free() and must not be copied
+ * (the pointer refers into the structure itself).  The code starts empty.
+ */
+  if (fixed == NULL)
+    return NULL;
+  memset(fixed->storage, 0, sizeof(fixed->storage));
+  fixed->code.size = ARCP_MAX_PULSECODE_SIZE;
+  fixed->code.code_length = 0;
+  fixed->code.data = fixed->storage;
+  return &fixed->code;
+}
+/* ======================================================================== */
+
 arcp_pulseseq_t *arcp_pulseseq_new(uint16 length) {
 /*
  * Allocates a new pulse sequence object with sufficient storage to store
@@ -326,6 +597,53 @@ signed int arcp_pulseseq_set_entry(arcp_pulseseq_t *seq, uint16 entry,
 }
 /* ======================================================================== */
 
+static signed int in_stx2_arena(arcp_stx2stat_t *stat, void *p) {
+/*
+ * Internal function: returns 1 if p lies within the decode arena of the
+ * given STX2 status object, 0 otherwise.
+ */
+  return stat->arena!=NULL && (uint8 *)p>=stat->arena &&
+         (uint8 *)p<stat->arena+stat->arena_size;
+}
+/* ======================================================================== */
+
+static void *stx2_resize(arcp_stx2stat_t *stat, void *buf,
+  unsigned int new_size, unsigned int old_size) {
+/*
+ * Internal function: resizes one of the dynamic arrays hanging off a STX2
+ * status object.  This behaves like set_new_size() except that storage
+ * belonging to the object's decode arena is never passed to free(), and
+ * new storage is carved from the arena while space remains.  Once the
+ * arena is exhausted the heap is used, so the accessor functions work on
+ * arena-backed objects exactly as they do on ordinary ones.
+ */
+uint8 *res;
+
+  if (stat->arena==NULL || (buf!=NULL && !in_stx2_arena(stat, buf)))
+    return set_new_size(buf, new_size, old_size);
+
+  if (new_size == old_size)
+    return buf;
+  if (new_size == 0)
+    return NULL;
+
+  if (stat->arena_used+ARENA_ROUND(new_size) <= stat->arena_size) {
+    res = stat->arena + stat->arena_used;
+    stat->arena_used = (uint16)(stat->arena_used+ARENA_ROUND(new_size));
+  } else {
+    res = malloc(new_size);
+    if (res == NULL)
+      return NULL;
+  }
+
+  if (buf != NULL)
+    memcpy(res, buf, new_size<old_size?new_size:old_size);
+  if (new_size > old_size)
+    memset(res+old_size, 0, new_size-old_size);
+  return res;
+}
+/* ======================================================================== */
+
 arcp_stx2stat_t *arcp_stx2stat_new(void) {
 /*
  * Creates a new STX2 status object and returns a pointer to it.  If
@@ -337,27 +655,32 @@ arcp_stx2stat_t *arcp_stx2stat_new(void) {
 
 void arcp_stx2stat_free(arcp_stx2stat_t *stat) {
 /*
- * Deallocates all storage used by the given STX2 status object.
+ * Deallocates all storage used by the given STX2 status object.  For an
+ * arena-backed object only storage which has since moved to the heap is
+ * freed here; the arena itself goes with the owning system status object.
  */
 uint8 rf_card;
 
   if (stat == NULL)
     return;
-  if (stat->fan_speed != NULL)
+  if (stat->fan_speed!=NULL && !in_stx2_arena(stat, stat->fan_speed))
     free(stat->fan_speed);
 
   if (stat->rf_card_stat != NULL) {
     for (rf_card=0; rf_card<stat->n_rf_cards; rf_card++) {
-      if (stat->rf_card_stat[rf_card].output_stat != NULL)
+      if (stat->rf_card_stat[rf_card].output_stat!=NULL &&
+          !in_stx2_arena(stat, stat->rf_card_stat[rf_card].output_stat))
         free(stat->rf_card_stat[rf_card].output_stat);
     }
-    free(stat->rf_card_stat);
+    if (!in_stx2_arena(stat, stat->rf_card_stat))
+      free(stat->rf_card_stat);
   }
 
-  if (stat->unit_stat != NULL) {
+  if (stat->unit_stat!=NULL && !in_stx2_arena(stat, stat->unit_stat)) {
     free(stat->unit_stat);
   }
-  free(stat);
+  if (stat->arena == NULL)
+    free(stat);
 }
 /* ======================================================================== */
 
@@ -382,7 +705,7 @@ uint16 *buf;
     return ARCP_ERROR_LOCAL;
 
   /* Each fanspeed record is 2 bytes */
-  buf = set_new_size((void *)stat->fan_speed, 
+  buf = stx2_resize(stat, (void *)stat->fan_speed, 
           2*n_chassis_fans, 2*stat->n_chassis_fans);
   if (n_chassis_fans!=0 && buf==NULL)
     return ARCP_ERROR_LOCAL;
@@ -414,7 +737,7 @@ signed int arcp_stx2stat_set_n_rf_cards(arcp_stx2stat_t *stat, uint8 n_rf_cards)
  */
 arcp_rf_card_stat_t *buf;
 
-  buf = set_new_size((void *)stat->rf_card_stat,
+  buf = stx2_resize(stat, (void *)stat->rf_card_stat,
           sizeof(arcp_rf_card_stat_t)*n_rf_cards, 
           sizeof(arcp_rf_card_stat_t)*stat->n_rf_cards);
   if (n_rf_cards!=0 && buf==NULL)
@@ -445,7 +768,7 @@ arcp_rf_card_output_stat_t *buf;
   if (card_index >= stat->n_rf_cards)
     return ARCP_ERROR_INTERNAL;
 
-  buf = set_new_size((void *)stat->rf_card_stat[card_index].output_stat,
+  buf = stx2_resize(stat, (void *)stat->rf_card_stat[card_index].output_stat,
           sizeof(arcp_rf_card_output_stat_t)*n_rf_outputs, 
           sizeof(arcp_rf_card_output_stat_t)*stat->rf_card_stat[card_index].n_rf_outputs);
   if (n_rf_outputs!=0 && buf==NULL)
@@ -473,7 +796,7 @@ arcp_stx2unit_union_t *buf;
   if (stat==NULL || n_units>ARCP_STX2_MAX_N_STX2_UNITS)
     return ARCP_ERROR_INTERNAL;
 
-  buf = set_new_size((void *)stat->unit_stat,
+  buf = stx2_resize(stat, (void *)stat->unit_stat,
           sizeof(arcp_stx2unit_union_t)*n_units,
           sizeof(arcp_stx2unit_union_t)*stat->n_units);
   if (n_units!=0 && buf==NULL)
@@ -555,7 +878,9 @@ arcp_sysstat_t *res = calloc(1,sizeof(arcp_sysstat_t));
 
 void arcp_sysstat_free(arcp_sysstat_t *sysstat) {
 /*
- * Deallocates memory used by the given system status object.
+ * Deallocates memory used by the given system status object.  If the
+ * object was produced by an arena-backed decode the whole tree is released
+ * by the final free().
  */
   if (sysstat == NULL)
     return;
@@ -564,13 +889,74 @@ void arcp_sysstat_free(arcp_sysstat_t *sysstat) {
       arcp_stx2stat_free(sysstat->data.stx2);
       break;
     case ARCP_MODULE_BSM:
-      arcp_bsmstat_free(sysstat->data.bsm);
+      if (sysstat->arena_size == 0)
+        arcp_bsmstat_free(sysstat->data.bsm);
       break;
   }
   free(sysstat);
 }
 /* ======================================================================== */
 
+static arcp_sysstat_t *sysstat_arena_new(uint16 wire_len) {
+/*
+ * Internal function: creates a system status object whose entire tree
+ * will be placed in a single block.  The block holds the arcp_sysstat_t,
+ * space for the module-specific status structure and a pool for the STX2
+ * arrays.  The pool is sized from wire_len (the number of message bytes
+ * still to be decoded) using the minimum number of wire bytes each array
+ * element occupies, capped by the ARCP_MAX_* limits.
+ *
+ * Returns the new object or NULL if memory is exhausted.
+ */
+arcp_sysstat_t *res;
+unsigned int size, n = wire_len;
+
+  size = ARENA_ROUND(sizeof(arcp_sysstat_t));
+  size += ARENA_ROUND(sizeof(arcp_stx2stat_t)>sizeof(arcp_bsmstat_t)?
+            sizeof(arcp_stx2stat_t):sizeof(arcp_bsmstat_t));
+  /* Fan speeds: 2 bytes each on the wire */
+  size += ARENA_ROUND(2*ARENA_MIN(ARCP_MAX_N_CHASSIS_FANS, n/2));
+  /* RF cards: at least 5 bytes each on the wire */
+  size += ARENA_ROUND(sizeof(arcp_rf_card_stat_t)*ARENA_MIN(ARCP_MAX_N_RF_CARDS, n/5));
+  /* RF outputs: 4 bytes each on the wire, allocated per card */
+  size += ARENA_ROUND(sizeof(arcp_rf_card_output_stat_t)*
+            ARENA_MIN(ARCP_MAX_N_RF_CARDS*ARCP_MAX_N_RF_CARD_OUTPUT, n/4));
+  size += ARCP_MAX_N_RF_CARDS*ARENA_ALIGN;
+  /* External units: at least 2 bytes each on the wire */
+  size += ARENA_ROUND(sizeof(arcp_stx2unit_union_t)*
+            ARENA_MIN(ARCP_STX2_MAX_N_STX2_UNITS, n/2));
+
+  res = calloc(1, size);
+  if (res == NULL)
+    return NULL;
+  res->module_type = -1;
+  res->arena_size = (uint16)size;
+  return res;
+}
+/* ======================================================================== */
+
+static void *sysstat_arena_module(arcp_sysstat_t *sysstat) {
+/*
+ * Internal function: returns the (zeroed) storage reserved for the
+ * module-specific status structure of an arena-backed system status
+ * object.  For STX2 modules the remainder of the block is attached to the
+ * status structure as its arena.
+ */
+uint8 *base = (uint8 *)sysstat;
+unsigned int offset = ARENA_ROUND(sizeof(arcp_sysstat_t));
+unsigned int pool = offset + ARENA_ROUND(sizeof(arcp_stx2stat_t)>sizeof(arcp_bsmstat_t)?
+                      sizeof(arcp_stx2stat_t):sizeof(arcp_bsmstat_t));
+
+  if (sysstat->module_type == ARCP_MODULE_STX2) {
+    arcp_stx2stat_t *stat = (arcp_stx2stat_t *)(base+offset);
+    stat->arena = base + pool;
+    stat->arena_size = (uint16)(sysstat->arena_size - pool);
+    stat->arena_used = 0;
+  }
+  return base+offset;
+}
+/* ======================================================================== */
+
 signed int arcp_sysstat_set_moduletype(arcp_sysstat_t *sysstat, arcp_moduletype_t type) {
 /*
  * Sets the module type of the given status structure and configures any
@@ -595,6 +981,67 @@ signed int arcp_sysstat_set_moduletype(arcp_sysstat_t *sysstat, arcp_moduletype_
 }
 /* ======================================================================== */
 
+arcp_sysstat_t *arcp_sysstat_copy(arcp_sysstat_t *sysstat) {
+/*
+ * Creates a new system status object holding a deep copy of the given one,
+ * for example so a cached status can be sent with arcp_send_sysstat() or
+ * attached to a response message which is later freed.  The copy is an
+ * ordinary heap-allocated object even if the original came from an
+ * arena-backed decode.  Returns NULL if memory could not be allocated.
+ */
+arcp_sysstat_t *res;
+arcp_stx2stat_t *src, *dst;
+uint8 i;
+
+  if (sysstat==NULL || (res=arcp_sysstat_new())==NULL)
+    return NULL;
+  res->module_status = sysstat->module_status;
+  if (sysstat->module_type < 0)
+    return res;
+  if (arcp_sysstat_set_moduletype(res, sysstat->module_type) != 0)
+    goto fail;
+
+  switch (sysstat->module_type) {
+    case ARCP_MODULE_STX2:
+      src = sysstat->data.stx2;
+      dst = res->data.stx2;
+      dst->status_code = src->status_code;
+      dst->rail_supply = src->rail_supply;
+      dst->rail_aux = src->rail_aux;
+      dst->ambient_temp = src->ambient_temp;
+      dst->card_map = src->card_map;
+      if (arcp_stx2stat_set_n_chassis_fans(dst, src->n_chassis_fans)!=0 ||
+          arcp_stx2stat_set_n_rf_cards(dst, src->n_rf_cards)!=0 ||
+          arcp_stx2stat_set_n_units(dst, src->n_units)!=0)
+        goto fail;
+      dst->chassis_datasize = src->chassis_datasize;
+      if (src->n_chassis_fans != 0)
+        memcpy(dst->fan_speed, src->fan_speed, 2*src->n_chassis_fans);
+      for (i=0; i<src->n_rf_cards; i++) {
+        dst->rf_card_stat[i].rail_supply = src->rf_card_stat[i].rail_supply;
+        dst->rf_card_stat[i].heatsink_temp = src->rf_card_stat[i].heatsink_temp;
+        if (arcp_stx2stat_set_n_rf_outputs(dst, i, src->rf_card_stat[i].n_rf_outputs) != 0)
+          goto fail;
+        if (src->rf_card_stat[i].n_rf_outputs != 0)
+          memcpy(dst->rf_card_stat[i].output_stat, src->rf_card_stat[i].output_stat,
+            sizeof(arcp_rf_card_output_stat_t)*src->rf_card_stat[i].n_rf_outputs);
+      }
+      if (src->n_units != 0)
+        memcpy(dst->unit_stat, src->unit_stat,
+          sizeof(arcp_stx2unit_union_t)*src->n_units);
+      break;
+    case ARCP_MODULE_BSM:
+      *res->data.bsm = *sysstat->data.bsm;
+      break;
+  }
+  return res;
+
+fail:
+  arcp_sysstat_free(res);
+  return NULL;
+}
+/* ======================================================================== */
+
 static signed int arcp_id_is_response(signed int id) {
 /*
  * Returns 1 if the given ID is an ARCP response code, or 0 if it represents
@@ -880,6 +1327,39 @@ signed int arcp_stream_error(arcp_stream_t *stream) {
 }
 /* ======================================================================== */
 
+static uint8 *stream_claim(arcp_stream_t *stream, unsigned int n) {
+/*
+ * Internal function: checks that n bytes are available at the head of the
+ * stream and, if so, advances the head past them and returns a pointer to
+ * the first.  Otherwise the stream's error flag is set and NULL returned.
+ * All stream accessors go through this so each read or write of a value
+ * or array costs a single bounds check.
+ */
+uint8 *p = stream->head;
+  if (stream->err || n > (unsigned int)(stream->end+1-stream->head)) {
+    stream->err = 1;
+    return NULL;
+  }
+  stream->head += n;
+  return p;
+}
+/* ======================================================================== */
+
+/* Byte-wise big-endian accessors.  These make no assumptions about host
+ * byte order or the alignment of p.
+ */
+#define get_be16(_p) ((uint16)(((uint16)(_p)[0]<<8) | (_p)[1]))
+#define get_be32(_p) (((uint32)(_p)[0]<<24) | ((uint32)(_p)[1]<<16) | \
+                      ((uint32)(_p)[2]<<8) | (uint32)(_p)[3])
+#define put_be16(_p,_v) do { (_p)[0] = (uint8)((_v)>>8); \
+                             (_p)[1] = (uint8)(_v); } while (0)
+#define put_be32(_p,_v) do { (_p)[0] = (uint8)((_v)>>24); \
+                             (_p)[1] = (uint8)((_v)>>16); \
+                             (_p)[2] = (uint8)((_v)>>8); \
+                             (_p)[3] = (uint8)(_v); } while (0)
+
+/* ======================================================================== */
+
 signed int arcp_stream_get_int32(arcp_stream_t *stream, int32 *data) {
 /*
  * Read a 32 bit integer from the head of the stream.  Returns 0 on success
@@ -887,13 +1367,10 @@ signed int arcp_stream_get_int32(arcp_stream_t *stream, int32 *data) {
  * completing.  The stream head is advanced past the 32 bits read before
  * returning.
  */
-uint32 *sp = (uint32 *)(stream->head);
-  if (stream->err || stream->head+4-1 > stream->end) {
-    stream->err = 1;
+uint8 *sp = stream_claim(stream, 4);
+  if (sp == NULL)
     return ARCP_ERROR_BADMSG;
-  }
-  *data = htonl(*sp);
-  stream->head += 4;
+  *data = (int32)get_be32(sp);
   return 0;
 }
 /* ======================================================================== */
@@ -905,13 +1382,10 @@ signed int arcp_stream_get_int16(arcp_stream_t *stream, int16 *data) {
  * completing.  The stream head is advanced past the 8 bits read before
  * returning.
  */
-uint16 *sp = (uint16 *)(stream->head);
-  if (stream->err || stream->head+2-1 > stream->end) {
-    stream->err = 1;
+uint8 *sp = stream_claim(stream, 2);
+  if (sp == NULL)
     return ARCP_ERROR_BADMSG;
-  }
-  *data = htons(*sp);
-  stream->head += 2;
+  *data = (int16)get_be16(sp);
   return 0;
 }
 /* ======================================================================== */
@@ -923,11 +1397,10 @@ signed int arcp_stream_get_int8(arcp_stream_t *stream, int8 *data) {
  * completing.  The stream head is advanced past the 8 bits read before
  * returning.
  */
-  if (stream->err || stream->head+1-1 > stream->end) {
-    stream->err = 1;
+uint8 *sp = stream_claim(stream, 1);
+  if (sp == NULL)
     return ARCP_ERROR_BADMSG;
-  }
-  *data = *(stream->head++);
+  *data = (int8)*sp;
   return 0;
 }
 /* ======================================================================== */
@@ -938,13 +1411,10 @@ signed int arcp_stream_store_int32(arcp_stream_t *stream, int32 data) {
  * to the next free location.  Returns 0 on success or ARCP_ERROR_BADMSG
  * if the end-of-stream is hit before the operation can complete.
  */
-uint32 *dp = (uint32 *)(stream->head);
-  if (stream->err || stream->head+4-1 > stream->end) {
-    stream->err = 1;
+uint8 *dp = stream_claim(stream, 4);
+  if (dp == NULL)
     return ARCP_ERROR_BADMSG;
-  }
-  *dp = htonl(data);
-  stream->head += 4;
+  put_be32(dp, (uint32)data);
   return 0;
 }
 /* ======================================================================== */
@@ -954,13 +1424,10 @@ signed int arcp_stream_store_int16(arcp_stream_t *stream, int16 data) {
  * Store a 16 bit integer into the stream at the head and move the head
  * if the end-of-stream is hit before the operation can complete.
  */
-uint16 *dp = (uint16 *)(stream->head);
-  if (stream->err || stream->head+2-1 > stream->end) {
-    stream->err = 1;
+uint8 *dp = stream_claim(stream, 2);
+  if (dp == NULL)
     return ARCP_ERROR_BADMSG;
-  }
-  *dp = htons(data);
-  stream->head += 2;
+  put_be16(dp, (uint16)data);
   return 0;
 }
 /* ======================================================================== */
@@ -971,11 +1438,10 @@ signed int arcp_stream_store_int8(arcp_stream_t *stream, int8 data) {
  * to the next free location.  Returns 0 on success or ARCP_ERROR_BADMSG
  * if the end-of-stream is hit before the operation can complete.
  */
-  if (stream->err || stream->head+1-1 > stream->end) {
-    stream->err = 1;
+uint8 *dp = stream_claim(stream, 1);
+  if (dp == NULL)
     return ARCP_ERROR_BADMSG;
-  }
-  *(stream->head++) = data;
+  *dp = (uint8)data;
   return 0;
 }
 /* ======================================================================== */
@@ -1027,81 +1493,288 @@ union {
 }
 /* ======================================================================== */
 
-signed int arcp_stream_reset(arcp_stream_t *stream) {
+static void swap16_copy(uint8 *dst, const uint8 *src, unsigned int n) {
 /*
- * Resets the stream head to the start of the stream.  Returns 0 on success.
- * Currently this function does not fail.
+ * Internal function: copies n 16-bit values from src to dst, converting
+ * between big-endian (wire) and host byte order.  Neither pointer needs
+ * to be aligned.  The conversion is its own inverse so this is used in
+ * both directions.
  */
-  stream->head = stream->data;
-  stream->err = 0;
-  return 0;
+unsigned int i = 0;
+
+  /* Big-endian hosts need no conversion */
+  if (htons(1) == 1) {
+    memcpy(dst, src, 2*n);
+    return;
+  }
+#ifdef ARCP_SIMD_AVX2
+  {
+    const __m256i mask = _mm256_setr_epi8(
+      1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+      1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+    for (; i+16 <= n; i+=16) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(src+2*i));
+      _mm256_storeu_si256((__m256i *)(dst+2*i), _mm256_shuffle_epi8(v, mask));
+    }
+  }
+#endif
+#ifdef ARCP_SIMD_SSE2
+  for (; i+8 <= n; i+=8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src+2*i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(dst+2*i), v);
+  }
+#endif
+  for (; i<n; i++) {
+    uint8 b = src[2*i];
+    dst[2*i] = src[2*i+1];
+    dst[2*i+1] = b;
+  }
 }
 /* ======================================================================== */
 
-signed int arcp_stream_setsize(arcp_stream_t *stream, uint16 newsize) {
+static void swap32_copy(uint8 *dst, const uint8 *src, unsigned int n) {
 /*
- * Sizes the given stream to accept up to newsize bytes.  Any existing
- * data in the stream is destroyed.  This function can be called with a
- * NULL stream pointer, in which case -1 will be returned to the caller.
- *
- * Returns 0 on success or an ARCP_ERROR_* if an error occurred.
+ * Internal function: as for swap16_copy() but for n 32-bit values (either
+ * integers or IEEE floats).
  */
-  /* Don't proceed if the given stream hasn't been allocated */
-  if (stream == NULL)
-    return ARCP_ERROR_LOCAL;
-
-  /* If no resize is necessary simply return to the caller */
-  if (newsize == stream->size)
-    return 0;
+unsigned int i = 0;
 
-  /* Deallocate any existing data the given stream might have */
-  if (stream->data != NULL) {
-    free(stream->data);
-    stream->data = NULL;
+  if (htons(1) == 1) {
+    memcpy(dst, src, 4*n);
+    return;
   }
-
-  /* Limit the streamsize to that specified in the protocol */
-  if (newsize > ARCP_MSG_MAX_SIZE)
-    return ARCP_ERROR_BADMSG;
-
-  /* Allocate storage as requested and deal with any errors */
-  if (newsize != 0) {
-    stream->data = malloc(newsize);
+#ifdef ARCP_SIMD_AVX2
+  {
+    const __m256i mask = _mm256_setr_epi8(
+      3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+      3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+    for (; i+8 <= n; i+=8) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(src+4*i));
+      _mm256_storeu_si256((__m256i *)(dst+4*i), _mm256_shuffle_epi8(v, mask));
+    }
   }
-  if (newsize!=0 && stream->data==NULL) {
-    stream->size = 0;
-    return ARCP_ERROR_LOCAL;
+#endif
+#ifdef ARCP_SIMD_SSE2
+  for (; i+4 <= n; i+=4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src+4*i));
+    /* Swap the 16-bit halves of each word, then the bytes of each half */
+    v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(dst+4*i), v);
   }
-  
-  stream->size = newsize;
-  stream->head = stream->data;
-  stream->end = stream->data + newsize-1;
+#endif
+  for (; i<n; i++) {
+    dst[4*i]   = src[4*i+3];
+    dst[4*i+1] = src[4*i+2];
+    dst[4*i+2] = src[4*i+1];
+    dst[4*i+3] = src[4*i];
+  }
+}
+/* ======================================================================== */
+
+signed int arcp_stream_get_int16_array(arcp_stream_t *stream, int16 *data,
+  uint16 n) {
+/*
+ * Read n consecutive 16 bit integers from the head of the stream into
+ * data.  Returns 0 on success or ARCP_ERROR_BADMSG if the end-of-stream
+ * prevents the operation from completing, in which case nothing is read.
+ */
+uint8 *sp = stream_claim(stream, 2*(unsigned int)n);
+  if (sp == NULL)
+    return ARCP_ERROR_BADMSG;
+  swap16_copy((uint8 *)data, sp, n);
   return 0;
 }
 /* ======================================================================== */
 
-void arcp_stream_free(arcp_stream_t *stream) {
+signed int arcp_stream_get_int32_array(arcp_stream_t *stream, int32 *data,
+  uint16 n) {
 /*
- * Frees the given stream object.
+ * Read n consecutive 32 bit integers from the head of the stream into
+ * data.  Returns 0 on success or ARCP_ERROR_BADMSG if the end-of-stream
+ * prevents the operation from completing.
  */
-  if (stream == NULL)
-    return;
-  if (stream->data != NULL)
-    free(stream->data);
-  free(stream);
+uint8 *sp = stream_claim(stream, 4*(unsigned int)n);
+  if (sp == NULL)
+    return ARCP_ERROR_BADMSG;
+  swap32_copy((uint8 *)data, sp, n);
+  return 0;
 }
 /* ======================================================================== */
-/* Support functions for stream encoding functionality */
 
-static signed int store_arcp_cmd(arcp_stream_t *stream, arcp_msg_t *msg) {
+signed int arcp_stream_get_float_array(arcp_stream_t *stream, float *data,
+  uint16 n) {
 /*
- * Stores ARCP command message details into the given stream.  In the event
- * of stream overflow, the stream's error flag will be set on exit.  Return
- * values are 0 on success or an ARCP_ERROR_* code in the event of an error.
+ * Read n consecutive IEEE 32-bit floats from the head of the stream into
+ * data.  Returns 0 on success or ARCP_ERROR_BADMSG if the end-of-stream
+ * prevents the operation from completing.
  */
-int16 i;
-signed int err = 0;
-  arcp_stream_store_int16(stream, msg->command.id);
+uint8 *sp = stream_claim(stream, 4*(unsigned int)n);
+  if (sp == NULL)
+    return ARCP_ERROR_BADMSG;
+  swap32_copy((uint8 *)data, sp, n);
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_stream_get_bytes(arcp_stream_t *stream, void *data, uint16 n) {
+/*
+ * Read n bytes from the head of the stream into data.  Returns 0 on
+ * success or ARCP_ERROR_BADMSG if the end-of-stream prevents the operation
+ * from completing.
+ */
+uint8 *sp = stream_claim(stream, n);
+  if (sp == NULL)
+    return ARCP_ERROR_BADMSG;
+  memcpy(data, sp, n);
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_stream_store_int16_array(arcp_stream_t *stream,
+  const int16 *data, uint16 n) {
+/*
+ * Store n consecutive 16 bit integers from data into the stream at the
+ * head.  Returns 0 on success or ARCP_ERROR_BADMSG if the end-of-stream is
+ * hit before the operation can complete, in which case nothing is stored.
+ */
+uint8 *dp = stream_claim(stream, 2*(unsigned int)n);
+  if (dp == NULL)
+    return ARCP_ERROR_BADMSG;
+  swap16_copy(dp, (const uint8 *)data, n);
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_stream_store_int32_array(arcp_stream_t *stream,
+  const int32 *data, uint16 n) {
+/*
+ * Store n consecutive 32 bit integers from data into the stream at the
+ * head.  Returns 0 on success or ARCP_ERROR_BADMSG if the end-of-stream is
+ * hit before the operation can complete.
+ */
+uint8 *dp = stream_claim(stream, 4*(unsigned int)n);
+  if (dp == NULL)
+    return ARCP_ERROR_BADMSG;
+  swap32_copy(dp, (const uint8 *)data, n);
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_stream_store_float_array(arcp_stream_t *stream,
+  const float *data, uint16 n) {
+/*
+ * Store n consecutive IEEE 32-bit floats from data into the stream at the
+ * head.  Returns 0 on success or ARCP_ERROR_BADMSG if the end-of-stream is
+ * hit before the operation can complete.
+ */
+uint8 *dp = stream_claim(stream, 4*(unsigned int)n);
+  if (dp == NULL)
+    return ARCP_ERROR_BADMSG;
+  swap32_copy(dp, (const uint8 *)data, n);
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_stream_store_bytes(arcp_stream_t *stream, const void *data,
+  uint16 n) {
+/*
+ * Store n bytes from data into the stream at the head.  Returns 0 on
+ * success or ARCP_ERROR_BADMSG if the end-of-stream is hit before the
+ * operation can complete.
+ */
+uint8 *dp = stream_claim(stream, n);
+  if (dp == NULL)
+    return ARCP_ERROR_BADMSG;
+  memcpy(dp, data, n);
+  return 0;
+}
+/* ======================================================================== */
+/* The RF output status records are sent as consecutive (uint16, int16)
+ * pairs, so an array of them can be transferred with the 16-bit array
+ * functions.  This fails to compile if the structure is ever padded.
+ */
+typedef char arcp_rf_output_is_packed[
+  sizeof(arcp_rf_card_output_stat_t)==2*sizeof(int16) ? 1 : -1];
+
+/* ======================================================================== */
+
+signed int arcp_stream_reset(arcp_stream_t *stream) {
+/*
+ * Resets the stream head to the start of the stream.  Returns 0 on success.
+ * Currently this function does not fail.
+ */
+  stream->head = stream->data;
+  stream->err = 0;
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_stream_setsize(arcp_stream_t *stream, uint16 newsize) {
+/*
+ * Sizes the given stream to accept up to newsize bytes.  Any existing
+ * data in the stream is destroyed.  This function can be called with a
+ * NULL stream pointer, in which case -1 will be returned to the caller.
+ *
+ * Returns 0 on success or an ARCP_ERROR_* if an error occurred.
+ */
+  /* Don't proceed if the given stream hasn't been allocated */
+  if (stream == NULL)
+    return ARCP_ERROR_LOCAL;
+
+  /* If no resize is necessary simply return to the caller */
+  if (newsize == stream->size)
+    return 0;
+
+  /* Deallocate any existing data the given stream might have */
+  if (stream->data != NULL) {
+    free(stream->data);
+    stream->data = NULL;
+  }
+
+  /* Limit the streamsize to that specified in the protocol */
+  if (newsize > ARCP_MSG_MAX_SIZE)
+    return ARCP_ERROR_BADMSG;
+
+  /* Allocate storage as requested and deal with any errors */
+  if (newsize != 0) {
+    stream->data = malloc(newsize);
+  }
+  if (newsize!=0 && stream->data==NULL) {
+    stream->size = 0;
+    return ARCP_ERROR_LOCAL;
+  }
+  
+  stream->size = newsize;
+  stream->head = stream->data;
+  stream->end = stream->data + newsize-1;
+  return 0;
+}
+/* ======================================================================== */
+
+void arcp_stream_free(arcp_stream_t *stream) {
+/*
+ * Frees the given stream object.
+ */
+  if (stream == NULL)
+    return;
+  if (stream->data != NULL)
+    free(stream->data);
+  free(stream);
+}
+/* ======================================================================== */
+/* Support functions for stream encoding functionality */
+
+static signed int store_arcp_cmd(arcp_stream_t *stream, arcp_msg_t *msg) {
+/*
+ * Stores ARCP command message details into the given stream.  In the event
+ * of stream overflow, the stream's error flag will be set on exit.  Return
+ * values are 0 on success or an ARCP_ERROR_* code in the event of an error.
+ */
+int16 i;
+signed int err = 0;
+  arcp_stream_store_int16(stream, msg->command.id);
   switch (msg->command.id) {
     case ARCP_CMD_SET_MODULE_ENABLE:
       arcp_stream_store_int8(stream, msg->cmd_enable.enable);
@@ -1121,11 +1794,8 @@ signed int err = 0;
         arcp_stream_store_int16(stream, 
           arcp_pulsecode_getlength(msg->cmd_set_pulse_param.pulse_param.code));
         /* Write the code bytes */
-        i = 0;
-        while (i<(arcp_pulsecode_getlength(msg->cmd_set_pulse_param.pulse_param.code)-1)/8 +1) {
-          arcp_stream_store_int8(stream, msg->cmd_set_pulse_param.pulse_param.code->data[i]);
-          i++;
-        }
+        arcp_stream_store_bytes(stream, msg->cmd_set_pulse_param.pulse_param.code->data,
+          (uint16)((arcp_pulsecode_getlength(msg->cmd_set_pulse_param.pulse_param.code)-1)/8 +1));
       } else {
         /* A NULL pulsecode is taken as a monopulse with a length of 0 */
         arcp_stream_store_int16(stream, 0);
@@ -1136,10 +1806,12 @@ signed int err = 0;
       if (msg->cmd_set_pulse_seq.seq->length > ARCP_MAX_PULSE_SEQ_LENGTH)
         err = ARCP_ERROR_BADMSG;
       else {
+        uint8 *dp;
         arcp_stream_store_int16(stream, msg->cmd_set_pulse_seq.seq->length);
-        for (i=0; i<msg->cmd_set_pulse_seq.seq->length; i++) {
-          arcp_stream_store_int8(stream, msg->cmd_set_pulse_seq.seq->seq[i].slot);
-          arcp_stream_store_int8(stream, msg->cmd_set_pulse_seq.seq->seq[i].flags);
+        dp = stream_claim(stream, 2*(unsigned int)msg->cmd_set_pulse_seq.seq->length);
+        for (i=0; dp!=NULL && i<msg->cmd_set_pulse_seq.seq->length; i++) {
+          *(dp++) = msg->cmd_set_pulse_seq.seq->seq[i].slot;
+          *(dp++) = msg->cmd_set_pulse_seq.seq->seq[i].flags;
         }
       }
       break;
@@ -1160,11 +1832,18 @@ signed int err = 0;
       if (msg->cmd_set_phase.n_phases > ARCP_BSM_MAX_N_PHASES)
         err = ARCP_ERROR_BADMSG;
       else {
+        uint8 *dp;
+        union {
+          uint32 i;
+          float f;
+        } d;
         arcp_stream_store_int16(stream, msg->cmd_set_phase.phase_slot);
         arcp_stream_store_int16(stream, msg->cmd_set_phase.n_phases);
-        for (i=0; i<msg->cmd_set_phase.n_phases; i++) {
-          arcp_stream_store_int16(stream, msg->cmd_set_phase.phases[i].channel);
-          arcp_stream_store_float(stream, msg->cmd_set_phase.phases[i].phase);
+        dp = stream_claim(stream, 6*(unsigned int)msg->cmd_set_phase.n_phases);
+        for (i=0; dp!=NULL && i<msg->cmd_set_phase.n_phases; i++, dp+=6) {
+          put_be16(dp, msg->cmd_set_phase.phases[i].channel);
+          d.f = msg->cmd_set_phase.phases[i].phase;
+          put_be32(dp+2, d.i);
         }
       }
       break;
@@ -1182,7 +1861,7 @@ static signed int store_arcp_resp(arcp_stream_t *stream, arcp_msg_t *msg) {
  * be set on return to the caller.  Return values are 0 on success or an
  * ARCP_ERROR_* code in the event of an error.
  */
-int16 i,j;
+int16 i;
 signed int err = 0;
   arcp_stream_store_int16(stream, msg->response.id);
   arcp_stream_store_int16(stream, msg->response.info_code);
@@ -1213,19 +1892,16 @@ signed int err = 0;
           arcp_stream_store_int16(stream, msg->resp_sysstat.sysstat->data.stx2->rail_aux);
           arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.stx2->ambient_temp);
           arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.stx2->n_chassis_fans);
-          for (i=0; i<msg->resp_sysstat.sysstat->data.stx2->n_chassis_fans; i++) {
-            arcp_stream_store_int16(stream, msg->resp_sysstat.sysstat->data.stx2->fan_speed[i]);
-          }
+          arcp_stream_store_int16_array(stream, (const int16 *)msg->resp_sysstat.sysstat->data.stx2->fan_speed,
+            msg->resp_sysstat.sysstat->data.stx2->n_chassis_fans);
           arcp_stream_store_int16(stream, msg->resp_sysstat.sysstat->data.stx2->card_map);
           arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.stx2->n_rf_cards);
           for (i=0; i<msg->resp_sysstat.sysstat->data.stx2->n_rf_cards; i++) {
             arcp_stream_store_int16(stream, msg->resp_sysstat.sysstat->data.stx2->rf_card_stat[i].rail_supply);
             arcp_stream_store_int16(stream, msg->resp_sysstat.sysstat->data.stx2->rf_card_stat[i].heatsink_temp);
             arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.stx2->rf_card_stat[i].n_rf_outputs);
-            for (j=0; j<msg->resp_sysstat.sysstat->data.stx2->rf_card_stat[i].n_rf_outputs; j++) {
-              arcp_stream_store_int16(stream, msg->resp_sysstat.sysstat->data.stx2->rf_card_stat[i].output_stat[j].forward_power);
-              arcp_stream_store_int16(stream, msg->resp_sysstat.sysstat->data.stx2->rf_card_stat[i].output_stat[j].return_loss);
-            }
+            arcp_stream_store_int16_array(stream, (const int16 *)msg->resp_sysstat.sysstat->data.stx2->rf_card_stat[i].output_stat,
+              (uint16)(2*msg->resp_sysstat.sysstat->data.stx2->rf_card_stat[i].n_rf_outputs));
           }
           /* Store information about additional STX2 units if present */
           arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.stx2->n_units);
@@ -1235,14 +1911,11 @@ signed int err = 0;
             switch (msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].unit.type) {
               case ARCP_STX2_UNIT_EXT_COMBINER_SPLITTER:
                 arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].comb.n_temperatures);
-                for (j=0; j<msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].comb.n_temperatures; j++) {
-                  arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].comb.temperature[j]);
-                }
+                arcp_stream_store_bytes(stream, msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].comb.temperature,
+                  msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].comb.n_temperatures);
                 arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].comb.n_outputs);
-                for (j=0; j<msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].comb.n_outputs; j++) {
-                  arcp_stream_store_int16(stream, msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].comb.output[j].forward_power);
-                  arcp_stream_store_int16(stream, msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].comb.output[j].return_loss);
-                }
+                arcp_stream_store_int16_array(stream, (const int16 *)msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].comb.output,
+                  (uint16)(2*msg->resp_sysstat.sysstat->data.stx2->unit_stat[i].comb.n_outputs));
                 break;
             }
           }
@@ -1254,13 +1927,11 @@ signed int err = 0;
           arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.bsm->ambient_temp);
           arcp_stream_store_int16(stream, msg->resp_sysstat.sysstat->data.bsm->channel_map);
           arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.bsm->n_fans);
-          for (i=0; i<msg->resp_sysstat.sysstat->data.bsm->n_fans; i++) {
-            arcp_stream_store_int16(stream, msg->resp_sysstat.sysstat->data.bsm->fan_speed[i]);
-          }
+          arcp_stream_store_int16_array(stream, (const int16 *)msg->resp_sysstat.sysstat->data.bsm->fan_speed,
+            msg->resp_sysstat.sysstat->data.bsm->n_fans);
           arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.bsm->n_heatsink_temps);
-          for (i=0; i<msg->resp_sysstat.sysstat->data.bsm->n_heatsink_temps; i++) {
-            arcp_stream_store_int8(stream, msg->resp_sysstat.sysstat->data.bsm->heatsink_temp[i]);
-          }
+          arcp_stream_store_bytes(stream, msg->resp_sysstat.sysstat->data.bsm->heatsink_temp,
+            msg->resp_sysstat.sysstat->data.bsm->n_heatsink_temps);
           break;
 
       }
@@ -1280,7 +1951,7 @@ static signed int decode_arcp_cmd(arcp_stream_t *stream, arcp_msg_t *msg) {
  * If the stream underflowed during decoding the stream's error flag will
  * be set on exit.
  */
-uint8 i;
+uint16 i;
 signed int err = 0;
   arcp_stream_get_int16(stream, &msg->command.id);
   switch (msg->command.id) {
@@ -1306,18 +1977,15 @@ signed int err = 0;
           err = ARCP_ERROR_LOCAL;
         else {
           /* Load the bytes containing the pulse code */
-          i = 0;
-          while (i < 1+(len-1)/8) {
-            arcp_stream_get_uint8(stream, &msg->cmd_set_pulse_param.pulse_param.code->data[i]);
-            i++;
-          }
+          arcp_stream_get_bytes(stream, msg->cmd_set_pulse_param.pulse_param.code->data,
+            (uint16)(1+(len-1)/8));
         }
       } else
         msg->cmd_set_pulse_param.pulse_param.code = NULL;
       break;
     }
     case ARCP_CMD_SET_PULSE_SEQ: {
-      uint16 len;
+      uint16 len = 0;
       arcp_stream_get_uint16(stream, &len);
       if (len > ARCP_MAX_PULSE_SEQ_LENGTH)
         err = ARCP_ERROR_BADMSG;
@@ -1325,9 +1993,10 @@ signed int err = 0;
       if ((msg->cmd_set_pulse_seq.seq = arcp_pulseseq_new(len)) == NULL)
         err = ARCP_ERROR_LOCAL;
       else {
-        for (i=0; i<len; i++) {
-          arcp_stream_get_uint8(stream, &msg->cmd_set_pulse_seq.seq->seq[i].slot);
-          arcp_stream_get_uint8(stream, &msg->cmd_set_pulse_seq.seq->seq[i].flags);
+        uint8 *sp = stream_claim(stream, 2*(unsigned int)len);
+        for (i=0; sp!=NULL && i<len; i++) {
+          msg->cmd_set_pulse_seq.seq->seq[i].slot = *(sp++);
+          msg->cmd_set_pulse_seq.seq->seq[i].flags = *(sp++);
         }
       }
       break;
@@ -1353,9 +2022,17 @@ signed int err = 0;
       msg->cmd_set_phase.phases = malloc(sizeof(arcp_phase_entry_t)*msg->cmd_set_phase.n_phases);
       if (msg->cmd_set_phase.phases == NULL)
         return ARCP_ERROR_LOCAL;
-      for (i=0; i<msg->cmd_set_phase.n_phases; i++) {
-        arcp_stream_get_uint16(stream, &msg->cmd_set_phase.phases[i].channel);
-        arcp_stream_get_float(stream, &msg->cmd_set_phase.phases[i].phase);
+      {
+        uint8 *sp = stream_claim(stream, 6*(unsigned int)msg->cmd_set_phase.n_phases);
+        union {
+          uint32 i;
+          float f;
+        } d;
+        for (i=0; sp!=NULL && i<msg->cmd_set_phase.n_phases; i++, sp+=6) {
+          msg->cmd_set_phase.phases[i].channel = get_be16(sp);
+          d.i = get_be32(sp+2);
+          msg->cmd_set_phase.phases[i].phase = d.f;
+        }
       }
       break;
 
@@ -1365,14 +2042,15 @@ signed int err = 0;
   return err;
 }
 
-static signed int decode_arcp_resp(arcp_stream_t *stream, arcp_msg_t *msg) {
+static signed int decode_arcp_resp(arcp_stream_t *stream, arcp_msg_t *msg,
+  uint8 flags) {
 /*
  * Decodes the response message details from the stream into the given message
  * structure.  Return values are 0 if successful, ARCP_ERROR_* codes on error.
  * If the stream underflowed during decoding the stream's error flag will
- * be set on exit.
+ * be set on exit.  flags is a set of ARCP_DECODE_* values.
  */
-int16 i,j;
+int16 i = 0;
 uint8 byte;
 signed int err = 0;
   /* Read the response ID and set up required dynamic structures */
@@ -1401,16 +2079,26 @@ signed int err = 0;
       }
       break;
     case ARCP_RESP_SYSSTAT:
-      err = ((msg->resp_sysstat.sysstat = arcp_sysstat_new()) == NULL);
-      if (err)
+      if (flags & ARCP_DECODE_ARENA)
+        msg->resp_sysstat.sysstat =
+          sysstat_arena_new((uint16)(stream->end+1-stream->head));
+      else
+        msg->resp_sysstat.sysstat = arcp_sysstat_new();
+      if (msg->resp_sysstat.sysstat == NULL) {
+        err = ARCP_ERROR_LOCAL;
         break;
+      }
       arcp_stream_get_int8(stream, &msg->resp_sysstat.sysstat->module_type);
       arcp_stream_get_int8(stream, &msg->resp_sysstat.sysstat->module_status);
       switch (msg->resp_sysstat.sysstat->module_type) {
         case ARCP_MODULE_STX2: {
           arcp_stx2stat_t *stx2stat;
           byte = 0;
-          if ((stx2stat = arcp_stx2stat_new()) == NULL) {
+          if (msg->resp_sysstat.sysstat->arena_size != 0)
+            stx2stat = sysstat_arena_module(msg->resp_sysstat.sysstat);
+          else
+            stx2stat = arcp_stx2stat_new();
+          if (stx2stat == NULL) {
             err = ARCP_ERROR_LOCAL;
             break;
           }
@@ -1426,9 +2114,8 @@ signed int err = 0;
           else
             err = arcp_stx2stat_set_n_chassis_fans(stx2stat, byte);
           if (err == 0) {
-            for (i=0; i<stx2stat->n_chassis_fans; i++) {
-              arcp_stream_get_uint16(stream, &stx2stat->fan_speed[i]);
-            }
+            arcp_stream_get_int16_array(stream, (int16 *)stx2stat->fan_speed,
+              stx2stat->n_chassis_fans);
             arcp_stream_get_uint16(stream, &stx2stat->card_map);
             arcp_stream_get_uint8(stream, &byte);
 
@@ -1448,12 +2135,9 @@ signed int err = 0;
                 err = ARCP_ERROR_BADMSG;
               else
                 err = arcp_stx2stat_set_n_rf_outputs(stx2stat,i,byte);
-              if (err == 0) {
-                for (j=0; j<stx2stat->rf_card_stat[i].n_rf_outputs; j++) {
-                  arcp_stream_get_uint16(stream, &stx2stat->rf_card_stat[i].output_stat[j].forward_power);
-                  arcp_stream_get_int16(stream, &stx2stat->rf_card_stat[i].output_stat[j].return_loss);
-                }
-              }
+              if (err == 0)
+                arcp_stream_get_int16_array(stream, (int16 *)stx2stat->rf_card_stat[i].output_stat,
+                  (uint16)(2*stx2stat->rf_card_stat[i].n_rf_outputs));
             }
           }
           byte = 0;
@@ -1479,9 +2163,7 @@ signed int err = 0;
                   err = ARCP_ERROR_BADMSG;
                 else {
                   stx2stat->unit_stat[i].comb.n_temperatures = byte;
-                  for (j=0; j<stx2stat->unit_stat[i].comb.n_temperatures; j++) {
-                    arcp_stream_get_int8(stream, &stx2stat->unit_stat[i].comb.temperature[j]);
-                  }
+                  arcp_stream_get_bytes(stream, stx2stat->unit_stat[i].comb.temperature, byte);
                 }
                 if (err == 0)
                   arcp_stream_get_uint8(stream, &byte);
@@ -1489,10 +2171,8 @@ signed int err = 0;
                   err = ARCP_ERROR_BADMSG;
                 if (err == 0) {
                   stx2stat->unit_stat[i].comb.n_outputs = byte;
-                  for (j=0; j<stx2stat->unit_stat[i].comb.n_outputs; j++) {
-                    arcp_stream_get_uint16(stream, &stx2stat->unit_stat[i].comb.output[j].forward_power);
-                    arcp_stream_get_int16(stream, &stx2stat->unit_stat[i].comb.output[j].return_loss);
-                  }
+                  arcp_stream_get_int16_array(stream, (int16 *)stx2stat->unit_stat[i].comb.output,
+                    (uint16)(2*byte));
                 }
                 break;
             }
@@ -1508,7 +2188,11 @@ signed int err = 0;
         case ARCP_MODULE_BSM: {
           arcp_bsmstat_t *bsmstat;
           byte = 0;
-          if ((bsmstat = arcp_bsmstat_new()) == NULL) {
+          if (msg->resp_sysstat.sysstat->arena_size != 0)
+            bsmstat = sysstat_arena_module(msg->resp_sysstat.sysstat);
+          else
+            bsmstat = arcp_bsmstat_new();
+          if (bsmstat == NULL) {
             err = ARCP_ERROR_LOCAL;
             break;
           }
@@ -1524,22 +2208,21 @@ signed int err = 0;
           else
             err = arcp_bsmstat_set_n_fans(bsmstat, byte);
           if (err == 0) {
-            for (i=0; i<bsmstat->n_fans; i++) {
-              arcp_stream_get_uint16(stream, &bsmstat->fan_speed[i]);
-            }
+            arcp_stream_get_int16_array(stream, (int16 *)bsmstat->fan_speed,
+              bsmstat->n_fans);
             arcp_stream_get_uint8(stream, &byte);
             /* Allow up to ARCP_BSM_MAX_N_TEMPERATURES temperatures */
             if (byte > ARCP_BSM_MAX_N_TEMPERATURES) {
               err = ARCP_ERROR_BADMSG;
             } else
               bsmstat->n_heatsink_temps = byte;
-            for (i=0; i<bsmstat->n_heatsink_temps && err==0; i++) {
-              arcp_stream_get_int8(stream, &bsmstat->heatsink_temp[i]);
-            }
+            if (err == 0)
+              arcp_stream_get_bytes(stream, bsmstat->heatsink_temp,
+                bsmstat->n_heatsink_temps);
           }
           if (err == 0)
             msg->resp_sysstat.sysstat->data.bsm = bsmstat;
-          else
+          else if (msg->resp_sysstat.sysstat->arena_size == 0)
             arcp_bsmstat_free(bsmstat);
           break;
         }
@@ -1552,15 +2235,29 @@ signed int err = 0;
 }
 /* ======================================================================== */
 
-signed int arcp_stream_decode(arcp_stream_t *stream, arcp_msg_t **dec_msg) {
+static void decode_header(arcp_stream_t *stream, arcp_msg_header_t *header) {
 /*
- * Decodes the given ARCP stream into a new arcp_msg_t structure.  Returns 0
- * on success or an ARCP_ERROR_* on failure.  In event of an error, *dec_msg
- * will be NULL on return.
+ * Internal function: reads the ARCP header at the start of the stream into
+ * the given header structure.  Underflow is flagged in the stream's error
+ * flag.
  */
-arcp_msgtype_t msg_type;
-uint32 magic_num;
-uint16 msg_length, xchg_id;
+  arcp_stream_get_uint32(stream, &header->magic_num);
+  arcp_stream_get_uint16(stream, &header->msg_length);
+  arcp_stream_get_uint16(stream, &header->exchange_id);
+  arcp_stream_get_uint8(stream, &header->msg_type);
+  arcp_stream_get_uint16(stream, &header->protocol_version);
+}
+/* ======================================================================== */
+
+static signed int stream_decode(arcp_stream_t *stream, arcp_msg_t **dec_msg,
+  uint8 flags) {
+/*
+ * Internal function: decodes the given ARCP stream into a new arcp_msg_t
+ * structure using the given ARCP_DECODE_* flags.  Returns 0 on success or
+ * an ARCP_ERROR_* on failure.  In event of an error, *dec_msg will be NULL
+ * on return.
+ */
+arcp_msg_header_t header;
 arcp_msg_t *msg;
 signed int res = 0;
 
@@ -1579,24 +2276,16 @@ signed int res = 0;
     return ARCP_ERROR_BADMSG;
   }
 
-  /* Read in most of the header information */
-  arcp_stream_get_uint32(stream, &magic_num);
-  arcp_stream_get_uint16(stream, &msg_length);
-  arcp_stream_get_uint16(stream, &xchg_id);
-  arcp_stream_get_uint8(stream, &msg_type);
+  /* Read in the header information */
+  decode_header(stream, &header);
 
   /* Use information from the header to construct an arcp_msg_t object */
-  msg = arcp_msg_new(msg_type);
+  msg = arcp_msg_new(header.msg_type);
 
   if (msg == NULL) {
     return ARCP_ERROR_LOCAL;
   }
-  msg->header.magic_num = magic_num;
-  msg->header.msg_length = msg_length;
-  msg->header.exchange_id = xchg_id;
-
-  /* Complete the reading of the header data */
-  arcp_stream_get_uint16(stream, &msg->header.protocol_version);
+  msg->header = header;
 
   /* Now get the message-specific details */
   switch (msg->header.msg_type) {
@@ -1604,7 +2293,7 @@ signed int res = 0;
       res = decode_arcp_cmd(stream, msg);
       break;
     case ARCP_MSG_RESPONSE:
-      res = decode_arcp_resp(stream, msg);
+      res = decode_arcp_resp(stream, msg, flags);
       break;
   }
 
@@ -1618,6 +2307,170 @@ signed int res = 0;
 }
 /* ======================================================================== */
 
+signed int arcp_stream_decode(arcp_stream_t *stream, arcp_msg_t **dec_msg) {
+/*
+ * Decodes the given ARCP stream into a new arcp_msg_t structure.  Returns 0
+ * on success or an ARCP_ERROR_* on failure.  In event of an error, *dec_msg
+ * will be NULL on return.
+ */
+  return stream_decode(stream, dec_msg, 0);
+}
+/* ======================================================================== */
+
+static signed int decode_stx2flat(arcp_stream_t *stream, arcp_msg_t *resp,
+  arcp_stx2flat_t *flat) {
+/*
+ * Internal function: decodes an ARCP response from the stream.  The header,
+ * response ID and info code are stored in resp (which is otherwise left
+ * untouched - in particular no sysstat object is attached).  If the
+ * response is a SYSSTAT from a STX2 the status is decoded directly into
+ * the flat structure, which is zeroed first.
+ *
+ * Returns 0 if the stream was well formed, ARCP_ERROR_BADMSG if it was
+ * corrupt or ARCP_ERROR_BAD_RESPONSE if it was a SYSSTAT response from
+ * something other than a STX2.  If flat is NULL, only the header,
+ * response ID and info code are decoded.
+ */
+uint8 byte = 0, i;
+int8 module_type = -1;
+
+  if (stream->size<11 || stream->size>ARCP_MSG_MAX_SIZE)
+    return ARCP_ERROR_BADMSG;
+
+  decode_header(stream, &resp->header);
+  if (resp->header.magic_num != ARCP_MAGIC_NUMBER)
+    return ARCP_ERROR_BADMSG;
+  if (resp->header.msg_type != ARCP_MSG_RESPONSE)
+    return ARCP_ERROR_NOT_RESP;
+  arcp_stream_get_int16(stream, &resp->response.id);
+  arcp_stream_get_int16(stream, &resp->response.info_code);
+  if (resp->response.id!=ARCP_RESP_SYSSTAT || flat==NULL)
+    return arcp_stream_error(stream)?ARCP_ERROR_BADMSG:0;
+
+  memset(flat, 0, sizeof(arcp_stx2flat_t));
+  arcp_stream_get_int8(stream, &module_type);
+  arcp_stream_get_int8(stream, &flat->module_status);
+  if (module_type != ARCP_MODULE_STX2)
+    return arcp_stream_error(stream)?ARCP_ERROR_BADMSG:ARCP_ERROR_BAD_RESPONSE;
+
+  arcp_stream_get_uint16(stream, &flat->status_code);
+  arcp_stream_get_uint8(stream, &flat->chassis_datasize);
+  arcp_stream_get_uint16(stream, &flat->rail_supply);
+  arcp_stream_get_uint16(stream, &flat->rail_aux);
+  arcp_stream_get_int8(stream, &flat->ambient_temp);
+
+  /* The array counts are bounded by the inline capacities */
+  arcp_stream_get_uint8(stream, &flat->n_chassis_fans);
+  if (flat->n_chassis_fans > ARCP_MAX_N_CHASSIS_FANS)
+    return ARCP_ERROR_BADMSG;
+  arcp_stream_get_int16_array(stream, (int16 *)flat->fan_speed,
+    flat->n_chassis_fans);
+
+  arcp_stream_get_uint16(stream, &flat->card_map);
+  arcp_stream_get_uint8(stream, &flat->n_rf_cards);
+  if (flat->n_rf_cards > ARCP_MAX_N_RF_CARDS)
+    return ARCP_ERROR_BADMSG;
+  for (i=0; i<flat->n_rf_cards; i++) {
+    arcp_rf_card_flat_t *card = &flat->rf_card_stat[i];
+    arcp_stream_get_uint16(stream, &card->rail_supply);
+    arcp_stream_get_int16(stream, &card->heatsink_temp);
+    arcp_stream_get_uint8(stream, &card->n_rf_outputs);
+    if (card->n_rf_outputs > ARCP_MAX_N_RF_CARD_OUTPUT)
+      return ARCP_ERROR_BADMSG;
+    arcp_stream_get_int16_array(stream, (int16 *)card->output_stat,
+      (uint16)(2*card->n_rf_outputs));
+  }
+
+  arcp_stream_get_uint8(stream, &flat->n_units);
+  if (flat->n_units > ARCP_STX2_MAX_N_STX2_UNITS)
+    return ARCP_ERROR_BADMSG;
+  for (i=0; i<flat->n_units; i++) {
+    arcp_stx2unit_union_t *unit = &flat->unit_stat[i];
+    arcp_stream_get_uint8(stream, &unit->unit.flags);
+    arcp_stream_get_uint8(stream, &unit->unit.type);
+    if (unit->unit.type == ARCP_STX2_UNIT_EXT_COMBINER_SPLITTER) {
+      arcp_stream_get_uint8(stream, &byte);
+      if (byte > ARCP_STX2_EXTCOMB_MAX_N_TEMPERATURES)
+        return ARCP_ERROR_BADMSG;
+      unit->comb.n_temperatures = byte;
+      arcp_stream_get_bytes(stream, unit->comb.temperature, byte);
+      arcp_stream_get_uint8(stream, &byte);
+      if (byte > ARCP_STX2_EXTCOMB_MAX_N_OUTPUTS)
+        return ARCP_ERROR_BADMSG;
+      unit->comb.n_outputs = byte;
+      arcp_stream_get_int16_array(stream, (int16 *)unit->comb.output,
+        (uint16)(2*byte));
+    }
+  }
+
+  return arcp_stream_error(stream)?ARCP_ERROR_BADMSG:0;
+}
+/* ======================================================================== */
+
+signed int arcp_stx2flat_decode_buf(uint8 *buf, uint16 buf_size,
+  arcp_stx2flat_t *flat) {
+/*
+ * Decodes the raw SYSSTAT response message held in buf (buf_size bytes,
+ * starting with the ARCP magic number) from a STX2 directly into the
+ * caller's flat status structure.  No dynamic memory is used.
+ *
+ * Returns 0 on success or an ARCP_ERROR_* code on failure.
+ * ARCP_ERROR_BAD_RESPONSE is returned if buf holds a valid response other
+ * than a STX2 SYSSTAT.
+ */
+arcp_stream_t stream;
+arcp_msg_t resp;
+signed int res;
+
+  if (buf==NULL || flat==NULL)
+    return ARCP_ERROR_INTERNAL;
+
+  stream.size = buf_size;
+  stream.data = buf;
+  stream.head = buf;
+  stream.end = buf + buf_size-1;
+  stream.err = 0;
+
+  res = decode_stx2flat(&stream, &resp, flat);
+  if (res==0 && resp.response.id!=ARCP_RESP_SYSSTAT)
+    res = ARCP_ERROR_BAD_RESPONSE;
+  return res;
+}
+/* ======================================================================== */
+
+static void store_header(arcp_stream_t *stream, arcp_msg_header_t *header) {
+/*
+ * Internal function: writes the given ARCP header into the stream. 
+ * Overflow is flagged in the stream's error flag.
+ */
+  arcp_stream_store_int32(stream, header->magic_num);
+  arcp_stream_store_int16(stream, header->msg_length);
+  arcp_stream_store_int16(stream, header->exchange_id);
+  arcp_stream_store_int8(stream, header->msg_type);
+  arcp_stream_store_int16(stream, header->protocol_version);
+}
+/* ======================================================================== */
+
+static signed int encode_msg(arcp_stream_t *stream, arcp_msg_t *msg) {
+/*
+ * Internal function: serialises the given message into a stream which has
+ * already been sized to hold it.  Returns 0 on success or an ARCP_ERROR_*
+ * code on failure.
+ */
+  /* Construct the ARCP header - common to all messages */
+  store_header(stream, &msg->header);
+
+  /* Now put the message-specific details in */
+  switch (msg->header.msg_type) {
+    case ARCP_MSG_COMMAND:
+      return store_arcp_cmd(stream, msg);
+    case ARCP_MSG_RESPONSE:
+      return store_arcp_resp(stream, msg);
+  }
+  return 0;
+}
+/* ======================================================================== */
+
 signed int arcp_msg_encode(arcp_msg_t *msg, arcp_stream_t **enc_stream) {
 /*
  * Encodes the given ARCP message into a new ARCP stream object.  Returns 0
@@ -1650,22 +2503,7 @@ signed int res = 0;
     return ARCP_ERROR_LOCAL;
   }
 
-  /* Construct the ARCP header - common to all messages */
-  arcp_stream_store_int32(stream, msg->header.magic_num);
-  arcp_stream_store_int16(stream, msg->header.msg_length);
-  arcp_stream_store_int16(stream, msg->header.exchange_id);
-  arcp_stream_store_int8(stream, msg->header.msg_type);
-  arcp_stream_store_int16(stream, msg->header.protocol_version);
-
-  /* Now put the message-specific details in */
-  switch (msg->header.msg_type) {
-    case ARCP_MSG_COMMAND:
-      res = store_arcp_cmd(stream, msg);
-      break;
-    case ARCP_MSG_RESPONSE:
-      res = store_arcp_resp(stream, msg);
-      break;
-  }
+  res = encode_msg(stream, msg);
 
   if (res < 0) {
     arcp_stream_free(stream);
@@ -1676,24 +2514,211 @@ signed int res = 0;
 }
 /* ======================================================================== */
 
+signed int arcp_msg_encode_buf(arcp_msg_t *msg, uint8 *buf, uint16 buf_size,
+  uint16 *enc_size) {
+/*
+ * Encodes the given ARCP message into the caller-supplied buffer buf, which
+ * is buf_size bytes long.  A buffer of ARCP_MSG_MAX_SIZE bytes is always
+ * sufficient.  Unlike arcp_msg_encode() no dynamic memory is used.
+ *
+ * Returns 0 on success or an ARCP_ERROR_* code on failure.  On success the
+ * number of bytes written to buf is returned in *enc_size if enc_size is
+ * not NULL.  ARCP_ERROR_BADMSG is returned if the encoded message would not
+ * fit in buf.
+ */
+arcp_stream_t stream;
+uint16 msg_size = arcp_msg_set_stream_size(msg);
+signed int res;
+
+  if (enc_size != NULL)
+    *enc_size = 0;
+
+  /* Check for programming errors and invalid message requests */
+  if (buf == NULL)
+    return ARCP_ERROR_INTERNAL;
+  if (msg_size==0 || msg_size>ARCP_MSG_MAX_SIZE || msg_size>buf_size)
+    return ARCP_ERROR_BADMSG;
+
+  /* Point a stack-based stream at the caller's buffer */
+  stream.size = msg_size;
+  stream.data = buf;
+  stream.head = buf;
+  stream.end = buf + msg_size-1;
+  stream.err = 0;
+
+  res = encode_msg(&stream, msg);
+  if (res==0 && enc_size!=NULL)
+    *enc_size = msg_size;
+  return res;
+}
+/* ======================================================================== */
+
+#ifdef VECTORED_SEND
+static uint16 msg_head_size(arcp_msg_t *msg) {
+/*
+ * Internal function: returns the number of bytes of the given message which
+ * encode_msg_iov() writes to its buffer, the rest being sent from the
+ * message itself.  0 is returned if the message can't be encoded.
+ */
+uint16 msg_size = arcp_msg_set_stream_size(msg);
+
+  if (msg_size==0 || msg_size>ARCP_MSG_MAX_SIZE)
+    return 0;
+  /* Pulse sequence entries are two bytes each in wire order already */
+  if (msg->header.msg_type==ARCP_MSG_COMMAND &&
+      msg->command.id==ARCP_CMD_SET_PULSE_SEQ &&
+      sizeof(arcp_pulseseq_entry_t)==2) {
+    if (msg->cmd_set_pulse_seq.seq->length > ARCP_MAX_PULSE_SEQ_LENGTH)
+      return 0;
+    msg_size = (uint16)(msg_size-2*msg->cmd_set_pulse_seq.seq->length);
+  }
+  return msg_size;
+}
+/* ======================================================================== */
+
+static signed int encode_msg_iov(arcp_msg_t *msg, uint8 *buf, uint16 buf_size,
+  struct iovec *iov, unsigned int *n_iov) {
+/*
+ * Internal function: encodes the given message for sending with sendmsg(). 
+ * The message is described by iov[0..*n_iov-1] (never more than two
+ * pieces).  The header, fixed fields and any payload needing conversion -
+ * the byte-swapped entries of a SET_PHASE command, for example - are
+ * written to buf and described by iov[0].  The entries of a SET_PULSE_SEQ
+ * command are already in wire format, so they are referenced in place by
+ * iov[1] rather than copied; the message must therefore not be modified
+ * until it has been sent.
+ *
+ * Returns 0 on success or an ARCP_ERROR_* code on failure; ARCP_ERROR_BADMSG
+ * is returned if the encoded part would not fit in buf.
+ */
+arcp_stream_t stream;
+uint16 head_size = msg_head_size(msg);
+uint16 msg_size = msg->header.msg_length;
+signed int res;
+
+  *n_iov = 0;
+  if (head_size==0 || head_size>buf_size)
+    return ARCP_ERROR_BADMSG;
+
+  stream.size = head_size;
+  stream.data = buf;
+  stream.head = buf;
+  stream.end = buf + head_size-1;
+  stream.err = 0;
+
+  if (head_size == msg_size)
+    res = encode_msg(&stream, msg);
+  else {
+    store_header(&stream, &msg->header);
+    arcp_stream_store_int16(&stream, msg->command.id);
+    arcp_stream_store_int16(&stream, msg->cmd_set_pulse_seq.seq->length);
+    res = arcp_stream_error(&stream) ? ARCP_ERROR_BADMSG : 0;
+  }
+  if (res != 0)
+    return res;
+
+  iov[0].iov_base = buf;
+  iov[0].iov_len = head_size;
+  *n_iov = 1;
+  if (head_size != msg_size) {
+    iov[1].iov_base = msg->cmd_set_pulse_seq.seq->seq;
+    iov[1].iov_len = (size_t)(msg_size-head_size);
+    *n_iov = 2;
+  }
+  return 0;
+}
+/* ======================================================================== */
+#endif
+
+uint32 arcp_clock_ms(void) {
+/*
+ * Returns a monotonic millisecond clock, as used to implement timeouts.
+ * Only differences between values are meaningful; the clock wraps after
+ * about 49 days, so compare values with (int32)(a-b).
+ */
+#if defined(ARCP_NUTOS)
+  return NutGetMillis();
+#elif defined(ARCP_WIN32)
+  return GetTickCount();
+#else
+struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32)ts.tv_sec*1000 + (uint32)(ts.tv_nsec/1000000);
+#endif
+}
+/* ======================================================================== */
+
+static signed int wait_socket(arcp_socket_t fd, signed int for_write,
+  uint32 deadline) {
+/*
+ * Internal function: waits until the given socket is readable (for_write
+ * is 0) or writable (for_write is non-zero), or until arcp_clock_ms() reaches
+ * deadline.  Returns 0 if the socket is ready (or has an error pending,
+ * which the following recv()/send() will report), ARCP_ERROR_CONN_TIMEOUT
+ * if the deadline passed first, or ARCP_ERROR_CONN_DROPPED on error.
+ *
+ * NutOS has no poll()/select(); there the timeouts are applied to the
+ * socket itself by arcp_handle_set_timeouts() and this returns at once.
+ */
+#ifdef ARCP_NUTOS
+  return 0;
+#else
+int32 remaining;
+int i;
+
+  for (;;) {
+    remaining = (int32)(deadline - arcp_clock_ms());
+    if (remaining <= 0)
+      return ARCP_ERROR_CONN_TIMEOUT;
+#ifdef ARCP_WIN32
+    {
+      fd_set set;
+      struct timeval tv;
+      FD_ZERO(&set);
+      FD_SET(fd, &set);
+      tv.tv_sec = remaining/1000;
+      tv.tv_usec = (remaining%1000)*1000;
+      i = select((int)fd+1, for_write?NULL:&set, for_write?&set:NULL, NULL, &tv);
+    }
+#else
+    {
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = for_write?POLLOUT:POLLIN;
+      pfd.revents = 0;
+      i = poll(&pfd, 1, (int)remaining);
+    }
+#endif
+    if (i > 0)
+      return 0;
+    if (i == 0)
+      return ARCP_ERROR_CONN_TIMEOUT;
+    if (SOCKET_ERRNO(fd) != EINTR)
+      return ARCP_ERROR_CONN_DROPPED;
+  }
+#endif
+}
+/* ======================================================================== */
+
 static signed int read_from_socket(arcp_socket_t fd, void *buf, size_t len, 
   int flags) {
 /*
  * This function acts as a wrapper around arcp_socket_read(); it avoids the
  * need for replicating the boilerplate error handing code in multiple
- * places.
+ * places.  Whatever is available on the socket (up to len bytes) is read
+ * in a single call; the function only blocks if nothing at all is
+ * available.
  *
- * Return value is the number of bytes read on success or an
- * ARCP_ERROR_CONN_* code in the case of an error.
+ * Return value is the number of bytes read (always greater than zero) on
+ * success or an ARCP_ERROR_CONN_* code in the case of an error.
  */
 signed int i;
-size_t count=0;
 
-  while (count < len) {
+  for (;;) {
     /* Typecast to (char *) is required by some windoze compilers which
      * refuse to assume sizeof(void) == 1.
      */
-    i = arcp_socket_read(fd, ((char *)buf)+count, len-count, flags);
+    i = arcp_socket_read(fd, (char *)buf, len, flags);
     /* This series of conditionals allow for resumption of interrupted
      * system calls and a subtle difference between the return values from
      * NutOS' NutTcpReceive() and BSD recv() functions in the case of a
@@ -1711,43 +2736,255 @@ size_t count=0;
       return ARCP_ERROR_CONN_DROPPED;
 #endif
     if (i > 0)
-      count += i;
+      return i;
+  }
+}
+/* ======================================================================== */
+
+#ifndef ARCP_NUTOS
+/* Capture files may be written from more than one thread, for example by
+ * a server reading and writing a connection from different threads, so
+ * each record is written with the file locked.
+ */
+#ifdef ARCP_WIN32
+  #define CAPTURE_LOCK(_f)     _lock_file(_f)
+  #define CAPTURE_UNLOCK(_f)   _unlock_file(_f)
+#else
+  #define CAPTURE_LOCK(_f)     flockfile(_f)
+  #define CAPTURE_UNLOCK(_f)   funlockfile(_f)
+#endif
+
+/* Records data sent or received on a handle if it is being captured */
+#define CAPTURE(_handle,_type,_buf,_len) \
+  do { \
+    if ((_handle)->capture != NULL) \
+      capture_data(_handle, _type, _buf, _len); \
+  } while (0)
+
+static void capture_clock(uint32 *sec, uint32 *usec) {
+/*
+ * Internal function: reads the monotonic microsecond clock used to
+ * timestamp capture records.
+ */
+#ifdef ARCP_WIN32
+LARGE_INTEGER count, freq;
+
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  *sec = (uint32)(count.QuadPart/freq.QuadPart);
+  *usec = (uint32)((count.QuadPart%freq.QuadPart)*1000000/freq.QuadPart);
+#else
+struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  *sec = (uint32)ts.tv_sec;
+  *usec = (uint32)(ts.tv_nsec/1000);
+#endif
+}
+/* ======================================================================== */
+
+static void capture_varint(FILE *f, uint32 value) {
+/*
+ * Internal function: writes value to a capture file as a base-128 varint.
+ */
+  while (value >= 0x80) {
+    putc((int)((value & 0x7f) | 0x80), f);
+    value >>= 7;
   }
+  putc((int)value, f);
+}
+/* ======================================================================== */
 
-  return count;
+static void capture_begin(arcp_handle_t *handle, uint8 type, uint32 len) {
+/*
+ * Internal function: locks the handle's capture file and writes the head
+ * of a record of the given type whose data is len bytes long.  The data
+ * must follow, and then capture_end().
+ */
+FILE *f = (FILE *)handle->capture;
+uint32 sec, usec, delta;
+
+  CAPTURE_LOCK(f);
+  capture_clock(&sec, &usec);
+  /* The gap is clamped if it is too long to record, at about 71 minutes */
+  if (sec-handle->capture_sec >= 4294)
+    delta = 0xffffffffUL;
+  else
+    delta = (uint32)((sec-handle->capture_sec)*1000000UL + usec -
+              handle->capture_usec);
+  handle->capture_sec = sec;
+  handle->capture_usec = usec;
+
+  putc(type, f);
+  capture_varint(f, delta);
+  capture_varint(f, len);
 }
 /* ======================================================================== */
 
-static signed int arcp_socket_process(arcp_socket_t fd, arcp_stream_t **stream,
+static void capture_end(arcp_handle_t *handle) {
+/*
+ * Internal function: completes a record started by capture_begin().
+ */
+  CAPTURE_UNLOCK((FILE *)handle->capture);
+}
+/* ======================================================================== */
+
+static void capture_data(arcp_handle_t *handle, uint8 type, const uint8 *buf,
+  uint32 len) {
+/*
+ * Internal function: writes a record holding the len bytes at buf to the
+ * handle's capture file.
+ */
+  capture_begin(handle, type, len);
+  fwrite(buf, 1, len, (FILE *)handle->capture);
+  capture_end(handle);
+}
+/* ======================================================================== */
+#else
+#define CAPTURE(_handle,_type,_buf,_len)
+#endif
+
+static signed int rx_fill(arcp_handle_t *handle, uint16 need) {
+/*
+ * Internal function: ensures that at least "need" unconsumed bytes are held
+ * in the handle's receive buffer, reading from the socket as required. 
+ * Each read asks for as much as the buffer can take, so a complete
+ * response normally arrives in a single call.
+ *
+ * Returns 0 on success or an ARCP_ERROR_CONN_* code on error.
+ */
+signed int i;
+
+  if (need > ARCP_RX_BUF_SIZE)
+    return ARCP_ERROR_INTERNAL;
+
+  while (handle->rx_tail-handle->rx_head < need) {
+    /* Move unconsumed data to the front of the buffer if the requested
+     * amount would otherwise run off the end.
+     */
+    if (handle->rx_head+need > ARCP_RX_BUF_SIZE) {
+      memmove(handle->rx_buf, handle->rx_buf+handle->rx_head,
+        handle->rx_tail-handle->rx_head);
+      handle->rx_tail = (uint16)(handle->rx_tail-handle->rx_head);
+      handle->rx_head = 0;
+    }
+    /* In non-blocking mode take only what is already available; the
+     * caller retries later if the message is still incomplete.
+     */
+    if (handle->rx_nonblock == RX_BUFFERED)
+      return ARCP_ERROR_CONN_TIMEOUT;
+    if (handle->rx_nonblock == RX_NONBLOCK) {
+      i = read_from_socket(handle->fd, handle->rx_buf+handle->rx_tail,
+            ARCP_RX_BUF_SIZE-handle->rx_tail, ARCP_MSG_DONTWAIT);
+      if (i < 0)
+        return i;
+      CAPTURE(handle, ARCP_CAPTURE_RX, handle->rx_buf+handle->rx_tail, i);
+      handle->rx_tail = (uint16)(handle->rx_tail+i);
+      continue;
+    }
+    /* With a receive timeout set, wait for data to arrive before each
+     * read so that the whole message is bounded by handle->rx_deadline.
+     */
+    if (handle->recv_timeout_ms != 0) {
+      i = wait_socket(handle->fd, 0, handle->rx_deadline);
+      if (i < 0)
+        return i;
+    }
+    i = read_from_socket(handle->fd, handle->rx_buf+handle->rx_tail,
+          ARCP_RX_BUF_SIZE-handle->rx_tail,
+          handle->recv_timeout_ms!=0 ? ARCP_MSG_DONTWAIT : 0);
+#ifndef ARCP_NUTOS
+    /* A spurious wakeup is retried; wait_socket() enforces the deadline.
+     * NutOS has no such wait: there the timeout comes from the socket
+     * itself and is returned.
+     */
+    if (i==ARCP_ERROR_CONN_TIMEOUT && handle->recv_timeout_ms!=0)
+      continue;
+#endif
+    if (i < 0)
+      return i;
+    CAPTURE(handle, ARCP_CAPTURE_RX, handle->rx_buf+handle->rx_tail, i);
+    handle->rx_tail = (uint16)(handle->rx_tail+i);
+  }
+  return 0;
+}
+/* ======================================================================== */
+
+static void rx_consume(arcp_handle_t *handle, uint16 n) {
+/*
+ * Internal function: discards n bytes from the head of the handle's receive
+ * buffer.
+ */
+  handle->rx_head = (uint16)(handle->rx_head+n);
+  if (handle->rx_head >= handle->rx_tail)
+    handle->rx_head = handle->rx_tail = 0;
+}
+/* ======================================================================== */
+
+static void rx_resync(arcp_handle_t *handle) {
+/*
+ * Internal function: discards bytes from the head of the receive buffer
+ * until it starts with something which could be the ARCP magic number. 
+ * At least one byte is always discarded.  A partial match at the end of
+ * the buffered data is retained since the rest of the magic number may
+ * still be in transit.
+ */
+static const uint8 magic[4] = { 
+  (ARCP_MAGIC_NUMBER>>24)&0xff, (ARCP_MAGIC_NUMBER>>16)&0xff,
+  (ARCP_MAGIC_NUMBER>>8)&0xff, ARCP_MAGIC_NUMBER&0xff };
+uint16 avail, n;
+
+  rx_consume(handle, 1);
+  while ((avail = (uint16)(handle->rx_tail-handle->rx_head)) != 0) {
+    n = (uint16)(avail<4?avail:4);
+    if (memcmp(handle->rx_buf+handle->rx_head, magic, n) == 0)
+      break;
+    rx_consume(handle, 1);
+  }
+}
+/* ======================================================================== */
+
+static signed int arcp_socket_process(arcp_handle_t *handle, arcp_stream_t *stream,
   unsigned char **ascii_msg) {
 /*
  * Internal function: reads an ARCP stream or ASCII message from the given
- * socket.  This function attempts to be reasonably intelligent in that it
+ * handle.  This function attempts to be reasonably intelligent in that it
  * will ensure that the returned stream is valid and complete.  This
  * insulates any users of this function from the effect of transport delays
  * from TCP/IP, and allows error recovery in the event that the reader gets
  * out of sync with the incoming byte stream.
  *
+ * Data is pulled from the socket into the handle's receive buffer in as
+ * large a chunk as is available, and complete messages are then extracted
+ * from the buffer.  Any bytes following the message remain buffered for
+ * the next call.
+ *
  * The mode used depends on which storage locations have been provided by
  * the caller.  If stream is given, ARCP streams will be read if present,
  * and if ascii_msg is given, ASCII messages will be allowed.  Both
  * stream and ascii_msg can be given, in which case the function will
  * search for both, returning the first one identified.
  *
- * Returns 0 on success (with *stream pointing to a newly created stream
- * object OR *ascii_msg pointing to a newly created ascii message).  In
- * event of error an ARCP_ERROR_* code will be returned.
+ * ARCP streams are decoded in place from the handle's receive buffer; on
+ * success *stream is set up to refer to that buffer, so it remains valid
+ * only until the next read on the same handle.  No dynamic memory is used
+ * for ARCP streams.
+ *
+ * Returns 0 on success (with *stream describing the received ARCP stream
+ * OR *ascii_msg pointing to a newly created ascii message).  In event of
+ * error an ARCP_ERROR_* code will be returned.
  *
- * TODO: implement timeouts, possibly using select().
+ * If the handle has a receive timeout (see arcp_handle_set_timeouts()) the
+ * whole message must arrive within that time, otherwise
+ * ARCP_ERROR_CONN_TIMEOUT is returned.  Any partial message remains
+ * buffered.
  */
 unsigned char *c;
-arcp_stream_t *local_stream;
 signed int i;
 uint32 magic_num = 0;
 uint16 msg_size = 0;
 uint8 byte = 0;
 uint8 flags = 0;
-uint16 len;
 
   /* If the caller didn't supply a pointer variable in which to reference
    * the resultant stream, there's no point in continuing.
@@ -1755,11 +2992,14 @@ uint16 len;
   if (stream==NULL && ascii_msg==NULL)
     return ARCP_ERROR_INTERNAL;
 
+  if (handle->recv_timeout_ms != 0)
+    handle->rx_deadline = arcp_clock_ms() + handle->recv_timeout_ms;
+
   /* Set the return pointers to sensible defaults and set the operation
    * mode.
    */
   if (stream != NULL) {
-    *stream = NULL;
+    memset(stream, 0, sizeof(*stream));
     flags |= MSG_ARCP;
   }
   if (ascii_msg != NULL) {
@@ -1786,16 +3026,24 @@ uint16 len;
   msg_size = 0;
   while ( (!(flags & MSG_ARCP) || magic_num!=ARCP_MAGIC_NUMBER) && msg_size<4 &&
           (!(flags & MSG_ASCII) || byte!='\n') ) {
-    i = read_from_socket(fd, &byte, 1, 0);
+    i = rx_fill(handle, (uint16)(msg_size+1));
     if (i < 0)
       return i;
 
+    byte = handle->rx_buf[handle->rx_head+msg_size];
     magic_num = (magic_num << 8) | byte;
-    if (msg_size < 4)
-      msg_size++;
+    msg_size++;
   }
   if ( (!(flags & MSG_ARCP) || magic_num!=ARCP_MAGIC_NUMBER) &&
        (!(flags & MSG_ASCII) || byte!='\n') ) {
+    /* Garbage at the head of the buffer.  In ARCP mode skip forward to the
+     * next candidate magic number so the following call picks up in sync;
+     * otherwise drop the bytes examined.  Either way report the bad data.
+     */
+    if (flags & MSG_ARCP)
+      rx_resync(handle);
+    else
+      rx_consume(handle, msg_size);
     return ARCP_ERROR_BADMSG;
   }
 
@@ -1803,6 +3051,7 @@ uint16 len;
    * there's nothing else to do with it.
    */
   if ((flags & MSG_ASCII) && byte=='\n') {
+    rx_consume(handle, msg_size);
     /* Work out the length of the ASCII message including a NULL terminator
      * but excluding any CR/LF characters which might have been sent.
      * The last character read must be a LF by definition.  The one before
@@ -1833,56 +3082,41 @@ uint16 len;
     return 0;
   }
 
-  /* At this point a valid magic number has been read, so the next two bytes 
-   * should indicate the total message size in bytes.
+  /* At this point a valid magic number is at the head of the buffer, so the
+   * next two bytes should indicate the total message size in bytes.
    */
-  i = read_from_socket(fd, &msg_size, 2, 0);
+  i = rx_fill(handle, 6);
   if (i < 0)
     return i;
 
   /* msg_size will be in network byte order as it comes off the wire */
-  msg_size = htons(msg_size);
+  msg_size = (uint16)((handle->rx_buf[handle->rx_head+4]<<8) |
+                      handle->rx_buf[handle->rx_head+5]);
 
   /* Sanity-check the message size.  By definition it must be greater than
    * or equal to 11.  We also place an upper bound of ARCP_MSG_MAX_SIZE on
    * the size.
    */
   if (msg_size<=11 || msg_size>ARCP_MSG_MAX_SIZE) {
+    rx_resync(handle);
     return ARCP_ERROR_BADMSG;
   }
 
-  /* Everything has checked out, so prepare to read the rest of the message
-   * from the stream.
+  /* Everything has checked out, so make sure the rest of the message is in
+   * the receive buffer.  Allow for partial transfers.
    */
-  local_stream = arcp_stream_new();
-  if (local_stream == NULL)
-    return ARCP_ERROR_LOCAL;
-  if (arcp_stream_setsize(local_stream,msg_size) < 0) {
-    arcp_stream_free(local_stream);
-    return ARCP_ERROR_LOCAL;
-  }
-  /* Put the two data fields already read into the new message stream 
-   * object.
-   */
-  arcp_stream_store_int32(local_stream, magic_num);
-  arcp_stream_store_int16(local_stream, msg_size);
+  i = rx_fill(handle, msg_size);
+  if (i < 0)
+    return i;
 
-  /* The number of bytes left to read is <msg_size>-4-2; 4 for the magic
-   * number and 2 for the message size.  Read these bytes straight into
-   * the stream object.  Allow for partial transfers.
+  /* Describe the message in place and consume it from the buffer.  The
+   * bytes themselves are not touched until the next read on this handle.
    */
-  len = 6;
-  i = read_from_socket(fd, local_stream->data+len, msg_size-len, 0);
-  if (i<0 || len+i!=msg_size) {
-    arcp_stream_free(local_stream);
-    return ARCP_ERROR_BADMSG;
-  }
-  local_stream->head += i;
-
-  /* Reset the stream pointer so it's ready to be read */
-  arcp_stream_reset(local_stream);
-
-  *stream = local_stream;
+  stream->size = msg_size;
+  stream->data = handle->rx_buf + handle->rx_head;
+  stream->end = stream->data + msg_size-1;
+  arcp_stream_reset(stream);
+  rx_consume(handle, msg_size);
   return 0;
 }
 /* ======================================================================== */
@@ -1898,21 +3132,256 @@ arcp_handle_t *h = calloc(1, sizeof(arcp_handle_t));
     return NULL;
   h->fd = fd;
 
-  /* Assume the current protocol version is appropriate */
-  h->connection_arcp_version = ARCP_VERSION_WORD(ARCP_VERSION_MAJOR, ARCP_VERSION_MINOR);
-  return h;
+  /* Assume the current protocol version is appropriate */
+  h->connection_arcp_version = ARCP_VERSION_WORD(ARCP_VERSION_MAJOR, ARCP_VERSION_MINOR);
+  return h;
+}
+/* ======================================================================== */
+
+arcp_socket_t arcp_handle_get_socket(arcp_handle_t *handle) {
+/*
+ * Returns the socket identifier associated with the given handle.  On
+ * error, (arcp_socket_t)0 is returned.
+ */
+  if (handle != NULL) {
+    return handle->fd;
+  }
+  return (arcp_socket_t)0;
+}
+/* ======================================================================== */
+
+static uint16 next_exchange_id(arcp_handle_t *handle) {
+/*
+ * Internal function: allocates the next exchange ID for a command sent on
+ * the given handle.  Each handle has its own sequence, and the increment is
+ * atomic where the platform supports threads so that a handle shared
+ * between threads never hands out the same ID twice.  NutOS threads are
+ * cooperative, so a plain increment suffices there.
+ */
+#if defined(ARCP_NUTOS)
+  return handle->exchange_id++;
+#elif defined(_MSC_VER)
+  return (uint16)_InterlockedExchangeAdd16((short volatile *)&handle->exchange_id, 1);
+#else
+  return __sync_fetch_and_add(&handle->exchange_id, (uint16)1);
+#endif
+}
+/* ======================================================================== */
+
+uint16 arcp_handle_get_exchange_id(arcp_handle_t *handle) {
+/*
+ * Returns the exchange ID which will be used for the next command sent on
+ * the given handle.  On error, 0 is returned.
+ */
+  if (handle != NULL) {
+    return handle->exchange_id;
+  }
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_handle_set_timeouts(arcp_handle_t *handle, uint32 connect_ms,
+  uint32 send_ms, uint32 recv_ms) {
+/*
+ * Sets the connect, send and receive timeouts (in milliseconds) used by
+ * the given handle.  A value of 0 disables the respective timeout.  The
+ * receive timeout bounds the time taken for a complete message to arrive;
+ * the send timeout bounds the time taken to send a complete message.  An
+ * operation which times out returns ARCP_ERROR_CONN_TIMEOUT.  Returns 0 on
+ * success or ARCP_ERROR_INTERNAL if handle is NULL.
+ *
+ * Under NutOS the send and receive timeouts are applied to each socket
+ * operation by way of socket options.
+ */
+  if (handle == NULL)
+    return ARCP_ERROR_INTERNAL;
+  handle->connect_timeout_ms = connect_ms;
+  handle->send_timeout_ms = send_ms;
+  handle->recv_timeout_ms = recv_ms;
+#ifdef ARCP_NUTOS
+  if (handle->fd != ARCP_INVALID_SOCKET) {
+    u_long tmo;
+    tmo = send_ms;
+    NutTcpSetSockOpt(handle->fd, SO_SNDTIMEO, &tmo, sizeof(tmo));
+    tmo = recv_ms;
+    NutTcpSetSockOpt(handle->fd, SO_RCVTIMEO, &tmo, sizeof(tmo));
+  }
+#endif
+  return 0;
+}
+/* ======================================================================== */
+
+#ifndef ARCP_NUTOS
+static void set_socket_nonblocking(arcp_socket_t fd, signed int nonblocking) {
+/*
+ * Internal function: switches the given socket between blocking and
+ * non-blocking modes.
+ */
+#ifdef ARCP_WIN32
+u_long mode = nonblocking?1:0;
+  ioctlsocket(fd, FIONBIO, &mode);
+#else
+int fl = fcntl(fd, F_GETFL, 0);
+  if (fl != -1)
+    fcntl(fd, F_SETFL, nonblocking?(fl|O_NONBLOCK):(fl&~O_NONBLOCK));
+#endif
+}
+/* ======================================================================== */
+
+signed int arcp_handle_connect(arcp_handle_t *handle, const char *ip_addr,
+  uint16 port) {
+/*
+ * Opens a TCP connection to the ARCP slave at the given dotted-quad IP
+ * address and port and associates it with the given handle, which must
+ * not already have a socket (create it with
+ * arcp_handle_new(ARCP_INVALID_SOCKET)).  If the handle has a connect
+ * timeout the attempt is abandoned after that time.  Returns 0 on success,
+ * ARCP_ERROR_CONN_TIMEOUT if the connection timed out,
+ * ARCP_ERROR_CONN_DROPPED if it was refused or failed, ARCP_ERROR_LOCAL if
+ * a socket could not be created or ARCP_ERROR_INTERNAL on invalid
+ * arguments.
+ */
+struct sockaddr_in addr;
+arcp_socket_t fd;
+signed int i, err;
+int so_err;
+#ifdef ARCP_WIN32
+int so_len;
+#else
+socklen_t so_len;
+#endif
+
+  if (handle==NULL || ip_addr==NULL || handle->fd!=ARCP_INVALID_SOCKET)
+    return ARCP_ERROR_INTERNAL;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr(ip_addr);
+  if (addr.sin_addr.s_addr == INADDR_NONE)
+    return ARCP_ERROR_INTERNAL;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == ARCP_INVALID_SOCKET)
+    return ARCP_ERROR_LOCAL;
+
+  if (handle->connect_timeout_ms != 0)
+    set_socket_nonblocking(fd, 1);
+  err = 0;
+  i = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+  if (i < 0) {
+#ifdef ARCP_WIN32
+    if (handle->connect_timeout_ms!=0 && SOCKET_ERRNO(fd)==WSAEWOULDBLOCK) {
+#else
+    if (handle->connect_timeout_ms!=0 &&
+        (SOCKET_ERRNO(fd)==EINPROGRESS || SOCKET_ERRNO(fd)==EINTR)) {
+#endif
+      /* Connection in progress: wait for it to complete, then collect its
+       * result.
+       */
+      err = wait_socket(fd, 1, arcp_clock_ms()+handle->connect_timeout_ms);
+      if (err == 0) {
+        so_err = 0;
+        so_len = sizeof(so_err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *)&so_err, &so_len)<0 ||
+            so_err!=0)
+          err = ARCP_ERROR_CONN_DROPPED;
+      }
+    } else
+      err = ARCP_ERROR_CONN_DROPPED;
+  }
+  if (err != 0) {
+    arcp_socket_close(fd);
+    return err;
+  }
+  if (handle->connect_timeout_ms != 0)
+    set_socket_nonblocking(fd, 0);
+
+  handle->fd = fd;
+  handle->rx_head = handle->rx_tail = 0;
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_handle_capture(arcp_handle_t *handle, const char *path) {
+/*
+ * Starts recording everything sent and received on the given handle, with
+ * microsecond timestamps, by appending to the capture file at path (which
+ * is created if need be).  Each socket read and write is one record, so
+ * the file holds the exact byte streams, including anything the decoder
+ * had to resynchronise over; arcpreplay decodes or replays them.  The file
+ * format is described in arcp.h.
+ *
+ * Capturing stops, and the file is closed, when this is called with path
+ * NULL or the handle is freed.  Capture must not be started or stopped
+ * while another thread is using the handle.
+ *
+ * Returns 0 on success, ARCP_ERROR_LOCAL if the file could not be opened
+ * or ARCP_ERROR_INTERNAL if handle is NULL.
+ */
+FILE *f;
+uint8 start[8];
+uint32 sec, usec;
+#ifdef ARCP_WIN32
+time_t now;
+#else
+struct timespec now;
+#endif
+
+  if (handle == NULL)
+    return ARCP_ERROR_INTERNAL;
+  if (handle->capture != NULL) {
+    fclose((FILE *)handle->capture);
+    handle->capture = NULL;
+  }
+  if (path == NULL)
+    return 0;
+
+  f = fopen(path, "ab");
+  if (f == NULL)
+    return ARCP_ERROR_LOCAL;
+  /* A new file starts with the signature */
+  fseek(f, 0, SEEK_END);
+  if (ftell(f) == 0)
+    fwrite(ARCP_CAPTURE_SIGNATURE, 1, 8, f);
+
+#ifdef ARCP_WIN32
+  now = time(NULL);
+  sec = (uint32)now;
+  usec = 0;
+#else
+  clock_gettime(CLOCK_REALTIME, &now);
+  sec = (uint32)now.tv_sec;
+  usec = (uint32)(now.tv_nsec/1000);
+#endif
+  start[0] = (uint8)(sec >> 24);
+  start[1] = (uint8)(sec >> 16);
+  start[2] = (uint8)(sec >> 8);
+  start[3] = (uint8)sec;
+  start[4] = (uint8)(usec >> 24);
+  start[5] = (uint8)(usec >> 16);
+  start[6] = (uint8)(usec >> 8);
+  start[7] = (uint8)usec;
+
+  handle->capture = f;
+  capture_clock(&handle->capture_sec, &handle->capture_usec);
+  capture_data(handle, ARCP_CAPTURE_START, start, sizeof(start));
+  return 0;
 }
 /* ======================================================================== */
+#endif
 
-arcp_socket_t arcp_handle_get_socket(arcp_handle_t *handle) {
+void arcp_handle_disconnect(arcp_handle_t *handle) {
 /*
- * Returns the socket identifier associated with the given handle.  On
- * error, (arcp_socket_t)0 is returned.
+ * Closes the socket associated with the given handle, leaving the handle
+ * free for reuse with arcp_handle_connect().  Any buffered received data
+ * is discarded.
  */
-  if (handle != NULL) {
-    return handle->fd;
-  }
-  return (arcp_socket_t)0;
+  if (handle==NULL || handle->fd==ARCP_INVALID_SOCKET)
+    return;
+  arcp_socket_close(handle->fd);
+  handle->fd = ARCP_INVALID_SOCKET;
+  handle->rx_head = handle->rx_tail = 0;
 }
 /* ======================================================================== */
 
@@ -1928,6 +3397,20 @@ uint16 arcp_handle_get_connection_arcp_version(arcp_handle_t *handle) {
 }
 /* ======================================================================== */
 
+signed int arcp_handle_set_decode_flags(arcp_handle_t *handle, uint8 flags) {
+/*
+ * Sets the ARCP_DECODE_* flags used when decoding messages read from the
+ * given handle.  For example, ARCP_DECODE_ARENA causes arcp_get_sysstat()
+ * to return status trees held in a single block.  Returns 0 on success or
+ * ARCP_ERROR_INTERNAL if the handle is NULL or an unknown flag is given.
+ */
+  if (handle==NULL || (flags & ~ARCP_DECODE_ARENA)!=0)
+    return ARCP_ERROR_INTERNAL;
+  handle->decode_flags = flags;
+  return 0;
+}
+/* ======================================================================== */
+
 void arcp_handle_free(arcp_handle_t *handle) {
 /*
  * Closes down an ARCP handle and frees memory used by it.  Note that the
@@ -1935,6 +3418,9 @@ void arcp_handle_free(arcp_handle_t *handle) {
  * the caller prior to calling this function.
  */
   if (handle!=NULL) {
+#ifndef ARCP_NUTOS
+    arcp_handle_capture(handle, NULL);
+#endif
     free(handle);
   }
 }
@@ -1952,32 +3438,69 @@ signed int arcp_stream_read(arcp_handle_t *handle, arcp_stream_t **stream) {
  * Returns 0 on success (with *stream pointing to a newly created stream
  * object).  In event of error an ARCP_ERROR_* code will be returned.
  */
-  return arcp_socket_process(handle->fd, stream, NULL);
+arcp_stream_t rx;
+signed int res;
+
+  if (stream == NULL)
+    return ARCP_ERROR_INTERNAL;
+  *stream = NULL;
+
+  res = arcp_socket_process(handle, &rx, NULL);
+  if (res != 0)
+    return res;
+
+  /* The received stream lives in the handle's receive buffer; give the
+   * caller a copy it can keep.
+   */
+  *stream = arcp_stream_new();
+  if (*stream == NULL)
+    return ARCP_ERROR_LOCAL;
+  if (arcp_stream_setsize(*stream, rx.size) < 0) {
+    arcp_stream_free(*stream);
+    *stream = NULL;
+    return ARCP_ERROR_LOCAL;
+  }
+  memcpy((*stream)->data, rx.data, rx.size);
+  return 0;
 }
 /* ======================================================================== */
 
-signed int arcp_stream_write(arcp_handle_t *handle, arcp_stream_t *stream) {
+static signed int write_to_socket(arcp_handle_t *handle, const uint8 *buf,
+  size_t len) {
 /*
- * Sends the given ARCP stream contents to the given ARCP connection. 
+ * Internal function: sends len bytes from buf to the given ARCP connection. 
  * Returns 0 on success or ARCP_ERROR_CONN_DROPPED if an error occurs (which
- * is assumed to be caused by a connection dropout).
+ * is assumed to be caused by a connection dropout).  If the handle has a
+ * send timeout and the bytes could not all be sent within that time
+ * ARCP_ERROR_CONN_TIMEOUT is returned.
  */
-
-size_t send_cx, len;
+size_t send_cx;
 int n_sent;
+int flags = MSG_NOSIGNAL;
+uint32 deadline = 0;
 
   /* send() (or NutTcpSend() under NutOS) doesn't guarantee to send all
    * the bytes in the one call.  Therefore loop until all bytes are sent
    * or an error occurs.
    */
-  len = stream->size;
   send_cx = 0;
   n_sent = 0;
+  if (handle->send_timeout_ms != 0) {
+    deadline = arcp_clock_ms() + handle->send_timeout_ms;
+    flags |= ARCP_MSG_DONTWAIT;
+  }
 
   while (send_cx<len && n_sent>=0) {
-    n_sent = arcp_socket_write(handle->fd, stream->data+send_cx, len-send_cx, MSG_NOSIGNAL);
-    if (n_sent > 0)
+    if (handle->send_timeout_ms != 0) {
+      n_sent = wait_socket(handle->fd, 1, deadline);
+      if (n_sent < 0)
+        return n_sent;
+    }
+    n_sent = arcp_socket_write(handle->fd, buf+send_cx, len-send_cx, flags);
+    if (n_sent > 0) {
+      CAPTURE(handle, ARCP_CAPTURE_TX, buf+send_cx, n_sent);
       send_cx += n_sent;
+    }
 
     /* Deal with timeouts if the socket has been configured with a recv
      * timeout using setsockopts(..., SOL_SOCKET, SO_RCVTIMEO, ...). 
@@ -1991,8 +3514,15 @@ int n_sent;
     if (n_sent == 0)
       return ARCP_ERROR_CONN_TIMEOUT;
 #else
-    if (n_sent<0 && SOCKET_ERRNO(handle->fd)==EWOULDBLOCK)
-      return ARCP_ERROR_CONN_TIMEOUT;
+    if (n_sent<0 && SOCKET_ERRNO(handle->fd)==EWOULDBLOCK) {
+      /* With a send timeout set the socket buffer merely filled up again
+       * after wait_socket(); wait_socket() enforces the deadline.
+       */
+      if (handle->send_timeout_ms == 0)
+        return ARCP_ERROR_CONN_TIMEOUT;
+      n_sent = 0;
+      continue;
+    }
     if (n_sent == 0)
       return ARCP_ERROR_CONN_DROPPED;
 #endif
@@ -2006,6 +3536,95 @@ int n_sent;
 }
 /* ======================================================================== */
 
+#ifdef VECTORED_SEND
+static signed int writev_to_socket(arcp_handle_t *handle, struct iovec *iov,
+  unsigned int n_iov) {
+/*
+ * Internal function: as write_to_socket(), but the bytes are gathered from
+ * the n_iov pieces described by iov using sendmsg(), so they needn't be
+ * copied into one buffer first.  The contents of iov are modified.
+ */
+struct msghdr mh;
+ssize_t n_sent;
+size_t len, piece;
+signed int i;
+int flags = MSG_NOSIGNAL;
+uint32 deadline = 0;
+
+  if (handle->send_timeout_ms != 0) {
+    deadline = arcp_clock_ms() + handle->send_timeout_ms;
+    flags |= ARCP_MSG_DONTWAIT;
+  }
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = n_iov;
+
+  /* As with send(), sendmsg() may send only part of the data */
+  for (;;) {
+    while (mh.msg_iovlen!=0 && mh.msg_iov->iov_len==0) {
+      mh.msg_iov++;
+      mh.msg_iovlen--;
+    }
+    if (mh.msg_iovlen == 0)
+      return 0;
+
+    if (handle->send_timeout_ms != 0) {
+      i = wait_socket(handle->fd, 1, deadline);
+      if (i < 0)
+        return i;
+    }
+    n_sent = sendmsg(handle->fd, &mh, flags);
+    if (n_sent < 0) {
+      if (errno == EINTR)
+        continue;
+      /* See write_to_socket() */
+      if (errno == EWOULDBLOCK) {
+        if (handle->send_timeout_ms == 0)
+          return ARCP_ERROR_CONN_TIMEOUT;
+        continue;
+      }
+      return ARCP_ERROR_CONN_DROPPED;
+    }
+    if (n_sent == 0)
+      return ARCP_ERROR_CONN_DROPPED;
+
+    if (handle->capture != NULL) {
+      capture_begin(handle, ARCP_CAPTURE_TX, (uint32)n_sent);
+      for (i=0, len=(size_t)n_sent; len!=0; i++) {
+        piece = mh.msg_iov[i].iov_len<len ? mh.msg_iov[i].iov_len : len;
+        fwrite(mh.msg_iov[i].iov_base, 1, piece, (FILE *)handle->capture);
+        len -= piece;
+      }
+      capture_end(handle);
+    }
+
+    /* Step over the bytes sent */
+    while (n_sent > 0) {
+      if ((size_t)n_sent >= mh.msg_iov->iov_len) {
+        n_sent -= (ssize_t)mh.msg_iov->iov_len;
+        mh.msg_iov++;
+        mh.msg_iovlen--;
+      } else {
+        mh.msg_iov->iov_base = (uint8 *)mh.msg_iov->iov_base + n_sent;
+        mh.msg_iov->iov_len -= (size_t)n_sent;
+        n_sent = 0;
+      }
+    }
+  }
+}
+/* ======================================================================== */
+#endif
+
+signed int arcp_stream_write(arcp_handle_t *handle, arcp_stream_t *stream) {
+/*
+ * Sends the given ARCP stream contents to the given ARCP connection. 
+ * Returns 0 on success or ARCP_ERROR_CONN_DROPPED if an error occurs (which
+ * is assumed to be caused by a connection dropout).
+ */
+  return write_to_socket(handle, stream->data, stream->size);
+}
+/* ======================================================================== */
+
 signed int arcp_ascii_or_arcp_read(arcp_handle_t *handle, arcp_msg_t **msg_read,
   unsigned char **ascii_read) {
 /*
@@ -2019,7 +3638,7 @@ signed int arcp_ascii_or_arcp_read(arcp_handle_t *handle, arcp_msg_t **msg_read,
  * Return value is 0 on success or an ARCP_ERROR_* code otherwise.
  */
 
-arcp_stream_t *stream;
+arcp_stream_t stream;
 signed int res;
 arcp_msg_t *msg;
 
@@ -2033,7 +3652,7 @@ arcp_msg_t *msg;
    * pass a pointer for an ARCP stream if the caller has provided somewhere
    * to store the resulting message.
    */
-  res = arcp_socket_process(handle->fd, msg_read==NULL?NULL:&stream, ascii_read);
+  res = arcp_socket_process(handle, msg_read==NULL?NULL:&stream, ascii_read);
 
   /* If there was an error while reading from the socket, return immediately.
    * Neither *stream nor *ascii will be allocated in this case. 
@@ -2047,12 +3666,11 @@ arcp_msg_t *msg;
     return 0;
   }
 
-  /* An ARCP stream was read, so attempt to decode it.  Since stream was
-   * only passed to arcp_socket_process() if msg_read has been supplied 
-   * by the caller we don't have to check the validity of msg_read any
-   * more. */
-  res = arcp_stream_decode(stream, &msg);
-  arcp_stream_free(stream);
+  /* An ARCP stream was read, so attempt to decode it in place.  Since
+   * stream was only passed to arcp_socket_process() if msg_read has been
+   * supplied by the caller we don't have to check the validity of msg_read
+   * any more. */
+  res = stream_decode(&stream, &msg, handle->decode_flags);
 
   if (res == 0)
     *msg_read = msg;
@@ -2067,7 +3685,7 @@ signed int arcp_ascii_read(arcp_handle_t *handle, unsigned char **ascii) {
  * contains the ASCII message or is NULL if any error occurred.  Return
  * value is 0 on success or an ARCP_ERROR_* code otherwise.
  */
-signed int res = arcp_socket_process(handle->fd, NULL, ascii);
+signed int res = arcp_socket_process(handle, NULL, ascii);
   return res;
 }    
 /* ======================================================================== */
@@ -2099,23 +3717,169 @@ signed int result;
 }    
 /* ======================================================================== */
 
+signed int arcp_msg_poll(arcp_handle_t *handle, arcp_msg_t **msg_read) {
+/*
+ * Non-blocking counterpart of arcp_msg_read(), intended for event-driven
+ * masters which learn from poll()/epoll that the handle's socket is
+ * readable.  Whatever data is available is read without waiting.  If a
+ * complete message is then buffered it is decoded and returned in
+ * *msg_read as for arcp_msg_read(); otherwise ARCP_ERROR_CONN_TIMEOUT is
+ * returned and any partial message stays buffered for the next call. 
+ * Several messages may arrive in one read, so callers should repeat the
+ * call until it returns an error.
+ *
+ * Under NutOS, where non-blocking reads aren't available, this behaves
+ * like arcp_msg_read().
+ */
+signed int result;
+
+  if (handle==NULL || msg_read==NULL)
+    return ARCP_ERROR_INTERNAL;
+
+  handle->rx_nonblock = RX_NONBLOCK;
+  result = arcp_msg_read(handle, msg_read);
+  handle->rx_nonblock = 0;
+  return result;
+}
+/* ======================================================================== */
+
+signed int arcp_msg_parse(arcp_handle_t *handle, arcp_msg_t **msg_read) {
+/*
+ * As arcp_msg_poll(), but never reads from the socket: only data already
+ * held in the handle's receive buffer is considered.  This is for use with
+ * transports which fill the receive buffer themselves via
+ * arcp_handle_rx_space() and arcp_handle_rx_commit().
+ */
+signed int result;
+
+  if (handle==NULL || msg_read==NULL)
+    return ARCP_ERROR_INTERNAL;
+
+  handle->rx_nonblock = RX_BUFFERED;
+  result = arcp_msg_read(handle, msg_read);
+  handle->rx_nonblock = 0;
+  return result;
+}
+/* ======================================================================== */
+
+uint8 *arcp_handle_rx_space(arcp_handle_t *handle, uint16 *len) {
+/*
+ * Returns the free space at the end of the handle's receive buffer, in
+ * which a transport may place incoming data before calling
+ * arcp_handle_rx_commit().  Buffered data is first moved to the front of
+ * the buffer so the space is as large as possible.  The size of the space
+ * is returned in *len.  Returns NULL if handle or len is NULL.
+ */
+  if (handle==NULL || len==NULL)
+    return NULL;
+  if (handle->rx_head != 0) {
+    memmove(handle->rx_buf, handle->rx_buf+handle->rx_head,
+      handle->rx_tail-handle->rx_head);
+    handle->rx_tail = (uint16)(handle->rx_tail-handle->rx_head);
+    handle->rx_head = 0;
+  }
+  *len = (uint16)(ARCP_RX_BUF_SIZE-handle->rx_tail);
+  return handle->rx_buf+handle->rx_tail;
+}
+/* ======================================================================== */
+
+void arcp_handle_rx_commit(arcp_handle_t *handle, uint16 n) {
+/*
+ * Records that n bytes have been placed in the space returned by
+ * arcp_handle_rx_space().
+ */
+  if (handle!=NULL && n<=ARCP_RX_BUF_SIZE-handle->rx_tail) {
+    CAPTURE(handle, ARCP_CAPTURE_RX, handle->rx_buf+handle->rx_tail, n);
+    handle->rx_tail = (uint16)(handle->rx_tail+n);
+  }
+}
+/* ======================================================================== */
+
+void arcp_handle_tx_commit(arcp_handle_t *handle, const uint8 *buf,
+  uint16 n) {
+/*
+ * Records that a transport has sent the n bytes at buf on the handle's
+ * socket itself, so that they appear in the handle's capture file as
+ * libarcp's own sends do.  Does nothing if the handle is not capturing.
+ */
+  if (handle!=NULL && buf!=NULL && n!=0)
+    CAPTURE(handle, ARCP_CAPTURE_TX, buf, n);
+}
+/* ======================================================================== */
+
+static signed int send_msg(arcp_handle_t *handle, arcp_msg_t *msg) {
+/*
+ * Internal function: encodes the given message, whose header is complete,
+ * and sends it on the handle.  The handle's own transmit buffer is used so
+ * no allocation is needed; where vectored sends are available payload
+ * already in wire format is sent straight from the message.  Returns 0 on
+ * success or an ARCP_ERROR_* code on error.
+ */
+signed int i;
+#ifdef VECTORED_SEND
+struct iovec iov[2];
+unsigned int n_iov;
+
+  i = encode_msg_iov(msg, handle->tx_buf, sizeof(handle->tx_buf), iov, &n_iov);
+  if (i != 0)
+    return i;
+  return writev_to_socket(handle, iov, n_iov);
+#else
+uint16 len;
+
+  i = arcp_msg_encode_buf(msg, handle->tx_buf, sizeof(handle->tx_buf), &len);
+  if (i != 0)
+    return i;
+  return write_to_socket(handle, handle->tx_buf, len);
+#endif
+}
+/* ======================================================================== */
+
 signed int arcp_msg_write(arcp_handle_t *handle, arcp_msg_t *msg) {
 /*
  * Sends the given ARCP message to the supplied ARCP handle.  Returns 0
  * on success or an ARCP_ERROR_* code on error.
  */
-arcp_stream_t *stream;
-signed int i;
-
   /* Set the message's protocol version to that of the connection in use */
   msg->header.protocol_version = handle->connection_arcp_version;
 
-  i = arcp_msg_encode(msg, &stream);
-  if (i != 0)
-    return i;
-  i = arcp_stream_write(handle, stream);
-  arcp_stream_free(stream);
-  return i;
+  return send_msg(handle, msg);
+}
+/* ======================================================================== */
+
+signed int arcp_cmd_encode(arcp_handle_t *handle, arcp_msg_t *cmd,
+  uint16 *len) {
+/*
+ * Assigns the next exchange ID of the given handle to the command message
+ * cmd and encodes it into the handle's transmit buffer (handle->tx_buf),
+ * setting *len to the encoded size.  The caller then sends it by whatever
+ * means it chooses.  Returns 0 on success or an ARCP_ERROR_* code on error.
+ */
+  if (handle==NULL || cmd==NULL || len==NULL ||
+      cmd->header.msg_type!=ARCP_MSG_COMMAND)
+    return ARCP_ERROR_INTERNAL;
+  cmd->header.exchange_id = next_exchange_id(handle);
+  cmd->header.protocol_version = handle->connection_arcp_version;
+  return arcp_msg_encode_buf(cmd, handle->tx_buf, sizeof(handle->tx_buf), len);
+}
+/* ======================================================================== */
+
+signed int arcp_cmd_write(arcp_handle_t *handle, arcp_msg_t *cmd) {
+/*
+ * Assigns the next exchange ID of the given handle to the command message
+ * cmd and sends it.  The response can later be read with arcp_msg_read()
+ * or arcp_msg_poll() and checked against cmd with arcp_check_resp_msg(). 
+ * This is the sending half of the command/response exchanges performed by
+ * arcp_ping() and friends, for masters which don't want to wait for the
+ * response.
+ *
+ * Returns 0 on success or an ARCP_ERROR_* code on error.
+ */
+  if (handle==NULL || cmd==NULL || cmd->header.msg_type!=ARCP_MSG_COMMAND)
+    return ARCP_ERROR_INTERNAL;
+  cmd->header.exchange_id = next_exchange_id(handle);
+  cmd->header.protocol_version = handle->connection_arcp_version;
+  return send_msg(handle, cmd);
 }
 /* ======================================================================== */
 
@@ -2224,11 +3988,8 @@ int8 resp_id = 0;
 
     cmd_to_send = cmd_msg;
   }
-  /* Assign an appropriate exchange ID */
-  cmd_to_send->header.exchange_id = exchange_id++;
-
-  /* Send the message */
-  err = arcp_msg_write(handle,cmd_to_send);
+  /* Send the message with an appropriate exchange ID */
+  err = arcp_cmd_write(handle,cmd_to_send);
 
   /* If no errors, attempt to read a response message and check it */
   if (err == 0) {
@@ -2261,6 +4022,156 @@ int8 resp_id = 0;
 }
 /* ======================================================================== */
 
+signed int arcp_exec_cmds(arcp_handle_t *handle, arcp_msg_t **cmds,
+  arcp_msg_t **resps, unsigned int n_cmds) {
+/*
+ * Pipelined command execution.  The n_cmds pre-prepared command messages in
+ * cmds[] are sent back to back on the given handle (coalesced into as few
+ * socket writes as the handle's transmit buffer allows) and the responses
+ * are then collected in whatever order they arrive, being matched to their
+ * commands by exchange ID.  Compared with calling arcp_exec_cmd() for each
+ * command this costs roughly one round trip rather than n_cmds.
+ *
+ * On return resps[i] holds the response to cmds[i] or NULL if none was
+ * received.  Each response has been checked with arcp_check_resp_msg() and
+ * must be freed by the caller with arcp_msg_free().  Responses carrying an
+ * exchange ID which doesn't belong to an outstanding command (for example a
+ * late answer to an earlier exchange) are discarded.  A response which does
+ * match but fails arcp_check_resp_msg() is discarded too, leaving resps[i]
+ * NULL, and the remaining responses are still collected so that none is
+ * left unread on the connection.
+ *
+ * Return value is 0 if a valid response was received for every command, or
+ * an ARCP_ERROR_* code: that of a failure to send or receive, or else that
+ * of the first response (in command order) which failed its check.  Any
+ * valid responses received are
+ * returned in either case.  If sending or receiving failed once anything
+ * had been written the handle is disconnected, since responses to the
+ * commands sent may still be on their way and would be taken as answers
+ * to later commands; it must be reconnected with arcp_handle_connect()
+ * before further use.  cmds[] is NOT deallocated by this function.
+ */
+unsigned int i, sent, outstanding;
+uint16 len, offset = 0;
+signed int err = 0, check_err;
+uint8 flushed = 0;
+arcp_msg_t *resp;
+#ifdef VECTORED_SEND
+struct iovec iov[SEND_IOV_MAX];
+unsigned int n_iov = 0, n;
+#endif
+
+  if (handle==NULL || cmds==NULL || resps==NULL)
+    return ARCP_ERROR_INTERNAL;
+  for (i=0; i<n_cmds; i++) {
+    resps[i] = NULL;
+    if (cmds[i]==NULL || cmds[i]->header.msg_type!=ARCP_MSG_COMMAND)
+      return ARCP_ERROR_INTERNAL;
+  }
+
+  /* Encode the commands into the transmit buffer, flushing it whenever the
+   * next message won't fit.
+   */
+  for (sent=0; sent<n_cmds && err==0; sent++) {
+    cmds[sent]->header.exchange_id = next_exchange_id(handle);
+    cmds[sent]->header.protocol_version = handle->connection_arcp_version;
+#ifdef VECTORED_SEND
+    /* Pulse sequences are sent from the commands themselves, so only the
+     * rest of each message takes space in the buffer.
+     */
+    len = msg_head_size(cmds[sent]);
+    if (offset+len>sizeof(handle->tx_buf) || n_iov+2>SEND_IOV_MAX) {
+      flushed = 1;
+      err = writev_to_socket(handle, iov, n_iov);
+      offset = 0;
+      n_iov = 0;
+    }
+    if (err == 0)
+      err = encode_msg_iov(cmds[sent], handle->tx_buf+offset,
+              (uint16)(sizeof(handle->tx_buf)-offset), iov+n_iov, &n);
+    if (err != 0)
+      break;
+    offset = (uint16)(offset+iov[n_iov].iov_len);
+    /* Merge with the previous piece if it ends in the buffer where this
+     * message starts.
+     */
+    if (n_iov!=0 && (uint8 *)iov[n_iov-1].iov_base+iov[n_iov-1].iov_len==
+        (uint8 *)iov[n_iov].iov_base) {
+      iov[n_iov-1].iov_len += iov[n_iov].iov_len;
+      if (n == 2)
+        iov[n_iov] = iov[n_iov+1];
+      n--;
+    }
+    n_iov += n;
+  }
+  if (err==0 && n_iov!=0) {
+    flushed = 1;
+    err = writev_to_socket(handle, iov, n_iov);
+  }
+#else
+    len = arcp_msg_set_stream_size(cmds[sent]);
+    if (offset+len > sizeof(handle->tx_buf)) {
+      flushed = 1;
+      err = write_to_socket(handle, handle->tx_buf, offset);
+      offset = 0;
+    }
+    if (err == 0)
+      err = arcp_msg_encode_buf(cmds[sent], handle->tx_buf+offset,
+              (uint16)(sizeof(handle->tx_buf)-offset), &len);
+    if (err == 0)
+      offset = (uint16)(offset+len);
+  }
+  if (err==0 && offset!=0) {
+    flushed = 1;
+    err = write_to_socket(handle, handle->tx_buf, offset);
+  }
+#endif
+  if (err != 0) {
+    /* Nothing is outstanding if the first flush was never reached */
+    if (flushed)
+      arcp_handle_disconnect(handle);
+    return err;
+  }
+
+  /* Collect the responses, matching each to its command.  Responses are
+   * only checked once all have arrived, so that one failing its check
+   * still stops its command being matched again.
+   */
+  outstanding = n_cmds;
+  while (outstanding != 0) {
+    err = arcp_msg_read(handle, &resp);
+    if (err != 0) {
+      arcp_handle_disconnect(handle);
+      break;
+    }
+    for (i=0; i<n_cmds; i++) {
+      if (resps[i]==NULL && 
+          resp->header.exchange_id==cmds[i]->header.exchange_id)
+        break;
+    }
+    if (i == n_cmds) {
+      arcp_msg_free(resp);
+      continue;
+    }
+    resps[i] = resp;
+    outstanding--;
+  }
+
+  for (i=0; i<n_cmds; i++) {
+    if (resps[i] == NULL)
+      continue;
+    check_err = arcp_check_resp_msg(cmds[i], resps[i]);
+    if (check_err != 0) {
+      arcp_msg_free(resps[i]);
+      resps[i] = NULL;
+      if (err == 0)
+        err = check_err;
+    }
+  }
+  return err;
+}
+/* ======================================================================== */
+
 static signed int arcp_exec_resp(arcp_handle_t *handle, arcp_msg_t *orig_cmd, 
   arcp_resp_id_t resp_id, arcp_msg_t *resp_msg, int16 info_code) {
 /*
@@ -2544,6 +4455,50 @@ signed int i;
 }
 /* ======================================================================== */
 
+signed int arcp_get_stx2flat(arcp_handle_t *handle, arcp_stx2flat_t *flat) {
+/*
+ * Sends an ARCP "get sysstat" packet to the ARCP handle and decodes the
+ * response straight from the handle's receive buffer into the caller's
+ * flat STX2 status structure.  Unlike arcp_get_sysstat() no memory is
+ * allocated for the response.
+ *
+ * Return value is 0 on success, the response ID if the slave answered
+ * with a NAK or UNK, or an ARCP_ERROR_* code on failure.
+ * ARCP_ERROR_BAD_RESPONSE is returned if the module is not a STX2.
+ */
+arcp_msg_t *cmd;
+arcp_msg_t resp;
+arcp_stream_t stream;
+signed int res;
+
+  if (flat == NULL)
+    return ARCP_ERROR_INTERNAL;
+
+  cmd = arcp_msg_new(ARCP_MSG_COMMAND);
+  if (cmd == NULL)
+    return ARCP_ERROR_LOCAL;
+  cmd->command.id = ARCP_CMD_GET_SYSSTAT;
+  cmd->header.exchange_id = next_exchange_id(handle);
+
+  res = arcp_msg_write(handle, cmd);
+  if (res == 0)
+    res = arcp_socket_process(handle, &stream, NULL);
+  if (res == 0)
+    res = decode_stx2flat(&stream, &resp, flat);
+  if (res == 0)
+    res = arcp_check_resp_msg(cmd, &resp);
+  arcp_msg_free(cmd);
+
+  if (res != 0)
+    return res;
+  if (resp.response.id == ARCP_RESP_SYSSTAT)
+    return ARCP_RESP_ACK;
+  if (resp.response.id==ARCP_RESP_NAK || resp.response.id==ARCP_RESP_UNK)
+    return resp.response.id;
+  return ARCP_ERROR_BAD_RESPONSE;
+}
+/* ======================================================================== */
+
 signed int arcp_set_module_enable(arcp_handle_t *handle, uint8 enable) {
 /*
  * Sets the enable status of the module connected through the given ARCP
@@ -2602,6 +4557,103 @@ signed int i;
 }
 /* ======================================================================== */
 
+signed int arcp_set_resp_result(arcp_msg_t *resp) {
+/*
+ * Converts the response to a parameter setting command into the result
+ * code which arcp_set_pulseparam() and friends return: ARCP_RESP_ACK,
+ * ARCP_RESP_UNK, the error code carried by a NAK (or ARCP_RESP_NAK if it
+ * carries none) or ARCP_ERROR_BAD_RESPONSE.  This is for masters which
+ * send such commands with arcp_exec_cmds() or similar.
+ */
+signed int res;
+
+  if (resp == NULL)
+    return ARCP_ERROR_LOCAL;
+  res = resp->response.id;
+  if (res == ARCP_RESP_NAK) {
+    if (resp->response.info_code < 0)
+      res = resp->response.info_code;
+  } else
+  if (res!=ARCP_RESP_ACK && res!=ARCP_RESP_UNK)
+    res = ARCP_ERROR_BAD_RESPONSE;
+  return res;
+}
+/* ======================================================================== */
+
+signed int arcp_set_pulsetable(arcp_handle_t *handle,
+  arcp_pulsetable_entry_t *table, uint16 n_entries) {
+/*
+ * Programs a number of pulse slots at once.  A SET_PULSE_PARAM command is
+ * built for each of the n_entries entries in table and the whole lot is
+ * sent in one pipelined burst with arcp_exec_cmds(), so the cost is
+ * roughly one round trip rather than one per slot as when calling
+ * arcp_set_pulseparam() repeatedly.
+ *
+ * On return the result field of each entry holds what
+ * arcp_set_pulseparam() would have returned for that slot: ARCP_RESP_ACK,
+ * ARCP_RESP_UNK, the error code carried by a NAK (for example
+ * ARCP_STX2_ERROR_PULSE_TOO_LONG if the pulse doesn't fit the slot) or an
+ * ARCP_ERROR_* code if no valid response was received.  As with
+ * arcp_exec_cmds(), the handle is disconnected if sending or receiving
+ * fails part way through.
+ *
+ * Return value is the number of entries whose result is not ARCP_RESP_ACK
+ * (so 0 if every slot was programmed), or ARCP_ERROR_LOCAL if there is
+ * insufficient memory to process the request.
+ */
+arcp_msg_t **cmds, **resps;
+uint16 i;
+signed int res, n_failed = 0;
+
+  if (handle==NULL || (table==NULL && n_entries!=0))
+    return ARCP_ERROR_INTERNAL;
+  if (n_entries == 0)
+    return 0;
+  cmds = calloc(2*(size_t)n_entries, sizeof(arcp_msg_t *));
+  if (cmds == NULL)
+    return ARCP_ERROR_LOCAL;
+  resps = cmds+n_entries;
+
+  for (i=0; i<n_entries; i++) {
+    cmds[i] = arcp_msg_new(ARCP_MSG_COMMAND);
+    if (cmds[i]==NULL || arcp_msg_set_cmd_id(cmds[i], ARCP_CMD_SET_PULSE_PARAM)<0)
+      break;
+    cmds[i]->cmd_set_pulse_param.pulse_map_index = table[i].slot;
+    cmds[i]->cmd_set_pulse_param.pulse_param = table[i].param;
+  }
+  if (i < n_entries) {
+    for (i=0; i<n_entries && cmds[i]!=NULL; i++) {
+      cmds[i]->cmd_set_pulse_param.pulse_param.code = NULL;
+      arcp_msg_free(cmds[i]);
+    }
+    free(cmds);
+    return ARCP_ERROR_LOCAL;
+  }
+
+  res = arcp_exec_cmds(handle, cmds, resps, n_entries);
+
+  for (i=0; i<n_entries; i++) {
+    /* Slots left without a response take the error which ended the
+     * exchange.
+     */
+    if (resps[i] == NULL)
+      table[i].result = res!=0 ? res : ARCP_ERROR_INTERNAL;
+    else {
+      table[i].result = arcp_set_resp_result(resps[i]);
+      arcp_msg_free(resps[i]);
+    }
+    if (table[i].result != ARCP_RESP_ACK)
+      n_failed++;
+
+    /* The pulse codes belong to the caller */
+    cmds[i]->cmd_set_pulse_param.pulse_param.code = NULL;
+    arcp_msg_free(cmds[i]);
+  }
+  free(cmds);
+  return n_failed;
+}
+/* ======================================================================== */
+
 signed int arcp_set_pulseseq(arcp_handle_t *handle, arcp_pulseseq_t *seq) {
 /*
  * Sends an ARCP message to the slave connected to ARCP handle "handle"
@@ -29,6 +29,9 @@
   #define arcp_socket_read(_fd,_buf,_len,_flags) NutTcpReceive(_fd,_buf,_len)
   #define arcp_socket_write(_fd,_buf,_len,_flags) NutTcpSend(_fd,_buf,_len)
   #define SOCKET_ERRNO(_sock) NutTcpError(_sock)
+  #define arcp_socket_close(_fd) NutTcpCloseSocket(_fd)
+  #define ARCP_INVALID_SOCKET NULL
+  #define ARCP_MSG_DONTWAIT 0
 #else
   #ifdef ARCP_WIN32
     /* Borland C++ Builder needs this before including Winsock2.h */
@@ -42,6 +45,12 @@
      */
     #define arcp_socket_write(_fd,_buf,_len,_flags) send(_fd,(char *)(_buf),_len,_flags)
     #define SOCKET_ERRNO(_sock) WSAGetLastError()
+    #define arcp_socket_close closesocket
+    #define ARCP_INVALID_SOCKET INVALID_SOCKET
+    /* Readiness is established with select() before each recv()/send() so
+     * a non-blocking flag isn't needed.
+     */
+    #define ARCP_MSG_DONTWAIT 0
     #ifndef EINTR
     #define EINTR WSAEINTR
     #define EWOULDBLOCK WSAEWOULDBLOCK
@@ -55,11 +64,19 @@
     #include <sys/socket.h>
     #include <errno.h>
     #include <netinet/in.h>           /* For htonl() etc in arcp.c */
+    #include <arpa/inet.h>
+    #include <poll.h>
+    #include <sys/uio.h>
+    #include <fcntl.h>
+    #include <unistd.h>
     #include <stdint.h>
     typedef signed int arcp_socket_t;
     #define arcp_socket_read recv
     #define arcp_socket_write send
     #define SOCKET_ERRNO(_sock) errno
+    #define arcp_socket_close close
+    #define ARCP_INVALID_SOCKET (-1)
+    #define ARCP_MSG_DONTWAIT MSG_DONTWAIT
   #endif
 #endif
 
@@ -139,6 +156,12 @@
  */
 #define ARCP_MSG_MAX_SIZE       1024
 
+/* Size of the per-connection receive buffer.  This must be able to hold at
+ * least one complete message; making it larger lets a single read pick up
+ * several back-to-back messages.
+ */
+#define ARCP_RX_BUF_SIZE        (2*ARCP_MSG_MAX_SIZE)
+
 /* Maximum size of a pulse sequence (ie: maximum number of entries).  The
  * setting of ARCP_MSG_MAX_SIZE will affect this to a certain extent, as
  * will the size of a single entry in the pulse sequence list.  This should
@@ -350,14 +373,76 @@ enum {
 typedef struct arcp_handle_t {
   arcp_socket_t fd;
   uint16 connection_arcp_version;
+  /* Scratch space used by arcp_msg_write() to encode outgoing messages.
+   * Keeping this with the handle means steady-state command traffic does
+   * not need to touch the heap.
+   */
+  uint8 tx_buf[ARCP_MSG_MAX_SIZE];
+  /* Incoming data is buffered here.  Complete messages are extracted from
+   * between rx_head and rx_tail and decoded in place.
+   */
+  uint8 rx_buf[ARCP_RX_BUF_SIZE];
+  uint16 rx_head, rx_tail;
+  /* ARCP_DECODE_* flags applied to messages read from this handle */
+  uint8 decode_flags;
+  /* The next exchange ID to use for commands sent on this handle.  This is
+   * only modified atomically (see next_exchange_id() in arcp.c).
+   */
+  volatile uint16 exchange_id;
+  /* Timeouts in milliseconds for connecting, sending a message and
+   * receiving a message; 0 means wait indefinitely.  See
+   * arcp_handle_set_timeouts().  rx_deadline is the clock value at which
+   * the message currently being received times out.
+   */
+  uint32 connect_timeout_ms, send_timeout_ms, recv_timeout_ms;
+  uint32 rx_deadline;
+  /* Set while arcp_msg_poll() or arcp_msg_parse() is reading so that the
+   * socket is never waited on (or not read at all).
+   */
+  uint8 rx_nonblock;
+  /* Capture file (a FILE *) recording the data sent and received, or NULL,
+   * and the monotonic clock time of the last record written to it.  See
+   * arcp_handle_capture().
+   */
+  void *capture;
+  uint32 capture_sec, capture_usec;
 } arcp_handle_t;
 
+/* Flags controlling how incoming messages are decoded.
+ *   ARCP_DECODE_ARENA: place each decoded system status tree in a single
+ *     block sized from the message length, so it is built with one
+ *     allocation and released by arcp_sysstat_free() with one free().
+ */
+#define ARCP_DECODE_ARENA        0x01
+
+/* Capture files written by arcp_handle_capture() start with the 8 byte
+ * signature below and continue with records, each made up of a type byte,
+ * the time since the previous record in microseconds, the length of the
+ * record's data and the data itself.  The time and length are unsigned
+ * base-128 varints, least significant 7 bits first.  Every capture session
+ * begins with a START record whose data is the wall clock time it began,
+ * as big-endian 32-bit seconds and microseconds since the Unix epoch.
+ * RX and TX records hold the bytes of one socket read or write.
+ */
+#define ARCP_CAPTURE_SIGNATURE   "ARCPCAP1"
+#define ARCP_CAPTURE_START       0
+#define ARCP_CAPTURE_RX          1
+#define ARCP_CAPTURE_TX          2
+
 /* A type to support pulse codes of arbitary length */
 typedef struct arcp_pulsecode_t {
   uint16 size, code_length;
   uint8  *data;
 } arcp_pulsecode_t;
 
+/* A pulse code with inline storage for the longest code, so it never
+ * allocates.  See arcp_pulsecode_fixed_init().
+ */
+typedef struct arcp_pulsecode_fixed_t {
+  arcp_pulsecode_t code;
+  uint8 storage[ARCP_MAX_PULSECODE_SIZE/8];
+} arcp_pulsecode_fixed_t;
+
 /* A structure to hold entries in a pulse sequence */
 typedef struct arcp_pulseseq_entry_t {
   uint8 slot;
@@ -370,6 +455,13 @@ typedef struct arcp_phase_entry_t {
   float phase;
 } arcp_phase_entry_t;
 
+/* The phases for one phase slot of a beamsteering unit */
+typedef struct arcp_phasetable_t {
+  uint16 phase_slot;
+  uint16 n_phases;
+  arcp_phase_entry_t *phases;
+} arcp_phasetable_t;
+
 /* ======================================================================== */
 /* Structures used to group related data together for various processes.
  * The end user of this library will usually be using structures in this
@@ -385,6 +477,15 @@ typedef struct arcp_pulse_t {
   arcp_pulsecode_t *code;
 } arcp_pulse_t;
 
+/* One slot of a pulse table, as programmed by arcp_set_pulsetable().  The
+ * result field is filled in with the outcome for the slot.
+ */
+typedef struct arcp_pulsetable_entry_t {
+  uint8 slot;
+  arcp_pulse_t param;
+  signed int result;
+} arcp_pulsetable_entry_t;
+
 /* A pulse sequence */
 typedef struct arcp_pulseseq_t {
   uint16 length;
@@ -482,6 +583,13 @@ typedef struct arcp_stx2stat_t {
   arcp_rf_card_stat_t *rf_card_stat;
   uint8 n_units;
   arcp_stx2unit_union_t *unit_stat;
+  /* Non-NULL if this structure was created by an arena-backed decode (see
+   * ARCP_DECODE_ARENA).  The arrays above are then carved from this
+   * block and are released along with the owning arcp_sysstat_t rather
+   * than individually.
+   */
+  uint8 *arena;
+  uint16 arena_size, arena_used;
 } arcp_stx2stat_t;
 
 /* Status data specific to a BSM (beam steering module) */
@@ -506,8 +614,42 @@ typedef struct arcp_sysstat_t {
     arcp_stx2stat_t *stx2;
     arcp_bsmstat_t *bsm;
   } data; 
+  /* Non-zero if the whole status tree lives in a single block starting at
+   * this structure (see ARCP_DECODE_ARENA).
+   */
+  uint16 arena_size;
 } arcp_sysstat_t;
 
+/* Flat alternatives to arcp_rf_card_stat_t and arcp_stx2stat_t.  All
+ * arrays are held inline at their ARCP_MAX_* capacity so the structures
+ * contain no pointers: they can be copied with memcpy() or assignment and
+ * stored in bulk (for example as a history of snapshots) without any
+ * per-object allocation.  The n_* fields give the number of valid entries
+ * in each array; entries beyond these are zero after a decode.
+ */
+typedef struct arcp_rf_card_flat_t {
+  uint16 rail_supply;    /* Supply rail in mV */
+  int16  heatsink_temp;
+  uint8  n_rf_outputs;
+  arcp_rf_card_output_stat_t output_stat[ARCP_MAX_N_RF_CARD_OUTPUT];
+} arcp_rf_card_flat_t;
+
+typedef struct arcp_stx2flat_t {
+  int8  module_status;
+  uint16 status_code;
+  uint8 chassis_datasize;
+  uint16 rail_supply;    /* Supply rail in mV */
+  uint16 rail_aux;       /* Auxillary power rail in mV */
+  int8  ambient_temp;
+  uint8 n_chassis_fans;
+  uint16 fan_speed[ARCP_MAX_N_CHASSIS_FANS];
+  uint16 card_map;
+  uint8 n_rf_cards;
+  arcp_rf_card_flat_t rf_card_stat[ARCP_MAX_N_RF_CARDS];
+  uint8 n_units;
+  arcp_stx2unit_union_t unit_stat[ARCP_STX2_MAX_N_STX2_UNITS];
+} arcp_stx2flat_t;
+
 /* ======================================================================== */
 /* Structures used to manipulate ARCP messages on the wire.  These are
  * basically low-level structures and it is not expected that the end user
@@ -675,6 +817,13 @@ uint16 arcp_pulsecode_getlength(arcp_pulsecode_t *code);
 signed int arcp_pulsecode_setlength(arcp_pulsecode_t *code, uint16 new_length);
 uint8  arcp_pulsecode_getbit(arcp_pulsecode_t *code, uint16 bitnum);
 signed int arcp_pulsecode_setbit(arcp_pulsecode_t *code, uint16 bitnum, uint8 value);
+signed int arcp_pulsecode_set_bytes(arcp_pulsecode_t *code, const uint8 *bytes, uint16 length);
+signed int arcp_pulsecode_set_words(arcp_pulsecode_t *code, const uint32 *words, uint16 length);
+signed int arcp_pulsecode_set_chips(arcp_pulsecode_t *code, const char *chips);
+void arcp_pulsecode_complement(arcp_pulsecode_t *code);
+void arcp_pulsecode_invert(arcp_pulsecode_t *code);
+signed int arcp_pulsecode_sidelobes(arcp_pulsecode_t *code, int16 *acf);
+arcp_pulsecode_t *arcp_pulsecode_fixed_init(arcp_pulsecode_fixed_t *fixed);
 
 /* Management of the pulse sequence type */
 arcp_pulseseq_t *arcp_pulseseq_new(uint16 length);
@@ -701,6 +850,7 @@ void arcp_sysid_free(arcp_sysid_t *sysid);
 arcp_sysstat_t *arcp_sysstat_new(void);
 void arcp_sysstat_free(arcp_sysstat_t *sysstat);
 signed int arcp_sysstat_set_moduletype(arcp_sysstat_t *sysstat, arcp_moduletype_t type);
+arcp_sysstat_t *arcp_sysstat_copy(arcp_sysstat_t *sysstat);
 
 /* Management of the higher-level arcp_msg_t type which provides native
  * access to the raw content of messages.  Direct use of arcp_msg_t is
@@ -712,12 +862,30 @@ signed int arcp_msg_set_cmd_id(arcp_msg_t *msg, arcp_cmd_id_t id);
 arcp_resp_id_t arcp_msg_get_resp_id(arcp_msg_t *msg);
 signed int arcp_msg_set_resp_id(arcp_msg_t *msg, arcp_resp_id_t id);
 uint16 arcp_msg_set_stream_size(arcp_msg_t *msg);
+signed int arcp_stx2flat_decode_buf(uint8 *buf, uint16 buf_size,
+  arcp_stx2flat_t *flat);
+signed int arcp_msg_encode_buf(arcp_msg_t *msg, uint8 *buf, uint16 buf_size,
+  uint16 *enc_size);
 void arcp_msg_free(arcp_msg_t *msg);
 
 /* Create and manage ARCP handles */
 arcp_handle_t *arcp_handle_new(arcp_socket_t fd);
 arcp_socket_t arcp_handle_get_socket(arcp_handle_t *handle);
 uint16 arcp_handle_get_connection_arcp_version(arcp_handle_t *handle);
+uint16 arcp_handle_get_exchange_id(arcp_handle_t *handle);
+signed int arcp_handle_set_timeouts(arcp_handle_t *handle, uint32 connect_ms,
+  uint32 send_ms, uint32 recv_ms);
+#ifndef ARCP_NUTOS
+signed int arcp_handle_connect(arcp_handle_t *handle, const char *ip_addr,
+  uint16 port);
+signed int arcp_handle_capture(arcp_handle_t *handle, const char *path);
+#endif
+void arcp_handle_disconnect(arcp_handle_t *handle);
+uint8 *arcp_handle_rx_space(arcp_handle_t *handle, uint16 *len);
+void arcp_handle_rx_commit(arcp_handle_t *handle, uint16 n);
+void arcp_handle_tx_commit(arcp_handle_t *handle, const uint8 *buf,
+  uint16 n);
+signed int arcp_handle_set_decode_flags(arcp_handle_t *handle, uint8 flags);
 void arcp_handle_free(arcp_handle_t *handle);
 
 /* Public functions to send, receive and verify ARCP messages.  Only the
@@ -728,8 +896,15 @@ signed int arcp_ascii_or_arcp_read(arcp_handle_t *handle, arcp_msg_t **msg_read,
   unsigned char **ascii_read);
 signed int arcp_ascii_read(arcp_handle_t *handle, unsigned char **ascii);
 signed int arcp_msg_read(arcp_handle_t *handle, arcp_msg_t **msg_read);
+signed int arcp_msg_poll(arcp_handle_t *handle, arcp_msg_t **msg_read);
+signed int arcp_msg_parse(arcp_handle_t *handle, arcp_msg_t **msg_read);
 signed int arcp_msg_write(arcp_handle_t *handle, arcp_msg_t *msg);
+signed int arcp_cmd_encode(arcp_handle_t *handle, arcp_msg_t *cmd,
+  uint16 *len);
+signed int arcp_cmd_write(arcp_handle_t *handle, arcp_msg_t *cmd);
 signed int arcp_check_resp_msg(arcp_msg_t *cmd, arcp_msg_t *resp);
+signed int arcp_exec_cmds(arcp_handle_t *handle, arcp_msg_t **cmds,
+  arcp_msg_t **resps, unsigned int n_cmds);
 
 /* Public functions to send the ARCP commands and deal with the response.
  * The reset, ping and get/set functions will usually be used by a master
@@ -737,12 +912,16 @@ signed int arcp_check_resp_msg(arcp_msg_t *cmd, arcp_msg_t *resp);
  */
 uint32 arcp_get_lib_version(void);
 unsigned int arcp_get_lib_proto_version(void);
+uint32 arcp_clock_ms(void);
 signed int arcp_reset(arcp_handle_t *handle);
 signed int arcp_ping(arcp_handle_t *handle);
 signed int arcp_get_sysid(arcp_handle_t *handle, arcp_sysid_t **sysid);
 signed int arcp_get_sysstat(arcp_handle_t *handle, arcp_sysstat_t **sysstat);
+signed int arcp_get_stx2flat(arcp_handle_t *handle, arcp_stx2flat_t *flat);
 signed int arcp_set_module_enable(arcp_handle_t *handle, uint8 enable);
 signed int arcp_set_pulseparam(arcp_handle_t *handle, uint8 slot, arcp_pulse_t *param);
+signed int arcp_set_pulsetable(arcp_handle_t *handle, arcp_pulsetable_entry_t *table, uint16 n_entries);
+signed int arcp_set_resp_result(arcp_msg_t *resp);
 signed int arcp_set_pulseseq(arcp_handle_t *handle, arcp_pulseseq_t *seq);
 signed int arcp_set_pulseseq_index(arcp_handle_t *handle, uint16 index);
 signed int arcp_set_trigparam(arcp_handle_t *handle, arcp_trigger_t *param);
@@ -0,0 +1,596 @@
+/*
+ * A C++ (C++17 or later) companion to arcp.h which describes the wire
+ * layout of ARCP messages once, as compile-time field lists, and derives
+ * the message size calculation, the encoder and the decoder from that one
+ * description.  The generated code is straight-line for each message type:
+ * the only run-time dispatch is the selection of the message schema from
+ * the command or response ID.
+ *
+ * The codecs operate on the same arcp_msg_t structures as the C library, so
+ * messages decoded here can be passed to arcp_msg_write(), freed with
+ * arcp_msg_free() and so on.  "make check" runs arcpcodeccheck, which
+ * verifies that these codecs and the C library's produce the same bytes
+ * for every message described here.
+ *
+ * The SYSSTAT response is not described here: its layout is a pointer-linked
+ * tree whose shape depends on the module type, and it is handled by the C
+ * library (or arcp_stx2flat_decode_buf() for STX2 status).  encode() and
+ * decode() return ARCP_ERROR_UNKNOWN_RESP for it.
+ */
+
+#ifndef _ARCP_CODEC_H
+#define _ARCP_CODEC_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <cstdint>
+#include <type_traits>
+#include "arcp.h"
+
+namespace arcp {
+namespace codec {
+
+/* ======================================================================== */
+/* Big-endian wire access.  Values are assembled byte-wise so no alignment
+ * of the buffer is required.
+ */
+
+/* Number of bytes a value of type W occupies on the wire.  The 32-bit types
+ * from arcp.h may be wider than 32 bits on some hosts but are still sent as
+ * 4 bytes.
+ */
+template <typename W> constexpr unsigned int wire_size = sizeof(W)>4 ? 4 : sizeof(W);
+
+template <typename W> inline void put(uint8 *p, W v) {
+  std::uint32_t u;
+  if constexpr (std::is_floating_point_v<W>) {
+    static_assert(sizeof(W) == 4, "only IEEE single precision is supported");
+    memcpy(&u, &v, 4);
+  } else
+    u = (std::uint32_t)v;
+  for (unsigned int i=0; i<wire_size<W>; i++)
+    p[i] = (uint8)(u >> (8*(wire_size<W>-1-i)));
+}
+
+template <typename W> inline W get(const uint8 *p) {
+  std::uint32_t u = 0;
+  for (unsigned int i=0; i<wire_size<W>; i++)
+    u = (u<<8) | p[i];
+  if constexpr (std::is_floating_point_v<W>) {
+    W v;
+    memcpy(&v, &u, 4);
+    return v;
+  } else
+    return (W)u;
+}
+
+/* Size of the header common to all messages, and of the ID fields which
+ * follow it in commands (command ID) and responses (response ID and info
+ * code).
+ */
+constexpr uint16 header_size = 11;
+constexpr uint16 cmd_prefix_size = header_size + 2;
+constexpr uint16 resp_prefix_size = header_size + 4;
+
+/* ======================================================================== */
+/* Field types.  Every field provides:
+ *   fixed               - true if the field always has the same wire size
+ *   min_size            - the wire size of the field (or its minimum)
+ *   size(obj)           - the wire size of the field for the given object
+ *   encode(p, obj)      - writes the field at p and advances p.  The caller
+ *                         has already checked that size(obj) bytes fit.
+ *                         Returns 0 or an ARCP_ERROR_* code.
+ *   decode(p, end, obj) - reads the field from [p,end) and advances p.
+ *                         Returns 0 or an ARCP_ERROR_* code.
+ * Path is a chain of pointers to members leading from the object to the
+ * field, e.g. &arcp_msg_t::cmd_set_trig_param, &arcp_msg_cmd_settrig_t::
+ * trig_param, &arcp_trigger_t::pulse_predelay.
+ */
+
+/* A single value sent on the wire as type W */
+template <typename W, auto... Path> struct scalar {
+  static constexpr bool fixed = true;
+  static constexpr unsigned int min_size = wire_size<W>;
+
+  template <typename T> static unsigned int size(const T &) {
+    return wire_size<W>;
+  }
+  template <typename T> static signed int encode(uint8 *&p, const T &obj) {
+    put<W>(p, (W)(obj .* ... .* Path));
+    p += wire_size<W>;
+    return 0;
+  }
+  template <typename T> static signed int decode(const uint8 *&p,
+    const uint8 *end, T &obj) {
+    if (end-p < (long)wire_size<W>)
+      return ARCP_ERROR_BADMSG;
+    (obj .* ... .* Path) = get<W>(p);
+    p += wire_size<W>;
+    return 0;
+  }
+};
+
+/* The pulse code of an arcp_pulse_t: a 16-bit length in bits followed by
+ * the code bytes.  A NULL or empty code is sent as a length of 0.
+ */
+template <auto... Path> struct pulse_code {
+  static constexpr bool fixed = false;
+  static constexpr unsigned int min_size = 2;
+
+  static uint16 bytes(const arcp_pulsecode_t *code) {
+    if (code==NULL || code->code_length==0)
+      return 0;
+    return (uint16)((code->code_length-1)/8 + 1);
+  }
+  template <typename T> static unsigned int size(const T &obj) {
+    return 2 + bytes((obj .* ... .* Path));
+  }
+  template <typename T> static signed int encode(uint8 *&p, const T &obj) {
+    const arcp_pulsecode_t *code = (obj .* ... .* Path);
+    uint16 n = bytes(code);
+    put<uint16>(p, n==0 ? 0 : code->code_length);
+    if (n != 0)
+      memcpy(p+2, code->data, n);
+    p += 2+n;
+    return 0;
+  }
+  template <typename T> static signed int decode(const uint8 *&p,
+    const uint8 *end, T &obj) {
+    arcp_pulsecode_t *&code = (obj .* ... .* Path);
+    uint16 len, n;
+    if (end-p < 2)
+      return ARCP_ERROR_BADMSG;
+    len = get<uint16>(p);
+    p += 2;
+    code = NULL;
+    if (len == 0)
+      return 0;
+    if (len > ARCP_MAX_PULSECODE_SIZE)
+      return ARCP_ERROR_BADMSG;
+    n = (uint16)((len-1)/8 + 1);
+    if (end-p < n)
+      return ARCP_ERROR_BADMSG;
+    code = arcp_pulsecode_new(len);
+    if (code==NULL || arcp_pulsecode_setlength(code, len)<0)
+      return ARCP_ERROR_LOCAL;
+    memcpy(code->data, p, n);
+    p += n;
+    return 0;
+  }
+};
+
+/* A pulse sequence: a 16-bit length followed by (slot, flags) byte pairs */
+template <auto... Path> struct pulse_seq {
+  static constexpr bool fixed = false;
+  static constexpr unsigned int min_size = 2;
+
+  template <typename T> static unsigned int size(const T &obj) {
+    const arcp_pulseseq_t *seq = (obj .* ... .* Path);
+    return 2 + (seq==NULL ? 0 : 2*seq->length);
+  }
+  template <typename T> static signed int encode(uint8 *&p, const T &obj) {
+    const arcp_pulseseq_t *seq = (obj .* ... .* Path);
+    if (seq==NULL || seq->length>ARCP_MAX_PULSE_SEQ_LENGTH)
+      return ARCP_ERROR_BADMSG;
+    put<uint16>(p, seq->length);
+    p += 2;
+    for (uint16 i=0; i<seq->length; i++) {
+      *(p++) = seq->seq[i].slot;
+      *(p++) = seq->seq[i].flags;
+    }
+    return 0;
+  }
+  template <typename T> static signed int decode(const uint8 *&p,
+    const uint8 *end, T &obj) {
+    arcp_pulseseq_t *&seq = (obj .* ... .* Path);
+    uint16 len;
+    if (end-p < 2)
+      return ARCP_ERROR_BADMSG;
+    len = get<uint16>(p);
+    p += 2;
+    if (len>ARCP_MAX_PULSE_SEQ_LENGTH || end-p<2*len)
+      return ARCP_ERROR_BADMSG;
+    if ((seq = arcp_pulseseq_new(len)) == NULL)
+      return ARCP_ERROR_LOCAL;
+    for (uint16 i=0; i<len; i++) {
+      seq->seq[i].slot = *(p++);
+      seq->seq[i].flags = *(p++);
+    }
+    return 0;
+  }
+};
+
+/* A BSM phase table: a 16-bit entry count followed by (uint16 channel,
+ * float phase) entries.
+ */
+template <auto Count, auto Table> struct phase_table {
+  static constexpr bool fixed = false;
+  static constexpr unsigned int min_size = 2;
+
+  template <typename T> static unsigned int size(const T &obj) {
+    return 2 + 6*(obj.*Count);
+  }
+  template <typename T> static signed int encode(uint8 *&p, const T &obj) {
+    uint16 n = obj.*Count;
+    if (n > ARCP_BSM_MAX_N_PHASES)
+      return ARCP_ERROR_BADMSG;
+    put<uint16>(p, n);
+    p += 2;
+    for (uint16 i=0; i<n; i++, p+=6) {
+      put<uint16>(p, (obj.*Table)[i].channel);
+      put<float>(p+2, (obj.*Table)[i].phase);
+    }
+    return 0;
+  }
+  template <typename T> static signed int decode(const uint8 *&p,
+    const uint8 *end, T &obj) {
+    uint16 n;
+    if (end-p < 2)
+      return ARCP_ERROR_BADMSG;
+    n = get<uint16>(p);
+    p += 2;
+    if (n>ARCP_BSM_MAX_N_PHASES || end-p<6*n)
+      return ARCP_ERROR_BADMSG;
+    obj.*Count = n;
+    obj.*Table = (arcp_phase_entry_t *)malloc(sizeof(arcp_phase_entry_t)*n);
+    if (obj.*Table == NULL)
+      return ARCP_ERROR_LOCAL;
+    for (uint16 i=0; i<n; i++, p+=6) {
+      (obj.*Table)[i].channel = get<uint16>(p);
+      (obj.*Table)[i].phase = get<float>(p+2);
+    }
+    return 0;
+  }
+};
+
+/* The fields of an object owned through a pointer member (View.*Ptr, for
+ * example the arcp_sysid_t of a SYSID response).  New allocates the object
+ * when decoding.
+ */
+template <auto View, auto Ptr, auto New, typename... Fields> struct owned {
+  static constexpr bool fixed = (true && ... && Fields::fixed);
+  static constexpr unsigned int min_size = (0 + ... + Fields::min_size);
+
+  template <typename T> static unsigned int size(const T &obj) {
+    if (obj.*View.*Ptr == NULL)
+      return 0;
+    return (0 + ... + Fields::size(*(obj.*View.*Ptr)));
+  }
+  template <typename T> static signed int encode(uint8 *&p, const T &obj) {
+    signed int err = 0;
+    if (obj.*View.*Ptr == NULL)
+      return ARCP_ERROR_INTERNAL;
+    ((err = err!=0 ? err : Fields::encode(p, *(obj.*View.*Ptr))), ...);
+    return err;
+  }
+  template <typename T> static signed int decode(const uint8 *&p,
+    const uint8 *end, T &obj) {
+    signed int err = 0;
+    if ((obj.*View.*Ptr = New()) == NULL)
+      return ARCP_ERROR_LOCAL;
+    ((err = err!=0 ? err : Fields::decode(p, end, *(obj.*View.*Ptr))), ...);
+    return err;
+  }
+};
+
+/* One alternative of a select<> field: Fields are present when the
+ * discriminant equals Value.
+ */
+template <auto Value, typename... Fields> struct when {
+  static constexpr auto value = Value;
+  static constexpr bool fixed = (true && ... && Fields::fixed);
+  static constexpr unsigned int min_size = (0 + ... + Fields::min_size);
+
+  template <typename T> static unsigned int size(const T &obj) {
+    return (0 + ... + Fields::size(obj));
+  }
+  template <typename T> static signed int encode(uint8 *&p, const T &obj) {
+    signed int err = 0;
+    ((err = err!=0 ? err : Fields::encode(p, obj)), ...);
+    return err;
+  }
+  template <typename T> static signed int decode(const uint8 *&p,
+    const uint8 *end, T &obj) {
+    signed int err = 0;
+    ((err = err!=0 ? err : Fields::decode(p, end, obj)), ...);
+    return err;
+  }
+};
+
+/* Fields whose presence depends on an earlier field (Disc), such as the
+ * module-specific tail of a SYSID response.  If no alternative matches,
+ * nothing further is sent, as in the C library.
+ */
+template <auto Disc, typename... Cases> struct select {
+  static constexpr bool fixed = false;
+  static constexpr unsigned int min_size = 0;
+
+  template <typename T> static unsigned int size(const T &obj) {
+    unsigned int res = 0;
+    ((obj.*Disc==Cases::value ? (void)(res = Cases::size(obj)) : (void)0), ...);
+    return res;
+  }
+  template <typename T> static signed int encode(uint8 *&p, const T &obj) {
+    signed int err = 0;
+    ((obj.*Disc==Cases::value ? (void)(err = Cases::encode(p, obj)) : (void)0), ...);
+    return err;
+  }
+  template <typename T> static signed int decode(const uint8 *&p,
+    const uint8 *end, T &obj) {
+    signed int err = 0;
+    ((obj.*Disc==Cases::value ? (void)(err = Cases::decode(p, end, obj)) : (void)0), ...);
+    return err;
+  }
+};
+
+/* ======================================================================== */
+/* Message schemas.  Type is ARCP_MSG_COMMAND or ARCP_MSG_RESPONSE and Id
+ * the command or response ID.  For messages made up only of fixed fields,
+ * wire_size is the exact message size and size() is a constant.
+ */
+
+template <arcp_msgtype_t Type, int16 Id, typename... Fields> struct message {
+  static constexpr arcp_msgtype_t type = Type;
+  static constexpr int16 id = Id;
+  static constexpr uint16 prefix_size =
+    Type==ARCP_MSG_COMMAND ? cmd_prefix_size : resp_prefix_size;
+  static constexpr bool fixed = (true && ... && Fields::fixed);
+  static constexpr uint16 wire_size = prefix_size + (0 + ... + Fields::min_size);
+
+  static uint16 size(const arcp_msg_t &msg) {
+    if constexpr (fixed)
+      return wire_size;
+    else
+      return (uint16)(prefix_size + (0 + ... + Fields::size(msg)));
+  }
+
+  static signed int encode(const arcp_msg_t &msg, uint8 *buf, uint16 buf_size,
+    uint16 *enc_size) {
+    uint16 len = size(msg);
+    uint8 *p = buf;
+    signed int err = 0;
+
+    if (len>ARCP_MSG_MAX_SIZE || len>buf_size)
+      return ARCP_ERROR_BADMSG;
+    put<uint32>(p, msg.header.magic_num);
+    put<uint16>(p+4, len);
+    put<uint16>(p+6, msg.header.exchange_id);
+    put<uint8>(p+8, Type);
+    put<uint16>(p+9, msg.header.protocol_version);
+    put<int16>(p+11, Id);
+    p += cmd_prefix_size;
+    if constexpr (Type == ARCP_MSG_RESPONSE) {
+      put<int16>(p, msg.response.info_code);
+      p += 2;
+    }
+    ((err = err!=0 ? err : Fields::encode(p, msg)), ...);
+    if (err==0 && enc_size!=NULL)
+      *enc_size = len;
+    return err;
+  }
+
+  /* Decodes the fields following the prefix (which the caller has already
+   * read into msg).
+   */
+  static signed int decode_body(const uint8 *p, const uint8 *end,
+    arcp_msg_t &msg) {
+    signed int err = 0;
+    ((err = err!=0 ? err : Fields::decode(p, end, msg)), ...);
+    (void)p;
+    (void)end;
+    return err;
+  }
+};
+
+/* Shorthand for the path from arcp_msg_t to a member of one of its views */
+#define ARCP_CODEC_FIELD(_view, _vtype, _member) \
+  &arcp_msg_t::_view, &_vtype::_member
+
+using set_module_enable = message<ARCP_MSG_COMMAND, ARCP_CMD_SET_MODULE_ENABLE,
+  scalar<int8, ARCP_CODEC_FIELD(cmd_enable, arcp_msg_cmd_enable_t, enable)>>;
+
+using set_pulse_param = message<ARCP_MSG_COMMAND, ARCP_CMD_SET_PULSE_PARAM,
+  scalar<uint8, ARCP_CODEC_FIELD(cmd_set_pulse_param, arcp_msg_cmd_setpulse_t, pulse_map_index)>,
+  scalar<int8, ARCP_CODEC_FIELD(cmd_set_pulse_param, arcp_msg_cmd_setpulse_t, pulse_param),
+    &arcp_pulse_t::pulse_shape>,
+  scalar<uint16, ARCP_CODEC_FIELD(cmd_set_pulse_param, arcp_msg_cmd_setpulse_t, pulse_param),
+    &arcp_pulse_t::pulse_ampl>,
+  scalar<uint16, ARCP_CODEC_FIELD(cmd_set_pulse_param, arcp_msg_cmd_setpulse_t, pulse_param),
+    &arcp_pulse_t::pulse_options>,
+  scalar<uint32, ARCP_CODEC_FIELD(cmd_set_pulse_param, arcp_msg_cmd_setpulse_t, pulse_param),
+    &arcp_pulse_t::pulse_width_ns>,
+  pulse_code<ARCP_CODEC_FIELD(cmd_set_pulse_param, arcp_msg_cmd_setpulse_t, pulse_param),
+    &arcp_pulse_t::code>>;
+
+using set_pulse_seq = message<ARCP_MSG_COMMAND, ARCP_CMD_SET_PULSE_SEQ,
+  pulse_seq<ARCP_CODEC_FIELD(cmd_set_pulse_seq, arcp_msg_cmd_setseq_t, seq)>>;
+
+using set_pulse_seq_idx = message<ARCP_MSG_COMMAND, ARCP_CMD_SET_PULSE_SEQ_IDX,
+  scalar<uint16, ARCP_CODEC_FIELD(cmd_set_pulse_seq_idx, arcp_msg_cmd_setseq_idx_t, seq_index)>>;
+
+using set_trig_param = message<ARCP_MSG_COMMAND, ARCP_CMD_SET_TRIG_PARAM,
+  scalar<uint8, ARCP_CODEC_FIELD(cmd_set_trig_param, arcp_msg_cmd_settrig_t, trig_param),
+    &arcp_trigger_t::trigger_source>,
+  scalar<uint8, ARCP_CODEC_FIELD(cmd_set_trig_param, arcp_msg_cmd_settrig_t, trig_param),
+    &arcp_trigger_t::ext_trigger_options>,
+  scalar<uint16, ARCP_CODEC_FIELD(cmd_set_trig_param, arcp_msg_cmd_settrig_t, trig_param),
+    &arcp_trigger_t::int_trigger_freq>,
+  scalar<uint16, ARCP_CODEC_FIELD(cmd_set_trig_param, arcp_msg_cmd_settrig_t, trig_param),
+    &arcp_trigger_t::pulse_predelay>>;
+
+using set_usrctl_enable = message<ARCP_MSG_COMMAND, ARCP_CMD_SET_USRCTL_ENABLE,
+  scalar<int8, ARCP_CODEC_FIELD(cmd_usrctl_enable, arcp_msg_cmd_usrctl_enable_t, enable)>>;
+
+/* The phase table's count and pointer live in arcp_msg_cmd_set_phase_t, so
+ * the table is described relative to that view.
+ */
+struct set_phase_body {
+  using table = phase_table<&arcp_msg_cmd_set_phase_t::n_phases,
+                            &arcp_msg_cmd_set_phase_t::phases>;
+  static constexpr bool fixed = false;
+  static constexpr unsigned int min_size = 2 + table::min_size;
+
+  static unsigned int size(const arcp_msg_t &msg) {
+    return 2 + table::size(msg.cmd_set_phase);
+  }
+  static signed int encode(uint8 *&p, const arcp_msg_t &msg) {
+    if (msg.cmd_set_phase.n_phases > ARCP_BSM_MAX_N_PHASES)
+      return ARCP_ERROR_BADMSG;
+    put<uint16>(p, msg.cmd_set_phase.phase_slot);
+    p += 2;
+    return table::encode(p, msg.cmd_set_phase);
+  }
+  static signed int decode(const uint8 *&p, const uint8 *end, arcp_msg_t &msg) {
+    if (end-p < 2)
+      return ARCP_ERROR_BADMSG;
+    msg.cmd_set_phase.phase_slot = get<uint16>(p);
+    p += 2;
+    return table::decode(p, end, msg.cmd_set_phase);
+  }
+};
+
+using set_phase = message<ARCP_MSG_COMMAND, ARCP_CMD_SET_PHASE, set_phase_body>;
+
+using reset = message<ARCP_MSG_COMMAND, ARCP_CMD_RESET>;
+using ping = message<ARCP_MSG_COMMAND, ARCP_CMD_PING>;
+using get_sysid = message<ARCP_MSG_COMMAND, ARCP_CMD_GET_SYSID>;
+using get_sysstat = message<ARCP_MSG_COMMAND, ARCP_CMD_GET_SYSSTAT>;
+
+using ack = message<ARCP_MSG_RESPONSE, ARCP_RESP_ACK>;
+using nak = message<ARCP_MSG_RESPONSE, ARCP_RESP_NAK>;
+using unk = message<ARCP_MSG_RESPONSE, ARCP_RESP_UNK>;
+
+using sysid = message<ARCP_MSG_RESPONSE, ARCP_RESP_SYSID,
+  owned<&arcp_msg_t::resp_sysid, &arcp_msg_resp_sysid_t::sysid, arcp_sysid_new,
+    scalar<int8, &arcp_sysid_t::module_type>,
+    scalar<uint16, &arcp_sysid_t::module_version>,
+    scalar<uint16, &arcp_sysid_t::firmware_version>,
+    scalar<uint16, &arcp_sysid_t::ctrl_board_logic_version>,
+    select<&arcp_sysid_t::module_type,
+      when<(arcp_moduletype_t)ARCP_MODULE_STX2,
+        scalar<uint16, &arcp_sysid_t::data, &decltype(arcp_sysid_t::data)::stx2,
+          &decltype(arcp_sysid_t::data.stx2)::card_map>,
+        scalar<uint32, &arcp_sysid_t::data, &decltype(arcp_sysid_t::data)::stx2,
+          &decltype(arcp_sysid_t::data.stx2)::pulse_slot_length>>,
+      when<(arcp_moduletype_t)ARCP_MODULE_BSM,
+        scalar<uint16, &arcp_sysid_t::data, &decltype(arcp_sysid_t::data)::bsm,
+          &decltype(arcp_sysid_t::data.bsm)::channel_map>>>>>;
+
+#undef ARCP_CODEC_FIELD
+
+/* Fixed-size messages have their size known at compile time */
+static_assert(set_trig_param::fixed && set_trig_param::wire_size == 19, "SET_TRIG_PARAM size");
+static_assert(set_pulse_seq_idx::fixed && set_pulse_seq_idx::wire_size == 15, "SET_PULSE_SEQ_IDX size");
+static_assert(ack::wire_size == 15, "ACK size");
+
+/* ======================================================================== */
+/* Dispatch over the schemas above */
+
+template <typename... Schemas> struct schema_list {
+  /* Calls f with the schema matching the message type and ID and returns
+   * its result, or returns fallback if there is no matching schema.
+   */
+  template <typename F> static signed int visit(arcp_msgtype_t type, int16 id,
+    signed int fallback, F f) {
+    signed int res = fallback;
+    ((type==Schemas::type && id==Schemas::id ? (void)(res = f(Schemas())) : (void)0), ...);
+    return res;
+  }
+};
+
+using schemas = schema_list<set_module_enable, set_pulse_param, set_pulse_seq,
+  set_pulse_seq_idx, set_trig_param, set_usrctl_enable, set_phase, reset,
+  ping, get_sysid, get_sysstat, ack, nak, unk, sysid>;
+
+inline signed int unknown_id(arcp_msgtype_t type) {
+  if (type == ARCP_MSG_COMMAND)
+    return ARCP_ERROR_UNKNOWN_CMD;
+  return ARCP_ERROR_UNKNOWN_RESP;
+}
+
+inline int16 msg_id(const arcp_msg_t &msg) {
+  return msg.header.msg_type==ARCP_MSG_COMMAND ? msg.command.id : msg.response.id;
+}
+
+/* Returns the wire size of msg, or an ARCP_ERROR_* code if it has no
+ * schema.
+ */
+inline signed int size(const arcp_msg_t &msg) {
+  return schemas::visit(msg.header.msg_type, msg_id(msg), unknown_id(msg.header.msg_type),
+    [&](auto s) -> signed int { return decltype(s)::size(msg); });
+}
+
+/* Encodes msg into buf (buf_size bytes).  Returns 0 on success, storing the
+ * encoded length in *enc_size if enc_size is not NULL, or an ARCP_ERROR_*
+ * code on failure.
+ */
+inline signed int encode(const arcp_msg_t &msg, uint8 *buf, uint16 buf_size,
+  uint16 *enc_size) {
+  if (enc_size != NULL)
+    *enc_size = 0;
+  return schemas::visit(msg.header.msg_type, msg_id(msg), unknown_id(msg.header.msg_type),
+    [&](auto s) { return decltype(s)::encode(msg, buf, buf_size, enc_size); });
+}
+
+/* Decodes the message at the start of the len bytes in buf into a new
+ * arcp_msg_t returned in *dec_msg.  The message must carry the ARCP magic
+ * number and its msg_length must fit within len; bytes beyond msg_length
+ * are ignored.  Returns 0 on success or an ARCP_ERROR_* code on failure,
+ * in which case *dec_msg is NULL.
+ */
+inline signed int decode(const uint8 *buf, uint16 len, arcp_msg_t **dec_msg) {
+  arcp_msg_header_t hdr;
+  arcp_msg_t *msg;
+  const uint8 *p = buf, *end = buf+len;
+  signed int res;
+  int16 id;
+
+  if (dec_msg == NULL)
+    return ARCP_ERROR_INTERNAL;
+  *dec_msg = NULL;
+  if (len<header_size || len>ARCP_MSG_MAX_SIZE)
+    return ARCP_ERROR_BADMSG;
+
+  hdr.magic_num = get<uint32>(p);
+  hdr.msg_length = get<uint16>(p+4);
+  hdr.exchange_id = get<uint16>(p+6);
+  hdr.msg_type = get<uint8>(p+8);
+  hdr.protocol_version = get<uint16>(p+9);
+  p += header_size;
+  if (hdr.magic_num!=ARCP_MAGIC_NUMBER || hdr.msg_length<header_size ||
+      hdr.msg_length>len)
+    return ARCP_ERROR_BADMSG;
+  end = buf+hdr.msg_length;
+  if (hdr.msg_type!=ARCP_MSG_COMMAND && hdr.msg_type!=ARCP_MSG_RESPONSE)
+    return ARCP_ERROR_BADMSG;
+  if (end-p < (hdr.msg_type==ARCP_MSG_COMMAND ? 2 : 4))
+    return ARCP_ERROR_BADMSG;
+
+  if ((msg = arcp_msg_new(hdr.msg_type)) == NULL)
+    return ARCP_ERROR_LOCAL;
+  msg->header = hdr;
+  id = get<int16>(p);
+  p += 2;
+  if (hdr.msg_type == ARCP_MSG_COMMAND)
+    msg->command.id = id;
+  else {
+    msg->response.id = id;
+    msg->response.info_code = get<int16>(p);
+    p += 2;
+  }
+
+  res = schemas::visit(hdr.msg_type, id, unknown_id(hdr.msg_type),
+    [&](auto s) { return decltype(s)::decode_body(p, end, *msg); });
+  if (res < 0)
+    arcp_msg_free(msg);
+  else
+    *dec_msg = msg;
+  return res;
+}
+
+/* ======================================================================== */
+
+} /* namespace codec */
+} /* namespace arcp */
+
+#endif
@@ -0,0 +1,621 @@
+/*
+ * A C++20 coroutine interface to libarcp for Linux.  Control scripts can
+ * be written as straight-line code:
+ *
+ *   arcp::task<void> bring_up(arcp::connection &c) {
+ *     if (co_await c.connect("172.16.16.5") != 0)
+ *       co_return;
+ *     co_await arcp::set_module_enable(c, 1);
+ *     for (;;) {
+ *       auto st = co_await arcp::get_sysstat(c);
+ *       if (st.code==ARCP_RESP_ACK && st.status->module_status==...)
+ *         break;
+ *       co_await c.exec().sleep_for(500);
+ *     }
+ *     co_await arcp::set_phase(c, 0, phases, n_phases);
+ *   }
+ *
+ *   arcp::executor ex;
+ *   arcp::connection c(ex);
+ *   ex.spawn(bring_up(c));
+ *   ex.run();
+ *
+ * run() returns once every spawned task has completed; the connection is
+ * left open for later tasks and is closed by c.disconnect() or when it is
+ * destroyed.
+ *
+ * An executor multiplexes any number of connections, and any number of
+ * outstanding commands on each connection, over one epoll descriptor on
+ * the thread which calls run().  Larger installations run one executor per
+ * thread, each with its own connections.  Responses are matched to the
+ * waiting command by exchange ID, so several coroutines may share a
+ * connection.
+ *
+ * Commands are encoded and responses decoded by libarcp itself (see
+ * arcp_cmd_write() and arcp_msg_poll()), so link with arcp.o as usual.  A
+ * connection owns its arcp_handle_t; programs which previously kept a
+ * handle of their own (as set up by the PROB* pollers) use a connection
+ * instead.
+ */
+
+#ifndef _ARCP_CORO_H
+#define _ARCP_CORO_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <deque>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "arcp.h"
+
+namespace arcp {
+
+/* Default timeouts in milliseconds */
+constexpr uint32 connect_timeout_ms = 2000;
+constexpr uint32 cmd_timeout_ms = 1000;
+
+/* ======================================================================== */
+/* task<T>: a lazily started coroutine producing a T.  Awaiting a task
+ * starts it; the awaiting coroutine resumes when it completes.
+ */
+
+template <typename T> class task;
+
+namespace detail {
+
+struct final_awaiter {
+  bool await_ready() noexcept { return false; }
+  template <typename P>
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+    auto c = h.promise().continuation;
+    return c ? c : std::noop_coroutine();
+  }
+  void await_resume() noexcept { }
+};
+
+struct promise_base {
+  std::coroutine_handle<> continuation;
+  std::exception_ptr error;
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  final_awaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T> struct promise : promise_base {
+  T value{};
+  task<T> get_return_object();
+  void return_value(T v) { value = std::move(v); }
+  T result() {
+    if (error)
+      std::rethrow_exception(error);
+    return std::move(value);
+  }
+};
+
+template <> struct promise<void> : promise_base {
+  task<void> get_return_object();
+  void return_void() { }
+  void result() {
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+
+} /* namespace detail */
+
+template <typename T = void> class task {
+public:
+  using promise_type = detail::promise<T>;
+
+  explicit task(std::coroutine_handle<promise_type> h) : coro(h) { }
+  task(task &&t) noexcept : coro(std::exchange(t.coro, nullptr)) { }
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+  ~task() {
+    if (coro)
+      coro.destroy();
+  }
+
+  bool await_ready() const noexcept { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+    coro.promise().continuation = caller;
+    return coro;
+  }
+  T await_resume() { return coro.promise().result(); }
+
+private:
+  friend class executor;
+  std::coroutine_handle<promise_type> coro;
+};
+
+template <typename T> inline task<T> detail::promise<T>::get_return_object() {
+  return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+inline task<void> detail::promise<void>::get_return_object() {
+  return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+/* ======================================================================== */
+/* The executor: an epoll loop with timers and a queue of coroutines ready
+ * to run.  Not thread-safe; each executor belongs to the thread running
+ * it.
+ */
+
+class executor {
+public:
+  using clock = std::chrono::steady_clock;
+  using timer_id = std::multimap<clock::time_point, std::function<void()>>::iterator;
+
+  executor() : epfd(epoll_create1(EPOLL_CLOEXEC)) { }
+  executor(const executor &) = delete;
+  executor &operator=(const executor &) = delete;
+  ~executor() {
+    for (auto h : spawned)
+      h.destroy();
+    if (epfd >= 0)
+      close(epfd);
+  }
+
+  /* Starts t running under this executor.  It is destroyed once it
+   * completes, or with the executor if it never does.
+   */
+  void spawn(task<void> t) {
+    auto h = std::exchange(t.coro, nullptr);
+    spawned.push_back(h);
+    post(h);
+  }
+
+  /* Runs until every spawned task has completed.  Connections stay open
+   * (their idle watches don't keep run() going), so further tasks may be
+   * spawned on them and run() called again.  Returns false if epoll
+   * failed, or if tasks remain but none can ever be resumed.
+   */
+  bool run() {
+    epoll_event ev[64];
+    for (;;) {
+      while (!ready.empty()) {
+        auto h = ready.front();
+        ready.pop_front();
+        h.resume();
+      }
+      if (!reap())
+        break;
+      if (timers.empty() && watches.empty())
+        return false;
+
+      int wait = -1;
+      if (!timers.empty()) {
+        auto d = std::chrono::duration_cast<std::chrono::milliseconds>(
+          timers.begin()->first - clock::now()).count();
+        wait = d<0 ? 0 : (int)d;
+      }
+      int n = epoll_wait(epfd, ev, 64, wait);
+      if (n<0 && errno!=EINTR)
+        return false;
+      for (int i=0; i<n; i++) {
+        auto w = watches.find(ev[i].data.fd);
+        if (w != watches.end()) {
+          auto cb = w->second;
+          cb(ev[i].events);
+        }
+      }
+      auto now = clock::now();
+      while (!timers.empty() && timers.begin()->first<=now) {
+        auto cb = std::move(timers.begin()->second);
+        timers.erase(timers.begin());
+        cb();
+      }
+    }
+    return true;
+  }
+
+  void post(std::coroutine_handle<> h) { ready.push_back(h); }
+
+  timer_id add_timer(uint32 ms, std::function<void()> cb) {
+    return timers.emplace(clock::now()+std::chrono::milliseconds(ms),
+      std::move(cb));
+  }
+  void cancel_timer(timer_id id) { timers.erase(id); }
+
+  /* Calls cb with the epoll event mask whenever fd is ready for events */
+  bool watch(int fd, uint32 events, std::function<void(uint32)> cb) {
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    int op = watches.count(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(epfd, op, fd, &ev) < 0)
+      return false;
+    watches[fd] = std::move(cb);
+    return true;
+  }
+  void unwatch(int fd) {
+    if (watches.erase(fd))
+      epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+  }
+
+  /* co_await ex.sleep_for(ms) */
+  auto sleep_for(uint32 ms) {
+    struct awaiter {
+      executor &ex;
+      uint32 ms;
+      bool await_ready() const noexcept { return ms == 0; }
+      void await_suspend(std::coroutine_handle<> h) {
+        ex.add_timer(ms, [this, h] { ex.post(h); });
+      }
+      void await_resume() noexcept { }
+    };
+    return awaiter{*this, ms};
+  }
+
+private:
+  /* Destroys spawned tasks which have completed.  Returns true if any
+   * remain.
+   */
+  bool reap() {
+    size_t j = 0;
+    for (auto h : spawned) {
+      if (h.done())
+        h.destroy();
+      else
+        spawned[j++] = h;
+    }
+    spawned.resize(j);
+    return !spawned.empty();
+  }
+
+  int epfd;
+  std::deque<std::coroutine_handle<>> ready;
+  std::vector<std::coroutine_handle<>> spawned;
+  std::multimap<clock::time_point, std::function<void()>> timers;
+  std::unordered_map<int, std::function<void(uint32)>> watches;
+};
+
+/* ======================================================================== */
+/* A connection to one module.  Owns its arcp_handle_t and socket.  The
+ * connection must outlive any coroutine using it.
+ */
+
+class connection {
+public:
+  explicit connection(executor &ex) : ex(ex) { }
+  connection(const connection &) = delete;
+  connection &operator=(const connection &) = delete;
+  ~connection() { disconnect(ARCP_ERROR_CONN_DROPPED); }
+
+  executor &exec() { return ex; }
+  arcp_handle_t *handle() { return h; }
+  bool connected() const { return h != NULL; }
+
+  /* co_await c.connect(ip): returns 0 or an ARCP_ERROR_* code */
+  auto connect(const char *ip_addr, uint16 port = ARCP_TCP_PORT,
+    uint32 timeout_ms = connect_timeout_ms) {
+    struct awaiter {
+      connection &c;
+      const char *ip_addr;
+      uint16 port;
+      uint32 timeout_ms;
+      signed int res = 0;
+      int fd = -1;
+      executor::timer_id timer = {};
+
+      bool await_ready() {
+        struct sockaddr_in addr;
+        if (c.h != NULL) {
+          res = ARCP_ERROR_INTERNAL;
+          return true;
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_aton(ip_addr, &addr.sin_addr) == 0) {
+          res = ARCP_ERROR_INTERNAL;
+          return true;
+        }
+        fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+          res = ARCP_ERROR_LOCAL;
+          return true;
+        }
+        if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+          res = c.attach(fd);
+          return true;
+        }
+        if (errno != EINPROGRESS) {
+          close(fd);
+          res = ARCP_ERROR_CONN_DROPPED;
+          return true;
+        }
+        return false;
+      }
+      bool await_suspend(std::coroutine_handle<> h) {
+        if (!c.ex.watch(fd, EPOLLOUT, [this, h](uint32) {
+              int err = 0;
+              socklen_t len = sizeof(err);
+              c.ex.cancel_timer(timer);
+              c.ex.unwatch(fd);
+              if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len)<0 || err!=0) {
+                close(fd);
+                res = ARCP_ERROR_CONN_DROPPED;
+              } else
+                res = c.attach(fd);
+              c.ex.post(h);
+            })) {
+          close(fd);
+          res = ARCP_ERROR_LOCAL;
+          return false;
+        }
+        timer = c.ex.add_timer(timeout_ms, [this, h] {
+          c.ex.unwatch(fd);
+          close(fd);
+          res = ARCP_ERROR_CONN_TIMEOUT;
+          c.ex.post(h);
+        });
+        return true;
+      }
+      signed int await_resume() const noexcept { return res; }
+    };
+    return awaiter{*this, ip_addr, port, timeout_ms};
+  }
+
+  /* Closes the connection.  Commands still awaiting a response complete
+   * with the given error.
+   */
+  void disconnect(signed int err = ARCP_ERROR_CONN_DROPPED) {
+    if (h == NULL)
+      return;
+    ex.unwatch(h->fd);
+    close(h->fd);
+    arcp_handle_free(h);
+    h = NULL;
+    auto p = std::move(pending);
+    pending.clear();
+    for (auto &e : p) {
+      ex.cancel_timer(e.second->timer);
+      e.second->res = err;
+      ex.post(e.second->coro);
+    }
+  }
+
+  /* co_await c.exec_cmd(cmd): sends the command and waits for the matching
+   * response.  Returns 0 with the response (to be freed with arcp_msg_free())
+   * in *resp, or an ARCP_ERROR_* code.  cmd is not freed.
+   */
+  auto exec_cmd(arcp_msg_t *cmd, arcp_msg_t **resp,
+    uint32 timeout_ms = cmd_timeout_ms) {
+    struct awaiter : waiter {
+      connection &c;
+      arcp_msg_t *cmd, **resp_ret;
+      uint32 timeout_ms;
+
+      awaiter(connection &c, arcp_msg_t *cmd, arcp_msg_t **resp_ret,
+        uint32 timeout_ms) : c(c), cmd(cmd), resp_ret(resp_ret),
+        timeout_ms(timeout_ms) { }
+      bool await_ready() {
+        *resp_ret = NULL;
+        if (c.h == NULL)
+          res = ARCP_ERROR_CONN_DROPPED;
+        else
+          res = arcp_cmd_write(c.h, cmd);
+        return res != 0;
+      }
+      void await_suspend(std::coroutine_handle<> h) {
+        uint16 xid = cmd->header.exchange_id;
+        coro = h;
+        c.pending[xid] = this;
+        timer = c.ex.add_timer(timeout_ms, [this, xid] {
+          c.pending.erase(xid);
+          res = ARCP_ERROR_CONN_TIMEOUT;
+          c.ex.post(coro);
+        });
+      }
+      signed int await_resume() {
+        if (res == 0)
+          res = arcp_check_resp_msg(cmd, resp);
+        if (res == 0)
+          *resp_ret = resp;
+        else
+          arcp_msg_free(resp);
+        return res;
+      }
+    };
+    return awaiter(*this, cmd, resp, timeout_ms);
+  }
+
+private:
+  /* A command awaiting its response */
+  struct waiter {
+    std::coroutine_handle<> coro;
+    executor::timer_id timer;
+    arcp_msg_t *resp = NULL;
+    signed int res = 0;
+  };
+
+  signed int attach(int fd) {
+    h = arcp_handle_new(fd);
+    if (h == NULL) {
+      close(fd);
+      return ARCP_ERROR_LOCAL;
+    }
+    /* The socket is non-blocking; commands are small so sends normally
+     * complete at once, and the send timeout covers a full buffer.
+     */
+    arcp_handle_set_timeouts(h, 0, cmd_timeout_ms, 0);
+    if (!ex.watch(fd, EPOLLIN, [this](uint32) { readable(); })) {
+      arcp_handle_free(h);
+      h = NULL;
+      close(fd);
+      return ARCP_ERROR_LOCAL;
+    }
+    return 0;
+  }
+
+  void readable() {
+    arcp_msg_t *msg;
+    signed int res;
+    while (h != NULL) {
+      res = arcp_msg_poll(h, &msg);
+      if (res == ARCP_ERROR_CONN_TIMEOUT)
+        return;
+      if (res == ARCP_ERROR_BADMSG)
+        continue;
+      if (res != 0) {
+        disconnect(res);
+        return;
+      }
+      /* Hand the response to the command awaiting it; anything else (such
+       * as a late response to a command which timed out) is dropped.
+       */
+      auto w = pending.find(msg->header.exchange_id);
+      if (w == pending.end()) {
+        arcp_msg_free(msg);
+        continue;
+      }
+      waiter *wt = w->second;
+      pending.erase(w);
+      ex.cancel_timer(wt->timer);
+      wt->resp = msg;
+      ex.post(wt->coro);
+    }
+  }
+
+  executor &ex;
+  arcp_handle_t *h = NULL;
+  std::unordered_map<uint16, waiter *> pending;
+};
+
+/* ======================================================================== */
+/* Awaitable forms of the libarcp command functions.  Return values are as
+ * for the corresponding C functions.
+ */
+
+namespace detail {
+
+struct msg_deleter {
+  void operator()(arcp_msg_t *m) const { arcp_msg_free(m); }
+};
+using msg_ptr = std::unique_ptr<arcp_msg_t, msg_deleter>;
+
+inline msg_ptr new_cmd(arcp_cmd_id_t id) {
+  msg_ptr m(arcp_msg_new(ARCP_MSG_COMMAND));
+  if (m)
+    m->command.id = id;
+  return m;
+}
+
+} /* namespace detail */
+
+struct sysstat_deleter {
+  void operator()(arcp_sysstat_t *s) const { arcp_sysstat_free(s); }
+};
+
+/* Result of get_sysstat(): status is set when code is ARCP_RESP_ACK */
+struct sysstat_result {
+  signed int code = ARCP_ERROR_INTERNAL;
+  std::unique_ptr<arcp_sysstat_t, sysstat_deleter> status;
+};
+
+inline task<signed int> ping(connection &c) {
+  arcp_msg_t *resp;
+  auto cmd = detail::new_cmd(ARCP_CMD_PING);
+  if (!cmd)
+    co_return ARCP_ERROR_LOCAL;
+  signed int res = co_await c.exec_cmd(cmd.get(), &resp);
+  if (res == 0) {
+    if (resp->response.id != ARCP_RESP_ACK)
+      res = ARCP_ERROR_BAD_RESPONSE;
+    arcp_msg_free(resp);
+  }
+  co_return res;
+}
+
+inline task<sysstat_result> get_sysstat(connection &c) {
+  sysstat_result r;
+  arcp_msg_t *resp;
+  auto cmd = detail::new_cmd(ARCP_CMD_GET_SYSSTAT);
+  if (!cmd) {
+    r.code = ARCP_ERROR_LOCAL;
+    co_return r;
+  }
+  r.code = co_await c.exec_cmd(cmd.get(), &resp);
+  if (r.code == 0) {
+    if (resp->response.id == ARCP_RESP_SYSSTAT) {
+      r.status.reset(resp->resp_sysstat.sysstat);
+      resp->resp_sysstat.sysstat = NULL;
+      r.code = ARCP_RESP_ACK;
+    } else
+    if (resp->response.id!=ARCP_RESP_NAK && resp->response.id!=ARCP_RESP_UNK)
+      r.code = ARCP_ERROR_BAD_RESPONSE;
+    else
+      r.code = resp->response.id;
+    arcp_msg_free(resp);
+  }
+  co_return r;
+}
+
+inline task<signed int> set_module_enable(connection &c, uint8 enable) {
+  arcp_msg_t *resp = NULL;
+  auto cmd = detail::new_cmd(ARCP_CMD_SET_MODULE_ENABLE);
+  if (!cmd)
+    co_return ARCP_ERROR_LOCAL;
+  cmd->cmd_enable.enable = enable;
+  signed int res = co_await c.exec_cmd(cmd.get(), &resp);
+  if (res == 0)
+    res = arcp_set_resp_result(resp);
+  /* All ARCP nodes know this command, so UNK is not a valid answer */
+  if (res == ARCP_RESP_UNK)
+    res = ARCP_ERROR_BAD_RESPONSE;
+  arcp_msg_free(resp);
+  co_return res;
+}
+
+inline task<signed int> set_trigparam(connection &c, const arcp_trigger_t &param) {
+  arcp_msg_t *resp = NULL;
+  auto cmd = detail::new_cmd(ARCP_CMD_SET_TRIG_PARAM);
+  if (!cmd)
+    co_return ARCP_ERROR_LOCAL;
+  cmd->cmd_set_trig_param.trig_param = param;
+  signed int res = co_await c.exec_cmd(cmd.get(), &resp);
+  if (res == 0)
+    res = arcp_set_resp_result(resp);
+  arcp_msg_free(resp);
+  co_return res;
+}
+
+/* phases is referenced, not copied, and must remain valid until the
+ * returned task completes.
+ */
+inline task<signed int> set_phase(connection &c, uint16 phase_slot,
+  arcp_phase_entry_t *phases, uint16 n_phases) {
+  arcp_msg_t *resp = NULL;
+  if (!c.connected())
+    co_return ARCP_ERROR_CONN_DROPPED;
+  if (c.handle()->connection_arcp_version < ARCP_VERSION_1_1)
+    co_return ARCP_RESP_UNK;
+  auto cmd = detail::new_cmd(ARCP_CMD_SET_PHASE);
+  if (!cmd)
+    co_return ARCP_ERROR_LOCAL;
+  cmd->cmd_set_phase.phase_slot = phase_slot;
+  cmd->cmd_set_phase.n_phases = n_phases;
+  cmd->cmd_set_phase.phases = phases;
+  signed int res = co_await c.exec_cmd(cmd.get(), &resp);
+  if (res == 0)
+    res = arcp_set_resp_result(resp);
+  cmd->cmd_set_phase.phases = NULL;
+  arcp_msg_free(resp);
+  co_return res;
+}
+
+/* ======================================================================== */
+
+} /* namespace arcp */
+
+#endif
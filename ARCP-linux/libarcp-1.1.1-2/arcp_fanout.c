@@ -0,0 +1,259 @@
+/*
+ * Parallel application of pulse parameters, pulse sequence and trigger
+ * parameters to many modules, typically every STX2 of an array when
+ * changing experiment mode.
+ *
+ * The modules are shared between a pool of worker threads.  Each worker
+ * starts with an equal, contiguous share of the module list and when that
+ * runs out steals modules from the end of the other workers' shares, so
+ * slow or unreachable modules don't leave threads idle while work remains.
+ * For each module a worker connects, sends the whole configuration as one
+ * pipelined batch with arcp_exec_cmds() (one round trip rather than one per
+ * command) and disconnects.
+ *
+ * This module uses POSIX threads; link with -lpthread.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "arcp_fanout.h"
+
+/* ======================================================================== */
+
+/* One worker's share of the modules: indices [head, tail) */
+typedef struct fanout_queue_t {
+  pthread_mutex_t lock;
+  unsigned int head, tail;
+} fanout_queue_t;
+
+typedef struct fanout_job_t {
+  const arcp_fanout_config_t *cfg;
+  const char * const *ip_addrs;
+  uint16 port;
+  arcp_fanout_result_t *results;
+  fanout_queue_t *queues;
+  unsigned int n_queues;
+} fanout_job_t;
+
+typedef struct fanout_worker_t {
+  fanout_job_t *job;
+  unsigned int id;
+} fanout_worker_t;
+
+/* ======================================================================== */
+
+static signed int fanout_module(const arcp_fanout_config_t *cfg,
+  const char *ip_addr, uint16 port) {
+/*
+ * Internal function: applies the configuration to a single module and
+ * returns the result (see arcp_fanout_result_t).
+ */
+arcp_handle_t *handle;
+arcp_msg_t *cmds[256+2], *resps[256+2];
+unsigned int i, n = 0;
+signed int res;
+
+  handle = arcp_handle_new(ARCP_INVALID_SOCKET);
+  if (handle == NULL)
+    return ARCP_ERROR_LOCAL;
+  arcp_handle_set_timeouts(handle,
+    cfg->connect_timeout_ms!=0?cfg->connect_timeout_ms:ARCP_FANOUT_CONNECT_TIMEOUT,
+    cfg->io_timeout_ms!=0?cfg->io_timeout_ms:ARCP_FANOUT_IO_TIMEOUT,
+    cfg->io_timeout_ms!=0?cfg->io_timeout_ms:ARCP_FANOUT_IO_TIMEOUT);
+
+  /* Build the command batch.  Each module gets its own messages since
+   * exchange IDs are written into them as they are sent.  The caller's
+   * pulse codes and sequence are referenced, not copied.
+   */
+  res = 0;
+  for (i=0; i<cfg->n_pulse_params && res==0; i++) {
+    cmds[n] = arcp_msg_new(ARCP_MSG_COMMAND);
+    if (cmds[n]==NULL || arcp_msg_set_cmd_id(cmds[n], ARCP_CMD_SET_PULSE_PARAM)<0)
+      res = ARCP_ERROR_LOCAL;
+    else {
+      cmds[n]->cmd_set_pulse_param.pulse_map_index = (uint8)i;
+      cmds[n]->cmd_set_pulse_param.pulse_param = cfg->pulse_params[i];
+    }
+    if (cmds[n] != NULL)
+      n++;
+  }
+  if (cfg->pulse_seq!=NULL && res==0) {
+    cmds[n] = arcp_msg_new(ARCP_MSG_COMMAND);
+    if (cmds[n]==NULL || arcp_msg_set_cmd_id(cmds[n], ARCP_CMD_SET_PULSE_SEQ)<0)
+      res = ARCP_ERROR_LOCAL;
+    else
+      cmds[n]->cmd_set_pulse_seq.seq = cfg->pulse_seq;
+    if (cmds[n] != NULL)
+      n++;
+  }
+  if (cfg->trig_param!=NULL && res==0) {
+    cmds[n] = arcp_msg_new(ARCP_MSG_COMMAND);
+    if (cmds[n]==NULL || arcp_msg_set_cmd_id(cmds[n], ARCP_CMD_SET_TRIG_PARAM)<0)
+      res = ARCP_ERROR_LOCAL;
+    else
+      cmds[n]->cmd_set_trig_param.trig_param = *cfg->trig_param;
+    if (cmds[n] != NULL)
+      n++;
+  }
+
+  if (res == 0)
+    res = arcp_handle_connect(handle, ip_addr, port);
+  if (res==0 && n!=0) {
+    res = arcp_exec_cmds(handle, cmds, resps, n);
+    /* Report the first command which wasn't accepted */
+    for (i=0; i<n; i++) {
+      if (resps[i] == NULL)
+        continue;
+      if (res == 0)
+        res = arcp_set_resp_result(resps[i]);
+      arcp_msg_free(resps[i]);
+    }
+  }
+
+  for (i=0; i<n; i++) {
+    /* The pulse codes and sequence belong to the caller */
+    if (cmds[i]->command.id == ARCP_CMD_SET_PULSE_PARAM)
+      cmds[i]->cmd_set_pulse_param.pulse_param.code = NULL;
+    else
+    if (cmds[i]->command.id == ARCP_CMD_SET_PULSE_SEQ)
+      cmds[i]->cmd_set_pulse_seq.seq = NULL;
+    arcp_msg_free(cmds[i]);
+  }
+  arcp_handle_disconnect(handle);
+  arcp_handle_free(handle);
+  return res;
+}
+/* ======================================================================== */
+
+static signed int fanout_take(fanout_job_t *job, unsigned int id) {
+/*
+ * Internal function: returns the next module for worker id to process -
+ * from the front of its own share, or failing that stolen from the back
+ * of another worker's - or -1 once no work remains.
+ */
+fanout_queue_t *q;
+unsigned int i;
+signed int idx = -1;
+
+  q = &job->queues[id];
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail)
+    idx = (signed int)q->head++;
+  pthread_mutex_unlock(&q->lock);
+
+  for (i=1; i<job->n_queues && idx<0; i++) {
+    q = &job->queues[(id+i)%job->n_queues];
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+      idx = (signed int)--q->tail;
+    pthread_mutex_unlock(&q->lock);
+  }
+  return idx;
+}
+/* ======================================================================== */
+
+static void *fanout_worker(void *arg) {
+/*
+ * Internal function: worker thread body.
+ */
+fanout_worker_t *w = arg;
+fanout_job_t *job = w->job;
+signed int idx;
+uint32 start;
+
+  while ((idx = fanout_take(job, w->id)) >= 0) {
+    start = arcp_clock_ms();
+    job->results[idx].result = fanout_module(job->cfg, job->ip_addrs[idx],
+      job->port);
+    job->results[idx].elapsed_ms = arcp_clock_ms()-start;
+  }
+  return NULL;
+}
+/* ======================================================================== */
+
+signed int arcp_fanout_apply(const arcp_fanout_config_t *cfg,
+  const char * const *ip_addrs, unsigned int n_modules, uint16 port,
+  unsigned int n_threads, arcp_fanout_result_t *results, uint32 *total_ms) {
+/*
+ * Applies the configuration cfg to the n_modules modules whose dotted-quad
+ * IP addresses are given in ip_addrs, connecting to each on the given port
+ * (normally ARCP_TCP_PORT).  Up to n_threads modules (0 selects
+ * ARCP_FANOUT_THREADS) are configured at once.  results[i] receives the
+ * outcome for ip_addrs[i].  If total_ms is not NULL it receives the
+ * wall-clock time taken for the whole operation.
+ *
+ * Returns the number of modules which did not accept the complete
+ * configuration (0 if all did), or an ARCP_ERROR_* code if the operation
+ * could not be carried out at all.
+ */
+fanout_job_t job;
+fanout_worker_t *workers;
+pthread_t *threads;
+unsigned int i, started;
+uint32 start;
+signed int failed;
+
+  if (cfg==NULL || ip_addrs==NULL || results==NULL ||
+      (cfg->n_pulse_params!=0 && cfg->pulse_params==NULL))
+    return ARCP_ERROR_INTERNAL;
+  start = arcp_clock_ms();
+
+  if (n_threads == 0)
+    n_threads = ARCP_FANOUT_THREADS;
+  if (n_threads > n_modules)
+    n_threads = n_modules;
+
+  job.cfg = cfg;
+  job.ip_addrs = ip_addrs;
+  job.port = port;
+  job.results = results;
+  job.n_queues = n_threads;
+  job.queues = calloc(n_threads+1, sizeof(fanout_queue_t));
+  workers = calloc(n_threads+1, sizeof(fanout_worker_t));
+  threads = calloc(n_threads+1, sizeof(pthread_t));
+  if (job.queues==NULL || workers==NULL || threads==NULL) {
+    free(job.queues);
+    free(workers);
+    free(threads);
+    return ARCP_ERROR_LOCAL;
+  }
+
+  /* Deal the modules out in contiguous shares */
+  for (i=0; i<n_threads; i++) {
+    pthread_mutex_init(&job.queues[i].lock, NULL);
+    job.queues[i].head = (unsigned int)((unsigned long)n_modules*i/n_threads);
+    job.queues[i].tail = (unsigned int)((unsigned long)n_modules*(i+1)/n_threads);
+    workers[i].job = &job;
+    workers[i].id = i;
+  }
+
+  /* Should a thread fail to start its share is stolen by the others; if
+   * none start at all the work is done on this thread.
+   */
+  for (started=0; started<n_threads; started++) {
+    if (pthread_create(&threads[started], NULL, fanout_worker,
+          &workers[started]) != 0)
+      break;
+  }
+  if (started == 0 && n_threads != 0)
+    fanout_worker(&workers[0]);
+  for (i=0; i<started; i++)
+    pthread_join(threads[i], NULL);
+
+  for (i=0; i<n_threads; i++)
+    pthread_mutex_destroy(&job.queues[i].lock);
+  free(job.queues);
+  free(workers);
+  free(threads);
+
+  failed = 0;
+  for (i=0; i<n_modules; i++) {
+    if (results[i].result != ARCP_RESP_ACK)
+      failed++;
+  }
+  if (total_ms != NULL)
+    *total_ms = arcp_clock_ms()-start;
+  return failed;
+}
+/* ======================================================================== */
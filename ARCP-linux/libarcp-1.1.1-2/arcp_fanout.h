@@ -0,0 +1,53 @@
+/*
+ * Parallel application of a transmitter configuration to many modules.
+ * See arcp_fanout.c for details.
+ */
+
+#ifndef _ARCP_FANOUT_H
+#define _ARCP_FANOUT_H
+
+#include "arcp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ======================================================================== */
+
+/* Default number of worker threads and per-module timeouts (milliseconds) */
+#define ARCP_FANOUT_THREADS            8
+#define ARCP_FANOUT_CONNECT_TIMEOUT    2000
+#define ARCP_FANOUT_IO_TIMEOUT         2000
+
+/* The configuration applied to every module.  Parts which are NULL (or
+ * have no entries) are left unchanged on the modules.  Zero timeouts
+ * select the defaults above.
+ */
+typedef struct arcp_fanout_config_t {
+  arcp_pulse_t *pulse_params;   /* Written to pulse slots 0..n_pulse_params-1 */
+  uint8 n_pulse_params;
+  arcp_pulseseq_t *pulse_seq;
+  arcp_trigger_t *trig_param;
+  uint32 connect_timeout_ms, io_timeout_ms;
+} arcp_fanout_config_t;
+
+/* Outcome for one module: result is ARCP_RESP_ACK (0) if every command was
+ * accepted, otherwise the first failure - ARCP_RESP_UNK, the error code
+ * carried by a NAK, or an ARCP_ERROR_* code.
+ */
+typedef struct arcp_fanout_result_t {
+  signed int result;
+  uint32 elapsed_ms;
+} arcp_fanout_result_t;
+
+signed int arcp_fanout_apply(const arcp_fanout_config_t *cfg,
+  const char * const *ip_addrs, unsigned int n_modules, uint16 port,
+  unsigned int n_threads, arcp_fanout_result_t *results, uint32 *total_ms);
+
+/* ======================================================================== */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,439 @@
+/*
+ * An event-driven system status poller for ARCP masters.  A single thread
+ * samples the status of any number of modules (typically the STX2 and BSM
+ * modules of a radar array, addressed as ARCP_RN_BASE | module address),
+ * each on its own schedule.  Each module has one persistent connection
+ * which is serviced through non-blocking sockets and epoll, so slow or
+ * unreachable modules never hold up the others and no thread per module is
+ * required.
+ *
+ * Typical use:
+ *   p = arcp_poller_new();
+ *   arcp_poller_add(p, ARCP_RN_BASE|0x0101, ARCP_TCP_PORT, 5000, cb, NULL);
+ *   ...
+ *   for (;;)
+ *     arcp_poller_run_once(p, 1000);
+ *
+ * Connections are opened when a module's first sample falls due and are
+ * kept open between samples.  If a sample fails the connection is closed
+ * and reopened for the next sample.
+ *
+ * This module relies on epoll and is therefore only available under Linux.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include "arcp_poller.h"
+
+/* ======================================================================== */
+
+/* Module states */
+#define POLL_IDLE          0      /* Waiting for the next sample to fall due */
+#define POLL_CONNECTING    1      /* Non-blocking connect in progress */
+#define POLL_WAIT_RESP     2      /* SYSSTAT command sent */
+
+/* Maximum number of events collected per epoll_wait() call */
+#define POLL_MAX_EVENTS    64
+
+typedef struct poll_module_t {
+  uint32 ip_addr;
+  uint16 port;
+  uint32 period_ms;
+  arcp_poller_cb_t callback;
+  void *user_data;
+  /* The connection: fd is valid from the start of connect(), handle once
+   * the connection has been established.
+   */
+  arcp_socket_t fd;
+  arcp_handle_t *handle;
+  arcp_msg_t *cmd;
+  uint8 state;
+  /* Clock values at which the current sample started and at which the
+   * module next needs attention (the next sample in POLL_IDLE, the timeout
+   * otherwise).
+   */
+  uint32 started, due;
+} poll_module_t;
+
+struct arcp_poller_t {
+  int epfd;
+  poll_module_t *modules;
+  unsigned int n_modules, max_modules;
+  uint32 connect_timeout_ms, resp_timeout_ms;
+};
+
+/* ======================================================================== */
+
+static int epoll_set(arcp_poller_t *poller, int op, unsigned int idx,
+  uint32 events) {
+/*
+ * Internal function: adds module idx's socket to the poller's epoll set or
+ * changes the events waited for.
+ */
+struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.u32 = idx;
+  return epoll_ctl(poller->epfd, op, poller->modules[idx].fd, &ev);
+}
+/* ======================================================================== */
+
+static void module_close(arcp_poller_t *poller, poll_module_t *m) {
+/*
+ * Internal function: closes the given module's connection, if any.
+ */
+  if (m->fd != ARCP_INVALID_SOCKET) {
+    epoll_ctl(poller->epfd, EPOLL_CTL_DEL, m->fd, NULL);
+    arcp_socket_close(m->fd);
+    m->fd = ARCP_INVALID_SOCKET;
+  }
+  if (m->handle != NULL) {
+    arcp_handle_free(m->handle);
+    m->handle = NULL;
+  }
+}
+/* ======================================================================== */
+
+static void module_finish(arcp_poller_t *poller, unsigned int idx,
+  signed int result, arcp_msg_t *resp) {
+/*
+ * Internal function: ends the current sample of module idx with the given
+ * result, reports it to the module's callback and schedules the next
+ * sample.  A failed sample also closes the connection.  resp is freed.
+ */
+poll_module_t *m = &poller->modules[idx];
+uint32 now;
+
+  if (result != 0)
+    module_close(poller, m);
+  m->state = POLL_IDLE;
+
+  /* Keep to the module's schedule unless the sample overran it */
+  now = arcp_clock_ms();
+  m->due = m->started + m->period_ms;
+  if ((int32)(m->due-now) < 0)
+    m->due = now;
+
+  if (m->callback != NULL)
+    m->callback(poller, idx, m->ip_addr, result, result==0?resp:NULL,
+      m->user_data);
+  arcp_msg_free(resp);
+}
+/* ======================================================================== */
+
+static void module_send(arcp_poller_t *poller, unsigned int idx) {
+/*
+ * Internal function: sends the SYSSTAT command on module idx's
+ * established connection.
+ */
+poll_module_t *m = &poller->modules[idx];
+signed int res;
+
+  res = arcp_cmd_write(m->handle, m->cmd);
+  if (res != 0) {
+    module_finish(poller, idx, res, NULL);
+    return;
+  }
+  m->state = POLL_WAIT_RESP;
+  m->due = arcp_clock_ms() + poller->resp_timeout_ms;
+}
+/* ======================================================================== */
+
+static void module_connected(arcp_poller_t *poller, unsigned int idx) {
+/*
+ * Internal function: called when module idx's non-blocking connect has
+ * completed.  Sets up the handle and sends the first command.
+ */
+poll_module_t *m = &poller->modules[idx];
+int so_err = 0;
+socklen_t so_len = sizeof(so_err);
+
+  if (getsockopt(m->fd, SOL_SOCKET, SO_ERROR, &so_err, &so_len)<0 ||
+      so_err!=0) {
+    module_finish(poller, idx, ARCP_ERROR_CONN_DROPPED, NULL);
+    return;
+  }
+  m->handle = arcp_handle_new(m->fd);
+  if (m->handle == NULL) {
+    module_finish(poller, idx, ARCP_ERROR_LOCAL, NULL);
+    return;
+  }
+  /* The socket stays non-blocking.  Commands are small so a send normally
+   * completes at once; the send timeout covers a full socket buffer.
+   */
+  arcp_handle_set_timeouts(m->handle, 0, poller->resp_timeout_ms, 0);
+  epoll_set(poller, EPOLL_CTL_MOD, idx, EPOLLIN);
+  module_send(poller, idx);
+}
+/* ======================================================================== */
+
+static void module_start(arcp_poller_t *poller, unsigned int idx) {
+/*
+ * Internal function: starts a sample of module idx, connecting first if
+ * necessary.
+ */
+poll_module_t *m = &poller->modules[idx];
+struct sockaddr_in addr;
+int fl;
+
+  m->started = arcp_clock_ms();
+  if (m->handle != NULL) {
+    module_send(poller, idx);
+    return;
+  }
+
+  m->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (m->fd == ARCP_INVALID_SOCKET) {
+    module_finish(poller, idx, ARCP_ERROR_LOCAL, NULL);
+    return;
+  }
+  fl = fcntl(m->fd, F_GETFL, 0);
+  fcntl(m->fd, F_SETFL, fl|O_NONBLOCK);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(m->port);
+  addr.sin_addr.s_addr = htonl(m->ip_addr);
+
+  if (epoll_set(poller, EPOLL_CTL_ADD, idx, EPOLLOUT) < 0) {
+    module_finish(poller, idx, ARCP_ERROR_LOCAL, NULL);
+    return;
+  }
+  if (connect(m->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    module_connected(poller, idx);
+    return;
+  }
+  if (errno!=EINPROGRESS && errno!=EINTR) {
+    module_finish(poller, idx, ARCP_ERROR_CONN_DROPPED, NULL);
+    return;
+  }
+  m->state = POLL_CONNECTING;
+  m->due = m->started + poller->connect_timeout_ms;
+}
+/* ======================================================================== */
+
+static void module_readable(arcp_poller_t *poller, unsigned int idx) {
+/*
+ * Internal function: collects whatever has arrived on module idx's
+ * connection.  Responses to earlier, abandoned exchanges are discarded.
+ */
+poll_module_t *m = &poller->modules[idx];
+arcp_msg_t *resp;
+signed int res;
+
+  for (;;) {
+    res = arcp_msg_poll(m->handle, &resp);
+    if (res == ARCP_ERROR_CONN_TIMEOUT)
+      return;
+    if (res == ARCP_ERROR_BADMSG)
+      continue;
+    if (res != 0) {
+      /* A connection dropped between samples is silently reopened at the
+       * next sample.
+       */
+      if (m->state == POLL_WAIT_RESP)
+        module_finish(poller, idx, res, NULL);
+      else
+        module_close(poller, m);
+      return;
+    }
+    if (m->state != POLL_WAIT_RESP) {
+      arcp_msg_free(resp);
+      continue;
+    }
+
+    res = arcp_check_resp_msg(m->cmd, resp);
+    if (res == ARCP_ERROR_SEQUENCE) {
+      arcp_msg_free(resp);
+      continue;
+    }
+    if (res == 0) {
+      if (resp->response.id==ARCP_RESP_NAK || resp->response.id==ARCP_RESP_UNK)
+        res = resp->response.id;
+      else
+      if (resp->response.id != ARCP_RESP_SYSSTAT)
+        res = ARCP_ERROR_BAD_RESPONSE;
+    }
+    if (res != 0) {
+      arcp_msg_free(resp);
+      resp = NULL;
+    }
+    module_finish(poller, idx, res, resp);
+    return;
+  }
+}
+/* ======================================================================== */
+
+arcp_poller_t *arcp_poller_new(void) {
+/*
+ * Creates a new, empty poller.  Returns the poller or NULL on error.
+ */
+arcp_poller_t *p = calloc(1, sizeof(arcp_poller_t));
+
+  if (p == NULL)
+    return NULL;
+  p->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (p->epfd < 0) {
+    free(p);
+    return NULL;
+  }
+  p->connect_timeout_ms = ARCP_POLLER_CONNECT_TIMEOUT;
+  p->resp_timeout_ms = ARCP_POLLER_RESP_TIMEOUT;
+  return p;
+}
+/* ======================================================================== */
+
+void arcp_poller_free(arcp_poller_t *poller) {
+/*
+ * Closes all the poller's connections and frees it.
+ */
+unsigned int i;
+
+  if (poller == NULL)
+    return;
+  for (i=0; i<poller->n_modules; i++) {
+    module_close(poller, &poller->modules[i]);
+    arcp_msg_free(poller->modules[i].cmd);
+  }
+  free(poller->modules);
+  close(poller->epfd);
+  free(poller);
+}
+/* ======================================================================== */
+
+signed int arcp_poller_set_timeouts(arcp_poller_t *poller, uint32 connect_ms,
+  uint32 resp_ms) {
+/*
+ * Sets the connect timeout and the time allowed for a module to answer a
+ * SYSSTAT command, both in milliseconds.  Neither may be 0.  The new
+ * values apply from the next connection or sample.  Returns 0 on success
+ * or ARCP_ERROR_INTERNAL on invalid arguments.
+ */
+  if (poller==NULL || connect_ms==0 || resp_ms==0)
+    return ARCP_ERROR_INTERNAL;
+  poller->connect_timeout_ms = connect_ms;
+  poller->resp_timeout_ms = resp_ms;
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_poller_add(arcp_poller_t *poller, uint32 ip_addr, uint16 port,
+  uint32 period_ms, arcp_poller_cb_t callback, void *user_data) {
+/*
+ * Adds a module to the poller.  ip_addr is the module's IPv4 address in
+ * host byte order (for a module on the radar network this is
+ * ARCP_RN_BASE | module address) and port is normally ARCP_TCP_PORT.  The
+ * module's status is sampled every period_ms milliseconds, the first
+ * sample being taken by the next call to arcp_poller_run_once(), and each
+ * result is passed to callback.
+ *
+ * Returns the module's index (0 or greater) on success, ARCP_ERROR_LOCAL
+ * if memory could not be allocated or ARCP_ERROR_INTERNAL on invalid
+ * arguments.
+ */
+poll_module_t *m;
+unsigned int n;
+
+  if (poller==NULL || period_ms==0)
+    return ARCP_ERROR_INTERNAL;
+
+  if (poller->n_modules == poller->max_modules) {
+    n = poller->max_modules==0 ? 16 : poller->max_modules*2;
+    m = realloc(poller->modules, n*sizeof(poll_module_t));
+    if (m == NULL)
+      return ARCP_ERROR_LOCAL;
+    poller->modules = m;
+    poller->max_modules = n;
+  }
+
+  m = &poller->modules[poller->n_modules];
+  memset(m, 0, sizeof(*m));
+  m->cmd = arcp_msg_new(ARCP_MSG_COMMAND);
+  if (m->cmd == NULL)
+    return ARCP_ERROR_LOCAL;
+  m->cmd->command.id = ARCP_CMD_GET_SYSSTAT;
+  m->ip_addr = ip_addr;
+  m->port = port;
+  m->period_ms = period_ms;
+  m->callback = callback;
+  m->user_data = user_data;
+  m->fd = ARCP_INVALID_SOCKET;
+  m->state = POLL_IDLE;
+  m->due = arcp_clock_ms();
+  return (signed int)poller->n_modules++;
+}
+/* ======================================================================== */
+
+arcp_handle_t *arcp_poller_get_handle(arcp_poller_t *poller,
+  unsigned int module) {
+/*
+ * Returns the handle of the given module's connection, or NULL if it is
+ * not currently connected.  The handle may be used (for example to send
+ * a command) from within the module's callback; it must not be freed.
+ */
+  if (poller==NULL || module>=poller->n_modules)
+    return NULL;
+  return poller->modules[module].handle;
+}
+/* ======================================================================== */
+
+signed int arcp_poller_run_once(arcp_poller_t *poller, uint32 max_wait_ms) {
+/*
+ * Waits for up to max_wait_ms milliseconds for network activity or for a
+ * module to need attention, services every module which is ready and
+ * returns.  Call this repeatedly from the application's main loop.  Module
+ * callbacks are called from within this function.
+ *
+ * Returns 0 on success or ARCP_ERROR_LOCAL if epoll failed.
+ */
+struct epoll_event ev[POLL_MAX_EVENTS];
+poll_module_t *m;
+unsigned int i;
+uint32 now;
+int32 wait, left;
+int n, j;
+
+  if (poller == NULL)
+    return ARCP_ERROR_INTERNAL;
+
+  /* Sleep no longer than until the next module falls due */
+  now = arcp_clock_ms();
+  wait = (int32)max_wait_ms;
+  if (wait < 0)
+    wait = 0x7fffffff;
+  for (i=0; i<poller->n_modules; i++) {
+    left = (int32)(poller->modules[i].due-now);
+    if (left < wait)
+      wait = left<0 ? 0 : left;
+  }
+
+  n = epoll_wait(poller->epfd, ev, POLL_MAX_EVENTS, (int)wait);
+  if (n<0 && errno!=EINTR)
+    return ARCP_ERROR_LOCAL;
+
+  for (j=0; j<n; j++) {
+    i = ev[j].data.u32;
+    m = &poller->modules[i];
+    if (m->state == POLL_CONNECTING)
+      module_connected(poller, i);
+    else
+    if (m->handle != NULL)
+      module_readable(poller, i);
+  }
+
+  /* Start samples which have fallen due and expire overdue operations */
+  now = arcp_clock_ms();
+  for (i=0; i<poller->n_modules; i++) {
+    m = &poller->modules[i];
+    if ((int32)(m->due-now) > 0)
+      continue;
+    if (m->state == POLL_IDLE)
+      module_start(poller, i);
+    else
+      module_finish(poller, i, ARCP_ERROR_CONN_TIMEOUT, NULL);
+  }
+  return 0;
+}
+/* ======================================================================== */
@@ -0,0 +1,49 @@
+/*
+ * An event-driven status poller for ARCP masters which monitor many modules
+ * at once.  See arcp_poller.c for details.
+ */
+
+#ifndef _ARCP_POLLER_H
+#define _ARCP_POLLER_H
+
+#include "arcp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ======================================================================== */
+
+/* Default timeouts (in milliseconds) applied to each module's connection */
+#define ARCP_POLLER_CONNECT_TIMEOUT    2000
+#define ARCP_POLLER_RESP_TIMEOUT       1000
+
+typedef struct arcp_poller_t arcp_poller_t;
+
+/* Called once per status sample.  On success result is 0 and resp is the
+ * module's SYSSTAT response (resp->resp_sysstat.sysstat).  Otherwise result
+ * is the ARCP_ERROR_* code or NAK/UNK response ID which ended the sample
+ * and resp is NULL.  resp is freed by the poller when the callback returns.
+ * module is the index returned by arcp_poller_add() and ip_addr the
+ * module's IPv4 address in host byte order.
+ */
+typedef void (*arcp_poller_cb_t)(arcp_poller_t *poller, unsigned int module,
+  uint32 ip_addr, signed int result, arcp_msg_t *resp, void *user_data);
+
+arcp_poller_t *arcp_poller_new(void);
+void arcp_poller_free(arcp_poller_t *poller);
+signed int arcp_poller_set_timeouts(arcp_poller_t *poller, uint32 connect_ms,
+  uint32 resp_ms);
+signed int arcp_poller_add(arcp_poller_t *poller, uint32 ip_addr, uint16 port,
+  uint32 period_ms, arcp_poller_cb_t callback, void *user_data);
+arcp_handle_t *arcp_poller_get_handle(arcp_poller_t *poller,
+  unsigned int module);
+signed int arcp_poller_run_once(arcp_poller_t *poller, uint32 max_wait_ms);
+
+/* ======================================================================== */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * A pool of persistent ARCP connections, one per module address.  Masters
+ * which sample modules repeatedly borrow a handle from the pool for each
+ * exchange instead of connecting and disconnecting every time, which saves
+ * the TCP handshake on each sample and spares the modules' embedded TCP
+ * stacks a constant stream of new connections.
+ *
+ * Typical use:
+ *   pool = arcp_pool_new(ARCP_TCP_PORT);
+ *   ...
+ *   res = arcp_pool_get(pool, "172.16.16.5", &handle);
+ *   if (res == 0) {
+ *     res = arcp_get_sysstat(handle, &sysstat);
+ *     arcp_pool_release(pool, handle, res);
+ *   }
+ *
+ * A connection which has been idle for a while is checked with arcp_ping()
+ * before being handed out.  When a connection fails (as reported to
+ * arcp_pool_release()) or cannot be established, further connection
+ * attempts to that module are delayed by an exponentially increasing
+ * backoff; during the delay arcp_pool_get() fails at once with
+ * ARCP_ERROR_CONN_DROPPED.
+ *
+ * A pool is not thread-safe; use one pool per thread.  The pool relies on
+ * arcp_handle_connect() and so is not available under NutOS.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "arcp_pool.h"
+
+/* ======================================================================== */
+
+/* Longest dotted-quad address plus terminator */
+#define POOL_ADDR_LEN      16
+
+typedef struct pool_entry_t {
+  char ip_addr[POOL_ADDR_LEN];
+  arcp_handle_t *handle;
+  uint8 in_use;
+  /* Clock value when the connection was last used or checked, and the
+   * earliest clock value at which a new connection may be attempted.
+   */
+  uint32 last_used, next_attempt;
+  uint32 backoff_ms;
+} pool_entry_t;
+
+struct arcp_pool_t {
+  uint16 port;
+  pool_entry_t *entries;
+  unsigned int n_entries, max_entries;
+  uint32 connect_timeout_ms, send_timeout_ms, recv_timeout_ms;
+  uint32 idle_check_ms, backoff_min_ms, backoff_max_ms;
+};
+
+/* ======================================================================== */
+
+static void pool_failed(arcp_pool_t *pool, pool_entry_t *e) {
+/*
+ * Internal function: drops the given entry's connection and delays the
+ * next connection attempt by the current backoff, which is then doubled
+ * (up to the pool's maximum).  Up to a quarter of the delay again is added
+ * at random so that modules which failed together are not all retried at
+ * the same moment.
+ */
+uint32 delay;
+
+  arcp_handle_disconnect(e->handle);
+  delay = e->backoff_ms + (uint32)rand()%(e->backoff_ms/4+1);
+  e->next_attempt = arcp_clock_ms() + delay;
+  e->backoff_ms = e->backoff_ms>pool->backoff_max_ms/2 ?
+    pool->backoff_max_ms : e->backoff_ms*2;
+}
+/* ======================================================================== */
+
+static pool_entry_t *pool_find(arcp_pool_t *pool, const char *ip_addr) {
+/*
+ * Internal function: returns the pool entry for the given address,
+ * creating it if necessary.  Returns NULL if memory could not be
+ * allocated.
+ */
+pool_entry_t *e;
+unsigned int i, n;
+
+  for (i=0; i<pool->n_entries; i++) {
+    if (strcmp(pool->entries[i].ip_addr, ip_addr) == 0)
+      return &pool->entries[i];
+  }
+
+  if (pool->n_entries == pool->max_entries) {
+    n = pool->max_entries==0 ? 8 : pool->max_entries*2;
+    e = realloc(pool->entries, n*sizeof(pool_entry_t));
+    if (e == NULL)
+      return NULL;
+    pool->entries = e;
+    pool->max_entries = n;
+  }
+
+  e = &pool->entries[pool->n_entries];
+  memset(e, 0, sizeof(*e));
+  e->handle = arcp_handle_new(ARCP_INVALID_SOCKET);
+  if (e->handle == NULL)
+    return NULL;
+  arcp_handle_set_timeouts(e->handle, pool->connect_timeout_ms,
+    pool->send_timeout_ms, pool->recv_timeout_ms);
+  strcpy(e->ip_addr, ip_addr);
+  e->backoff_ms = pool->backoff_min_ms;
+  e->next_attempt = arcp_clock_ms();
+  pool->n_entries++;
+  return e;
+}
+/* ======================================================================== */
+
+arcp_pool_t *arcp_pool_new(uint16 port) {
+/*
+ * Creates a new, empty connection pool.  Connections will be made to the
+ * given TCP port, normally ARCP_TCP_PORT.  Returns the pool or NULL on
+ * error.
+ */
+arcp_pool_t *pool = calloc(1, sizeof(arcp_pool_t));
+
+  if (pool == NULL)
+    return NULL;
+  pool->port = port;
+  pool->idle_check_ms = ARCP_POOL_IDLE_CHECK;
+  pool->backoff_min_ms = ARCP_POOL_BACKOFF_MIN;
+  pool->backoff_max_ms = ARCP_POOL_BACKOFF_MAX;
+  return pool;
+}
+/* ======================================================================== */
+
+void arcp_pool_free(arcp_pool_t *pool) {
+/*
+ * Closes all of the pool's connections and frees it.  No handle obtained
+ * from the pool may be used after this.
+ */
+unsigned int i;
+
+  if (pool == NULL)
+    return;
+  for (i=0; i<pool->n_entries; i++) {
+    arcp_handle_disconnect(pool->entries[i].handle);
+    arcp_handle_free(pool->entries[i].handle);
+  }
+  free(pool->entries);
+  free(pool);
+}
+/* ======================================================================== */
+
+signed int arcp_pool_set_timeouts(arcp_pool_t *pool, uint32 connect_ms,
+  uint32 send_ms, uint32 recv_ms) {
+/*
+ * Sets the timeouts applied to the pool's handles; see
+ * arcp_handle_set_timeouts().  Returns 0 on success or ARCP_ERROR_INTERNAL
+ * if pool is NULL.
+ */
+unsigned int i;
+
+  if (pool == NULL)
+    return ARCP_ERROR_INTERNAL;
+  pool->connect_timeout_ms = connect_ms;
+  pool->send_timeout_ms = send_ms;
+  pool->recv_timeout_ms = recv_ms;
+  for (i=0; i<pool->n_entries; i++)
+    arcp_handle_set_timeouts(pool->entries[i].handle, connect_ms, send_ms,
+      recv_ms);
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_pool_set_backoff(arcp_pool_t *pool, uint32 idle_check_ms,
+  uint32 backoff_min_ms, uint32 backoff_max_ms) {
+/*
+ * Sets how long a connection may be idle before it is pinged when next
+ * handed out (0 to ping every time) and the shortest and longest delays
+ * between attempts to reconnect to a failed module.  Returns 0 on success
+ * or ARCP_ERROR_INTERNAL on invalid arguments.
+ */
+  if (pool==NULL || backoff_min_ms==0 || backoff_max_ms<backoff_min_ms)
+    return ARCP_ERROR_INTERNAL;
+  pool->idle_check_ms = idle_check_ms;
+  pool->backoff_min_ms = backoff_min_ms;
+  pool->backoff_max_ms = backoff_max_ms;
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_pool_get(arcp_pool_t *pool, const char *ip_addr,
+  arcp_handle_t **handle) {
+/*
+ * Obtains a connected handle for the module at the given dotted-quad IP
+ * address, reusing the pool's existing connection where there is one.
+ * The handle must be returned with arcp_pool_release() once the caller's
+ * exchange is complete, and must not be closed or freed by the caller.
+ *
+ * Returns 0 on success with *handle set.  Otherwise *handle is NULL and
+ * the return value is an ARCP_ERROR_* code: ARCP_ERROR_CONN_DROPPED or
+ * ARCP_ERROR_CONN_TIMEOUT if no connection could be made (or the module
+ * is in its reconnection backoff), ARCP_ERROR_LOCAL if memory could not be
+ * allocated or ARCP_ERROR_INTERNAL on invalid arguments or if the module's
+ * handle has not been released.
+ */
+pool_entry_t *e;
+uint32 now;
+signed int res;
+
+  if (handle == NULL)
+    return ARCP_ERROR_INTERNAL;
+  *handle = NULL;
+  if (pool==NULL || ip_addr==NULL || strlen(ip_addr)>=POOL_ADDR_LEN)
+    return ARCP_ERROR_INTERNAL;
+
+  e = pool_find(pool, ip_addr);
+  if (e == NULL)
+    return ARCP_ERROR_LOCAL;
+  if (e->in_use)
+    return ARCP_ERROR_INTERNAL;
+
+  now = arcp_clock_ms();
+
+  /* Make sure a connection which has sat idle is still alive.  A stale
+   * connection is replaced straight away rather than being subject to the
+   * backoff, since the module itself may well be fine.
+   */
+  if (e->handle->fd!=ARCP_INVALID_SOCKET &&
+      (uint32)(now-e->last_used)>=pool->idle_check_ms) {
+    if (arcp_ping(e->handle) != 0)
+      arcp_handle_disconnect(e->handle);
+    else
+      e->last_used = now;
+  }
+
+  if (e->handle->fd == ARCP_INVALID_SOCKET) {
+    if ((int32)(e->next_attempt-now) > 0)
+      return ARCP_ERROR_CONN_DROPPED;
+    res = arcp_handle_connect(e->handle, e->ip_addr, pool->port);
+    if (res != 0) {
+      pool_failed(pool, e);
+      return res;
+    }
+    e->last_used = arcp_clock_ms();
+  }
+
+  e->in_use = 1;
+  *handle = e->handle;
+  return 0;
+}
+/* ======================================================================== */
+
+void arcp_pool_release(arcp_pool_t *pool, arcp_handle_t *handle,
+  signed int result) {
+/*
+ * Returns a handle obtained from arcp_pool_get() to the pool.  result is
+ * the outcome of the last operation performed with it: a connection error
+ * (ARCP_ERROR_CONN_*), or an error which leaves the connection out of step
+ * with the module (ARCP_ERROR_BADMSG, ARCP_ERROR_SEQUENCE), closes the
+ * connection and starts the reconnection backoff.  Any other result,
+ * including NAK and UNK responses, means the connection is healthy.
+ */
+pool_entry_t *e;
+unsigned int i;
+
+  if (pool==NULL || handle==NULL)
+    return;
+  for (i=0; i<pool->n_entries; i++) {
+    e = &pool->entries[i];
+    if (e->handle != handle)
+      continue;
+    e->in_use = 0;
+    if (result==ARCP_ERROR_CONN_DROPPED || result==ARCP_ERROR_CONN_TIMEOUT ||
+        result==ARCP_ERROR_BADMSG || result==ARCP_ERROR_SEQUENCE) {
+      pool_failed(pool, e);
+    } else {
+      e->last_used = arcp_clock_ms();
+      e->backoff_ms = pool->backoff_min_ms;
+    }
+    return;
+  }
+}
+/* ======================================================================== */
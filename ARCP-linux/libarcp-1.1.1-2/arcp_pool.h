@@ -0,0 +1,41 @@
+/*
+ * A pool of persistent ARCP connections for masters which repeatedly talk
+ * to the same modules.  See arcp_pool.c for details.
+ */
+
+#ifndef _ARCP_POOL_H
+#define _ARCP_POOL_H
+
+#include "arcp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ======================================================================== */
+
+/* Default pool parameters, in milliseconds */
+#define ARCP_POOL_IDLE_CHECK     10000    /* Ping connections idle this long */
+#define ARCP_POOL_BACKOFF_MIN    1000     /* First reconnection delay */
+#define ARCP_POOL_BACKOFF_MAX    60000    /* Longest reconnection delay */
+
+typedef struct arcp_pool_t arcp_pool_t;
+
+arcp_pool_t *arcp_pool_new(uint16 port);
+void arcp_pool_free(arcp_pool_t *pool);
+signed int arcp_pool_set_timeouts(arcp_pool_t *pool, uint32 connect_ms,
+  uint32 send_ms, uint32 recv_ms);
+signed int arcp_pool_set_backoff(arcp_pool_t *pool, uint32 idle_check_ms,
+  uint32 backoff_min_ms, uint32 backoff_max_ms);
+signed int arcp_pool_get(arcp_pool_t *pool, const char *ip_addr,
+  arcp_handle_t **handle);
+void arcp_pool_release(arcp_pool_t *pool, arcp_handle_t *handle,
+  signed int result);
+
+/* ======================================================================== */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
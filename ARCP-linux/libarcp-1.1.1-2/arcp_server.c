@@ -0,0 +1,661 @@
+/*
+ * A multi-threaded ARCP slave server, for module firmware or gateways which
+ * would otherwise hand-roll an accept loop and command dispatch around
+ * arcp_msg_read() and arcp_send_*().
+ *
+ * Typical use:
+ *   server = arcp_server_new(8);
+ *   arcp_server_set_handler(server, ARCP_CMD_GET_SYSSTAT, get_sysstat, ctx);
+ *   arcp_server_set_handler(server, ARCP_CMD_SET_PULSE_PARAM, set_pulse, ctx);
+ *   arcp_server_start(server, NULL, ARCP_TCP_PORT);
+ *   ...
+ *   arcp_server_free(server);
+ *
+ * One I/O thread accepts connections and reads commands from all of them
+ * through non-blocking sockets and epoll.  Each command read is queued for
+ * a pool of handler threads, so a slow handler (a gateway waiting on the
+ * modules behind it, say) holds up neither other connections nor later
+ * commands on the same connection.  Responses are nevertheless sent on
+ * each connection in the order the commands arrived, which for a master
+ * is exchange ID order: a response which is ready early waits for those
+ * before it, and the handler thread completing the oldest outstanding
+ * command sends every response which is then ready.  At most
+ * ARCP_SERVER_WINDOW commands per connection are outstanding; reading
+ * from the connection stops until responses have been sent.
+ *
+ * Commands with no registered handler are answered with an UNK, except
+ * PING which is ACKed.
+ *
+ * This module relies on epoll and POSIX threads and is therefore only
+ * available under Linux; link with -lpthread.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "arcp_server.h"
+
+/* ======================================================================== */
+
+/* Maximum number of events collected per epoll_wait() call */
+#define SERVER_MAX_EVENTS      64
+
+typedef struct server_conn_t server_conn_t;
+
+/* A command being handled.  Slots are also the entries of the server's
+ * job queue.
+ */
+typedef struct server_slot_t {
+  server_conn_t *conn;
+  arcp_msg_t *cmd, *resp;
+  uint8 done;
+  struct server_slot_t *next;
+} server_slot_t;
+
+struct server_conn_t {
+  arcp_handle_t *handle;
+  pthread_mutex_t lock;
+  /* References are held by the I/O thread while the connection is open,
+   * by each outstanding command and by each wakeup sent to the I/O thread.
+   * The socket is closed and the connection freed with the last one.
+   */
+  unsigned int refs;
+  /* Commands are numbered in order of arrival.  Command n occupies
+   * slots[n % ARCP_SERVER_WINDOW] until its response is sent; send_seq is
+   * the number of the oldest outstanding command.
+   */
+  uint32 next_seq, send_seq;
+  server_slot_t slots[ARCP_SERVER_WINDOW];
+  uint8 sending;   /* A handler thread is sending responses */
+  uint8 paused;    /* Reading stopped because the window is full */
+  uint8 failed;    /* Responses can no longer be sent */
+  uint8 closed;    /* No longer being read by the I/O thread */
+  /* List of open connections, maintained by the I/O thread */
+  server_conn_t *prev, *next;
+};
+
+typedef struct server_handler_entry_t {
+  arcp_cmd_id_t cmd_id;
+  arcp_server_handler_t handler;
+  void *user_data;
+} server_handler_entry_t;
+
+struct arcp_server_t {
+  server_handler_entry_t handlers[ARCP_SERVER_MAX_HANDLERS];
+  unsigned int n_handlers;
+  unsigned int n_threads;
+  pthread_t *threads, io_thread;
+  uint8 running;
+  int epfd;
+  /* The I/O thread is sent connection pointers through this pipe to
+   * resume reading them; a NULL pointer tells it to stop.
+   */
+  int wake[2];
+  arcp_socket_t listen_fd;
+  server_conn_t *conns;
+  /* Queue of commands waiting for a handler thread */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  server_slot_t *head, *tail;
+  uint8 stopping;
+};
+
+/* ======================================================================== */
+
+static void conn_release(server_conn_t *conn, unsigned int n) {
+/*
+ * Internal function: drops n references to the given connection, closing
+ * its socket and freeing it if they were the last.
+ */
+unsigned int i;
+int last;
+
+  pthread_mutex_lock(&conn->lock);
+  conn->refs -= n;
+  last = conn->refs == 0;
+  pthread_mutex_unlock(&conn->lock);
+  if (!last)
+    return;
+
+  for (i=0; i<ARCP_SERVER_WINDOW; i++) {
+    arcp_msg_free(conn->slots[i].cmd);
+    arcp_msg_free(conn->slots[i].resp);
+  }
+  arcp_socket_close(arcp_handle_get_socket(conn->handle));
+  arcp_handle_free(conn->handle);
+  pthread_mutex_destroy(&conn->lock);
+  free(conn);
+}
+/* ======================================================================== */
+
+static void conn_close(arcp_server_t *server, server_conn_t *conn, int how) {
+/*
+ * Internal function, I/O thread only: stops reading the given connection
+ * and drops the I/O thread's reference to it.  how is passed to
+ * shutdown(): SHUT_RD lets responses to commands already read still be
+ * sent, SHUT_RDWR abandons them.
+ */
+  if (conn->closed)
+    return;
+  pthread_mutex_lock(&conn->lock);
+  conn->closed = 1;
+  pthread_mutex_unlock(&conn->lock);
+  epoll_ctl(server->epfd, EPOLL_CTL_DEL, arcp_handle_get_socket(conn->handle), NULL);
+  shutdown(arcp_handle_get_socket(conn->handle), how);
+
+  if (conn->prev != NULL)
+    conn->prev->next = conn->next;
+  else
+    server->conns = conn->next;
+  if (conn->next != NULL)
+    conn->next->prev = conn->prev;
+  conn_release(conn, 1);
+}
+/* ======================================================================== */
+
+static void conn_watch(arcp_server_t *server, server_conn_t *conn,
+  uint32 events) {
+/*
+ * Internal function: sets the events waited for on the given connection.
+ */
+struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = conn;
+  epoll_ctl(server->epfd, EPOLL_CTL_MOD, arcp_handle_get_socket(conn->handle), &ev);
+}
+/* ======================================================================== */
+
+static void conn_read(arcp_server_t *server, server_conn_t *conn) {
+/*
+ * Internal function, I/O thread only: reads the commands available on the
+ * given connection and queues them for the handler threads.  Reading
+ * stops if the connection's window fills up.
+ */
+arcp_msg_t *msg;
+server_slot_t *slot;
+signed int res;
+
+  while (!conn->closed) {
+    pthread_mutex_lock(&conn->lock);
+    if (conn->next_seq-conn->send_seq >= ARCP_SERVER_WINDOW) {
+      /* Resumed by the handler thread which sends the next response */
+      conn->paused = 1;
+      pthread_mutex_unlock(&conn->lock);
+      conn_watch(server, conn, 0);
+      return;
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    res = arcp_msg_poll(conn->handle, &msg);
+    if (res == ARCP_ERROR_CONN_TIMEOUT)
+      return;
+    if (res==ARCP_ERROR_CONN_DROPPED || res==ARCP_ERROR_LOCAL) {
+      conn_close(server, conn, SHUT_RD);
+      return;
+    }
+    /* A corrupt message has been skipped */
+    if (res != 0)
+      continue;
+    if (msg->header.msg_type != ARCP_MSG_COMMAND) {
+      arcp_msg_free(msg);
+      continue;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    slot = &conn->slots[conn->next_seq % ARCP_SERVER_WINDOW];
+    slot->conn = conn;
+    slot->cmd = msg;
+    slot->resp = NULL;
+    slot->done = 0;
+    conn->next_seq++;
+    conn->refs++;
+    pthread_mutex_unlock(&conn->lock);
+
+    slot->next = NULL;
+    pthread_mutex_lock(&server->lock);
+    if (server->tail != NULL)
+      server->tail->next = slot;
+    else
+      server->head = slot;
+    server->tail = slot;
+    pthread_cond_signal(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+  }
+}
+/* ======================================================================== */
+
+static void server_accept(arcp_server_t *server) {
+/*
+ * Internal function, I/O thread only: accepts pending connections.
+ */
+server_conn_t *conn;
+struct epoll_event ev;
+arcp_socket_t fd;
+int one = 1;
+
+  for (;;) {
+    fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    /* Responses are written as they become ready, so don't let them wait
+     * to be coalesced.
+     */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn = calloc(1, sizeof(server_conn_t));
+    if (conn != NULL) {
+      conn->handle = arcp_handle_new(fd);
+      if (conn->handle == NULL) {
+        free(conn);
+        conn = NULL;
+      }
+    }
+    if (conn == NULL) {
+      arcp_socket_close(fd);
+      continue;
+    }
+    arcp_handle_set_timeouts(conn->handle, 0, ARCP_SERVER_SEND_TIMEOUT, 0);
+    pthread_mutex_init(&conn->lock, NULL);
+    conn->refs = 1;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      conn->closed = 1;
+      conn_release(conn, 1);
+      continue;
+    }
+    conn->next = server->conns;
+    if (conn->next != NULL)
+      conn->next->prev = conn;
+    server->conns = conn;
+  }
+}
+/* ======================================================================== */
+
+static void *server_io_thread(void *arg) {
+/*
+ * Internal function: the I/O thread.  Runs until sent a NULL wakeup.
+ */
+arcp_server_t *server = arg;
+struct epoll_event events[SERVER_MAX_EVENTS];
+server_conn_t *conn, *woken[SERVER_MAX_EVENTS];
+signed int i, n, n_woken = 0;
+
+  for (;;) {
+    n = epoll_wait(server->epfd, events, SERVER_MAX_EVENTS, -1);
+    for (i=0; i<n; i++) {
+      if (events[i].data.ptr == server) {
+        server_accept(server);
+        continue;
+      }
+      if (events[i].data.ptr == server->wake) {
+        if (read(server->wake[0], &conn, sizeof(conn)) != sizeof(conn))
+          continue;
+        if (conn == NULL)
+          goto stop;
+        if (!conn->closed) {
+          conn_watch(server, conn, EPOLLIN);
+          conn_read(server, conn);
+        }
+        /* The wakeup's reference is kept until the end of the batch, as
+         * later events in it may still refer to the connection.
+         */
+        woken[n_woken++] = conn;
+        continue;
+      }
+
+      conn = events[i].data.ptr;
+      /* Errors and hangups are reported even while reading is paused */
+      if (!(events[i].events & EPOLLIN))
+        conn_close(server, conn, SHUT_RDWR);
+      else
+        conn_read(server, conn);
+    }
+    while (n_woken > 0)
+      conn_release(woken[--n_woken], 1);
+    if (n<0 && errno!=EINTR)
+      break;
+  }
+
+stop:
+  while (server->conns != NULL)
+    conn_close(server, server->conns, SHUT_RDWR);
+  while (n_woken > 0)
+    conn_release(woken[--n_woken], 1);
+  return NULL;
+}
+/* ======================================================================== */
+
+static void slot_handle(arcp_server_t *server, server_slot_t *slot) {
+/*
+ * Internal function: runs the handler for the command in the given slot
+ * and stores the response in the slot.  A NULL response means the
+ * connection is to be closed.
+ */
+arcp_msg_t *cmd = slot->cmd, *resp;
+server_handler_entry_t *h = NULL;
+unsigned int i;
+signed int res = 0;
+
+  for (i=0; i<server->n_handlers; i++) {
+    if (server->handlers[i].cmd_id == cmd->command.id) {
+      h = &server->handlers[i];
+      break;
+    }
+  }
+
+  resp = arcp_msg_new(ARCP_MSG_RESPONSE);
+  if (resp == NULL) {
+    slot->resp = NULL;
+    return;
+  }
+  resp->header.exchange_id = cmd->header.exchange_id;
+  resp->response.id = ARCP_RESP_ACK;
+  if (h != NULL)
+    res = h->handler(cmd, resp, h->user_data);
+  else
+  if (cmd->command.id != ARCP_CMD_PING)
+    resp->response.id = ARCP_RESP_UNK;
+
+  /* Don't try to send a SYSID or SYSSTAT with nothing to send */
+  if ((resp->response.id==ARCP_RESP_SYSID && resp->resp_sysid.sysid==NULL) ||
+      (resp->response.id==ARCP_RESP_SYSSTAT && resp->resp_sysstat.sysstat==NULL))
+    res = ARCP_ERROR_INTERNAL;
+  if (res != 0) {
+    arcp_msg_free(resp);
+    resp = NULL;
+  }
+  slot->resp = resp;
+}
+/* ======================================================================== */
+
+static void slot_complete(arcp_server_t *server, server_slot_t *slot) {
+/*
+ * Internal function: marks the given slot's command as handled and, unless
+ * another thread is already doing so, sends the connection's responses
+ * which are ready in order of arrival.
+ */
+server_conn_t *conn = slot->conn;
+server_slot_t *head;
+arcp_msg_t *cmd, *resp;
+unsigned int n_sent = 0;
+int failed, wake = 0;
+
+  pthread_mutex_lock(&conn->lock);
+  slot->done = 1;
+  if (conn->sending) {
+    pthread_mutex_unlock(&conn->lock);
+    return;
+  }
+  conn->sending = 1;
+  for (;;) {
+    head = &conn->slots[conn->send_seq % ARCP_SERVER_WINDOW];
+    if (conn->send_seq==conn->next_seq || !head->done)
+      break;
+    cmd = head->cmd;
+    resp = head->resp;
+    head->cmd = head->resp = NULL;
+    head->done = 0;
+    conn->send_seq++;
+    failed = conn->failed;
+    if (conn->paused) {
+      conn->paused = 0;
+      conn->refs++;
+      wake = 1;
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    /* After a failure the connection is being closed and the remaining
+     * responses are discarded.
+     */
+    if (!failed && (resp==NULL || arcp_msg_write(conn->handle, resp)!=0)) {
+      failed = 1;
+      shutdown(arcp_handle_get_socket(conn->handle), SHUT_RDWR);
+    }
+    arcp_msg_free(cmd);
+    arcp_msg_free(resp);
+    n_sent++;
+
+    pthread_mutex_lock(&conn->lock);
+    if (failed)
+      conn->failed = 1;
+  }
+  conn->sending = 0;
+  pthread_mutex_unlock(&conn->lock);
+
+  /* The I/O thread resumes reading once told of the space in the window */
+  if (wake && write(server->wake[1], &conn, sizeof(conn))!=sizeof(conn))
+    conn_release(conn, 1);
+  conn_release(conn, n_sent);
+}
+/* ======================================================================== */
+
+static void *server_handler_thread(void *arg) {
+/*
+ * Internal function: a handler thread.  Runs until the server is stopping
+ * and no commands remain queued.
+ */
+arcp_server_t *server = arg;
+server_slot_t *slot;
+
+  for (;;) {
+    pthread_mutex_lock(&server->lock);
+    while (server->head==NULL && !server->stopping)
+      pthread_cond_wait(&server->cond, &server->lock);
+    slot = server->head;
+    if (slot != NULL) {
+      server->head = slot->next;
+      if (server->head == NULL)
+        server->tail = NULL;
+    }
+    pthread_mutex_unlock(&server->lock);
+    if (slot == NULL)
+      return NULL;
+
+    slot_handle(server, slot);
+    slot_complete(server, slot);
+  }
+}
+/* ======================================================================== */
+
+arcp_server_t *arcp_server_new(unsigned int n_threads) {
+/*
+ * Creates a new server which will run its handlers on n_threads threads
+ * (ARCP_SERVER_THREADS if 0).  Handlers are registered with
+ * arcp_server_set_handler() and the server is then started with
+ * arcp_server_start().  Returns NULL if memory could not be allocated.
+ */
+arcp_server_t *server = calloc(1, sizeof(arcp_server_t));
+
+  if (server == NULL)
+    return NULL;
+  server->n_threads = n_threads!=0 ? n_threads : ARCP_SERVER_THREADS;
+  server->epfd = -1;
+  server->wake[0] = server->wake[1] = -1;
+  server->listen_fd = ARCP_INVALID_SOCKET;
+  pthread_mutex_init(&server->lock, NULL);
+  pthread_cond_init(&server->cond, NULL);
+  return server;
+}
+/* ======================================================================== */
+
+signed int arcp_server_set_handler(arcp_server_t *server, arcp_cmd_id_t cmd_id,
+  arcp_server_handler_t handler, void *user_data) {
+/*
+ * Registers handler (called with user_data) for commands with ID cmd_id,
+ * replacing any handler already registered for them.  Handlers must be
+ * registered before the server is started.
+ *
+ * Returns 0 on success, ARCP_ERROR_LOCAL if ARCP_SERVER_MAX_HANDLERS are
+ * already registered or ARCP_ERROR_INTERNAL if the server is running or
+ * an argument is NULL.
+ */
+unsigned int i;
+
+  if (server==NULL || handler==NULL || server->running)
+    return ARCP_ERROR_INTERNAL;
+  for (i=0; i<server->n_handlers; i++) {
+    if (server->handlers[i].cmd_id == cmd_id)
+      break;
+  }
+  if (i == ARCP_SERVER_MAX_HANDLERS)
+    return ARCP_ERROR_LOCAL;
+  server->handlers[i].cmd_id = cmd_id;
+  server->handlers[i].handler = handler;
+  server->handlers[i].user_data = user_data;
+  if (i == server->n_handlers)
+    server->n_handlers++;
+  return 0;
+}
+/* ======================================================================== */
+
+signed int arcp_server_start(arcp_server_t *server, const char *ip_addr,
+  uint16 port) {
+/*
+ * Starts the server listening on the given port (normally ARCP_TCP_PORT)
+ * of the given dotted-quad IP address, or of all addresses if ip_addr is
+ * NULL, and starts its threads.
+ *
+ * Returns 0 on success, ARCP_ERROR_INTERNAL if the server is already
+ * running or ip_addr is invalid, or ARCP_ERROR_LOCAL if the port could not
+ * be listened on or the threads could not be created.
+ */
+struct sockaddr_in addr;
+struct epoll_event ev;
+unsigned int i;
+int one = 1;
+
+  if (server==NULL || server->running)
+    return ARCP_ERROR_INTERNAL;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (ip_addr!=NULL && inet_aton(ip_addr, &addr.sin_addr)==0)
+    return ARCP_ERROR_INTERNAL;
+
+  server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  server->epfd = epoll_create1(0);
+  if (server->listen_fd==ARCP_INVALID_SOCKET || server->epfd<0 ||
+      pipe(server->wake)<0)
+    goto fail;
+  setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  fcntl(server->listen_fd, F_SETFL, fcntl(server->listen_fd, F_GETFL)|O_NONBLOCK);
+  if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr))<0 ||
+      listen(server->listen_fd, SOMAXCONN)<0)
+    goto fail;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = server;
+  if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->listen_fd, &ev) < 0)
+    goto fail;
+  ev.data.ptr = server->wake;
+  if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->wake[0], &ev) < 0)
+    goto fail;
+
+  server->threads = calloc(server->n_threads, sizeof(pthread_t));
+  if (server->threads == NULL)
+    goto fail;
+  server->stopping = 0;
+  for (i=0; i<server->n_threads; i++) {
+    if (pthread_create(&server->threads[i], NULL, server_handler_thread, server) != 0)
+      break;
+  }
+  if (i<server->n_threads ||
+      pthread_create(&server->io_thread, NULL, server_io_thread, server)!=0) {
+    /* Stop the handler threads which did start */
+    pthread_mutex_lock(&server->lock);
+    server->stopping = 1;
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+    while (i-- > 0)
+      pthread_join(server->threads[i], NULL);
+    goto fail;
+  }
+  server->running = 1;
+  return 0;
+
+fail:
+  free(server->threads);
+  server->threads = NULL;
+  if (server->listen_fd != ARCP_INVALID_SOCKET)
+    arcp_socket_close(server->listen_fd);
+  if (server->epfd >= 0)
+    close(server->epfd);
+  if (server->wake[0] >= 0) {
+    close(server->wake[0]);
+    close(server->wake[1]);
+  }
+  server->listen_fd = ARCP_INVALID_SOCKET;
+  server->epfd = server->wake[0] = server->wake[1] = -1;
+  return ARCP_ERROR_LOCAL;
+}
+/* ======================================================================== */
+
+void arcp_server_stop(arcp_server_t *server) {
+/*
+ * Stops the server: the listening socket and all connections are closed,
+ * commands already read are handled (their responses are discarded) and
+ * the threads are stopped.  The server may then be started again.
+ */
+server_conn_t *conn = NULL;
+unsigned int i;
+
+  if (server==NULL || !server->running)
+    return;
+  if (write(server->wake[1], &conn, sizeof(conn)) == sizeof(conn))
+    pthread_join(server->io_thread, NULL);
+
+  pthread_mutex_lock(&server->lock);
+  server->stopping = 1;
+  pthread_cond_broadcast(&server->cond);
+  pthread_mutex_unlock(&server->lock);
+  for (i=0; i<server->n_threads; i++)
+    pthread_join(server->threads[i], NULL);
+
+  /* Drop the references held by wakeups the I/O thread never saw */
+  fcntl(server->wake[0], F_SETFL, O_NONBLOCK);
+  while (read(server->wake[0], &conn, sizeof(conn)) == sizeof(conn)) {
+    if (conn != NULL)
+      conn_release(conn, 1);
+  }
+
+  free(server->threads);
+  server->threads = NULL;
+  arcp_socket_close(server->listen_fd);
+  close(server->epfd);
+  close(server->wake[0]);
+  close(server->wake[1]);
+  server->listen_fd = ARCP_INVALID_SOCKET;
+  server->epfd = server->wake[0] = server->wake[1] = -1;
+  server->running = 0;
+}
+/* ======================================================================== */
+
+void arcp_server_free(arcp_server_t *server) {
+/*
+ * Stops the given server if it is running and frees it.
+ */
+  if (server == NULL)
+    return;
+  arcp_server_stop(server);
+  pthread_mutex_destroy(&server->lock);
+  pthread_cond_destroy(&server->cond);
+  free(server);
+}
+/* ======================================================================== */
@@ -0,0 +1,63 @@
+/*
+ * Multi-threaded ARCP slave server: accepts master connections and
+ * dispatches their commands to registered handlers on a pool of threads.
+ * See arcp_server.c for details.
+ */
+
+#ifndef _ARCP_SERVER_H
+#define _ARCP_SERVER_H
+
+#include "arcp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ======================================================================== */
+
+/* Default number of handler threads */
+#define ARCP_SERVER_THREADS            4
+
+/* Maximum number of commands from one connection being handled or waiting
+ * for their response to be sent.  Reading from a connection stops while
+ * this many are outstanding.
+ */
+#define ARCP_SERVER_WINDOW             32
+
+/* Maximum number of command handlers which can be registered */
+#define ARCP_SERVER_MAX_HANDLERS       32
+
+/* Time allowed for a response to be sent before the master is considered
+ * dead and the connection is closed (milliseconds).
+ */
+#define ARCP_SERVER_SEND_TIMEOUT       5000
+
+typedef struct arcp_server_t arcp_server_t;
+
+/* A command handler.  cmd is the decoded command and resp a response to
+ * it, preset to an ACK with the command's exchange ID.  The handler may
+ * turn resp into a NAK or UNK (setting response.id and response.info_code)
+ * or a SYSID or SYSSTAT response (setting response.id and attaching a
+ * sysid or sysstat object, which is freed with the response).  Returning
+ * 0 sends resp; returning an ARCP_ERROR_* code closes the connection
+ * without a response.  Handlers are called concurrently, including for
+ * commands from the same connection.
+ */
+typedef signed int (*arcp_server_handler_t)(arcp_msg_t *cmd, arcp_msg_t *resp,
+  void *user_data);
+
+arcp_server_t *arcp_server_new(unsigned int n_threads);
+signed int arcp_server_set_handler(arcp_server_t *server, arcp_cmd_id_t cmd_id,
+  arcp_server_handler_t handler, void *user_data);
+signed int arcp_server_start(arcp_server_t *server, const char *ip_addr,
+  uint16 port);
+void arcp_server_stop(arcp_server_t *server);
+void arcp_server_free(arcp_server_t *server);
+
+/* ======================================================================== */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * A client-side shadow of the configuration last acknowledged by a module:
+ * trigger parameters, the pulse parameters of each slot, the pulse
+ * sequence and the BSM phase table of each phase slot.  Given a target
+ * configuration, arcp_shadow_reconcile() sends only the commands needed to
+ * get from the shadowed configuration to the target, as one pipelined
+ * batch, and updates the shadow from the responses.  Since most mode
+ * changes touch only a slot or two this saves most of the traffic and time
+ * of resending everything.
+ *
+ * Parts of the configuration the shadow knows nothing about - initially
+ * everything, and anything whose command failed - are always sent.  The
+ * shadow can only be trusted while nothing else configures the module, so
+ * one shadow should be kept per module and arcp_shadow_invalidate() called
+ * whenever the module may have been reset or reconfigured behind its back
+ * (after reconnecting, for example).
+ *
+ * Typical use:
+ *   shadow = arcp_shadow_new();
+ *   for (each mode change) {
+ *     ... fill in target ...
+ *     arcp_shadow_reconcile(shadow, handle, &target, NULL);
+ *   }
+ *   arcp_shadow_free(shadow);
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "arcp_shadow.h"
+
+/* ======================================================================== */
+
+/* Number of pulse slots addressable by SET_PULSE_PARAM */
+#define SHADOW_N_PULSE_SLOTS   256
+
+/* Size in bytes of the longest pulse code */
+#define SHADOW_MAX_CODE_BYTES  (ARCP_MAX_PULSECODE_SIZE/8)
+
+/* Which part of the configuration a command in a batch sets */
+#define PART_PULSE             0
+#define PART_SEQ               1
+#define PART_TRIG              2
+#define PART_PHASES            3
+
+typedef struct shadow_pulse_t {
+  uint8 valid;
+  arcp_pulse_t param;             /* The code field is not used */
+  uint16 code_length;
+  uint8 code[SHADOW_MAX_CODE_BYTES];
+} shadow_pulse_t;
+
+typedef struct shadow_phases_t {
+  uint8 valid;
+  uint16 phase_slot;
+  uint16 n_phases;
+  arcp_phase_entry_t phases[ARCP_BSM_MAX_N_PHASES];
+} shadow_phases_t;
+
+struct arcp_shadow_t {
+  shadow_pulse_t pulses[SHADOW_N_PULSE_SLOTS];
+  uint8 seq_valid;
+  uint16 seq_length;
+  arcp_pulseseq_entry_t seq[ARCP_MAX_PULSE_SEQ_LENGTH];
+  uint8 trig_valid;
+  arcp_trigger_t trig;
+  /* Phase tables seen so far, in no particular order */
+  shadow_phases_t *phases;
+  unsigned int n_phases, phases_size;
+};
+
+/* ======================================================================== */
+
+static uint16 code_bytes(arcp_pulsecode_t *code) {
+/*
+ * Internal function: returns the number of bytes of the given pulse code
+ * which are sent in a SET_PULSE_PARAM command.
+ */
+uint16 len = code!=NULL ? arcp_pulsecode_getlength(code) : 0;
+
+  return (uint16)(len!=0 ? (len-1)/8+1 : 0);
+}
+/* ======================================================================== */
+
+static signed int pulse_matches(shadow_pulse_t *s, arcp_pulse_t *p) {
+/*
+ * Internal function: returns non-zero if the shadowed slot s is known to
+ * hold the pulse parameters p.
+ */
+uint16 len = code_bytes(p->code);
+
+  return s->valid && s->param.pulse_shape==p->pulse_shape &&
+    s->param.pulse_ampl==p->pulse_ampl &&
+    s->param.pulse_options==p->pulse_options &&
+    s->param.pulse_width_ns==p->pulse_width_ns &&
+    s->code_length==(len!=0 ? arcp_pulsecode_getlength(p->code) : 0) &&
+    (len==0 || memcmp(s->code, arcp_pulsecode_getdata(p->code), len)==0);
+}
+/* ======================================================================== */
+
+static void pulse_record(shadow_pulse_t *s, arcp_pulse_t *p) {
+/*
+ * Internal function: records that the shadowed slot s now holds the pulse
+ * parameters p.  Codes too long to shadow leave the slot unknown.
+ */
+uint16 len = code_bytes(p->code);
+
+  s->valid = 0;
+  if (len > SHADOW_MAX_CODE_BYTES)
+    return;
+  s->param = *p;
+  s->param.code = NULL;
+  s->code_length = len!=0 ? arcp_pulsecode_getlength(p->code) : 0;
+  if (len != 0)
+    memcpy(s->code, arcp_pulsecode_getdata(p->code), len);
+  s->valid = 1;
+}
+/* ======================================================================== */
+
+static signed int seq_matches(arcp_shadow_t *shadow, arcp_pulseseq_t *seq) {
+/*
+ * Internal function: returns non-zero if the module is known to hold the
+ * given pulse sequence.
+ */
+uint16 i;
+
+  if (!shadow->seq_valid || shadow->seq_length!=seq->length)
+    return 0;
+  for (i=0; i<seq->length; i++) {
+    if (shadow->seq[i].slot!=seq->seq[i].slot ||
+        shadow->seq[i].flags!=seq->seq[i].flags)
+      return 0;
+  }
+  return 1;
+}
+/* ======================================================================== */
+
+static void seq_record(arcp_shadow_t *shadow, arcp_pulseseq_t *seq) {
+/*
+ * Internal function: records that the module now holds the given pulse
+ * sequence.
+ */
+  shadow->seq_valid = 0;
+  if (seq->length > ARCP_MAX_PULSE_SEQ_LENGTH)
+    return;
+  shadow->seq_length = seq->length;
+  if (seq->length != 0)
+    memcpy(shadow->seq, seq->seq, seq->length*sizeof(arcp_pulseseq_entry_t));
+  shadow->seq_valid = 1;
+}
+/* ======================================================================== */
+
+static signed int trig_matches(arcp_shadow_t *shadow, arcp_trigger_t *trig) {
+/*
+ * Internal function: returns non-zero if the module is known to hold the
+ * given trigger parameters.
+ */
+  return shadow->trig_valid &&
+    shadow->trig.trigger_source==trig->trigger_source &&
+    shadow->trig.ext_trigger_options==trig->ext_trigger_options &&
+    shadow->trig.int_trigger_freq==trig->int_trigger_freq &&
+    shadow->trig.pulse_predelay==trig->pulse_predelay;
+}
+/* ======================================================================== */
+
+static shadow_phases_t *phases_find(arcp_shadow_t *shadow, uint16 phase_slot,
+  signed int create) {
+/*
+ * Internal function: returns the shadow of the given phase slot.  If there
+ * is none yet, one is created (marked unknown) if create is non-zero,
+ * otherwise NULL is returned.  NULL is also returned if memory runs out.
+ */
+shadow_phases_t *p;
+unsigned int i;
+
+  for (i=0; i<shadow->n_phases; i++) {
+    if (shadow->phases[i].phase_slot == phase_slot)
+      return &shadow->phases[i];
+  }
+  if (!create)
+    return NULL;
+  if (shadow->n_phases == shadow->phases_size) {
+    p = realloc(shadow->phases,
+          (shadow->phases_size+8)*sizeof(shadow_phases_t));
+    if (p == NULL)
+      return NULL;
+    shadow->phases = p;
+    shadow->phases_size += 8;
+  }
+  p = &shadow->phases[shadow->n_phases++];
+  p->valid = 0;
+  p->phase_slot = phase_slot;
+  return p;
+}
+/* ======================================================================== */
+
+static signed int phases_match(arcp_shadow_t *shadow,
+  arcp_phasetable_t *table) {
+/*
+ * Internal function: returns non-zero if the module is known to hold the
+ * given phase table.
+ */
+shadow_phases_t *p = phases_find(shadow, table->phase_slot, 0);
+uint16 i;
+
+  if (p==NULL || !p->valid || p->n_phases!=table->n_phases)
+    return 0;
+  for (i=0; i<table->n_phases; i++) {
+    if (p->phases[i].channel!=table->phases[i].channel ||
+        p->phases[i].phase!=table->phases[i].phase)
+      return 0;
+  }
+  return 1;
+}
+/* ======================================================================== */
+
+static void phases_record(arcp_shadow_t *shadow, arcp_phasetable_t *table,
+  signed int valid) {
+/*
+ * Internal function: records that the module now holds the given phase
+ * table (valid is non-zero) or that its contents are unknown (valid is 0).
+ */
+shadow_phases_t *p = phases_find(shadow, table->phase_slot, valid);
+
+  if (p == NULL)
+    return;
+  p->valid = 0;
+  if (!valid || table->n_phases>ARCP_BSM_MAX_N_PHASES)
+    return;
+  p->n_phases = table->n_phases;
+  if (table->n_phases != 0)
+    memcpy(p->phases, table->phases,
+      table->n_phases*sizeof(arcp_phase_entry_t));
+  p->valid = 1;
+}
+/* ======================================================================== */
+
+arcp_shadow_t *arcp_shadow_new(void) {
+/*
+ * Creates a new shadow which knows nothing about the module's
+ * configuration.  Returns NULL if memory could not be allocated.
+ */
+  return calloc(1, sizeof(arcp_shadow_t));
+}
+/* ======================================================================== */
+
+void arcp_shadow_free(arcp_shadow_t *shadow) {
+/*
+ * Frees the given shadow.
+ */
+  if (shadow == NULL)
+    return;
+  free(shadow->phases);
+  free(shadow);
+}
+/* ======================================================================== */
+
+void arcp_shadow_invalidate(arcp_shadow_t *shadow) {
+/*
+ * Forgets everything the shadow knows, so that the next reconcile sends
+ * every part of the target configuration.  Call this whenever the module
+ * may have been reset or configured by someone else.
+ */
+unsigned int i;
+
+  if (shadow == NULL)
+    return;
+  for (i=0; i<SHADOW_N_PULSE_SLOTS; i++)
+    shadow->pulses[i].valid = 0;
+  shadow->seq_valid = 0;
+  shadow->trig_valid = 0;
+  shadow->n_phases = 0;
+}
+/* ======================================================================== */
+
+signed int arcp_shadow_reconcile(arcp_shadow_t *shadow, arcp_handle_t *handle,
+  const arcp_shadow_config_t *target, unsigned int *n_sent) {
+/*
+ * Brings the module on the given handle to the target configuration,
+ * sending (as one pipelined batch with arcp_exec_cmds()) only the commands
+ * for those parts which the shadow doesn't know to be in place already.
+ * The shadow is updated from the responses: parts which were acknowledged
+ * become known, parts whose command failed become unknown so they will be
+ * sent next time.  If n_sent is not NULL it receives the number of
+ * commands sent.
+ *
+ * The result field of each entry in target->pulses is set as by
+ * arcp_set_pulsetable(); entries which didn't need sending get
+ * ARCP_RESP_ACK.
+ *
+ * Returns the number of commands which were not acknowledged (0 if the
+ * module now has the target configuration), ARCP_RESP_UNK without sending
+ * anything if the target includes phase tables but the connection's
+ * protocol version predates them (as for arcp_set_phase()), or an
+ * ARCP_ERROR_* code if the batch could not be built.
+ */
+arcp_msg_t **cmds, **resps;
+uint8 *part;
+uint16 *index;
+unsigned int i, n = 0, max_cmds;
+signed int res, built, r, n_failed = 0;
+arcp_msg_t *m;
+
+  if (n_sent != NULL)
+    *n_sent = 0;
+  if (shadow==NULL || handle==NULL || target==NULL ||
+      (target->n_pulses!=0 && target->pulses==NULL) ||
+      (target->n_phase_tables!=0 && target->phase_tables==NULL))
+    return ARCP_ERROR_INTERNAL;
+  /* As for arcp_set_phase() */
+  if (target->n_phase_tables!=0 &&
+      handle->connection_arcp_version < ARCP_VERSION_1_1)
+    return ARCP_RESP_UNK;
+
+  max_cmds = target->n_pulses + target->n_phase_tables + 2;
+  cmds = calloc(max_cmds, 2*sizeof(arcp_msg_t *) + sizeof(uint8) +
+           sizeof(uint16));
+  if (cmds == NULL)
+    return ARCP_ERROR_LOCAL;
+  resps = cmds+max_cmds;
+  index = (uint16 *)(resps+max_cmds);
+  part = (uint8 *)(index+max_cmds);
+
+  /* Build the commands for whatever differs.  The messages refer to the
+   * caller's pulse codes, sequence and phases rather than copying them.
+   */
+  res = 0;
+  for (i=0; i<target->n_pulses && res==0; i++) {
+    target->pulses[i].result = ARCP_RESP_ACK;
+    if (pulse_matches(&shadow->pulses[target->pulses[i].slot],
+          &target->pulses[i].param))
+      continue;
+    m = arcp_msg_new(ARCP_MSG_COMMAND);
+    if (m==NULL || arcp_msg_set_cmd_id(m, ARCP_CMD_SET_PULSE_PARAM)<0)
+      res = ARCP_ERROR_LOCAL;
+    else {
+      m->cmd_set_pulse_param.pulse_map_index = target->pulses[i].slot;
+      m->cmd_set_pulse_param.pulse_param = target->pulses[i].param;
+    }
+    if (m != NULL) {
+      part[n] = PART_PULSE;
+      index[n] = (uint16)i;
+      cmds[n++] = m;
+    }
+  }
+  if (target->pulse_seq!=NULL && res==0 &&
+      !seq_matches(shadow, target->pulse_seq)) {
+    m = arcp_msg_new(ARCP_MSG_COMMAND);
+    if (m==NULL || arcp_msg_set_cmd_id(m, ARCP_CMD_SET_PULSE_SEQ)<0)
+      res = ARCP_ERROR_LOCAL;
+    else
+      m->cmd_set_pulse_seq.seq = target->pulse_seq;
+    if (m != NULL) {
+      part[n] = PART_SEQ;
+      cmds[n++] = m;
+    }
+  }
+  if (target->trig_param!=NULL && res==0 &&
+      !trig_matches(shadow, target->trig_param)) {
+    m = arcp_msg_new(ARCP_MSG_COMMAND);
+    if (m==NULL || arcp_msg_set_cmd_id(m, ARCP_CMD_SET_TRIG_PARAM)<0)
+      res = ARCP_ERROR_LOCAL;
+    else
+      m->cmd_set_trig_param.trig_param = *target->trig_param;
+    if (m != NULL) {
+      part[n] = PART_TRIG;
+      cmds[n++] = m;
+    }
+  }
+  for (i=0; i<target->n_phase_tables && res==0; i++) {
+    if (phases_match(shadow, &target->phase_tables[i]))
+      continue;
+    m = arcp_msg_new(ARCP_MSG_COMMAND);
+    if (m==NULL || arcp_msg_set_cmd_id(m, ARCP_CMD_SET_PHASE)<0)
+      res = ARCP_ERROR_LOCAL;
+    else {
+      m->cmd_set_phase.phase_slot = target->phase_tables[i].phase_slot;
+      m->cmd_set_phase.n_phases = target->phase_tables[i].n_phases;
+      m->cmd_set_phase.phases = target->phase_tables[i].phases;
+    }
+    if (m != NULL) {
+      part[n] = PART_PHASES;
+      index[n] = (uint16)i;
+      cmds[n++] = m;
+    }
+  }
+
+  built = res;
+  if (res==0 && n!=0) {
+    res = arcp_exec_cmds(handle, cmds, resps, n);
+    if (n_sent != NULL)
+      *n_sent = n;
+  }
+
+  /* Update the shadow.  Anything not acknowledged, including commands
+   * which may or may not have reached the module before a failure, is
+   * forgotten.
+   */
+  for (i=0; i<n; i++) {
+    if (resps[i] == NULL)
+      r = res!=0 ? res : ARCP_ERROR_INTERNAL;
+    else {
+      r = arcp_set_resp_result(resps[i]);
+      arcp_msg_free(resps[i]);
+    }
+    if (r != ARCP_RESP_ACK)
+      n_failed++;
+
+    switch (part[i]) {
+      case PART_PULSE:
+        target->pulses[index[i]].result = r;
+        if (r == ARCP_RESP_ACK)
+          pulse_record(&shadow->pulses[target->pulses[index[i]].slot],
+            &target->pulses[index[i]].param);
+        else
+          shadow->pulses[target->pulses[index[i]].slot].valid = 0;
+        cmds[i]->cmd_set_pulse_param.pulse_param.code = NULL;
+        break;
+      case PART_SEQ:
+        if (r == ARCP_RESP_ACK)
+          seq_record(shadow, target->pulse_seq);
+        else
+          shadow->seq_valid = 0;
+        cmds[i]->cmd_set_pulse_seq.seq = NULL;
+        break;
+      case PART_TRIG:
+        shadow->trig = *target->trig_param;
+        shadow->trig_valid = r==ARCP_RESP_ACK;
+        break;
+      case PART_PHASES:
+        phases_record(shadow, &target->phase_tables[index[i]],
+          r==ARCP_RESP_ACK);
+        cmds[i]->cmd_set_phase.phases = NULL;
+        break;
+    }
+    arcp_msg_free(cmds[i]);
+  }
+  free(cmds);
+  return built!=0 ? built : n_failed;
+}
+/* ======================================================================== */
@@ -0,0 +1,44 @@
+/*
+ * Client-side shadow of a module's configuration, used to send only the
+ * parameters which have changed.  See arcp_shadow.c for details.
+ */
+
+#ifndef _ARCP_SHADOW_H
+#define _ARCP_SHADOW_H
+
+#include "arcp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ======================================================================== */
+
+/* A target configuration for arcp_shadow_reconcile().  Parts which are
+ * NULL (or have no entries) are left as they are on the module.  The
+ * result field of each pulse table entry is filled in by the reconcile.
+ */
+typedef struct arcp_shadow_config_t {
+  arcp_pulsetable_entry_t *pulses;
+  uint16 n_pulses;
+  arcp_pulseseq_t *pulse_seq;
+  arcp_trigger_t *trig_param;
+  arcp_phasetable_t *phase_tables;
+  uint16 n_phase_tables;
+} arcp_shadow_config_t;
+
+typedef struct arcp_shadow_t arcp_shadow_t;
+
+arcp_shadow_t *arcp_shadow_new(void);
+void arcp_shadow_free(arcp_shadow_t *shadow);
+void arcp_shadow_invalidate(arcp_shadow_t *shadow);
+signed int arcp_shadow_reconcile(arcp_shadow_t *shadow, arcp_handle_t *handle,
+  const arcp_shadow_config_t *target, unsigned int *n_sent);
+
+/* ======================================================================== */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,311 @@
+/*
+ * Precomputed beam steering phase tables for BSMs (beam steering modules).
+ *
+ * Rather than computing channel phases and sending them with
+ * arcp_set_phase() each time the beam direction changes, a master builds
+ * the phase tables for a whole grid of steering directions once, from the
+ * array geometry and the channel map the BSM reports in its SYSID, and
+ * loads each into its own BSM phase slot with arcp_steer_preload().
+ * Changing direction is then only a matter of selecting the slot returned
+ * by arcp_steer_nearest().
+ *
+ * Directions are given as azimuth (degrees clockwise from north) and
+ * zenith angle (degrees from vertical).  The phase of channel c for a
+ * direction is
+ *   offset[c] - 360 * (x[c]*sin(zen)*sin(az) + y[c]*sin(zen)*cos(az)) / wavelength
+ * wrapped into [0, 360) degrees.  The trigonometry depends only on the
+ * direction, so it is done once per table; the per-channel work is a
+ * multiply-add and wrap over contiguous arrays of floats.  When the
+ * compiler targets SSE2 (any x86-64 build) this is done four channels at
+ * a time by an explicit SSE2 kernel, independent of the optimisation
+ * level; other targets use the same arithmetic in scalar code.  Neither
+ * calls into libm.
+ *
+ * Typical use:
+ *   arcp_get_sysid(handle, &sysid);
+ *   steer = arcp_steer_new(sysid, &geom, az, n_az, zen, n_zen, 0);
+ *   arcp_steer_preload(steer, handle);
+ *   ...
+ *   slot = arcp_steer_nearest(steer, 45.0, 15.0);
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "arcp_steer.h"
+
+/* The SSE2 phase kernel is used when the compiler targets SSE2; other
+ * targets use the portable scalar code.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+  #include <emmintrin.h>
+  #define ARCP_SIMD_SSE2
+#endif
+
+/* ======================================================================== */
+
+/* Number of SET_PHASE commands sent per pipelined batch */
+#define STEER_BATCH            64
+
+#define STEER_DEG_TO_RAD       (3.14159265358979323846/180.0)
+
+struct arcp_steer_t {
+  uint16 n_azimuth, n_zenith;
+  float *azimuth, *zenith;
+  uint16 n_channels;
+  /* One table per direction, zenith-major, each of n_channels entries
+   * stored consecutively in entries[].
+   */
+  arcp_phasetable_t *tables;
+  arcp_phase_entry_t *entries;
+};
+
+/* ======================================================================== */
+
+static void steer_wrap(float *phase, const float *x, const float *y,
+  const float *offset, unsigned int n, float u, float v) {
+/*
+ * Internal function: computes phase[i] = offset[i] + x[i]*u + y[i]*v
+ * wrapped into [0, 360) for i = 0..n-1.  The wrap finds floor(p/360) by
+ * truncating to an integer and stepping down for negative non-integers,
+ * so unwrapped phases must lie within +/-2^31 turns (far beyond any real
+ * array geometry).
+ */
+unsigned int i = 0;
+float p, q, f;
+
+#ifdef ARCP_SIMD_SSE2
+  {
+    const __m128 vu = _mm_set1_ps(u), vv = _mm_set1_ps(v);
+    const __m128 full = _mm_set1_ps(360.0f), inv = _mm_set1_ps(1.0f/360.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    for (; i+4 <= n; i+=4) {
+      __m128 vp, vq, vf;
+      vp = _mm_add_ps(_mm_loadu_ps(offset+i),
+        _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x+i), vu),
+                   _mm_mul_ps(_mm_loadu_ps(y+i), vv)));
+      vq = _mm_mul_ps(vp, inv);
+      vf = _mm_cvtepi32_ps(_mm_cvttps_epi32(vq));
+      /* Truncation rounds negatives up: step those down by one */
+      vf = _mm_sub_ps(vf, _mm_and_ps(_mm_cmpgt_ps(vf, vq), one));
+      vp = _mm_sub_ps(vp, _mm_mul_ps(full, vf));
+      /* Rounding can leave exactly 360 (or a tiny negative): map to 0 */
+      vp = _mm_and_ps(vp, _mm_and_ps(_mm_cmplt_ps(vp, full),
+                                     _mm_cmpge_ps(vp, _mm_setzero_ps())));
+      _mm_storeu_ps(phase+i, vp);
+    }
+  }
+#endif
+  for (; i<n; i++) {
+    p = offset[i] + x[i]*u + y[i]*v;
+    q = p*(1.0f/360.0f);
+    f = (float)(int32)q;
+    if (f > q)
+      f -= 1.0f;
+    p -= 360.0f*f;
+    /* Rounding can leave exactly 360 (or a tiny negative) */
+    phase[i] = (p<360.0f && p>=0.0f) ? p : 0.0f;
+  }
+}
+/* ======================================================================== */
+
+arcp_steer_t *arcp_steer_new(const arcp_sysid_t *sysid,
+  const arcp_steer_geometry_t *geom, const float *azimuth, uint16 n_azimuth,
+  const float *zenith, uint16 n_zenith, uint16 first_slot) {
+/*
+ * Computes the phase tables for the grid of n_azimuth by n_zenith
+ * steering directions (in degrees) given by azimuth[] and zenith[], for
+ * the BSM whose SYSID is sysid and whose channels are laid out as
+ * described by geom.  Only the channels present in the BSM's channel map
+ * are included.  The table for azimuth[a] and zenith[z] is assigned phase
+ * slot first_slot + z*n_azimuth + a.
+ *
+ * Returns the new object, or NULL if the arguments are invalid (sysid not
+ * from a BSM, no directions, a non-positive wavelength or too many phase
+ * slots) or memory could not be allocated.
+ */
+arcp_steer_t *steer;
+float x[ARCP_STEER_MAX_CHANNELS], y[ARCP_STEER_MAX_CHANNELS];
+float offset[ARCP_STEER_MAX_CHANNELS], phase[ARCP_STEER_MAX_CHANNELS];
+uint16 channel[ARCP_STEER_MAX_CHANNELS];
+unsigned int a, z, c, t, n_tables;
+double k, s;
+
+  if (sysid==NULL || geom==NULL || azimuth==NULL || zenith==NULL ||
+      sysid->module_type!=ARCP_MODULE_BSM || n_azimuth==0 || n_zenith==0 ||
+      !(geom->wavelength > 0.0f))
+    return NULL;
+  n_tables = (unsigned int)n_azimuth*n_zenith;
+  if (first_slot+n_tables-1 > 0xffff)
+    return NULL;
+
+  /* Gather the geometry of the channels present into contiguous arrays */
+  for (c=0, t=0; c<ARCP_STEER_MAX_CHANNELS; c++) {
+    if (!(sysid->data.bsm.channel_map & (1<<c)))
+      continue;
+    channel[t] = (uint16)c;
+    x[t] = geom->x[c];
+    y[t] = geom->y[c];
+    offset[t] = geom->offset[c];
+    t++;
+  }
+
+  steer = calloc(1, sizeof(arcp_steer_t));
+  if (steer == NULL)
+    return NULL;
+  steer->n_azimuth = n_azimuth;
+  steer->n_zenith = n_zenith;
+  steer->n_channels = (uint16)t;
+  steer->azimuth = malloc(n_azimuth*sizeof(float));
+  steer->zenith = malloc(n_zenith*sizeof(float));
+  steer->tables = malloc(n_tables*sizeof(arcp_phasetable_t));
+  steer->entries = malloc((n_tables*t+1)*sizeof(arcp_phase_entry_t));
+  if (steer->azimuth==NULL || steer->zenith==NULL || steer->tables==NULL ||
+      steer->entries==NULL) {
+    arcp_steer_free(steer);
+    return NULL;
+  }
+  memcpy(steer->azimuth, azimuth, n_azimuth*sizeof(float));
+  memcpy(steer->zenith, zenith, n_zenith*sizeof(float));
+
+  k = -360.0/geom->wavelength;
+  for (z=0; z<n_zenith; z++) {
+    s = k*sin(zenith[z]*STEER_DEG_TO_RAD);
+    for (a=0; a<n_azimuth; a++) {
+      arcp_phasetable_t *tab = &steer->tables[z*n_azimuth+a];
+      steer_wrap(phase, x, y, offset, steer->n_channels,
+        (float)(s*sin(azimuth[a]*STEER_DEG_TO_RAD)),
+        (float)(s*cos(azimuth[a]*STEER_DEG_TO_RAD)));
+      tab->phase_slot = (uint16)(first_slot + z*n_azimuth+a);
+      tab->n_phases = steer->n_channels;
+      tab->phases = &steer->entries[(z*n_azimuth+a)*steer->n_channels];
+      for (c=0; c<steer->n_channels; c++) {
+        tab->phases[c].channel = channel[c];
+        tab->phases[c].phase = phase[c];
+      }
+    }
+  }
+  return steer;
+}
+/* ======================================================================== */
+
+void arcp_steer_free(arcp_steer_t *steer) {
+/*
+ * Frees the given object and its phase tables.
+ */
+  if (steer == NULL)
+    return;
+  free(steer->azimuth);
+  free(steer->zenith);
+  free(steer->tables);
+  free(steer->entries);
+  free(steer);
+}
+/* ======================================================================== */
+
+const arcp_phasetable_t *arcp_steer_table(arcp_steer_t *steer,
+  uint16 azimuth_idx, uint16 zenith_idx) {
+/*
+ * Returns the phase table for azimuth[azimuth_idx] and zenith[zenith_idx]
+ * as given to arcp_steer_new(), or NULL if either index is out of range.
+ * The table belongs to steer.
+ */
+  if (steer==NULL || azimuth_idx>=steer->n_azimuth ||
+      zenith_idx>=steer->n_zenith)
+    return NULL;
+  return &steer->tables[zenith_idx*steer->n_azimuth+azimuth_idx];
+}
+/* ======================================================================== */
+
+signed int arcp_steer_nearest(arcp_steer_t *steer, float azimuth,
+  float zenith) {
+/*
+ * Returns the phase slot holding the table for the grid direction nearest
+ * to the given azimuth and zenith angle (degrees), or ARCP_ERROR_INTERNAL
+ * if steer is NULL.  Azimuths are compared modulo 360 degrees.
+ */
+unsigned int i, a = 0, z = 0;
+float d, best;
+
+  if (steer == NULL)
+    return ARCP_ERROR_INTERNAL;
+
+  best = 1e30f;
+  for (i=0; i<steer->n_azimuth; i++) {
+    d = (float)fabs(fmod(steer->azimuth[i]-azimuth, 360.0));
+    if (d > 180.0f)
+      d = 360.0f-d;
+    if (d < best) {
+      best = d;
+      a = i;
+    }
+  }
+  best = 1e30f;
+  for (i=0; i<steer->n_zenith; i++) {
+    d = (float)fabs(steer->zenith[i]-zenith);
+    if (d < best) {
+      best = d;
+      z = i;
+    }
+  }
+  return steer->tables[z*steer->n_azimuth+a].phase_slot;
+}
+/* ======================================================================== */
+
+signed int arcp_steer_preload(arcp_steer_t *steer, arcp_handle_t *handle) {
+/*
+ * Loads every phase table into its phase slot on the BSM connected to
+ * handle.  The SET_PHASE commands are pipelined with arcp_exec_cmds() in
+ * batches, so the cost is a round trip per batch rather than per table.
+ *
+ * Returns the number of tables which were not acknowledged (0 if all
+ * were), or an ARCP_ERROR_* code if the BSM doesn't support phase tables,
+ * memory could not be allocated or the connection failed.
+ */
+arcp_msg_t *cmds[STEER_BATCH], *resps[STEER_BATCH];
+unsigned int i, n, done, n_tables;
+signed int res = 0, sent, n_failed = 0;
+
+  if (steer==NULL || handle==NULL)
+    return ARCP_ERROR_INTERNAL;
+  /* As for arcp_set_phase() */
+  if (handle->connection_arcp_version < ARCP_VERSION_1_1)
+    return ARCP_RESP_UNK;
+
+  n_tables = (unsigned int)steer->n_azimuth*steer->n_zenith;
+  for (done=0; done<n_tables && res==0; done+=n) {
+    n = n_tables-done;
+    if (n > STEER_BATCH)
+      n = STEER_BATCH;
+    for (i=0; i<n && res==0; i++) {
+      cmds[i] = arcp_msg_new(ARCP_MSG_COMMAND);
+      if (cmds[i] == NULL)
+        break;
+      if (arcp_msg_set_cmd_id(cmds[i], ARCP_CMD_SET_PHASE) < 0)
+        res = ARCP_ERROR_LOCAL;
+      cmds[i]->cmd_set_phase.phase_slot = steer->tables[done+i].phase_slot;
+      cmds[i]->cmd_set_phase.n_phases = steer->tables[done+i].n_phases;
+      cmds[i]->cmd_set_phase.phases = steer->tables[done+i].phases;
+    }
+    sent = res==0 && i==n;
+    if (sent)
+      res = arcp_exec_cmds(handle, cmds, resps, n);
+    else {
+      res = ARCP_ERROR_LOCAL;
+      n = i;
+    }
+
+    for (i=0; i<n; i++) {
+      if (sent && resps[i]!=NULL) {
+        if (arcp_set_resp_result(resps[i]) != ARCP_RESP_ACK)
+          n_failed++;
+        arcp_msg_free(resps[i]);
+      }
+      /* The tables belong to steer */
+      cmds[i]->cmd_set_phase.phases = NULL;
+      arcp_msg_free(cmds[i]);
+    }
+  }
+  return res!=0 ? res : n_failed;
+}
+/* ======================================================================== */
@@ -0,0 +1,50 @@
+/*
+ * Precomputed beam steering phase tables for BSMs.  See arcp_steer.c for
+ * details.
+ */
+
+#ifndef _ARCP_STEER_H
+#define _ARCP_STEER_H
+
+#include "arcp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ======================================================================== */
+
+/* Number of channels a BSM can have (one per bit of its channel map) */
+#define ARCP_STEER_MAX_CHANNELS        16
+
+/* Array geometry.  Positions are in metres with x towards the east and y
+ * towards the north, indexed by BSM channel number.  offset holds a fixed
+ * phase in degrees added to each channel (cable length calibration, for
+ * example).
+ */
+typedef struct arcp_steer_geometry_t {
+  float x[ARCP_STEER_MAX_CHANNELS];
+  float y[ARCP_STEER_MAX_CHANNELS];
+  float offset[ARCP_STEER_MAX_CHANNELS];
+  float wavelength;
+} arcp_steer_geometry_t;
+
+typedef struct arcp_steer_t arcp_steer_t;
+
+arcp_steer_t *arcp_steer_new(const arcp_sysid_t *sysid,
+  const arcp_steer_geometry_t *geom, const float *azimuth, uint16 n_azimuth,
+  const float *zenith, uint16 n_zenith, uint16 first_slot);
+void arcp_steer_free(arcp_steer_t *steer);
+const arcp_phasetable_t *arcp_steer_table(arcp_steer_t *steer,
+  uint16 azimuth_idx, uint16 zenith_idx);
+signed int arcp_steer_nearest(arcp_steer_t *steer, float azimuth,
+  float zenith);
+signed int arcp_steer_preload(arcp_steer_t *steer, arcp_handle_t *handle);
+
+/* ======================================================================== */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
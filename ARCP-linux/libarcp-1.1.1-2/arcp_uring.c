@@ -0,0 +1,578 @@
+/*
+ * An io_uring transport for masters which exchange commands with many
+ * modules at high rate.  Rather than one send() and at least one recv()
+ * system call per module, the sends and receives for a whole set of
+ * handles are queued on an io_uring and submitted together, so a round of
+ * commands to every module costs a handful of system calls.
+ *
+ * The handles' receive buffers are registered with the kernel when the ring
+ * is created, so incoming data is placed straight into each handle's buffer
+ * with IORING_OP_READ_FIXED and decoded there by arcp_msg_parse().  Commands
+ * are encoded into the handles' transmit buffers by arcp_cmd_encode() and
+ * sent with IORING_OP_SEND so that MSG_NOSIGNAL can be given.  Should
+ * buffer registration be refused (for example by RLIMIT_MEMLOCK) plain
+ * IORING_OP_RECV is used instead.
+ *
+ * The handles must stay allocated for the life of the ring but may be
+ * connected and disconnected freely (see arcp_handle_connect()).  The
+ * kernel interface is used directly, so liburing is not required; a kernel
+ * of 5.6 or later is.
+ *
+ * Typical use, given an array of connected handles:
+ *   ring = arcp_uring_new(handles, n);
+ *   for (...) {
+ *     ... prepare cmds[0..n-1] ...
+ *     arcp_uring_exec_cmds(ring, cmds, resps, results, 1000);
+ *     ... use and free resps[] ...
+ *   }
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "arcp_uring.h"
+
+/* ======================================================================== */
+
+/* Operation codes carried in the low bits of each request's user_data; the
+ * remaining bits hold the handle index.
+ */
+#define URING_OP_SEND      0
+#define URING_OP_RECV      1
+#define URING_OP_SHIFT     1
+#define URING_TIMEOUT      (~(uint64_t)0)
+#define URING_CANCEL       (~(uint64_t)1)
+
+/* Per-handle progress through an exchange */
+typedef struct uring_slot_t {
+  arcp_msg_t *cmd;
+  uint16 tx_len, tx_done;
+  uint8 sending, receiving, done;
+} uring_slot_t;
+
+struct arcp_uring_t {
+  int fd;
+  /* Submission queue */
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int sq_entries, sq_queued;
+  /* Requests handed to the kernel whose completions are yet to be reaped */
+  unsigned int in_flight;
+  /* Completion queue */
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* Mappings, for unmapping */
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+
+  arcp_handle_t **handles;
+  uring_slot_t *slots;
+  unsigned int n_handles;
+  uint8 fixed_buffers;
+  /* Set if requests may still be using the handles' buffers */
+  uint8 broken;
+};
+
+/* ======================================================================== */
+
+static struct io_uring_sqe *uring_get_sqe(arcp_uring_t *ring) {
+/*
+ * Internal function: returns the next free submission queue entry, cleared,
+ * or NULL if the queue is full.
+ */
+unsigned int tail, idx;
+struct io_uring_sqe *sqe;
+
+  tail = *ring->sq_tail + ring->sq_queued;
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    return NULL;
+  idx = tail & *ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[idx] = idx;
+  ring->sq_queued++;
+  return sqe;
+}
+/* ======================================================================== */
+
+static signed int uring_enter(arcp_uring_t *ring, unsigned int min_complete) {
+/*
+ * Internal function: submits all queued entries and, if min_complete is
+ * non-zero, waits for at least that many completions.  Returns 0 on
+ * success or ARCP_ERROR_LOCAL.
+ */
+unsigned int tail = *ring->sq_tail + ring->sq_queued;
+long res;
+
+  /* Once the tail moves the entries belong to the kernel.  Any it didn't
+   * consume in an earlier, failed call are offered again here.
+   */
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  ring->in_flight += ring->sq_queued;
+  ring->sq_queued = 0;
+  for (;;) {
+    res = syscall(__NR_io_uring_enter, ring->fd,
+            tail-__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE),
+            min_complete, min_complete!=0 ? IORING_ENTER_GETEVENTS : 0,
+            NULL, 0);
+    if (res>=0 || errno!=EINTR)
+      break;
+  }
+  return res<0 ? ARCP_ERROR_LOCAL : 0;
+}
+/* ======================================================================== */
+
+static signed int uring_queue_send(arcp_uring_t *ring, unsigned int i) {
+/*
+ * Internal function: queues the send of the unsent part of handle i's
+ * encoded command.
+ */
+struct io_uring_sqe *sqe = uring_get_sqe(ring);
+arcp_handle_t *h = ring->handles[i];
+uring_slot_t *s = &ring->slots[i];
+
+  if (sqe == NULL)
+    return ARCP_ERROR_LOCAL;
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = h->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(h->tx_buf+s->tx_done);
+  sqe->len = s->tx_len-s->tx_done;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = ((uint64_t)i<<URING_OP_SHIFT) | URING_OP_SEND;
+  s->sending = 1;
+  return 0;
+}
+/* ======================================================================== */
+
+static signed int uring_queue_recv(arcp_uring_t *ring, unsigned int i) {
+/*
+ * Internal function: queues a read into the free space of handle i's
+ * receive buffer.
+ */
+struct io_uring_sqe *sqe;
+arcp_handle_t *h = ring->handles[i];
+uint8 *space;
+uint16 len;
+
+  space = arcp_handle_rx_space(h, &len);
+  if (len == 0)
+    return ARCP_ERROR_BADMSG;
+  sqe = uring_get_sqe(ring);
+  if (sqe == NULL)
+    return ARCP_ERROR_LOCAL;
+  if (ring->fixed_buffers) {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->buf_index = (uint16_t)i;
+  } else
+    sqe->opcode = IORING_OP_RECV;
+  sqe->fd = h->fd;
+  sqe->addr = (uint64_t)(uintptr_t)space;
+  sqe->len = len;
+  sqe->user_data = ((uint64_t)i<<URING_OP_SHIFT) | URING_OP_RECV;
+  ring->slots[i].receiving = 1;
+  return 0;
+}
+/* ======================================================================== */
+
+static void uring_queue_cancel(arcp_uring_t *ring, uint64_t user_data) {
+/*
+ * Internal function: queues cancellation of the request with the given
+ * user_data.  The request itself then completes with -ECANCELED.  If the
+ * submission queue is full it is submitted first to make room.
+ */
+struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+  if (sqe == NULL) {
+    uring_enter(ring, 0);
+    sqe = uring_get_sqe(ring);
+  }
+  if (sqe == NULL)
+    return;
+  sqe->opcode = user_data==URING_TIMEOUT ? IORING_OP_TIMEOUT_REMOVE :
+    IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = user_data;
+  sqe->user_data = URING_CANCEL;
+}
+/* ======================================================================== */
+
+static void uring_finish(arcp_uring_t *ring, unsigned int i, signed int res,
+  arcp_msg_t *resp, arcp_msg_t **resps, signed int *results) {
+/*
+ * Internal function: ends handle i's exchange with the given result,
+ * cancelling any of its requests still in flight.
+ */
+uring_slot_t *s = &ring->slots[i];
+
+  s->done = 1;
+  results[i] = res;
+  resps[i] = resp;
+  if (s->sending)
+    uring_queue_cancel(ring,
+      ((uint64_t)i<<URING_OP_SHIFT) | URING_OP_SEND);
+  if (s->receiving)
+    uring_queue_cancel(ring,
+      ((uint64_t)i<<URING_OP_SHIFT) | URING_OP_RECV);
+}
+/* ======================================================================== */
+
+static void uring_received(arcp_uring_t *ring, unsigned int i,
+  arcp_msg_t **resps, signed int *results) {
+/*
+ * Internal function: looks for handle i's response among the data now in
+ * its receive buffer.  Responses to earlier exchanges are discarded.
+ */
+uring_slot_t *s = &ring->slots[i];
+arcp_msg_t *msg;
+signed int res;
+
+  for (;;) {
+    res = arcp_msg_parse(ring->handles[i], &msg);
+    if (res == ARCP_ERROR_CONN_TIMEOUT)
+      break;
+    if (res == ARCP_ERROR_BADMSG)
+      continue;
+    if (res != 0) {
+      uring_finish(ring, i, res, NULL, resps, results);
+      return;
+    }
+    if (msg->header.msg_type==ARCP_MSG_RESPONSE &&
+        msg->header.exchange_id!=s->cmd->header.exchange_id) {
+      arcp_msg_free(msg);
+      continue;
+    }
+    res = arcp_check_resp_msg(s->cmd, msg);
+    if (res != 0) {
+      arcp_msg_free(msg);
+      msg = NULL;
+    }
+    uring_finish(ring, i, res, msg, resps, results);
+    return;
+  }
+
+  /* Incomplete: keep reading */
+  res = uring_queue_recv(ring, i);
+  if (res != 0)
+    uring_finish(ring, i, res, NULL, resps, results);
+}
+/* ======================================================================== */
+
+static void uring_abort(arcp_uring_t *ring, arcp_msg_t **resps,
+  signed int *results) {
+/*
+ * Internal function: abandons an exchange after the ring itself failed.
+ * Entries not yet submitted are dropped, everything the kernel holds is
+ * cancelled and its completion reaped, so that nothing is left using the
+ * handles' buffers, and every exchange ends with ARCP_ERROR_LOCAL.  If the
+ * completions can't be reaped the ring is marked broken.
+ */
+unsigned int i, head;
+
+  ring->sq_queued = 0;
+  for (i=0; i<ring->n_handles; i++) {
+    if (ring->slots[i].sending)
+      uring_queue_cancel(ring,
+        ((uint64_t)i<<URING_OP_SHIFT) | URING_OP_SEND);
+    if (ring->slots[i].receiving)
+      uring_queue_cancel(ring,
+        ((uint64_t)i<<URING_OP_SHIFT) | URING_OP_RECV);
+    arcp_msg_free(resps[i]);
+    resps[i] = NULL;
+    if (ring->slots[i].cmd != NULL)
+      results[i] = ARCP_ERROR_LOCAL;
+  }
+  uring_queue_cancel(ring, URING_TIMEOUT);
+
+  while (ring->in_flight!=0 || ring->sq_queued!=0) {
+    if (uring_enter(ring, 1) != 0) {
+      ring->broken = 1;
+      return;
+    }
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      head++;
+      ring->in_flight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+/* ======================================================================== */
+
+static void uring_ring_unmap(arcp_uring_t *ring) {
+/*
+ * Internal function: releases the ring's kernel resources.
+ */
+  if (ring->sqes != NULL)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != NULL)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+}
+/* ======================================================================== */
+
+arcp_uring_t *arcp_uring_new(arcp_handle_t **handles, unsigned int n_handles) {
+/*
+ * Creates an io_uring transport serving the given handles and registers
+ * their receive buffers with the kernel.  The handles are referenced, not
+ * copied; they must not be freed before the ring.  Returns the ring, or
+ * NULL if io_uring is unavailable or memory could not be allocated.
+ */
+arcp_uring_t *ring;
+struct io_uring_params p;
+struct iovec *iov;
+unsigned int i, entries;
+unsigned char *sq, *cq;
+
+  if (handles==NULL || n_handles==0)
+    return NULL;
+  ring = calloc(1, sizeof(arcp_uring_t));
+  if (ring == NULL)
+    return NULL;
+  ring->fd = -1;
+  ring->handles = handles;
+  ring->n_handles = n_handles;
+  ring->slots = calloc(n_handles, sizeof(uring_slot_t));
+  if (ring->slots == NULL)
+    goto fail;
+
+  /* Room for a send, a receive and two cancellations per handle, plus the
+   * timeout and its removal.
+   */
+  entries = 1;
+  while (entries < 4*n_handles+2)
+    entries <<= 1;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = 2*entries;
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0)
+    goto fail;
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  ring->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+  sq = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+         MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto fail;
+  ring->sq_ring = sq;
+  cq = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE,
+         MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  if (cq == MAP_FAILED)
+    goto fail;
+  ring->cq_ring = cq;
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  ring->sq_entries = p.sq_entries;
+  ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  /* Register the receive buffers.  This is an optimisation only, so carry
+   * on without it if the kernel refuses.
+   */
+  iov = calloc(n_handles, sizeof(struct iovec));
+  if (iov != NULL) {
+    for (i=0; i<n_handles; i++) {
+      iov[i].iov_base = handles[i]->rx_buf;
+      iov[i].iov_len = ARCP_RX_BUF_SIZE;
+    }
+    ring->fixed_buffers = syscall(__NR_io_uring_register, ring->fd,
+      IORING_REGISTER_BUFFERS, iov, n_handles) == 0;
+    free(iov);
+  }
+  return ring;
+
+fail:
+  uring_ring_unmap(ring);
+  free(ring->slots);
+  free(ring);
+  return NULL;
+}
+/* ======================================================================== */
+
+void arcp_uring_free(arcp_uring_t *ring) {
+/*
+ * Frees the given ring.  The handles it served are not affected.
+ */
+  if (ring == NULL)
+    return;
+  uring_ring_unmap(ring);
+  free(ring->slots);
+  free(ring);
+}
+/* ======================================================================== */
+
+signed int arcp_uring_exec_cmds(arcp_uring_t *ring, arcp_msg_t **cmds,
+  arcp_msg_t **resps, signed int *results, uint32 timeout_ms) {
+/*
+ * Sends cmds[i] on the ring's handle i for every i and collects the
+ * responses, all through one io_uring.  A NULL cmds[i] skips handle i.
+ * Each command is assigned its handle's next exchange ID as for
+ * arcp_cmd_write().  The exchange ends after timeout_ms milliseconds
+ * (which must not be 0) whether or not every response has arrived.
+ *
+ * On return results[i] is 0 with the checked response in resps[i] (to be
+ * freed by the caller), or an ARCP_ERROR_* code with resps[i] NULL.
+ * ARCP_ERROR_CONN_TIMEOUT means no response arrived in time; the handle
+ * should then be reconnected or given time to resynchronise, since the
+ * late response will arrive later.  Skipped handles get
+ * ARCP_ERROR_INTERNAL.
+ *
+ * Returns the number of handles (not counting those skipped) which did not
+ * receive a response, or ARCP_ERROR_LOCAL if the ring itself failed, in
+ * which case no responses are returned.  Requests already given to the
+ * kernel are cancelled and reaped before returning; should even that fail
+ * the ring refuses all further use and must be freed.  cmds[] is NOT
+ * deallocated by this function.
+ */
+struct __kernel_timespec ts;
+struct io_uring_sqe *sqe;
+struct io_uring_cqe *cqe;
+uring_slot_t *s;
+unsigned int i, head;
+uint8 timer_running;
+signed int res, failed;
+uint64_t op;
+
+  if (ring==NULL || cmds==NULL || resps==NULL || results==NULL ||
+      timeout_ms==0)
+    return ARCP_ERROR_INTERNAL;
+  if (ring->broken)
+    return ARCP_ERROR_LOCAL;
+
+  /* Queue the sends and the first receive for each handle */
+  for (i=0; i<ring->n_handles; i++) {
+    s = &ring->slots[i];
+    memset(s, 0, sizeof(*s));
+    s->cmd = cmds[i];
+    results[i] = ARCP_ERROR_INTERNAL;
+    resps[i] = NULL;
+    if (s->cmd == NULL) {
+      s->done = 1;
+      continue;
+    }
+    res = ring->handles[i]->fd==ARCP_INVALID_SOCKET ? ARCP_ERROR_CONN_DROPPED :
+      arcp_cmd_encode(ring->handles[i], s->cmd, &s->tx_len);
+    if (res == 0)
+      res = uring_queue_send(ring, i);
+    if (res == 0)
+      res = uring_queue_recv(ring, i);
+    if (res != 0)
+      uring_finish(ring, i, res, NULL, resps, results);
+  }
+
+  sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    uring_abort(ring, resps, results);
+    return ARCP_ERROR_LOCAL;
+  }
+  ts.tv_sec = timeout_ms/1000;
+  ts.tv_nsec = (timeout_ms%1000)*1000000L;
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uint64_t)(uintptr_t)&ts;
+  sqe->len = 1;
+  sqe->user_data = URING_TIMEOUT;
+  timer_running = 1;
+
+  /* Submit and reap until every request has completed */
+  do {
+    if (uring_enter(ring, 1) != 0) {
+      uring_abort(ring, resps, results);
+      return ARCP_ERROR_LOCAL;
+    }
+
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &ring->cqes[head & *ring->cq_mask];
+      op = cqe->user_data;
+      res = cqe->res;
+      head++;
+      ring->in_flight--;
+
+      if (op == URING_CANCEL)
+        continue;
+      if (op == URING_TIMEOUT) {
+        /* Time's up: abandon the exchanges still in progress */
+        timer_running = 0;
+        for (i=0; i<ring->n_handles; i++) {
+          if (!ring->slots[i].done)
+            uring_finish(ring, i, ARCP_ERROR_CONN_TIMEOUT, NULL, resps,
+              results);
+        }
+        continue;
+      }
+
+      i = (unsigned int)(op >> URING_OP_SHIFT);
+      s = &ring->slots[i];
+      if ((op & 1) == URING_OP_SEND) {
+        s->sending = 0;
+        /* Bytes which went out are captured even if the exchange is over */
+        if (res > 0)
+          arcp_handle_tx_commit(ring->handles[i], ring->handles[i]->tx_buf+
+            s->tx_done, (uint16)res);
+        if (s->done)
+          continue;
+        if (res==-EINTR || res==-EAGAIN)
+          res = 0;
+        if (res < 0)
+          uring_finish(ring, i, ARCP_ERROR_CONN_DROPPED, NULL, resps, results);
+        else {
+          s->tx_done = (uint16)(s->tx_done+res);
+          if (s->tx_done<s->tx_len && uring_queue_send(ring, i)!=0)
+            uring_finish(ring, i, ARCP_ERROR_LOCAL, NULL, resps, results);
+        }
+      } else {
+        s->receiving = 0;
+        if (s->done)
+          continue;
+        if (res == -EINTR || res == -EAGAIN) {
+          if (uring_queue_recv(ring, i) != 0)
+            uring_finish(ring, i, ARCP_ERROR_LOCAL, NULL, resps, results);
+        } else
+        if (res <= 0)
+          uring_finish(ring, i, ARCP_ERROR_CONN_DROPPED, NULL, resps, results);
+        else {
+          arcp_handle_rx_commit(ring->handles[i], (uint16)res);
+          uring_received(ring, i, resps, results);
+        }
+      }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    /* Once every exchange is over the timer is no longer needed */
+    if (timer_running) {
+      for (i=0; i<ring->n_handles && ring->slots[i].done; i++)
+        ;
+      if (i == ring->n_handles) {
+        uring_queue_cancel(ring, URING_TIMEOUT);
+        timer_running = 0;
+      }
+    }
+  } while (ring->in_flight!=0 || ring->sq_queued!=0);
+
+  failed = 0;
+  for (i=0; i<ring->n_handles; i++) {
+    if (cmds[i]!=NULL && results[i]!=0)
+      failed++;
+  }
+  return failed;
+}
+/* ======================================================================== */
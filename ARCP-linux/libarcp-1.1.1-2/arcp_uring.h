@@ -0,0 +1,30 @@
+/*
+ * An io_uring transport for exchanging commands with many modules at once
+ * under Linux.  See arcp_uring.c for details.
+ */
+
+#ifndef _ARCP_URING_H
+#define _ARCP_URING_H
+
+#include "arcp.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ======================================================================== */
+
+typedef struct arcp_uring_t arcp_uring_t;
+
+arcp_uring_t *arcp_uring_new(arcp_handle_t **handles, unsigned int n_handles);
+void arcp_uring_free(arcp_uring_t *ring);
+signed int arcp_uring_exec_cmds(arcp_uring_t *ring, arcp_msg_t **cmds,
+  arcp_msg_t **resps, signed int *results, uint32 timeout_ms);
+
+/* ======================================================================== */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,522 @@
+/*
+ * arcpbench: throughput and latency benchmarks for libarcp, with the
+ * results written to stdout as JSON so they can be compared from release
+ * to release.
+ *
+ * Two groups of measurements are made:
+ *
+ *  - codec: for every command and response type, the time taken to encode
+ *    a message with arcp_msg_encode() (which allocates the stream) and
+ *    arcp_msg_encode_buf() (which doesn't), and to decode it with
+ *    arcp_stream_decode() and free the result.  The number of heap
+ *    allocations each operation makes is counted too.  Messages are made
+ *    as large as the protocol allows: a 512-bit pulse code, the longest
+ *    pulse sequence, a full phase table and a SYSSTAT from a STX2 with
+ *    ARCP_MAX_N_RF_CARDS cards of ARCP_MAX_N_RF_CARD_OUTPUT outputs, the
+ *    most fans and the most external units.  The flat STX2 status decode
+ *    (arcp_stx2flat_decode_buf()) of that SYSSTAT is measured as well.
+ *
+ *  - latency: round trip times of arcp_ping() and arcp_get_sysstat() over
+ *    a loopback TCP connection, reported as percentiles.  By default the
+ *    slave is a thread within the benchmark answering with the worst-case
+ *    status above; -a points the benchmark at another slave (arcpsim for
+ *    example) instead.
+ *
+ * Usage: arcpbench [-i iterations] [-n samples] [-a addr] [-p port]
+ *   -i N      codec iterations per measurement (default 100000)
+ *   -n N      round trips per latency measurement (default 10000)
+ *   -a ADDR   measure latency against the slave at ADDR
+ *   -p PORT   port of that slave (default ARCP_TCP_PORT)
+ *
+ * Allocations are counted by wrapping malloc(), calloc() and realloc() at
+ * link time (see the arcpbench rule in the Makefile), so this is Linux
+ * only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "arcp.h"
+
+/* Stream-level functions which arcp.h doesn't declare */
+signed int arcp_msg_encode(arcp_msg_t *msg, arcp_stream_t **enc_stream);
+signed int arcp_stream_decode(arcp_stream_t *stream, arcp_msg_t **dec_msg);
+void arcp_stream_free(arcp_stream_t *stream);
+
+/* ======================================================================== */
+
+/* Round trips made before latency samples are taken */
+#define BENCH_WARMUP           1000
+
+typedef struct bench_slave_t {
+  arcp_socket_t listen_fd;
+  arcp_sysstat_t *sysstat;
+} bench_slave_t;
+
+/* Heap allocations made since the program started */
+static volatile unsigned long n_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+/* ======================================================================== */
+
+void *__wrap_malloc(size_t size) {
+  __sync_fetch_and_add(&n_allocs, 1);
+  return __real_malloc(size);
+}
+/* ======================================================================== */
+
+void *__wrap_calloc(size_t n, size_t size) {
+  __sync_fetch_and_add(&n_allocs, 1);
+  return __real_calloc(n, size);
+}
+/* ======================================================================== */
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  __sync_fetch_and_add(&n_allocs, 1);
+  return __real_realloc(ptr, size);
+}
+/* ======================================================================== */
+
+static double bench_now_ns(void) {
+/*
+ * Returns the monotonic clock in nanoseconds.
+ */
+struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+/* ======================================================================== */
+
+static int bench_cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x<y ? -1 : x>y;
+}
+/* ======================================================================== */
+
+static arcp_sysstat_t *bench_worst_sysstat(void) {
+/*
+ * Creates the largest STX2 status the decoder accepts: the most fans, RF
+ * cards, outputs and external units, each unit with the most temperatures
+ * and outputs.
+ */
+arcp_sysstat_t *sysstat = arcp_sysstat_new();
+arcp_stx2stat_t *stx2;
+unsigned int i, j;
+
+  if (sysstat==NULL || arcp_sysstat_set_moduletype(sysstat, ARCP_MODULE_STX2)!=0)
+    return NULL;
+  stx2 = sysstat->data.stx2;
+  stx2->card_map = 0xffff;
+  stx2->rail_supply = 48000;
+  stx2->rail_aux = 12000;
+  stx2->ambient_temp = 25;
+  if (arcp_stx2stat_set_n_chassis_fans(stx2, ARCP_MAX_N_CHASSIS_FANS)!=0 ||
+      arcp_stx2stat_set_n_rf_cards(stx2, ARCP_MAX_N_RF_CARDS)!=0 ||
+      arcp_stx2stat_set_n_units(stx2, ARCP_STX2_MAX_N_STX2_UNITS)!=0)
+    return NULL;
+  for (i=0; i<ARCP_MAX_N_CHASSIS_FANS; i++)
+    stx2->fan_speed[i] = (uint16)(3000+i);
+  for (i=0; i<ARCP_MAX_N_RF_CARDS; i++) {
+    if (arcp_stx2stat_set_n_rf_outputs(stx2, (uint8)i, ARCP_MAX_N_RF_CARD_OUTPUT) != 0)
+      return NULL;
+    stx2->rf_card_stat[i].rail_supply = 48000;
+    stx2->rf_card_stat[i].heatsink_temp = 45;
+    for (j=0; j<ARCP_MAX_N_RF_CARD_OUTPUT; j++) {
+      stx2->rf_card_stat[i].output_stat[j].forward_power = (uint16)(1000+j);
+      stx2->rf_card_stat[i].output_stat[j].return_loss = -20;
+    }
+  }
+  for (i=0; i<ARCP_STX2_MAX_N_STX2_UNITS; i++) {
+    stx2->unit_stat[i].comb.unit_type = ARCP_STX2_UNIT_EXT_COMBINER_SPLITTER;
+    stx2->unit_stat[i].comb.n_temperatures = ARCP_STX2_EXTCOMB_MAX_N_TEMPERATURES;
+    for (j=0; j<ARCP_STX2_EXTCOMB_MAX_N_TEMPERATURES; j++)
+      stx2->unit_stat[i].comb.temperature[j] = 40;
+    stx2->unit_stat[i].comb.n_outputs = ARCP_STX2_EXTCOMB_MAX_N_OUTPUTS;
+    for (j=0; j<ARCP_STX2_EXTCOMB_MAX_N_OUTPUTS; j++) {
+      stx2->unit_stat[i].comb.output[j].forward_power = (uint16)(1000+j);
+      stx2->unit_stat[i].comb.output[j].return_loss = -20;
+    }
+  }
+  return sysstat;
+}
+/* ======================================================================== */
+
+static arcp_msg_t *bench_make_msg(unsigned int which, const char **name) {
+/*
+ * Creates message number "which" of the set benchmarked and returns its
+ * name in *name.  Returns NULL once "which" is past the end of the set.
+ */
+arcp_msg_t *msg;
+unsigned int i;
+
+  switch (which) {
+    case 0:  *name = "cmd_reset"; break;
+    case 1:  *name = "cmd_ping"; break;
+    case 2:  *name = "cmd_get_sysid"; break;
+    case 3:  *name = "cmd_get_sysstat"; break;
+    case 4:  *name = "cmd_set_module_enable"; break;
+    case 5:  *name = "cmd_set_pulse_param"; break;
+    case 6:  *name = "cmd_set_pulse_seq"; break;
+    case 7:  *name = "cmd_set_pulse_seq_idx"; break;
+    case 8:  *name = "cmd_set_trig_param"; break;
+    case 9:  *name = "cmd_set_usrctl_enable"; break;
+    case 10: *name = "cmd_set_phase"; break;
+    case 11: *name = "resp_ack"; break;
+    case 12: *name = "resp_nak"; break;
+    case 13: *name = "resp_unk"; break;
+    case 14: *name = "resp_sysid_stx2"; break;
+    case 15: *name = "resp_sysid_bsm"; break;
+    case 16: *name = "resp_sysstat_stx2_max"; break;
+    case 17: *name = "resp_sysstat_bsm"; break;
+    default:
+      return NULL;
+  }
+
+  msg = arcp_msg_new(which<11 ? ARCP_MSG_COMMAND : ARCP_MSG_RESPONSE);
+  if (msg == NULL)
+    return NULL;
+  msg->header.exchange_id = 0x1234;
+  msg->header.protocol_version = ARCP_VERSION_WORD(ARCP_VERSION_MAJOR, ARCP_VERSION_MINOR);
+
+  switch (which) {
+    case 0: msg->command.id = ARCP_CMD_RESET; break;
+    case 1: msg->command.id = ARCP_CMD_PING; break;
+    case 2: msg->command.id = ARCP_CMD_GET_SYSID; break;
+    case 3: msg->command.id = ARCP_CMD_GET_SYSSTAT; break;
+    case 4:
+      msg->command.id = ARCP_CMD_SET_MODULE_ENABLE;
+      msg->cmd_enable.enable = 1;
+      break;
+    case 5:
+      msg->command.id = ARCP_CMD_SET_PULSE_PARAM;
+      msg->cmd_set_pulse_param.pulse_map_index = 3;
+      msg->cmd_set_pulse_param.pulse_param.pulse_shape = ARCP_PULSE_SHAPE_GAUSSIAN;
+      msg->cmd_set_pulse_param.pulse_param.pulse_ampl = 1000;
+      msg->cmd_set_pulse_param.pulse_param.pulse_width_ns = 64000;
+      msg->cmd_set_pulse_param.pulse_param.code = arcp_pulsecode_new(ARCP_MAX_PULSECODE_SIZE);
+      if (msg->cmd_set_pulse_param.pulse_param.code == NULL)
+        break;
+      for (i=0; i<ARCP_MAX_PULSECODE_SIZE; i++)
+        arcp_pulsecode_setbit(msg->cmd_set_pulse_param.pulse_param.code,
+          (uint16)i, (uint8)((i*7)>>2 & 1));
+      break;
+    case 6:
+      msg->command.id = ARCP_CMD_SET_PULSE_SEQ;
+      msg->cmd_set_pulse_seq.seq = arcp_pulseseq_new(ARCP_MAX_PULSESEQ_SIZE);
+      if (msg->cmd_set_pulse_seq.seq == NULL)
+        break;
+      for (i=0; i<ARCP_MAX_PULSESEQ_SIZE; i++)
+        arcp_pulseseq_set_entry(msg->cmd_set_pulse_seq.seq, (uint16)i,
+          (uint8)(i%8), ARCP_PULSE_FLAG_NORMAL);
+      break;
+    case 7:
+      msg->command.id = ARCP_CMD_SET_PULSE_SEQ_IDX;
+      msg->cmd_set_pulse_seq_idx.seq_index = 7;
+      break;
+    case 8:
+      msg->command.id = ARCP_CMD_SET_TRIG_PARAM;
+      msg->cmd_set_trig_param.trig_param.pulse_predelay = 100;
+      break;
+    case 9:
+      msg->command.id = ARCP_CMD_SET_USRCTL_ENABLE;
+      msg->cmd_usrctl_enable.enable = 1;
+      break;
+    case 10:
+      msg->command.id = ARCP_CMD_SET_PHASE;
+      msg->cmd_set_phase.phase_slot = 5;
+      msg->cmd_set_phase.phases = malloc(ARCP_BSM_MAX_N_PHASES*sizeof(arcp_phase_entry_t));
+      if (msg->cmd_set_phase.phases == NULL)
+        break;
+      msg->cmd_set_phase.n_phases = ARCP_BSM_MAX_N_PHASES;
+      for (i=0; i<ARCP_BSM_MAX_N_PHASES; i++) {
+        msg->cmd_set_phase.phases[i].channel = (uint16)i;
+        msg->cmd_set_phase.phases[i].phase = 11.25f*i;
+      }
+      break;
+    case 11: msg->response.id = ARCP_RESP_ACK; break;
+    case 12:
+      msg->response.id = ARCP_RESP_NAK;
+      msg->response.info_code = ARCP_STX2_ERROR_PULSE_TOO_LONG;
+      break;
+    case 13: msg->response.id = ARCP_RESP_UNK; break;
+    case 14:
+    case 15:
+      msg->response.id = ARCP_RESP_SYSID;
+      msg->resp_sysid.sysid = arcp_sysid_new();
+      if (msg->resp_sysid.sysid == NULL)
+        break;
+      msg->resp_sysid.sysid->module_type = which==14 ? ARCP_MODULE_STX2 : ARCP_MODULE_BSM;
+      msg->resp_sysid.sysid->module_version = 1;
+      msg->resp_sysid.sysid->firmware_version = 0x0100;
+      if (which == 14) {
+        msg->resp_sysid.sysid->data.stx2.card_map = 0xffff;
+        msg->resp_sysid.sysid->data.stx2.pulse_slot_length = 100000;
+      } else
+        msg->resp_sysid.sysid->data.bsm.channel_map = 0xffff;
+      break;
+    case 16:
+      msg->response.id = ARCP_RESP_SYSSTAT;
+      msg->resp_sysstat.sysstat = bench_worst_sysstat();
+      break;
+    case 17:
+      msg->response.id = ARCP_RESP_SYSSTAT;
+      msg->resp_sysstat.sysstat = arcp_sysstat_new();
+      if (msg->resp_sysstat.sysstat==NULL ||
+          arcp_sysstat_set_moduletype(msg->resp_sysstat.sysstat, ARCP_MODULE_BSM)!=0)
+        break;
+      arcp_bsmstat_set_n_fans(msg->resp_sysstat.sysstat->data.bsm, ARCP_MAX_N_CHASSIS_FANS);
+      msg->resp_sysstat.sysstat->data.bsm->channel_map = 0xffff;
+      msg->resp_sysstat.sysstat->data.bsm->n_heatsink_temps = ARCP_BSM_MAX_N_TEMPERATURES;
+      break;
+  }
+  return msg;
+}
+/* ======================================================================== */
+
+static void bench_codec(unsigned long iterations) {
+/*
+ * Measures encoding and decoding of each message type and prints the
+ * "codec" JSON array.
+ */
+arcp_msg_t *msg, *dec;
+arcp_stream_t *stream, in;
+arcp_stx2flat_t flat;
+uint8 buf[ARCP_MSG_MAX_SIZE];
+uint16 size;
+const char *name, *sep = "";
+unsigned int which;
+unsigned long i, allocs, errs;
+double t, enc_ns, enc_buf_ns, dec_ns;
+double enc_allocs, enc_buf_allocs, dec_allocs;
+
+  printf("  \"codec\": [\n");
+  for (which=0; (msg = bench_make_msg(which, &name))!=NULL; which++) {
+    if (arcp_msg_encode_buf(msg, buf, sizeof(buf), &size) != 0) {
+      fprintf(stderr, "arcpbench: can't encode %s\n", name);
+      exit(1);
+    }
+    errs = 0;
+
+    allocs = n_allocs;
+    t = bench_now_ns();
+    for (i=0; i<iterations; i++) {
+      errs += arcp_msg_encode(msg, &stream) != 0;
+      arcp_stream_free(stream);
+    }
+    enc_ns = (bench_now_ns()-t)/iterations;
+    enc_allocs = (double)(n_allocs-allocs)/iterations;
+
+    allocs = n_allocs;
+    t = bench_now_ns();
+    for (i=0; i<iterations; i++)
+      errs += arcp_msg_encode_buf(msg, buf, sizeof(buf), NULL) != 0;
+    enc_buf_ns = (bench_now_ns()-t)/iterations;
+    enc_buf_allocs = (double)(n_allocs-allocs)/iterations;
+
+    allocs = n_allocs;
+    t = bench_now_ns();
+    for (i=0; i<iterations; i++) {
+      in.size = size;
+      in.data = in.head = buf;
+      in.end = buf+size-1;
+      in.err = 0;
+      errs += arcp_stream_decode(&in, &dec) != 0;
+      arcp_msg_free(dec);
+    }
+    dec_ns = (bench_now_ns()-t)/iterations;
+    dec_allocs = (double)(n_allocs-allocs)/iterations;
+
+    if (errs != 0) {
+      fprintf(stderr, "arcpbench: %lu errors coding %s\n", errs, name);
+      exit(1);
+    }
+    printf("%s    {\"name\": \"%s\", \"size\": %u, "
+      "\"encode_ns\": %.1f, \"encode_allocs\": %.2f, "
+      "\"encode_buf_ns\": %.1f, \"encode_buf_allocs\": %.2f, "
+      "\"decode_ns\": %.1f, \"decode_allocs\": %.2f}",
+      sep, name, size, enc_ns, enc_allocs, enc_buf_ns, enc_buf_allocs,
+      dec_ns, dec_allocs);
+
+    /* The largest STX2 status is also decoded into the flat form */
+    if (which == 16) {
+      errs = 0;
+      allocs = n_allocs;
+      t = bench_now_ns();
+      for (i=0; i<iterations; i++)
+        errs += arcp_stx2flat_decode_buf(buf, size, &flat) != 0;
+      dec_ns = (bench_now_ns()-t)/iterations;
+      dec_allocs = (double)(n_allocs-allocs)/iterations;
+      if (errs != 0) {
+        fprintf(stderr, "arcpbench: %lu errors decoding flat status\n", errs);
+        exit(1);
+      }
+      printf(",\n    {\"name\": \"%s_flat\", \"size\": %u, "
+        "\"decode_ns\": %.1f, \"decode_allocs\": %.2f}",
+        name, size, dec_ns, dec_allocs);
+    }
+    arcp_msg_free(msg);
+    sep = ",\n";
+  }
+  printf("\n  ],\n");
+}
+/* ======================================================================== */
+
+static void *bench_slave_thread(void *arg) {
+/*
+ * Answers PING and GET_SYSSTAT commands on the first connection accepted,
+ * until it is closed.
+ */
+bench_slave_t *slave = arg;
+arcp_handle_t *handle;
+arcp_msg_t *msg;
+arcp_socket_t fd;
+signed int res = 0;
+
+  fd = accept(slave->listen_fd, NULL, NULL);
+  if (fd < 0)
+    return NULL;
+  handle = arcp_handle_new(fd);
+  while (handle!=NULL && res==0 && arcp_msg_read(handle, &msg)==0) {
+    if (msg->header.msg_type == ARCP_MSG_COMMAND) {
+      if (msg->command.id == ARCP_CMD_GET_SYSSTAT)
+        res = arcp_send_sysstat(handle, msg, slave->sysstat);
+      else
+        res = arcp_send_ack(handle, msg);
+    }
+    arcp_msg_free(msg);
+  }
+  arcp_handle_free(handle);
+  close(fd);
+  return NULL;
+}
+/* ======================================================================== */
+
+static void bench_latency(arcp_handle_t *handle, const char *name,
+  unsigned long n_samples, int sysstat, int last) {
+/*
+ * Times n_samples round trips of arcp_ping() (or arcp_get_sysstat() if
+ * sysstat is non-zero) and prints their statistics as a JSON object.
+ */
+double *samples = malloc(n_samples*sizeof(double));
+double t, sum = 0.0;
+arcp_sysstat_t *stat;
+unsigned long i;
+signed int res = 0;
+
+  if (samples == NULL) {
+    fprintf(stderr, "arcpbench: out of memory\n");
+    exit(1);
+  }
+  for (i=0; i<BENCH_WARMUP+n_samples && res==0; i++) {
+    t = bench_now_ns();
+    if (sysstat) {
+      res = arcp_get_sysstat(handle, &stat);
+      if (res == 0)
+        arcp_sysstat_free(stat);
+    } else
+      res = arcp_ping(handle);
+    t = bench_now_ns()-t;
+    if (i >= BENCH_WARMUP) {
+      samples[i-BENCH_WARMUP] = t/1000.0;
+      sum += t/1000.0;
+    }
+  }
+  if (res != 0) {
+    fprintf(stderr, "arcpbench: %s failed (%d)\n", name, res);
+    exit(1);
+  }
+
+  qsort(samples, n_samples, sizeof(double), bench_cmp_double);
+  printf("    {\"name\": \"%s\", \"samples\": %lu, \"mean_us\": %.2f, "
+    "\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, "
+    "\"p999_us\": %.2f, \"max_us\": %.2f}%s\n",
+    name, n_samples, sum/n_samples, samples[n_samples/2],
+    samples[n_samples*9/10], samples[n_samples*99/100],
+    samples[n_samples*999/1000], samples[n_samples-1], last?"":",");
+  free(samples);
+}
+/* ======================================================================== */
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-i iterations] [-n samples] [-a addr] [-p port]\n",
+    prog);
+  exit(1);
+}
+/* ======================================================================== */
+
+int main(int argc, char *argv[]) {
+unsigned long iterations = 100000, n_samples = 10000;
+unsigned long port = ARCP_TCP_PORT;
+const char *slave_addr = NULL;
+struct sockaddr_in addr;
+socklen_t addr_len = sizeof(addr);
+bench_slave_t slave;
+arcp_handle_t *handle;
+pthread_t thread;
+signed int res;
+int opt;
+
+  while ((opt = getopt(argc, argv, "i:n:a:p:")) != -1) {
+    switch (opt) {
+      case 'i': iterations = strtoul(optarg, NULL, 0); break;
+      case 'n': n_samples = strtoul(optarg, NULL, 0); break;
+      case 'a': slave_addr = optarg; break;
+      case 'p': port = strtoul(optarg, NULL, 0); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (iterations==0 || n_samples==0 || port==0 || port>0xffff)
+    usage(argv[0]);
+
+  printf("{\n  \"libarcp_version\": \"%s\",\n  \"iterations\": %lu,\n",
+    LIBARCP_VERSION_STR, iterations);
+  bench_codec(iterations);
+
+  /* Start an internal slave on an ephemeral loopback port unless told to
+   * use another.
+   */
+  if (slave_addr == NULL) {
+    slave_addr = "127.0.0.1";
+    slave.sysstat = bench_worst_sysstat();
+    slave.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (slave.sysstat==NULL || slave.listen_fd<0 ||
+        bind(slave.listen_fd, (struct sockaddr *)&addr, sizeof(addr))<0 ||
+        listen(slave.listen_fd, 1)<0 ||
+        getsockname(slave.listen_fd, (struct sockaddr *)&addr, &addr_len)<0 ||
+        pthread_create(&thread, NULL, bench_slave_thread, &slave)!=0) {
+      fprintf(stderr, "arcpbench: can't start the internal slave\n");
+      return 1;
+    }
+    port = ntohs(addr.sin_port);
+  }
+
+  handle = arcp_handle_new(ARCP_INVALID_SOCKET);
+  if (handle == NULL)
+    return 1;
+  res = arcp_handle_connect(handle, slave_addr, (uint16)port);
+  if (res != 0) {
+    fprintf(stderr, "arcpbench: can't connect to %s:%lu (%d)\n", slave_addr,
+      port, res);
+    return 1;
+  }
+  printf("  \"latency_slave\": \"%s\",\n  \"latency\": [\n", slave_addr);
+  bench_latency(handle, "ping", n_samples, 0, 0);
+  bench_latency(handle, "get_sysstat", n_samples, 1, 1);
+  printf("  ]\n}\n");
+
+  close(arcp_handle_get_socket(handle));
+  arcp_handle_free(handle);
+  return 0;
+}
+/* ======================================================================== */
@@ -0,0 +1,246 @@
+/*
+ * arcpcodeccheck: checks that the schema-driven C++ codecs in arcp_codec.h
+ * and the hand-written C codecs in arcp.c agree on the wire format of
+ * every message arcp_codec.h describes.
+ *
+ * Each message is encoded by both and the bytes compared; the size
+ * reported by arcp::codec::size() must match too.  The encoding is then
+ * decoded by each codec and re-encoded by the other, which must reproduce
+ * it exactly.  Finally arcp::codec::decode() is given a bad magic number,
+ * a msg_length larger than the buffer and a truncated body, all of which
+ * it must reject.
+ *
+ * Run by "make check".  Prints a line for each failure and exits with
+ * status 1 if there were any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arcp.h"
+#include "arcp_codec.h"
+
+/* Stream-level function which arcp.h doesn't declare */
+extern "C" signed int arcp_stream_decode(arcp_stream_t *stream, arcp_msg_t **dec_msg);
+
+/* ======================================================================== */
+
+static arcp_msg_t *check_make_msg(unsigned int which, const char **name) {
+/*
+ * Creates message number "which" of the set checked and returns its name
+ * in *name.  Returns NULL once "which" is past the end of the set.
+ */
+arcp_msg_t *msg;
+unsigned int i;
+
+  switch (which) {
+    case 0:  *name = "cmd_reset"; break;
+    case 1:  *name = "cmd_ping"; break;
+    case 2:  *name = "cmd_get_sysid"; break;
+    case 3:  *name = "cmd_get_sysstat"; break;
+    case 4:  *name = "cmd_set_module_enable"; break;
+    case 5:  *name = "cmd_set_pulse_param"; break;
+    case 6:  *name = "cmd_set_pulse_seq"; break;
+    case 7:  *name = "cmd_set_pulse_seq_idx"; break;
+    case 8:  *name = "cmd_set_trig_param"; break;
+    case 9:  *name = "cmd_set_usrctl_enable"; break;
+    case 10: *name = "cmd_set_phase"; break;
+    case 11: *name = "resp_ack"; break;
+    case 12: *name = "resp_nak"; break;
+    case 13: *name = "resp_unk"; break;
+    case 14: *name = "resp_sysid_stx2"; break;
+    case 15: *name = "resp_sysid_bsm"; break;
+    default:
+      return NULL;
+  }
+
+  msg = arcp_msg_new(which<11 ? ARCP_MSG_COMMAND : ARCP_MSG_RESPONSE);
+  if (msg == NULL)
+    return NULL;
+  msg->header.exchange_id = (uint16)(0x1200+which);
+  msg->header.protocol_version = ARCP_VERSION_WORD(ARCP_VERSION_MAJOR, ARCP_VERSION_MINOR);
+
+  switch (which) {
+    case 0: msg->command.id = ARCP_CMD_RESET; break;
+    case 1: msg->command.id = ARCP_CMD_PING; break;
+    case 2: msg->command.id = ARCP_CMD_GET_SYSID; break;
+    case 3: msg->command.id = ARCP_CMD_GET_SYSSTAT; break;
+    case 4:
+      msg->command.id = ARCP_CMD_SET_MODULE_ENABLE;
+      msg->cmd_enable.enable = 1;
+      break;
+    case 5:
+      msg->command.id = ARCP_CMD_SET_PULSE_PARAM;
+      msg->cmd_set_pulse_param.pulse_map_index = 3;
+      msg->cmd_set_pulse_param.pulse_param.pulse_shape = ARCP_PULSE_SHAPE_GAUSSIAN;
+      msg->cmd_set_pulse_param.pulse_param.pulse_ampl = 1000;
+      msg->cmd_set_pulse_param.pulse_param.pulse_options = 0x0102;
+      msg->cmd_set_pulse_param.pulse_param.pulse_width_ns = 64000;
+      /* An odd length exercises the partial last byte */
+      msg->cmd_set_pulse_param.pulse_param.code = arcp_pulsecode_new(13);
+      if (msg->cmd_set_pulse_param.pulse_param.code == NULL)
+        break;
+      for (i=0; i<13; i++)
+        arcp_pulsecode_setbit(msg->cmd_set_pulse_param.pulse_param.code,
+          (uint16)i, (uint8)((i*7)>>2 & 1));
+      break;
+    case 6:
+      msg->command.id = ARCP_CMD_SET_PULSE_SEQ;
+      msg->cmd_set_pulse_seq.seq = arcp_pulseseq_new(37);
+      if (msg->cmd_set_pulse_seq.seq == NULL)
+        break;
+      for (i=0; i<37; i++)
+        arcp_pulseseq_set_entry(msg->cmd_set_pulse_seq.seq, (uint16)i,
+          (uint8)(i%8), ARCP_PULSE_FLAG_NORMAL);
+      break;
+    case 7:
+      msg->command.id = ARCP_CMD_SET_PULSE_SEQ_IDX;
+      msg->cmd_set_pulse_seq_idx.seq_index = 7;
+      break;
+    case 8:
+      msg->command.id = ARCP_CMD_SET_TRIG_PARAM;
+      msg->cmd_set_trig_param.trig_param.trigger_source = 1;
+      msg->cmd_set_trig_param.trig_param.ext_trigger_options = 2;
+      msg->cmd_set_trig_param.trig_param.int_trigger_freq = 1000;
+      msg->cmd_set_trig_param.trig_param.pulse_predelay = 100;
+      break;
+    case 9:
+      msg->command.id = ARCP_CMD_SET_USRCTL_ENABLE;
+      msg->cmd_usrctl_enable.enable = 1;
+      break;
+    case 10:
+      msg->command.id = ARCP_CMD_SET_PHASE;
+      msg->cmd_set_phase.phase_slot = 5;
+      msg->cmd_set_phase.phases =
+        (arcp_phase_entry_t *)malloc(ARCP_BSM_MAX_N_PHASES*sizeof(arcp_phase_entry_t));
+      if (msg->cmd_set_phase.phases == NULL)
+        break;
+      msg->cmd_set_phase.n_phases = ARCP_BSM_MAX_N_PHASES;
+      for (i=0; i<ARCP_BSM_MAX_N_PHASES; i++) {
+        msg->cmd_set_phase.phases[i].channel = (uint16)i;
+        msg->cmd_set_phase.phases[i].phase = 11.25f*i;
+      }
+      break;
+    case 11: msg->response.id = ARCP_RESP_ACK; break;
+    case 12:
+      msg->response.id = ARCP_RESP_NAK;
+      msg->response.info_code = ARCP_STX2_ERROR_PULSE_TOO_LONG;
+      break;
+    case 13: msg->response.id = ARCP_RESP_UNK; break;
+    case 14:
+    case 15:
+      msg->response.id = ARCP_RESP_SYSID;
+      msg->resp_sysid.sysid = arcp_sysid_new();
+      if (msg->resp_sysid.sysid == NULL)
+        break;
+      msg->resp_sysid.sysid->module_type = which==14 ? ARCP_MODULE_STX2 : ARCP_MODULE_BSM;
+      msg->resp_sysid.sysid->module_version = 1;
+      msg->resp_sysid.sysid->firmware_version = 0x0100;
+      msg->resp_sysid.sysid->ctrl_board_logic_version = 0x0203;
+      if (which == 14) {
+        msg->resp_sysid.sysid->data.stx2.card_map = 0x00ff;
+        msg->resp_sysid.sysid->data.stx2.pulse_slot_length = 100000;
+      } else
+        msg->resp_sysid.sysid->data.bsm.channel_map = 0xf0f0;
+      break;
+  }
+  return msg;
+}
+/* ======================================================================== */
+
+static unsigned int check_msg(const char *name, arcp_msg_t *msg) {
+/*
+ * Checks the given message as described at the top of the file.  Returns
+ * the number of failures.
+ */
+uint8 c_buf[ARCP_MSG_MAX_SIZE], x_buf[ARCP_MSG_MAX_SIZE], buf[ARCP_MSG_MAX_SIZE];
+uint16 c_len, x_len, len;
+arcp_msg_t *dec;
+arcp_stream_t in;
+unsigned int fails = 0;
+
+  if (arcp_msg_encode_buf(msg, c_buf, sizeof(c_buf), &c_len) != 0) {
+    printf("%s: C encode failed\n", name);
+    return 1;
+  }
+  if (arcp::codec::size(*msg) != c_len) {
+    printf("%s: codec size %d, C size %u\n", name, arcp::codec::size(*msg), c_len);
+    fails++;
+  }
+  if (arcp::codec::encode(*msg, x_buf, sizeof(x_buf), &x_len) != 0) {
+    printf("%s: codec encode failed\n", name);
+    return fails+1;
+  }
+  if (x_len!=c_len || memcmp(x_buf, c_buf, c_len)!=0) {
+    printf("%s: codec and C encodings differ\n", name);
+    fails++;
+  }
+
+  /* C encoding -> codec decode -> C encode */
+  if (arcp::codec::decode(c_buf, c_len, &dec) != 0) {
+    printf("%s: codec decode failed\n", name);
+    fails++;
+  } else {
+    if (arcp_msg_encode_buf(dec, buf, sizeof(buf), &len)!=0 ||
+        len!=c_len || memcmp(buf, c_buf, c_len)!=0) {
+      printf("%s: codec decode does not round-trip through C\n", name);
+      fails++;
+    }
+    arcp_msg_free(dec);
+  }
+
+  /* Codec encoding -> C decode -> codec encode */
+  in.size = x_len;
+  in.data = in.head = x_buf;
+  in.end = x_buf+x_len-1;
+  in.err = 0;
+  if (arcp_stream_decode(&in, &dec) != 0) {
+    printf("%s: C decode failed\n", name);
+    fails++;
+  } else {
+    if (arcp::codec::encode(*dec, buf, sizeof(buf), &len)!=0 ||
+        len!=x_len || memcmp(buf, x_buf, x_len)!=0) {
+      printf("%s: C decode does not round-trip through the codec\n", name);
+      fails++;
+    }
+    arcp_msg_free(dec);
+  }
+
+  /* Malformed input must be rejected */
+  memcpy(buf, c_buf, c_len);
+  buf[0] ^= 0xff;
+  if (arcp::codec::decode(buf, c_len, &dec) != ARCP_ERROR_BADMSG) {
+    printf("%s: bad magic number accepted\n", name);
+    arcp_msg_free(dec);
+    fails++;
+  }
+  if (arcp::codec::decode(c_buf, (uint16)(c_len-1), &dec) != ARCP_ERROR_BADMSG) {
+    printf("%s: msg_length beyond the buffer accepted\n", name);
+    arcp_msg_free(dec);
+    fails++;
+  }
+  memcpy(buf, c_buf, c_len);
+  arcp::codec::put<uint16>(buf+4, (uint16)(c_len-1));
+  if (c_len > (msg->header.msg_type==ARCP_MSG_COMMAND ?
+        arcp::codec::cmd_prefix_size : arcp::codec::resp_prefix_size) &&
+      arcp::codec::decode(buf, c_len, &dec) != ARCP_ERROR_BADMSG) {
+    printf("%s: truncated body accepted\n", name);
+    arcp_msg_free(dec);
+    fails++;
+  }
+  return fails;
+}
+/* ======================================================================== */
+
+int main(void) {
+arcp_msg_t *msg;
+const char *name;
+unsigned int which, fails = 0;
+
+  for (which=0; (msg = check_make_msg(which, &name))!=NULL; which++) {
+    fails += check_msg(name, msg);
+    arcp_msg_free(msg);
+  }
+  printf("arcpcodeccheck: %u messages, %u failures\n", which, fails);
+  return fails!=0;
+}
@@ -0,0 +1,469 @@
+/*
+ * arcpproxy: an aggregating ARCP proxy.  Monitoring clients connect to the
+ * proxy instead of to the modules themselves, so however many of them there
+ * are each module sees a single master polling it at a fixed rate.
+ *
+ * The proxy keeps one connection to each module given on the command line
+ * and refreshes a cached copy of the module's status from it at the
+ * configured interval (its system ID is fetched whenever the connection is
+ * made).  Clients connect to the proxy's port for that module: the first
+ * module is served on the listen port, the next on the port after it and
+ * so on.  Each port is served by an arcp_server (see arcp_server.c).
+ *
+ * GET_SYSID and GET_SYSSTAT are answered from the cache and PING by the
+ * proxy itself.  If the cached status is older than the maximum age (the
+ * module has stopped answering, say) a refresh is requested and awaited;
+ * if that fails too the client's connection is closed, much as a direct
+ * connection to the dead module would fail.  Every other command is
+ * forwarded to the module over the proxy's connection, renumbered into
+ * that connection's exchange ID sequence, and the module's response is
+ * returned to the client under the client's exchange ID.  Forwarded
+ * commands are sent one at a time, interleaved with the status refreshes,
+ * and each one triggers an early refresh so the cache soon reflects any
+ * change it made.
+ *
+ * Usage: arcpproxy [options] module_addr...
+ *   -l ADDR   address to listen on (default all)
+ *   -p PORT   listen port for the first module (default ARCP_TCP_PORT)
+ *   -P PORT   TCP port of the modules (default ARCP_TCP_PORT)
+ *   -r MS     status refresh interval in milliseconds (default 1000)
+ *   -x MS     maximum age of status served from the cache (default three
+ *             refresh intervals)
+ *   -T MS     connect, send and receive timeout towards the modules
+ *             (default 1000)
+ *   -t N      handler threads per module (default 2)
+ *   -v        report module connections and failures on stderr
+ *
+ * The proxy runs until interrupted or terminated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "arcp.h"
+#include "arcp_server.h"
+
+/* ======================================================================== */
+
+typedef struct proxy_config_t {
+  unsigned long module_port;
+  unsigned int refresh_ms, max_age_ms, timeout_ms;
+  unsigned int n_threads;
+  int verbose;
+} proxy_config_t;
+
+typedef struct proxy_module_t {
+  const char *addr;
+  unsigned long listen_port;
+  arcp_server_t *server;
+  pthread_t refresh_thread;
+  /* The connection to the module, used by one thread at a time.  io_lock
+   * is always taken before lock.
+   */
+  pthread_mutex_t io_lock;
+  arcp_handle_t *handle;
+  int connected;
+  /* The cache.  refreshed is signalled after every refresh attempt, which
+   * increments generation; wanted asks the refresh thread for an early
+   * refresh.
+   */
+  pthread_mutex_t lock;
+  pthread_cond_t refreshed, wake;
+  arcp_sysid_t *sysid;
+  arcp_sysstat_t *sysstat;
+  uint32 stamp;
+  unsigned int generation;
+  int wanted, stopping;
+} proxy_module_t;
+
+static proxy_config_t config = {
+  ARCP_TCP_PORT, 1000, 0, 1000, 2, 0,
+};
+
+/* Commands forwarded to the modules */
+static const arcp_cmd_id_t forwarded[] = {
+  ARCP_CMD_RESET, ARCP_CMD_SET_MODULE_ENABLE, ARCP_CMD_SET_PULSE_PARAM,
+  ARCP_CMD_SET_PULSE_SEQ, ARCP_CMD_SET_PULSE_SEQ_IDX, ARCP_CMD_SET_TRIG_PARAM,
+  ARCP_CMD_SET_USRCTL_ENABLE, ARCP_CMD_SET_PHASE,
+};
+
+/* ======================================================================== */
+
+static void proxy_deadline(struct timespec *ts, unsigned int ms) {
+/*
+ * Sets ts to ms milliseconds from now on the monotonic clock.
+ */
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts->tv_sec += ms/1000;
+  ts->tv_nsec += (long)(ms%1000)*1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+/* ======================================================================== */
+
+static void proxy_disconnect(proxy_module_t *m, signed int err) {
+/*
+ * Closes the connection to the given module after error err.  Called with
+ * io_lock held.
+ */
+  if (config.verbose)
+    fprintf(stderr, "%s: disconnected (error %d)\n", m->addr, err);
+  arcp_handle_disconnect(m->handle);
+  m->connected = 0;
+}
+/* ======================================================================== */
+
+static signed int proxy_connect(proxy_module_t *m) {
+/*
+ * Connects to the given module if not already connected and fetches its
+ * system ID into the cache.  Called with io_lock held.  Returns 0 on
+ * success or an ARCP_ERROR_* code.
+ */
+arcp_sysid_t *sysid = NULL;
+signed int res;
+
+  if (m->connected)
+    return 0;
+  res = arcp_handle_connect(m->handle, m->addr, (uint16)config.module_port);
+  if (res != 0) {
+    if (config.verbose)
+      fprintf(stderr, "%s: connect failed (error %d)\n", m->addr, res);
+    return res;
+  }
+  m->connected = 1;
+  res = arcp_get_sysid(m->handle, &sysid);
+  if (res != 0) {
+    proxy_disconnect(m, res);
+    return res<ARCP_RESP ? res : ARCP_ERROR_BAD_RESPONSE;
+  }
+  if (config.verbose)
+    fprintf(stderr, "%s: connected\n", m->addr);
+
+  pthread_mutex_lock(&m->lock);
+  arcp_sysid_free(m->sysid);
+  m->sysid = sysid;
+  pthread_mutex_unlock(&m->lock);
+  return 0;
+}
+/* ======================================================================== */
+
+static void proxy_refresh(proxy_module_t *m) {
+/*
+ * Refreshes the given module's cached status, connecting first if needed.
+ */
+arcp_sysstat_t *sysstat = NULL;
+signed int res;
+
+  pthread_mutex_lock(&m->io_lock);
+  res = proxy_connect(m);
+  if (res == 0) {
+    res = arcp_get_sysstat(m->handle, &sysstat);
+    if (res < ARCP_RESP)
+      proxy_disconnect(m, res);
+  }
+  pthread_mutex_unlock(&m->io_lock);
+
+  pthread_mutex_lock(&m->lock);
+  if (sysstat != NULL) {
+    arcp_sysstat_free(m->sysstat);
+    m->sysstat = sysstat;
+    m->stamp = arcp_clock_ms();
+  }
+  m->generation++;
+  pthread_cond_broadcast(&m->refreshed);
+  pthread_mutex_unlock(&m->lock);
+}
+/* ======================================================================== */
+
+static void *proxy_refresh_thread(void *arg) {
+/*
+ * Refreshes the given module's status every refresh interval, or earlier
+ * when asked to.
+ */
+proxy_module_t *m = arg;
+struct timespec next;
+
+  for (;;) {
+    proxy_refresh(m);
+    proxy_deadline(&next, config.refresh_ms);
+
+    pthread_mutex_lock(&m->lock);
+    while (!m->stopping && !m->wanted) {
+      if (pthread_cond_timedwait(&m->wake, &m->lock, &next) == ETIMEDOUT)
+        break;
+    }
+    m->wanted = 0;
+    if (m->stopping) {
+      pthread_mutex_unlock(&m->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&m->lock);
+  }
+}
+/* ======================================================================== */
+
+static int proxy_cache_fresh(proxy_module_t *m) {
+/*
+ * Returns non-zero if the given module's cache may be served.  Called with
+ * lock held.
+ */
+  return m->sysid!=NULL && m->sysstat!=NULL &&
+         (uint32)(arcp_clock_ms()-m->stamp) <= config.max_age_ms;
+}
+/* ======================================================================== */
+
+static int proxy_cache_wait(proxy_module_t *m) {
+/*
+ * Takes the given module's lock, first requesting and waiting for a
+ * refresh if the cache is stale.  Returns non-zero if the cache may be
+ * served.  The lock is held on return either way.
+ */
+struct timespec deadline;
+unsigned int generation;
+
+  pthread_mutex_lock(&m->lock);
+  if (proxy_cache_fresh(m))
+    return 1;
+
+  /* Allow for connecting and fetching the system ID and status */
+  m->wanted = 1;
+  pthread_cond_signal(&m->wake);
+  generation = m->generation;
+  proxy_deadline(&deadline, 3*config.timeout_ms+config.refresh_ms);
+  while (m->generation == generation) {
+    if (pthread_cond_timedwait(&m->refreshed, &m->lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+  return proxy_cache_fresh(m);
+}
+/* ======================================================================== */
+
+static signed int proxy_get_sysid(arcp_msg_t *cmd, arcp_msg_t *resp,
+  void *user_data) {
+/*
+ * Handler for GET_SYSID: answers from the cache.
+ */
+proxy_module_t *m = user_data;
+arcp_sysid_t *sysid = NULL;
+
+  if (proxy_cache_wait(m) && (sysid=arcp_sysid_new())!=NULL)
+    *sysid = *m->sysid;
+  pthread_mutex_unlock(&m->lock);
+  if (sysid == NULL)
+    return ARCP_ERROR_CONN_TIMEOUT;
+  resp->response.id = ARCP_RESP_SYSID;
+  resp->resp_sysid.sysid = sysid;
+  return 0;
+}
+/* ======================================================================== */
+
+static signed int proxy_get_sysstat(arcp_msg_t *cmd, arcp_msg_t *resp,
+  void *user_data) {
+/*
+ * Handler for GET_SYSSTAT: answers from the cache.
+ */
+proxy_module_t *m = user_data;
+arcp_sysstat_t *sysstat = NULL;
+
+  if (proxy_cache_wait(m))
+    sysstat = arcp_sysstat_copy(m->sysstat);
+  pthread_mutex_unlock(&m->lock);
+  if (sysstat == NULL)
+    return ARCP_ERROR_CONN_TIMEOUT;
+  resp->response.id = ARCP_RESP_SYSSTAT;
+  resp->resp_sysstat.sysstat = sysstat;
+  return 0;
+}
+/* ======================================================================== */
+
+static signed int proxy_forward(arcp_msg_t *cmd, arcp_msg_t *resp,
+  void *user_data) {
+/*
+ * Handler for commands which change the module's state: forwards the
+ * command to the module and returns its response.
+ */
+proxy_module_t *m = user_data;
+arcp_msg_t *mod_resp = NULL;
+signed int res;
+
+  /* arcp_exec_cmds() renumbers cmd in the module connection's exchange ID
+   * sequence; resp already carries the client's exchange ID.
+   */
+  pthread_mutex_lock(&m->io_lock);
+  res = proxy_connect(m);
+  if (res == 0) {
+    res = arcp_exec_cmds(m->handle, &cmd, &mod_resp, 1);
+    if (res != 0)
+      proxy_disconnect(m, res);
+  }
+  pthread_mutex_unlock(&m->io_lock);
+  if (res != 0)
+    return res;
+
+  resp->response.id = mod_resp->response.id;
+  resp->response.info_code = mod_resp->response.info_code;
+  if (mod_resp->response.id == ARCP_RESP_SYSID) {
+    resp->resp_sysid.sysid = mod_resp->resp_sysid.sysid;
+    mod_resp->resp_sysid.sysid = NULL;
+  } else
+  if (mod_resp->response.id == ARCP_RESP_SYSSTAT) {
+    resp->resp_sysstat.sysstat = mod_resp->resp_sysstat.sysstat;
+    mod_resp->resp_sysstat.sysstat = NULL;
+  }
+  arcp_msg_free(mod_resp);
+
+  /* The command may have changed the status */
+  pthread_mutex_lock(&m->lock);
+  m->wanted = 1;
+  pthread_cond_signal(&m->wake);
+  pthread_mutex_unlock(&m->lock);
+  return 0;
+}
+/* ======================================================================== */
+
+static int proxy_module_init(proxy_module_t *m) {
+/*
+ * Sets up the given module's connection, cache and server.  Returns 0 on
+ * success or -1 if memory could not be allocated.
+ */
+pthread_condattr_t attr;
+unsigned int i;
+
+  m->handle = arcp_handle_new(ARCP_INVALID_SOCKET);
+  m->server = arcp_server_new(config.n_threads);
+  if (m->handle==NULL || m->server==NULL)
+    return -1;
+  arcp_handle_set_timeouts(m->handle, config.timeout_ms, config.timeout_ms,
+    config.timeout_ms);
+
+  pthread_mutex_init(&m->io_lock, NULL);
+  pthread_mutex_init(&m->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&m->refreshed, &attr);
+  pthread_cond_init(&m->wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  arcp_server_set_handler(m->server, ARCP_CMD_GET_SYSID, proxy_get_sysid, m);
+  arcp_server_set_handler(m->server, ARCP_CMD_GET_SYSSTAT, proxy_get_sysstat, m);
+  for (i=0; i<sizeof(forwarded)/sizeof(forwarded[0]); i++)
+    arcp_server_set_handler(m->server, forwarded[i], proxy_forward, m);
+  return 0;
+}
+/* ======================================================================== */
+
+static void proxy_module_free(proxy_module_t *m) {
+/*
+ * Stops the given module's server and refresh thread and frees its
+ * resources.
+ */
+  arcp_server_free(m->server);
+  pthread_mutex_lock(&m->lock);
+  m->stopping = 1;
+  pthread_cond_signal(&m->wake);
+  pthread_mutex_unlock(&m->lock);
+  pthread_join(m->refresh_thread, NULL);
+
+  arcp_handle_disconnect(m->handle);
+  arcp_handle_free(m->handle);
+  arcp_sysid_free(m->sysid);
+  arcp_sysstat_free(m->sysstat);
+  pthread_mutex_destroy(&m->io_lock);
+  pthread_mutex_destroy(&m->lock);
+  pthread_cond_destroy(&m->refreshed);
+  pthread_cond_destroy(&m->wake);
+}
+/* ======================================================================== */
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "Usage: %s [-l listen_addr] [-p listen_port] [-P module_port]\n"
+    "  [-r refresh_ms] [-x max_age_ms] [-T timeout_ms] [-t threads] [-v]\n"
+    "  module_addr...\n",
+    prog);
+  exit(1);
+}
+/* ======================================================================== */
+
+int main(int argc, char *argv[]) {
+unsigned int n_modules, i;
+unsigned long listen_port = ARCP_TCP_PORT;
+const char *listen_addr = NULL;
+proxy_module_t *modules;
+sigset_t sigs;
+signed int res;
+int opt, sig;
+
+  while ((opt = getopt(argc, argv, "l:p:P:r:x:T:t:v")) != -1) {
+    switch (opt) {
+      case 'l': listen_addr = optarg; break;
+      case 'p': listen_port = strtoul(optarg, NULL, 0); break;
+      case 'P': config.module_port = strtoul(optarg, NULL, 0); break;
+      case 'r': config.refresh_ms = strtoul(optarg, NULL, 0); break;
+      case 'x': config.max_age_ms = strtoul(optarg, NULL, 0); break;
+      case 'T': config.timeout_ms = strtoul(optarg, NULL, 0); break;
+      case 't': config.n_threads = strtoul(optarg, NULL, 0); break;
+      case 'v': config.verbose = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  n_modules = argc-optind;
+  if (n_modules==0 || listen_port==0 || listen_port+n_modules-1>0xffff ||
+      config.module_port==0 || config.module_port>0xffff ||
+      config.refresh_ms==0 || config.timeout_ms==0)
+    usage(argv[0]);
+  if (config.max_age_ms == 0)
+    config.max_age_ms = 3*config.refresh_ms;
+
+  modules = calloc(n_modules, sizeof(proxy_module_t));
+  if (modules == NULL) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+  /* Sends use MSG_NOSIGNAL where possible, but be sure.  The signals which
+   * stop the proxy are taken by the main thread alone.
+   */
+  signal(SIGPIPE, SIG_IGN);
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+  for (i=0; i<n_modules; i++) {
+    modules[i].addr = argv[optind+i];
+    modules[i].listen_port = listen_port+i;
+    if (proxy_module_init(&modules[i]) != 0) {
+      fprintf(stderr, "%s: out of memory\n", argv[0]);
+      return 1;
+    }
+    if (pthread_create(&modules[i].refresh_thread, NULL, proxy_refresh_thread,
+          &modules[i]) != 0) {
+      fprintf(stderr, "%s: can't create thread\n", argv[0]);
+      return 1;
+    }
+    res = arcp_server_start(modules[i].server, listen_addr,
+            (uint16)modules[i].listen_port);
+    if (res != 0) {
+      fprintf(stderr, "%s: can't listen on port %lu for %s (error %d)\n",
+        argv[0], modules[i].listen_port, modules[i].addr, res);
+      return 1;
+    }
+  }
+  fprintf(stderr, "%s: proxying %u modules on ports %lu to %lu\n", argv[0],
+    n_modules, listen_port, listen_port+n_modules-1);
+
+  while (sigwait(&sigs, &sig) != 0)
+    ;
+  for (i=0; i<n_modules; i++)
+    proxy_module_free(&modules[i]);
+  free(modules);
+  return 0;
+}
+/* ======================================================================== */
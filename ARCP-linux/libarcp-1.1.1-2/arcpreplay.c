@@ -0,0 +1,523 @@
+/*
+ * arcpreplay: inspects and replays ARCP capture files written by
+ * arcp_handle_capture(), for reproducing problems seen in the field with
+ * the exact byte streams involved.
+ *
+ * By default the records in the file are listed.  With -d the received
+ * (or with -t the sent) data is pushed through the decoder of a handle
+ * with no socket, in the records' original pieces, exactly as if it were
+ * arriving on a connection; this gives a decode throughput benchmark on
+ * real traffic and reproduces resynchronisation after corrupt data.  The
+ * messages decoded and the errors reported are counted.
+ *
+ * With -a the sent (or with -r the received) data is instead written to a
+ * socket connected to the given address, for example a module or arcpsim,
+ * at its original pace or faster.  With -L the tool listens on the given
+ * port and replays the received data to the first master which connects,
+ * posing as the module.  Anything the peer sends back is read and counted
+ * but otherwise ignored.  The gaps between records are reproduced within
+ * each capture session; successive sessions in the file follow each other
+ * directly.
+ *
+ * Usage: arcpreplay [options] capture_file
+ *   -d        decode the data instead of listing the records
+ *   -n N      with -d, decode the data N times (default 1)
+ *   -a ADDR   replay the data to the module at ADDR
+ *   -L PORT   replay the data to the first master to connect to PORT
+ *   -p PORT   TCP port for -a (default ARCP_TCP_PORT)
+ *   -r        use the received data (default for -d and -L)
+ *   -t        use the sent data (default for -a)
+ *   -x SPEED  replay speed relative to the original, or 0 for as fast as
+ *             possible (default 1)
+ *   -w MS     time to wait for the peer after the last record (default
+ *             1000)
+ *   -v        list the data of each record in hex, or each message decoded
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "arcp.h"
+
+/* ======================================================================== */
+
+/* Sizes of the tables of message and error counts */
+#define REPLAY_MAX_KINDS       64
+#define REPLAY_MAX_ERRORS      32
+
+typedef struct replay_rec_t {
+  uint8 type;
+  uint32 delta;    /* Microseconds since the previous record */
+  uint32 len;
+  uint8 *data;
+} replay_rec_t;
+
+typedef struct replay_count_t {
+  signed int type, id;
+  unsigned long count;
+} replay_count_t;
+
+static const char *type_names[] = { "START", "RX", "TX" };
+
+static int verbose = 0;
+
+/* ======================================================================== */
+
+static double replay_now(void) {
+/*
+ * Returns the monotonic clock in seconds.
+ */
+struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+/* ======================================================================== */
+
+static uint32 replay_be32(const uint8 *p) {
+/*
+ * Returns the big-endian 32-bit value at p.
+ */
+  return ((uint32)p[0]<<24) | ((uint32)p[1]<<16) | ((uint32)p[2]<<8) | p[3];
+}
+/* ======================================================================== */
+
+static int replay_varint(uint8 **p, uint8 *end, uint32 *value) {
+/*
+ * Reads a base-128 varint of at most 32 bits from *p, advancing *p past
+ * it.  Returns 0 on success or -1 if it is truncated or too long.
+ */
+unsigned int shift;
+
+  *value = 0;
+  for (shift=0; shift<35 && *p<end; shift+=7) {
+    *value |= (uint32)(**p & 0x7f) << shift;
+    if (!(*(*p)++ & 0x80))
+      return 0;
+  }
+  return -1;
+}
+/* ======================================================================== */
+
+static replay_rec_t *replay_load(const char *path, uint8 **data,
+  unsigned int *n_recs) {
+/*
+ * Reads the capture file at path into memory and returns its records, the
+ * number of which is stored in *n_recs.  The records' data points into the
+ * block returned in *data; both are to be freed by the caller.  Returns
+ * NULL on error, after reporting it.
+ */
+FILE *f;
+uint8 *buf, *p, *end;
+long size;
+replay_rec_t *recs = NULL, *more;
+unsigned int n = 0, max = 0;
+uint32 value;
+
+  f = fopen(path, "rb");
+  if (f == NULL) {
+    perror(path);
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  rewind(f);
+  buf = malloc(size>0 ? size : 1);
+  if (buf==NULL || fread(buf, 1, size, f)!=(size_t)size) {
+    fprintf(stderr, "%s: can't read file\n", path);
+    fclose(f);
+    free(buf);
+    return NULL;
+  }
+  fclose(f);
+  if (size<8 || memcmp(buf, ARCP_CAPTURE_SIGNATURE, 8)!=0) {
+    fprintf(stderr, "%s: not an ARCP capture file\n", path);
+    free(buf);
+    return NULL;
+  }
+
+  end = buf+size;
+  for (p=buf+8; p<end; n++) {
+    if (n == max) {
+      max = max!=0 ? 2*max : 1024;
+      more = realloc(recs, max*sizeof(replay_rec_t));
+      if (more == NULL) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        free(recs);
+        free(buf);
+        return NULL;
+      }
+      recs = more;
+    }
+    recs[n].type = *p++;
+    if (replay_varint(&p, end, &recs[n].delta)!=0 ||
+        replay_varint(&p, end, &value)!=0 || value>(uint32)(end-p)) {
+      /* A capture cut short by a crash loses only its last record */
+      fprintf(stderr, "%s: record %u truncated\n", path, n);
+      break;
+    }
+    recs[n].len = value;
+    recs[n].data = p;
+    p += value;
+  }
+  *data = buf;
+  *n_recs = n;
+  return recs;
+}
+/* ======================================================================== */
+
+static void replay_list(replay_rec_t *recs, unsigned int n_recs) {
+/*
+ * Lists the given records, with their times within their capture session.
+ */
+unsigned int i, j, session = 0;
+double t = 0.0;
+time_t start;
+
+  for (i=0; i<n_recs; i++) {
+    if (recs[i].type==ARCP_CAPTURE_START && recs[i].len==8) {
+      start = (time_t)replay_be32(recs[i].data);
+      printf("session %u started %lu.%06lu %s", ++session,
+        (unsigned long)start, (unsigned long)replay_be32(recs[i].data+4),
+        ctime(&start));
+      t = 0.0;
+      continue;
+    }
+    t += recs[i].delta*1e-6;
+    printf("%11.6f %-5s %5lu\n", t, recs[i].type<3 ? type_names[recs[i].type] : "?",
+      (unsigned long)recs[i].len);
+    if (verbose) {
+      for (j=0; j<recs[i].len; j++)
+        printf("%s%02x", j%16!=0 ? " " : j!=0 ? "\n   " : "   ", recs[i].data[j]);
+      if (recs[i].len != 0)
+        printf("\n");
+    }
+  }
+}
+/* ======================================================================== */
+
+static void replay_count(replay_count_t *table, unsigned int *n, unsigned int max,
+  signed int type, signed int id) {
+/*
+ * Counts an occurrence of (type, id) in the given table.
+ */
+unsigned int i;
+
+  for (i=0; i<*n; i++) {
+    if (table[i].type==type && table[i].id==id)
+      break;
+  }
+  if (i == max)
+    return;
+  if (i == *n) {
+    table[i].type = type;
+    table[i].id = id;
+    table[i].count = 0;
+    (*n)++;
+  }
+  table[i].count++;
+}
+/* ======================================================================== */
+
+static void replay_decode(replay_rec_t *recs, unsigned int n_recs, uint8 type,
+  unsigned int n_reps) {
+/*
+ * Decodes the data of the records of the given type n_reps times and
+ * reports what was found and how long it took.  Each capture session is
+ * decoded separately, as the connection it came from was.
+ */
+replay_count_t kinds[REPLAY_MAX_KINDS], errors[REPLAY_MAX_ERRORS];
+unsigned int n_kinds = 0, n_errors = 0, rep, i;
+unsigned long n_msgs = 0, n_bytes = 0;
+arcp_handle_t *handle;
+arcp_msg_t *msg;
+uint8 *space;
+uint16 room;
+uint32 done, piece;
+signed int res;
+double t, best = 0.0;
+
+  for (rep=0; rep<n_reps; rep++) {
+    handle = arcp_handle_new(ARCP_INVALID_SOCKET);
+    if (handle == NULL) {
+      fprintf(stderr, "out of memory\n");
+      return;
+    }
+    t = replay_now();
+    for (i=0; i<n_recs; i++) {
+      /* Each capture session is a fresh connection, so a message left
+       * incomplete at the end of one must not be joined to the next.
+       */
+      if (recs[i].type==ARCP_CAPTURE_START && i!=0) {
+        if (rep==0 && verbose && handle->rx_tail!=handle->rx_head)
+          printf("record %u: %u bytes of an incomplete message dropped at "
+            "end of session\n", i, handle->rx_tail-handle->rx_head);
+        arcp_handle_free(handle);
+        handle = arcp_handle_new(ARCP_INVALID_SOCKET);
+        if (handle == NULL)
+          return;
+        continue;
+      }
+      if (recs[i].type != type)
+        continue;
+      for (done=0; done<recs[i].len; done+=piece) {
+        space = arcp_handle_rx_space(handle, &room);
+        if (room == 0) {
+          /* A message too large for the receive buffer: start afresh */
+          if (rep == 0)
+            replay_count(errors, &n_errors, REPLAY_MAX_ERRORS, 0, ARCP_ERROR_LOCAL);
+          arcp_handle_free(handle);
+          handle = arcp_handle_new(ARCP_INVALID_SOCKET);
+          if (handle == NULL)
+            return;
+          space = arcp_handle_rx_space(handle, &room);
+        }
+        piece = recs[i].len-done<room ? recs[i].len-done : room;
+        memcpy(space, recs[i].data+done, piece);
+        arcp_handle_rx_commit(handle, (uint16)piece);
+
+        for (;;) {
+          msg = NULL;
+          res = arcp_msg_parse(handle, &msg);
+          if (res == ARCP_ERROR_CONN_TIMEOUT)
+            break;
+          if (rep != 0) {
+            arcp_msg_free(msg);
+            continue;
+          }
+          if (res != 0) {
+            replay_count(errors, &n_errors, REPLAY_MAX_ERRORS, 0, res);
+            if (verbose)
+              printf("record %u: error %d\n", i, res);
+            continue;
+          }
+          n_msgs++;
+          if (msg->header.msg_type == ARCP_MSG_COMMAND)
+            replay_count(kinds, &n_kinds, REPLAY_MAX_KINDS, ARCP_MSG_COMMAND, msg->command.id);
+          else
+            replay_count(kinds, &n_kinds, REPLAY_MAX_KINDS, msg->header.msg_type, msg->response.id);
+          if (verbose)
+            printf("record %u: %s 0x%04x exchange %u\n", i,
+              msg->header.msg_type==ARCP_MSG_COMMAND ? "command" : "response",
+              msg->header.msg_type==ARCP_MSG_COMMAND ? msg->command.id & 0xffff : msg->response.id & 0xffff,
+              msg->header.exchange_id);
+          arcp_msg_free(msg);
+        }
+      }
+      if (rep == 0)
+        n_bytes += recs[i].len;
+    }
+    t = replay_now()-t;
+    if (rep==0 || t<best)
+      best = t;
+    arcp_handle_free(handle);
+  }
+
+  printf("%lu messages in %lu bytes of %s data\n", n_msgs, n_bytes,
+    type_names[type]);
+  for (i=0; i<n_kinds; i++)
+    printf("  %-8s %6d: %lu\n", kinds[i].type==ARCP_MSG_COMMAND ? "command" : "response",
+      kinds[i].id, kinds[i].count);
+  for (i=0; i<n_errors; i++)
+    printf("  error    %6d: %lu\n", errors[i].id, errors[i].count);
+  if (best > 0.0)
+    printf("decode time %.6f s (best of %u): %.0f messages/s, %.1f MB/s\n",
+      best, n_reps, n_msgs/best, n_bytes/best/1e6);
+}
+/* ======================================================================== */
+
+static unsigned long replay_drain(arcp_socket_t fd, double until, int *closed) {
+/*
+ * Reads and discards whatever the peer sends until the monotonic clock
+ * reaches until, or only what is already available if until has passed.
+ * Sets *closed if the peer closes the connection.  Returns the number of
+ * bytes read.
+ */
+struct pollfd pfd;
+struct timespec ts;
+uint8 buf[4096];
+unsigned long total = 0;
+double remaining;
+ssize_t n;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (!*closed) {
+    remaining = until-replay_now();
+    if (remaining < 0.0)
+      remaining = 0.0;
+    ts.tv_sec = (time_t)remaining;
+    ts.tv_nsec = (long)((remaining-ts.tv_sec)*1e9);
+    pfd.revents = 0;
+    if (ppoll(&pfd, 1, &ts, NULL) <= 0) {
+      if (remaining == 0.0)
+        break;
+      continue;
+    }
+    n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n > 0)
+      total += n;
+    else
+    if (n==0 || (errno!=EINTR && errno!=EAGAIN))
+      *closed = 1;
+  }
+  return total;
+}
+/* ======================================================================== */
+
+static void replay_send(arcp_socket_t fd, replay_rec_t *recs,
+  unsigned int n_recs, uint8 type, double speed, unsigned int wait_ms) {
+/*
+ * Writes the data of the records of the given type to fd, keeping to the
+ * original timing scaled by speed (or as fast as possible if speed is 0),
+ * and reports what was sent and received.
+ */
+unsigned long n_sent = 0, n_bytes = 0, n_read = 0;
+unsigned int i;
+uint32 done;
+double t0, elapsed = 0.0;
+ssize_t n;
+int closed = 0;
+
+  t0 = replay_now();
+  for (i=0; i<n_recs && !closed; i++) {
+    /* Sessions follow on from each other directly */
+    if (recs[i].type == ARCP_CAPTURE_START)
+      continue;
+    elapsed += recs[i].delta*1e-6;
+    if (recs[i].type != type)
+      continue;
+    n_read += replay_drain(fd, speed>0.0 ? t0+elapsed/speed : 0.0, &closed);
+
+    for (done=0; done<recs[i].len && !closed; done+=n) {
+      n = send(fd, recs[i].data+done, recs[i].len-done, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) {
+          n = 0;
+          continue;
+        }
+        closed = 1;
+        break;
+      }
+    }
+    if (verbose)
+      printf("%11.6f sent record %u, %lu bytes\n", replay_now()-t0, i,
+        (unsigned long)recs[i].len);
+    n_sent++;
+    n_bytes += recs[i].len;
+  }
+  n_read += replay_drain(fd, replay_now()+wait_ms*1e-3, &closed);
+
+  printf("sent %lu %s records (%lu bytes) in %.6f s, received %lu bytes%s\n",
+    n_sent, type_names[type], n_bytes, replay_now()-t0, n_read,
+    closed ? "; connection closed by peer" : "");
+}
+/* ======================================================================== */
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "Usage: %s [-d [-n reps]] [-a addr [-p port] | -L port] [-r | -t]\n"
+    "  [-x speed] [-w wait_ms] [-v] capture_file\n",
+    prog);
+  exit(1);
+}
+/* ======================================================================== */
+
+int main(int argc, char *argv[]) {
+unsigned int n_recs, n_reps = 1, wait_ms = 1000;
+unsigned long port = ARCP_TCP_PORT, listen_port = 0;
+const char *addr = NULL;
+replay_rec_t *recs;
+uint8 *data;
+struct sockaddr_in sa;
+arcp_socket_t fd, lfd;
+double speed = 1.0;
+int opt, decode = 0, type = -1, one = 1;
+
+  while ((opt = getopt(argc, argv, "dn:a:L:p:rtx:w:v")) != -1) {
+    switch (opt) {
+      case 'd': decode = 1; break;
+      case 'n': n_reps = strtoul(optarg, NULL, 0); break;
+      case 'a': addr = optarg; break;
+      case 'L': listen_port = strtoul(optarg, NULL, 0); break;
+      case 'p': port = strtoul(optarg, NULL, 0); break;
+      case 'r': type = ARCP_CAPTURE_RX; break;
+      case 't': type = ARCP_CAPTURE_TX; break;
+      case 'x': speed = atof(optarg); break;
+      case 'w': wait_ms = strtoul(optarg, NULL, 0); break;
+      case 'v': verbose = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind!=argc-1 || decode+(addr!=NULL)+(listen_port!=0)>1 || n_reps==0 ||
+      port==0 || port>0xffff || listen_port>0xffff || speed<0.0)
+    usage(argv[0]);
+  if (type < 0)
+    type = addr!=NULL ? ARCP_CAPTURE_TX : ARCP_CAPTURE_RX;
+
+  recs = replay_load(argv[optind], &data, &n_recs);
+  if (recs == NULL)
+    return 1;
+  if (decode || (addr==NULL && listen_port==0)) {
+    if (decode)
+      replay_decode(recs, n_recs, (uint8)type, n_reps);
+    else
+      replay_list(recs, n_recs);
+    free(recs);
+    free(data);
+    return 0;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return 1;
+  }
+  if (addr != NULL) {
+    sa.sin_port = htons((uint16)port);
+    if (inet_aton(addr, &sa.sin_addr) == 0)
+      usage(argv[0]);
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+      fprintf(stderr, "%s: can't connect to %s:%lu: %s\n", argv[0], addr,
+        port, strerror(errno));
+      return 1;
+    }
+  } else {
+    lfd = fd;
+    sa.sin_port = htons((uint16)listen_port);
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(lfd, (struct sockaddr *)&sa, sizeof(sa))<0 || listen(lfd, 1)<0) {
+      fprintf(stderr, "%s: can't listen on port %lu: %s\n", argv[0],
+        listen_port, strerror(errno));
+      return 1;
+    }
+    fd = accept(lfd, NULL, NULL);
+    if (fd < 0) {
+      perror("accept");
+      return 1;
+    }
+    close(lfd);
+  }
+  /* Keep the original segmentation as far as possible */
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  signal(SIGPIPE, SIG_IGN);
+
+  replay_send(fd, recs, n_recs, (uint8)type, speed, wait_ms);
+  close(fd);
+  free(recs);
+  free(data);
+  return 0;
+}
+/* ======================================================================== */
@@ -0,0 +1,540 @@
+/*
+ * arcpsim: simulates a collection of ARCP slave modules (STX2s and BSMs) so
+ * that masters and pollers can be load tested and regression tested at
+ * array scale without the real hardware.
+ *
+ * Each simulated module listens on the ARCP TCP port of its own loopback
+ * address, starting at the base address (127.0.1.1 by default) and counting
+ * up, STX2s first and then BSMs.  Linux routes the whole of 127.0.0.0/8 to
+ * the loopback interface so no configuration is needed.  Any number of
+ * masters may connect to a module at once; each connection is served by
+ * its own thread using the slave side of libarcp (arcp_ascii_or_arcp_read()
+ * and arcp_send_*()), much as the module firmware does.
+ *
+ * Modules answer RESET, PING, GET_SYSID, GET_SYSSTAT and SET_MODULE_ENABLE,
+ * STX2s the pulse, sequence, trigger and user control commands and BSMs
+ * SET_PHASE.  Anything else gets an UNK.  SET_PULSE_PARAM is NAKed with
+ * ARCP_STX2_ERROR_PULSE_TOO_LONG if the pulse doesn't fit in the pulse
+ * slot.  The module enable state is reported as the module status.
+ *
+ * The status reported is built from the options below, with a little
+ * random variation in fan speeds, temperatures and powers.  Faults can be
+ * injected: each response can be delayed, and with given probabilities a
+ * command is ignored (the master times out), the connection is closed, a
+ * command is NAKed or the status reports an overtemperature.
+ *
+ * Usage: arcpsim [options]
+ *   -n N      number of STX2 modules (default 1)
+ *   -b N      number of BSMs (default 0)
+ *   -a ADDR   address of the first module (default 127.0.1.1)
+ *   -p PORT   TCP port (default ARCP_TCP_PORT)
+ *   -f N      fans per module (default 4)
+ *   -r N      RF cards per STX2: an RF driver then PAs (default 7)
+ *   -o N      outputs per RF card (default 2)
+ *   -u N      external combiner units per STX2 (default 1)
+ *   -m MAP    BSM channel map (default 0x00ff)
+ *   -w NS     STX2 pulse slot length in nanoseconds (default 100000)
+ *   -l MS     delay before each response in milliseconds (default 0)
+ *   -j MS     random extra delay of up to MS milliseconds (default 0)
+ *   -d PCT    percentage of commands ignored (default 0)
+ *   -c PCT    percentage of commands on which the connection is closed
+ *   -k PCT    percentage of commands NAKed (default 0)
+ *   -t PCT    percentage of status responses reporting an overtemperature
+ *   -s SEED   random seed (default taken from the time)
+ *   -v        report connections on stderr
+ *
+ * Several hundred modules need more than the usual 1024 file descriptors;
+ * raise the limit with "ulimit -n" first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "arcp.h"
+
+/* ======================================================================== */
+
+/* Stack size for connection threads; they need very little */
+#define SIM_THREAD_STACK       (256*1024)
+
+/* Nominal readings, around which the reported status varies */
+#define SIM_RAIL_SUPPLY        48000   /* mV */
+#define SIM_RAIL_AUX           12000   /* mV */
+#define SIM_FAN_SPEED          3000
+#define SIM_AMBIENT_TEMP       25
+#define SIM_HEATSINK_TEMP      45
+#define SIM_OVERTEMP           95
+#define SIM_FORWARD_POWER      1000    /* W */
+#define SIM_RETURN_LOSS        (-20)
+
+typedef struct sim_config_t {
+  unsigned int n_fans, n_rf_cards, n_rf_outputs, n_units;
+  uint16 channel_map;
+  uint32 pulse_slot_length;
+  unsigned int latency_ms, jitter_ms;
+  double drop_pct, close_pct, nak_pct, overtemp_pct;
+  int verbose;
+} sim_config_t;
+
+typedef struct sim_module_t {
+  unsigned int index;
+  arcp_moduletype_t type;
+  struct in_addr addr;
+  /* Shared by all connections to the module */
+  volatile int8 enabled;
+} sim_module_t;
+
+typedef struct sim_conn_t {
+  sim_module_t *module;
+  arcp_socket_t fd;
+  unsigned int seed;
+} sim_conn_t;
+
+static sim_config_t config = {
+  4, 7, 2, 1, 0x00ff, 100000, 0, 0, 0.0, 0.0, 0.0, 0.0, 0,
+};
+
+/* ======================================================================== */
+
+static int sim_chance(unsigned int *seed, double pct) {
+/*
+ * Returns non-zero with a probability of pct percent.
+ */
+  return pct>0.0 && rand_r(seed)/((double)RAND_MAX+1.0)*100.0 < pct;
+}
+/* ======================================================================== */
+
+static signed int sim_vary(unsigned int *seed, signed int value,
+  signed int spread) {
+/*
+ * Returns value plus a random amount between -spread and +spread.
+ */
+  return value + rand_r(seed)%(2*spread+1) - spread;
+}
+/* ======================================================================== */
+
+static void sim_sleep_ms(unsigned int ms) {
+/*
+ * Sleeps for the given number of milliseconds.
+ */
+struct timespec ts;
+
+  ts.tv_sec = ms/1000;
+  ts.tv_nsec = (long)(ms%1000)*1000000L;
+  while (nanosleep(&ts, &ts)!=0 && errno==EINTR)
+    ;
+}
+/* ======================================================================== */
+
+static void sim_make_sysid(sim_module_t *module, arcp_sysid_t *sysid) {
+/*
+ * Fills in the system ID of the given module.
+ */
+unsigned int i;
+
+  memset(sysid, 0, sizeof(*sysid));
+  sysid->module_type = module->type;
+  sysid->module_version = 1;
+  sysid->firmware_version = 0x0100;
+  sysid->ctrl_board_logic_version = 1;
+  if (module->type == ARCP_MODULE_STX2) {
+    /* Card 0 is the RF driver and the remainder are PAs */
+    sysid->data.stx2.card_map = ARCP_STX2_CARDMAP_CONTROLLER;
+    for (i=0; i<config.n_rf_cards; i++)
+      sysid->data.stx2.card_map |= ARCP_STX2_CARDMAP_RFDRIVER<<i;
+    for (i=0; i<config.n_units; i++)
+      sysid->data.stx2.card_map |= ARCP_STX2_CARDMAP_EXT0<<i;
+    sysid->data.stx2.pulse_slot_length = config.pulse_slot_length;
+  } else
+    sysid->data.bsm.channel_map = config.channel_map;
+}
+/* ======================================================================== */
+
+static arcp_sysstat_t *sim_make_sysstat(sim_module_t *module,
+  arcp_sysid_t *sysid) {
+/*
+ * Creates a status object with the structure configured for the given
+ * module.  The readings are filled in by sim_update_sysstat().  Returns
+ * NULL if memory could not be allocated.
+ */
+arcp_sysstat_t *sysstat = arcp_sysstat_new();
+arcp_stx2stat_t *stx2;
+unsigned int i;
+signed int err;
+
+  if (sysstat == NULL)
+    return NULL;
+  err = arcp_sysstat_set_moduletype(sysstat, module->type);
+  if (err==0 && module->type==ARCP_MODULE_STX2) {
+    stx2 = sysstat->data.stx2;
+    stx2->card_map = sysid->data.stx2.card_map;
+    err = arcp_stx2stat_set_n_chassis_fans(stx2, (uint8)config.n_fans);
+    if (err == 0)
+      err = arcp_stx2stat_set_n_rf_cards(stx2, (uint8)config.n_rf_cards);
+    for (i=0; err==0 && i<config.n_rf_cards; i++)
+      err = arcp_stx2stat_set_n_rf_outputs(stx2, (uint8)i,
+              (uint8)config.n_rf_outputs);
+    if (err == 0)
+      err = arcp_stx2stat_set_n_units(stx2, (uint8)config.n_units);
+    for (i=0; err==0 && i<config.n_units; i++) {
+      stx2->unit_stat[i].comb.flags = 0;
+      stx2->unit_stat[i].comb.unit_type = ARCP_STX2_UNIT_EXT_COMBINER_SPLITTER;
+      stx2->unit_stat[i].comb.n_temperatures = 2;
+      stx2->unit_stat[i].comb.n_outputs = 2;
+    }
+  } else
+  if (err == 0) {
+    err = arcp_bsmstat_set_n_fans(sysstat->data.bsm, (uint8)config.n_fans);
+    sysstat->data.bsm->channel_map = config.channel_map;
+    sysstat->data.bsm->n_heatsink_temps = 4;
+  }
+  if (err != 0) {
+    arcp_sysstat_free(sysstat);
+    return NULL;
+  }
+  return sysstat;
+}
+/* ======================================================================== */
+
+static void sim_update_sysstat(sim_conn_t *conn, arcp_sysstat_t *sysstat) {
+/*
+ * Fills in fresh readings for the given connection's module, injecting an
+ * overtemperature if chosen to.
+ */
+unsigned int *seed = &conn->seed;
+arcp_stx2stat_t *stx2;
+arcp_bsmstat_t *bsm;
+unsigned int i, j;
+int overtemp = sim_chance(seed, config.overtemp_pct);
+
+  sysstat->module_status = conn->module->enabled;
+  if (sysstat->module_type == ARCP_MODULE_STX2) {
+    stx2 = sysstat->data.stx2;
+    stx2->status_code = ARCP_STX2_STATUS_OK;
+    stx2->rail_supply = (uint16)sim_vary(seed, SIM_RAIL_SUPPLY, 200);
+    stx2->rail_aux = (uint16)sim_vary(seed, SIM_RAIL_AUX, 50);
+    stx2->ambient_temp = (int8)sim_vary(seed, SIM_AMBIENT_TEMP, 2);
+    for (i=0; i<stx2->n_chassis_fans; i++)
+      stx2->fan_speed[i] = (uint16)sim_vary(seed, SIM_FAN_SPEED, 100);
+    for (i=0; i<stx2->n_rf_cards; i++) {
+      stx2->rf_card_stat[i].rail_supply = (uint16)sim_vary(seed, SIM_RAIL_SUPPLY, 200);
+      stx2->rf_card_stat[i].heatsink_temp = (int16)sim_vary(seed, SIM_HEATSINK_TEMP, 3);
+      for (j=0; j<stx2->rf_card_stat[i].n_rf_outputs; j++) {
+        stx2->rf_card_stat[i].output_stat[j].forward_power =
+          (uint16)sim_vary(seed, SIM_FORWARD_POWER, 20);
+        stx2->rf_card_stat[i].output_stat[j].return_loss =
+          (int16)sim_vary(seed, SIM_RETURN_LOSS, 1);
+      }
+    }
+    for (i=0; i<stx2->n_units; i++) {
+      for (j=0; j<stx2->unit_stat[i].comb.n_temperatures; j++)
+        stx2->unit_stat[i].comb.temperature[j] = (int8)sim_vary(seed, SIM_HEATSINK_TEMP, 3);
+      for (j=0; j<stx2->unit_stat[i].comb.n_outputs; j++) {
+        stx2->unit_stat[i].comb.output[j].forward_power =
+          (uint16)sim_vary(seed, SIM_FORWARD_POWER, 20);
+        stx2->unit_stat[i].comb.output[j].return_loss =
+          (int16)sim_vary(seed, SIM_RETURN_LOSS, 1);
+      }
+    }
+
+    /* Overheat the RF driver, a PA or an external combiner, whichever of
+     * them are present.
+     */
+    if (overtemp && stx2->n_rf_cards!=0) {
+      i = rand_r(seed) % (stx2->n_units!=0 ? 3 : 2);
+      if (i==1 && stx2->n_rf_cards<2)
+        i = 0;
+      switch (i) {
+        case 0:
+          stx2->status_code = ARCP_STX2_STATUS_RF_DRV_OVERTEMP;
+          stx2->rf_card_stat[0].heatsink_temp = SIM_OVERTEMP;
+          break;
+        case 1:
+          stx2->status_code = ARCP_STX2_STATUS_RF_PA_OVERTEMP;
+          stx2->rf_card_stat[1+rand_r(seed)%(stx2->n_rf_cards-1)].heatsink_temp = SIM_OVERTEMP;
+          break;
+        default:
+          stx2->status_code = ARCP_STX2_STATUS_EXTCOMB_OVERTEMP;
+          stx2->unit_stat[rand_r(seed)%stx2->n_units].comb.temperature[0] = SIM_OVERTEMP;
+      }
+    }
+  } else {
+    bsm = sysstat->data.bsm;
+    bsm->status_code = ARCP_BSM_STATUS_OK;
+    bsm->rail_supply = (uint16)sim_vary(seed, SIM_RAIL_SUPPLY, 200);
+    bsm->rail_aux = (uint16)sim_vary(seed, SIM_RAIL_AUX, 50);
+    bsm->ambient_temp = (int8)sim_vary(seed, SIM_AMBIENT_TEMP, 2);
+    for (i=0; i<bsm->n_fans; i++)
+      bsm->fan_speed[i] = (uint16)sim_vary(seed, SIM_FAN_SPEED, 100);
+    for (i=0; i<bsm->n_heatsink_temps; i++)
+      bsm->heatsink_temp[i] = (int8)sim_vary(seed, SIM_HEATSINK_TEMP, 3);
+    if (overtemp) {
+      bsm->status_code = ARCP_BSM_STATUS_OVERTEMP;
+      bsm->heatsink_temp[rand_r(seed)%bsm->n_heatsink_temps] = SIM_OVERTEMP;
+    }
+  }
+}
+/* ======================================================================== */
+
+static signed int sim_respond(sim_conn_t *conn, arcp_handle_t *handle,
+  arcp_msg_t *cmd, arcp_sysid_t *sysid, arcp_sysstat_t *sysstat) {
+/*
+ * Carries out the given command and sends the response.  Returns 0 on
+ * success or an ARCP_ERROR_* code if the response could not be sent.
+ */
+int stx2 = conn->module->type == ARCP_MODULE_STX2;
+
+  switch (cmd->command.id) {
+    case ARCP_CMD_RESET:
+    case ARCP_CMD_PING:
+      return arcp_send_ack(handle, cmd);
+    case ARCP_CMD_GET_SYSID:
+      return arcp_send_sysid(handle, cmd, sysid);
+    case ARCP_CMD_GET_SYSSTAT:
+      sim_update_sysstat(conn, sysstat);
+      return arcp_send_sysstat(handle, cmd, sysstat);
+    case ARCP_CMD_SET_MODULE_ENABLE:
+      conn->module->enabled = cmd->cmd_enable.enable!=0;
+      return arcp_send_ack(handle, cmd);
+
+    case ARCP_CMD_SET_PULSE_PARAM:
+      if (!stx2)
+        break;
+      if (cmd->cmd_set_pulse_param.pulse_param.pulse_width_ns >
+          sysid->data.stx2.pulse_slot_length)
+        return arcp_send_nak(handle, cmd, ARCP_STX2_ERROR_PULSE_TOO_LONG);
+      return arcp_send_ack(handle, cmd);
+    case ARCP_CMD_SET_PULSE_SEQ:
+    case ARCP_CMD_SET_PULSE_SEQ_IDX:
+    case ARCP_CMD_SET_TRIG_PARAM:
+    case ARCP_CMD_SET_USRCTL_ENABLE:
+      if (!stx2)
+        break;
+      return arcp_send_ack(handle, cmd);
+
+    case ARCP_CMD_SET_PHASE:
+      if (stx2)
+        break;
+      return arcp_send_ack(handle, cmd);
+  }
+  return arcp_send_unk(handle, cmd);
+}
+/* ======================================================================== */
+
+static void *sim_conn_thread(void *arg) {
+/*
+ * Serves one connection to a simulated module until the master
+ * disconnects or a dropout is injected.
+ */
+sim_conn_t *conn = arg;
+arcp_handle_t *handle = arcp_handle_new(conn->fd);
+arcp_sysid_t sysid;
+arcp_sysstat_t *sysstat;
+arcp_msg_t *msg;
+unsigned char *ascii;
+char addr[INET_ADDRSTRLEN];
+signed int res = 0;
+int arcp_mode = 0;
+
+  sim_make_sysid(conn->module, &sysid);
+  sysstat = sim_make_sysstat(conn->module, &sysid);
+  if (handle==NULL || sysstat==NULL)
+    res = ARCP_ERROR_LOCAL;
+
+  while (res == 0) {
+    /* As the firmware does, accept ASCII until the master shows it talks
+     * ARCP, and then only ARCP.
+     */
+    res = arcp_ascii_or_arcp_read(handle, &msg, arcp_mode?NULL:&ascii);
+    if (res==ARCP_ERROR_CONN_DROPPED || res==ARCP_ERROR_CONN_TIMEOUT ||
+        res==ARCP_ERROR_LOCAL)
+      break;
+    if (res != 0) {
+      /* Undecodable message: the reader has resynchronised */
+      res = 0;
+      continue;
+    }
+    if (!arcp_mode && ascii!=NULL) {
+      free(ascii);
+      continue;
+    }
+    arcp_mode = 1;
+    if (msg->header.msg_type != ARCP_MSG_COMMAND) {
+      arcp_msg_free(msg);
+      continue;
+    }
+
+    if (sim_chance(&conn->seed, config.close_pct)) {
+      arcp_msg_free(msg);
+      break;
+    }
+    if (sim_chance(&conn->seed, config.drop_pct)) {
+      arcp_msg_free(msg);
+      continue;
+    }
+    if (config.latency_ms!=0 || config.jitter_ms!=0)
+      sim_sleep_ms(config.latency_ms +
+        (config.jitter_ms!=0 ? rand_r(&conn->seed)%(config.jitter_ms+1) : 0));
+
+    if (sim_chance(&conn->seed, config.nak_pct))
+      res = arcp_send_nak(handle, msg, 0);
+    else
+      res = sim_respond(conn, handle, msg, &sysid, sysstat);
+    arcp_msg_free(msg);
+  }
+
+  if (config.verbose) {
+    inet_ntop(AF_INET, &conn->module->addr, addr, sizeof(addr));
+    fprintf(stderr, "%s: connection closed (%d)\n", addr, res);
+  }
+  arcp_sysstat_free(sysstat);
+  arcp_handle_free(handle);
+  close(conn->fd);
+  free(conn);
+  return NULL;
+}
+/* ======================================================================== */
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+    "Usage: %s [-n stx2s] [-b bsms] [-a first_addr] [-p port] [-f fans]\n"
+    "  [-r rf_cards] [-o outputs] [-u ext_units] [-m channel_map]\n"
+    "  [-w slot_ns] [-l latency_ms] [-j jitter_ms] [-d drop_pct]\n"
+    "  [-c close_pct] [-k nak_pct] [-t overtemp_pct] [-s seed] [-v]\n",
+    prog);
+  exit(1);
+}
+/* ======================================================================== */
+
+int main(int argc, char *argv[]) {
+unsigned int n_stx2 = 1, n_bsm = 0, n_modules, i;
+unsigned int seed = (unsigned int)time(NULL);
+unsigned long port = ARCP_TCP_PORT;
+const char *first_addr = "127.0.1.1";
+struct in_addr base;
+struct sockaddr_in addr;
+struct pollfd *fds;
+sim_module_t *modules;
+sim_conn_t *conn;
+pthread_attr_t attr;
+pthread_t thread;
+arcp_socket_t fd;
+int opt, one = 1;
+
+  while ((opt = getopt(argc, argv, "n:b:a:p:f:r:o:u:m:w:l:j:d:c:k:t:s:v")) != -1) {
+    switch (opt) {
+      case 'n': n_stx2 = strtoul(optarg, NULL, 0); break;
+      case 'b': n_bsm = strtoul(optarg, NULL, 0); break;
+      case 'a': first_addr = optarg; break;
+      case 'p': port = strtoul(optarg, NULL, 0); break;
+      case 'f': config.n_fans = strtoul(optarg, NULL, 0); break;
+      case 'r': config.n_rf_cards = strtoul(optarg, NULL, 0); break;
+      case 'o': config.n_rf_outputs = strtoul(optarg, NULL, 0); break;
+      case 'u': config.n_units = strtoul(optarg, NULL, 0); break;
+      case 'm': config.channel_map = (uint16)strtoul(optarg, NULL, 0); break;
+      case 'w': config.pulse_slot_length = strtoul(optarg, NULL, 0); break;
+      case 'l': config.latency_ms = strtoul(optarg, NULL, 0); break;
+      case 'j': config.jitter_ms = strtoul(optarg, NULL, 0); break;
+      case 'd': config.drop_pct = atof(optarg); break;
+      case 'c': config.close_pct = atof(optarg); break;
+      case 'k': config.nak_pct = atof(optarg); break;
+      case 't': config.overtemp_pct = atof(optarg); break;
+      case 's': seed = strtoul(optarg, NULL, 0); break;
+      case 'v': config.verbose = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  n_modules = n_stx2+n_bsm;
+  if (n_modules==0 || port==0 || port>0xffff || inet_aton(first_addr, &base)==0)
+    usage(argv[0]);
+  /* Keep within what the card map and the status structures can hold */
+  if (config.n_fans>ARCP_MAX_N_CHASSIS_FANS || config.n_rf_cards>7 ||
+      config.n_rf_outputs>ARCP_MAX_N_RF_CARD_OUTPUT || config.n_units>4) {
+    fprintf(stderr, "%s: at most %d fans, 7 RF cards, %d outputs and 4 "
+      "external units are supported\n", argv[0], ARCP_MAX_N_CHASSIS_FANS,
+      ARCP_MAX_N_RF_CARD_OUTPUT);
+    return 1;
+  }
+
+  modules = calloc(n_modules, sizeof(sim_module_t));
+  fds = calloc(n_modules, sizeof(struct pollfd));
+  if (modules==NULL || fds==NULL) {
+    fprintf(stderr, "%s: out of memory\n", argv[0]);
+    return 1;
+  }
+  /* Sends use MSG_NOSIGNAL where possible, but be sure */
+  signal(SIGPIPE, SIG_IGN);
+
+  for (i=0; i<n_modules; i++) {
+    modules[i].index = i;
+    modules[i].type = i<n_stx2 ? ARCP_MODULE_STX2 : ARCP_MODULE_BSM;
+    modules[i].addr.s_addr = htonl(ntohl(base.s_addr)+i);
+    modules[i].enabled = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = modules[i].addr;
+    addr.sin_port = htons((uint16)port);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+      perror("socket");
+      return 1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))<0 ||
+        listen(fd, 16)<0) {
+      fprintf(stderr, "%s: can't listen on %s:%lu: %s\n", argv[0],
+        inet_ntoa(modules[i].addr), port, strerror(errno));
+      return 1;
+    }
+    fds[i].fd = fd;
+    fds[i].events = POLLIN;
+  }
+  fprintf(stderr, "%s: %u STX2s and %u BSMs listening on port %lu from %s\n",
+    argv[0], n_stx2, n_bsm, port, first_addr);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, SIM_THREAD_STACK);
+
+  for (;;) {
+    if (poll(fds, n_modules, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      return 1;
+    }
+    for (i=0; i<n_modules; i++) {
+      if (!(fds[i].revents & POLLIN))
+        continue;
+      fd = accept(fds[i].fd, NULL, NULL);
+      if (fd < 0)
+        continue;
+      conn = malloc(sizeof(sim_conn_t));
+      if (conn == NULL) {
+        close(fd);
+        continue;
+      }
+      conn->module = &modules[i];
+      conn->fd = fd;
+      conn->seed = seed++;
+      if (pthread_create(&thread, &attr, sim_conn_thread, conn) != 0) {
+        close(fd);
+        free(conn);
+        continue;
+      }
+      if (config.verbose)
+        fprintf(stderr, "%s: connection accepted\n",
+          inet_ntoa(modules[i].addr));
+    }
+  }
+  return 0;
+}
+/* ======================================================================== */